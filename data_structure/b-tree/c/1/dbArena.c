@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dbArena.h"
+#include "dbHash.h"
+
+#define CHUNK_HEAD ((sizeof(struct ArenaChunk)+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1))
+
+static inline unsigned int ClassOf(size_t size)
+{
+   return (size+ARENA_ALIGN-1)/ARENA_ALIGN-1;
+}
+
+Arena* ArenaCreate(void)
+{
+   Arena* a=(Arena*)calloc(1,sizeof(Arena));
+   if(a==NULL)
+      return NULL;
+   if(pthread_mutex_init(&(a->lock),NULL)!=0)
+   {
+      free(a);
+      return NULL;
+   }
+   a->large.prev=a->large.next=&(a->large);
+   return a;
+}
+
+/*
+ * Map a chunk aligned to its size, so ArenaFree() finds the header from any object in it.
+ */
+static struct ArenaChunk* MapChunk(Arena* a)
+{
+   char* p,*start;
+   size_t lead;
+
+   p=(char*)mmap(NULL,2*ARENA_CHUNK,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+   if(p==MAP_FAILED)
+      return NULL;
+   start=(char*)(((uintptr_t)p+ARENA_CHUNK-1)&~(uintptr_t)(ARENA_CHUNK-1));
+   lead=start-p;
+   if(lead!=0)
+      munmap(p,lead);
+   munmap(start+ARENA_CHUNK,ARENA_CHUNK-lead);
+   ((struct ArenaChunk*)start)->arena=a;
+   ((struct ArenaChunk*)start)->next=a->chunks;
+   a->chunks=(struct ArenaChunk*)start;
+   __atomic_add_fetch(&(a->bytes),ARENA_CHUNK,__ATOMIC_RELAXED);
+   return (struct ArenaChunk*)start;
+}
+
+static void* AllocLarge(Arena* a,size_t size)
+{
+   struct ArenaLarge* l=(struct ArenaLarge*)malloc(sizeof(struct ArenaLarge)+size);
+   if(l==NULL)
+      return NULL;
+   pthread_mutex_lock(&(a->lock));
+   l->arena=a;
+   l->prev=&(a->large);
+   l->next=a->large.next;
+   l->next->prev=l;
+   a->large.next=l;
+   pthread_mutex_unlock(&(a->lock));
+   __atomic_add_fetch(&(a->bytes),size,__ATOMIC_RELAXED);
+   return l+1;
+}
+
+void* ArenaAlloc(Arena* a,size_t size)
+{
+   unsigned int c;
+   size_t n;
+   void* p;
+   struct ArenaChunk* chunk;
+
+   if(size==0)
+      size=1;
+   if(size>ARENA_MAX_OBJECT)
+      return AllocLarge(a,size);
+   c=ClassOf(size);
+   p=a->free[c];
+   if(p==NULL && __atomic_load_n(a->remote+c,__ATOMIC_RELAXED)!=NULL)
+      p=__atomic_exchange_n(a->remote+c,NULL,__ATOMIC_ACQUIRE);   //all of them, so no ABA
+   if(p!=NULL)
+   {
+      a->free[c]=*(void**)p;
+      return p;
+   }
+   n=(size_t)(c+1)*ARENA_ALIGN;
+   if(a->top+n>a->end)
+   {  //the rest of the chunk is left
+      chunk=MapChunk(a);
+      if(chunk==NULL)
+         return NULL;
+      a->top=(char*)chunk+CHUNK_HEAD;
+      a->end=(char*)chunk+ARENA_CHUNK;
+   }
+   p=a->top;
+   a->top+=n;
+   return p;
+}
+
+void ArenaFree(void* p,size_t size)
+{
+   struct ArenaLarge* l;
+   Arena* a;
+   void** head;
+   void* old;
+
+   if(p==NULL)
+      return;
+   if(size==0)
+      size=1;
+   if(size>ARENA_MAX_OBJECT)
+   {
+      l=(struct ArenaLarge*)p-1;
+      a=l->arena;
+      pthread_mutex_lock(&(a->lock));
+      l->prev->next=l->next;
+      l->next->prev=l->prev;
+      pthread_mutex_unlock(&(a->lock));
+      __atomic_sub_fetch(&(a->bytes),size,__ATOMIC_RELAXED);
+      free(l);
+      return;
+   }
+   a=((struct ArenaChunk*)((uintptr_t)p&~(uintptr_t)(ARENA_CHUNK-1)))->arena;
+   head=a->remote+ClassOf(size);
+   old=__atomic_load_n(head,__ATOMIC_RELAXED);
+   do{
+      *(void**)p=old;
+   }while(!__atomic_compare_exchange_n(head,&old,p,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+}
+
+size_t ArenaBytes(const Arena* a)
+{
+   return __atomic_load_n(&(a->bytes),__ATOMIC_RELAXED);
+}
+
+void ArenaDestroy(Arena* a)
+{
+   struct ArenaChunk* chunk;
+   struct ArenaLarge* l;
+
+   if(a==NULL)
+      return;
+   while((chunk=a->chunks)!=NULL)
+   {
+      a->chunks=chunk->next;
+      munmap(chunk,ARENA_CHUNK);
+   }
+   while((l=a->large.next)!=&(a->large))
+   {
+      a->large.next=l->next;
+      free(l);
+   }
+   pthread_mutex_destroy(&(a->lock));
+   free(a);
+}
+
+StringPool* PoolCreate(void)
+{
+   StringPool* pool=(StringPool*)malloc(sizeof(StringPool));
+   if(pool==NULL)
+      return NULL;
+   pool->slot=(struct PoolString**)calloc(POOL_MIN_SLOTS,sizeof(struct PoolString*));
+   if(pool->slot==NULL || pthread_mutex_init(&(pool->lock),NULL)!=0)
+   {
+      free(pool->slot);
+      free(pool);
+      return NULL;
+   }
+   pool->size=POOL_MIN_SLOTS;
+   pool->count=0;
+   return pool;
+}
+
+/*
+ * Double the slots, the caller holds the lock. The pool still works if it fails.
+ */
+static void PoolGrow(StringPool* pool)
+{
+   struct PoolString** slot,*s,*next;
+   size_t i,size=pool->size*2;
+
+   slot=(struct PoolString**)calloc(size,sizeof(struct PoolString*));
+   if(slot==NULL)
+      return;
+   for(i=0;i<pool->size;i++)
+   {
+      for(s=pool->slot[i];s!=NULL;s=next)
+      {
+         next=s->next;
+         s->next=slot[s->hash&(size-1)];
+         slot[s->hash&(size-1)]=s;
+      }
+   }
+   free(pool->slot);
+   pool->slot=slot;
+   pool->size=size;
+}
+
+const char* PoolIntern(StringPool* pool,const char* str)
+{
+   size_t len=strlen(str);
+   uint64_t hash=HashBytes((char*)str,len,0);
+   struct PoolString* s,**link;
+
+   pthread_mutex_lock(&(pool->lock));
+   for(s=pool->slot[hash&(pool->size-1)];s!=NULL;s=s->next)
+   {
+      if(s->hash==hash && s->length==len && memcmp(s->str,str,len)==0)
+      {
+         __atomic_add_fetch(&(s->refs),1,__ATOMIC_RELAXED);
+         pthread_mutex_unlock(&(pool->lock));
+         return s->str;
+      }
+   }
+   s=(struct PoolString*)malloc(sizeof(struct PoolString)+len+1);
+   if(s==NULL)
+   {
+      pthread_mutex_unlock(&(pool->lock));
+      return NULL;
+   }
+   s->hash=hash;
+   s->refs=1;
+   s->length=len;
+   memcpy(s->str,str,len+1);
+   if(pool->count>=pool->size)
+      PoolGrow(pool);
+   link=pool->slot+(hash&(pool->size-1));
+   s->next=*link;
+   *link=s;
+   pool->count++;
+   pthread_mutex_unlock(&(pool->lock));
+   return s->str;
+}
+
+void PoolRelease(StringPool* pool,const char* str)
+{
+   struct PoolString* s=(struct PoolString*)(str-offsetof(struct PoolString,str)),**link;
+   unsigned int refs=__atomic_load_n(&(s->refs),__ATOMIC_RELAXED);
+
+   //not the last reference: no lock
+   while(refs>1)
+   {
+      if(__atomic_compare_exchange_n(&(s->refs),&refs,refs-1,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED))
+         return;
+   }
+   //PoolIntern() may take a new reference until the lock is held
+   pthread_mutex_lock(&(pool->lock));
+   if(__atomic_sub_fetch(&(s->refs),1,__ATOMIC_ACQ_REL)==0)
+   {
+      for(link=pool->slot+(s->hash&(pool->size-1));*link!=s;link=&((*link)->next))
+         ;
+      *link=s->next;
+      pool->count--;
+      free(s);
+   }
+   pthread_mutex_unlock(&(pool->lock));
+}
+
+void PoolDestroy(StringPool* pool)
+{
+   struct PoolString* s,*next;
+   size_t i;
+
+   if(pool==NULL)
+      return;
+   for(i=0;i<pool->size;i++)
+   {
+      for(s=pool->slot[i];s!=NULL;s=next)
+      {
+         next=s->next;
+         free(s);
+      }
+   }
+   free(pool->slot);
+   pthread_mutex_destroy(&(pool->lock));
+   free(pool);
+}
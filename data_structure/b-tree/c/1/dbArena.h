@@ -0,0 +1,123 @@
+#ifndef DBARENA_H_INCLUDED
+#define DBARENA_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "dbUtility.h"
+
+#define ARENA_CHUNK (1024*1024)     /* chunks are mapped at this size and alignment */
+#define ARENA_ALIGN 16              /* size classes: 16, 32, ... ARENA_MAX_OBJECT */
+#define ARENA_MAX_OBJECT 512        /* larger objects are malloc'ed (and still freed by ArenaDestroy) */
+#define ARENA_CLASSES (ARENA_MAX_OBJECT/ARENA_ALIGN)
+#define POOL_MIN_SLOTS 256
+
+/*
+ * Slab arena of the index: the objects are cut from 1MB chunks, a free object goes to the
+ * free list of its size class and is used again by the next allocation of that size.
+ * One thread allocates at a time (the caller's lock), any thread may free: the freed objects
+ * of other threads are pushed to a lock-free list which the allocator takes as a whole.
+ * ArenaDestroy() unmaps the chunks at once, the objects need not be freed one by one.
+ */
+struct ArenaChunk
+{
+  struct Arena* arena;
+  struct ArenaChunk* next;
+};
+
+struct ArenaLarge
+{
+  struct ArenaLarge* prev;
+  struct ArenaLarge* next;
+  struct Arena* arena;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+typedef struct Arena
+{
+  void* free[ARENA_CLASSES];      /* objects freed by the allocating thread, or taken from remote */
+  void* remote[ARENA_CLASSES];    /* objects freed by any thread (atomic push) */
+  char* top;                      /* free space of the current chunk */
+  char* end;
+  struct ArenaChunk* chunks;
+  struct ArenaLarge large;        /* list of the large objects */
+  pthread_mutex_t lock;           /* of the large objects */
+  size_t bytes;                   /* mapped and malloc'ed */
+}Arena;
+
+/*
+ * Interned strings (the redirect IPs): every distinct string is stored once, with its length
+ * and a count of references. A record keeps a reference instead of a copy.
+ */
+struct PoolString
+{
+  struct PoolString* next;
+  uint64_t hash;
+  unsigned int refs;
+  unsigned int length;
+  char str[];
+};
+
+typedef struct
+{
+  struct PoolString** slot;
+  size_t size;                    /* power of 2 */
+  size_t count;
+  pthread_mutex_t lock;
+}StringPool;
+
+Arena* ArenaCreate(void);
+/*
+ * Usage: create an empty arena (no chunk is mapped yet).
+ * Output:  @return Arena*
+ *                  ------ the arena, NULL if no enough memory
+ */
+void* ArenaAlloc(Arena* a,size_t size);
+/*
+ * Usage: allocate 'size' bytes (aligned to ARENA_ALIGN). Allocations must be serialized by the caller.
+ * Output:  @return void*
+ *                  ------ the object, NULL if no enough memory
+ */
+void ArenaFree(void* p,size_t size);
+/*
+ * Usage: free an object of ArenaAlloc(), 'size' is the size it was allocated with.
+ *        It may be called by any thread at any time, the arena is found from the pointer.
+ */
+size_t ArenaBytes(const Arena* a);
+/*
+ * Usage: memory held by the arena (chunks and large objects), in bytes.
+ */
+void ArenaDestroy(Arena* a);
+/*
+ * Usage: free the arena with all its objects.
+ */
+
+StringPool* PoolCreate(void);
+/*
+ * Usage: create an empty string pool.
+ * Output:  @return StringPool*
+ *                  ------ the pool, NULL if no enough memory
+ */
+const char* PoolIntern(StringPool* pool,const char* str);
+/*
+ * Usage: get the pooled copy of 'str' with one more reference (it is added if it is new).
+ * Output:  @return const char*
+ *                  ------ the pooled string, NULL if no enough memory
+ */
+static inline void PoolRetain(const char* str)
+{  //the caller holds a reference already
+  struct PoolString* s=(struct PoolString*)(str-offsetof(struct PoolString,str));
+  __atomic_add_fetch(&(s->refs),1,__ATOMIC_RELAXED);
+}
+/*
+ * Usage: one more reference of a pooled string.
+ */
+void PoolRelease(StringPool* pool,const char* str);
+/*
+ * Usage: drop a reference of a pooled string, the last one frees it.
+ */
+void PoolDestroy(StringPool* pool);
+/*
+ * Usage: free the pool with all its strings.
+ */
+
+#endif // DBARENA_H_INCLUDED
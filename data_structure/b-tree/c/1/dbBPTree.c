@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+#include "dbBPTree.h"
+
+#define SIGN_BIT 0x8000000000000000ULL
+
+#if (BPT_KEYS+1)%4!=0
+#error "BPT_KEYS+1 must be a multiple of 4 (SIMD lanes)"
+#endif
+
+static struct BPNode* NewNode(BPTree* tree,int leaf)
+{
+   void* p=NULL;
+   struct BPNode* n;
+   if(posix_memalign(&p,64,sizeof(struct BPNode))!=0)
+      return NULL;
+   n=(struct BPNode*)p;
+   memset(n, 0, sizeof(struct BPNode));
+   n->leaf=leaf;
+   n->gen=tree->gen;
+   return n;
+}
+
+/*
+ * Make room for 'num' retired items, so an update never fails after the tree is changed.
+ */
+static result_t Reserve(BPTree* tree,size_t num)
+{
+   struct BPRetired* p;
+   size_t size;
+   if(tree->nretired+num<=tree->maxretired)
+      return R_SUCCESS;
+   size=tree->maxretired*2+num;
+   p=(struct BPRetired*)realloc(tree->retired,size*sizeof(struct BPRetired));
+   if(p==NULL)
+      return R_FAILED;
+   tree->retired=p;
+   tree->maxretired=size;
+   return R_SUCCESS;
+}
+
+static inline void Defer(BPTree* tree,void* ptr,void (*release)(void*))
+{
+   tree->retired[tree->nretired].ptr=ptr;
+   tree->retired[tree->nretired++].release=release;
+}
+
+/*
+ * Drop a node which is unlinked from the writer's tree: a private node is freed at once,
+ * a published one waits for the commit.
+ */
+static inline void Drop(BPTree* tree,struct BPNode* n)
+{
+   if(n->gen==tree->gen)
+      free(n);
+   else
+      Defer(tree,n,free);
+}
+
+/*
+ * Get the private copy of 'n' for the current generation.
+ */
+static struct BPNode* Writable(BPTree* tree,struct BPNode* n)
+{
+   struct BPNode* copy;
+   if(n->gen==tree->gen)
+      return n;
+   copy=NewNode(tree,n->leaf);
+   if(copy==NULL)
+      return NULL;
+   memcpy(copy,n,sizeof(struct BPNode));
+   copy->gen=tree->gen;
+   Defer(tree,n,free);
+   return copy;
+}
+
+/*
+ * Count of the keys which are <= k. The keys of a node are compared all at once,
+ * with AVX2 or SSE4.2 if the compiler enables them (-mavx2, -msse4.2).
+ * The last lane is the keynum/gen word, it is masked by keynum.
+ */
+static inline int BPRank(const struct BPNode* n,uint64_t k)
+{
+#if defined(__AVX2__)
+   __m256i sign=_mm256_set1_epi64x((long long)SIGN_BIT);
+   __m256i x=_mm256_set1_epi64x((long long)(k^SIGN_BIT));
+   unsigned int gt=0;
+   int i;
+   for(i=0;i<(BPT_KEYS+1)/4;i++)
+   {
+      __m256i a=_mm256_xor_si256(_mm256_load_si256((const __m256i*)(n->key+4*i)),sign);
+      gt|=_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(a,x)))<<(4*i);
+   }
+   return __builtin_popcount(~gt & ((1u<<n->keynum)-1));
+#elif defined(__SSE4_2__)
+   __m128i sign=_mm_set1_epi64x((long long)SIGN_BIT);
+   __m128i x=_mm_set1_epi64x((long long)(k^SIGN_BIT));
+   unsigned int gt=0;
+   int i;
+   for(i=0;i<(BPT_KEYS+1)/2;i++)
+   {
+      __m128i a=_mm_xor_si128(_mm_load_si128((const __m128i*)(n->key+2*i)),sign);
+      gt|=_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(a,x)))<<(2*i);
+   }
+   return __builtin_popcount(~gt & ((1u<<n->keynum)-1));
+#else
+   int i,r=0;
+   for(i=0;i<BPT_KEYS;i++)         /* no branch, the compiler can vectorize it */
+      r+=(i<(int)n->keynum) & (n->key[i]<=k);
+   return r;
+#endif
+}
+
+result_t BPTreeInit(BPTree* tree,void (*retire)(void*,void (*)(void*)),void (*release)(void*))
+{
+   memset(tree, 0, sizeof(BPTree));
+   tree->gen=1;
+   tree->retire=retire;
+   tree->release=release;
+   return R_SUCCESS;
+}
+
+static void* SearchNode(struct BPNode* n,uint64_t key)
+{
+   int r;
+   if(n==NULL)
+      return NULL;
+   while(!n->leaf)
+   {
+      n=(struct BPNode*)n->ptr[BPRank(n,key)];
+      __builtin_prefetch(n->ptr,0,1);      /* the pointer line of the child */
+   }
+   r=BPRank(n,key);
+   if(r>0 && n->key[r-1]==key)
+      return n->ptr[r-1];
+   return NULL;
+}
+
+void* BPTreeSearch(BPTree* tree,uint64_t key)
+{
+   //published nodes are never changed, the root is enough to order the reads.
+   return SearchNode(__atomic_load_n(&(tree->root),__ATOMIC_ACQUIRE),key);
+}
+
+void* BPTreeFind(BPTree* tree,uint64_t key)
+{
+   return SearchNode(tree->shadow,key);
+}
+
+result_t BPTreeUpdate(BPTree* tree,uint64_t key,void* value)
+{
+   struct BPNode* path[BPT_MAXHEIGHT];
+   int idx[BPT_MAXHEIGHT];
+   struct BPNode* spare[BPT_MAXHEIGHT+1];
+   struct BPNode* n,*c,*right;
+   uint64_t keys[BPT_KEYS+1],sep;
+   void* ptrs[BPT_KEYS+2];
+   int h=0,r,i,num,need=0,s=0;
+
+   if(Reserve(tree,BPT_MAXHEIGHT+1)==R_FAILED)
+      return R_FAILED;
+   if(tree->shadow==NULL)
+   {  //first key
+      n=NewNode(tree,1);
+      if(n==NULL)
+         return R_FAILED;
+      n->key[0]=key;
+      n->ptr[0]=value;
+      n->keynum=1;
+      tree->shadow=n;
+      tree->count++;
+      return R_SUCCESS;
+   }
+
+   //copy the path of the key (only the nodes which are published)
+   n=Writable(tree,tree->shadow);
+   if(n==NULL)
+      return R_FAILED;
+   tree->shadow=n;
+   while(!n->leaf)
+   {
+      r=BPRank(n,key);
+      c=Writable(tree,(struct BPNode*)n->ptr[r]);
+      if(c==NULL)
+         return R_FAILED;
+      n->ptr[r]=c;
+      path[h]=n;
+      idx[h++]=r;
+      n=c;
+   }
+   r=BPRank(n,key);
+   if(r>0 && n->key[r-1]==key)
+   {  //replace the value
+      Defer(tree,n->ptr[r-1],tree->release);
+      n->ptr[r-1]=value;
+      return R_SUCCESS;
+   }
+
+   //the new nodes of the splits are allocated first, the insert can not fail then.
+   if(n->keynum==BPT_KEYS)
+   {
+      need=1;
+      for(i=h-1;i>=0 && path[i]->keynum==BPT_KEYS;i--)
+         need++;
+      if(i<0)
+         need++;           //new root
+   }
+   for(i=0;i<need;i++)
+   {
+      spare[i]=NewNode(tree,i==0);
+      if(spare[i]==NULL)
+      {
+         while(i>0)
+            free(spare[--i]);
+         return R_FAILED;
+      }
+   }
+   tree->count++;
+
+   num=n->keynum;
+   if(num<BPT_KEYS)
+   {
+      memmove(n->key+r+1,n->key+r,(num-r)*sizeof(uint64_t));
+      memmove(n->ptr+r+1,n->ptr+r,(num-r)*sizeof(void*));
+      n->key[r]=key;
+      n->ptr[r]=value;
+      n->keynum++;
+      return R_SUCCESS;
+   }
+
+   //split the leaf: half of the keys move to the right node.
+   memcpy(keys,n->key,r*sizeof(uint64_t));
+   memcpy(ptrs,n->ptr,r*sizeof(void*));
+   keys[r]=key;
+   ptrs[r]=value;
+   memcpy(keys+r+1,n->key+r,(num-r)*sizeof(uint64_t));
+   memcpy(ptrs+r+1,n->ptr+r,(num-r)*sizeof(void*));
+   num++;
+   right=spare[s++];
+   n->keynum=num/2;
+   right->keynum=num-num/2;
+   memcpy(n->key,keys,n->keynum*sizeof(uint64_t));
+   memcpy(n->ptr,ptrs,n->keynum*sizeof(void*));
+   memcpy(right->key,keys+n->keynum,right->keynum*sizeof(uint64_t));
+   memcpy(right->ptr,ptrs+n->keynum,right->keynum*sizeof(void*));
+   sep=right->key[0];
+
+   //insert the separator into the parents
+   for(i=h-1;i>=0;i--)
+   {
+      n=path[i];
+      r=idx[i];
+      num=n->keynum;
+      if(num<BPT_KEYS)
+      {
+         memmove(n->key+r+1,n->key+r,(num-r)*sizeof(uint64_t));
+         memmove(n->ptr+r+2,n->ptr+r+1,(num-r)*sizeof(void*));
+         n->key[r]=sep;
+         n->ptr[r+1]=right;
+         n->keynum++;
+         return R_SUCCESS;
+      }
+      memcpy(keys,n->key,r*sizeof(uint64_t));
+      memcpy(ptrs,n->ptr,(r+1)*sizeof(void*));
+      keys[r]=sep;
+      ptrs[r+1]=right;
+      memcpy(keys+r+1,n->key+r,(num-r)*sizeof(uint64_t));
+      memcpy(ptrs+r+2,n->ptr+r+1,(num-r)*sizeof(void*));
+      num++;
+      //the middle key goes up
+      right=spare[s++];
+      n->keynum=num/2;
+      right->keynum=num-num/2-1;
+      memcpy(n->key,keys,n->keynum*sizeof(uint64_t));
+      memcpy(n->ptr,ptrs,(n->keynum+1)*sizeof(void*));
+      sep=keys[n->keynum];
+      memcpy(right->key,keys+n->keynum+1,right->keynum*sizeof(uint64_t));
+      memcpy(right->ptr,ptrs+n->keynum+1,(right->keynum+1)*sizeof(void*));
+   }
+
+   //the root has split, make a new root.
+   n=spare[s++];
+   n->keynum=1;
+   n->key[0]=sep;
+   n->ptr[0]=tree->shadow;
+   n->ptr[1]=right;
+   tree->shadow=n;
+   return R_SUCCESS;
+}
+
+result_t BPTreeRemove(BPTree* tree,uint64_t key)
+{
+   struct BPNode* path[BPT_MAXHEIGHT];
+   int idx[BPT_MAXHEIGHT];
+   struct BPNode* n,*c;
+   int h=0,r,i,gone;
+
+   if(BPTreeFind(tree,key)==NULL)
+      return R_SUCCESS;          //not found
+   if(Reserve(tree,2*BPT_MAXHEIGHT+1)==R_FAILED)
+      return R_FAILED;
+
+   n=Writable(tree,tree->shadow);
+   if(n==NULL)
+      return R_FAILED;
+   tree->shadow=n;
+   while(!n->leaf)
+   {
+      r=BPRank(n,key);
+      c=Writable(tree,(struct BPNode*)n->ptr[r]);
+      if(c==NULL)
+         return R_FAILED;
+      n->ptr[r]=c;
+      path[h]=n;
+      idx[h++]=r;
+      n=c;
+   }
+   r=BPRank(n,key);
+   Defer(tree,n->ptr[r-1],tree->release);
+   memmove(n->key+r-1,n->key+r,(n->keynum-r)*sizeof(uint64_t));
+   memmove(n->ptr+r-1,n->ptr+r,(n->keynum-r)*sizeof(void*));
+   n->keynum--;
+   tree->count--;
+
+   //the nodes are not merged: a sparse node is still correct, and deletes are rare.
+   //an empty node is removed from its parent.
+   gone=(n->keynum==0);
+   for(i=h-1;i>=0 && gone;i--)
+   {
+      Drop(tree,n);
+      n=path[i];
+      r=idx[i];
+      if(n->keynum==0)
+         continue;         //its only child is gone
+      memmove(n->ptr+r,n->ptr+r+1,(n->keynum-r)*sizeof(void*));
+      if(r>0)
+         memmove(n->key+r-1,n->key+r,(n->keynum-r)*sizeof(uint64_t));
+      else
+         memmove(n->key,n->key+1,(n->keynum-1)*sizeof(uint64_t));
+      n->keynum--;
+      gone=0;
+   }
+   if(gone)
+   {
+      Drop(tree,n);
+      tree->shadow=NULL;
+      return R_SUCCESS;
+   }
+   //a root with only one child is replaced by the child.
+   while(!tree->shadow->leaf && tree->shadow->keynum==0)
+   {
+      n=tree->shadow;
+      tree->shadow=(struct BPNode*)n->ptr[0];
+      Drop(tree,n);
+   }
+   return R_SUCCESS;
+}
+
+void BPTreeCommit(BPTree* tree)
+{
+   size_t i;
+   __atomic_store_n(&(tree->root),tree->shadow,__ATOMIC_RELEASE);
+   for(i=0;i<tree->nretired;i++)
+      tree->retire(tree->retired[i].ptr,tree->retired[i].release);
+   tree->nretired=0;
+   tree->gen++;
+}
+
+static result_t WalkNode(struct BPNode* n,result_t (*visit)(uint64_t,void*,void*),void* arg)
+{
+   unsigned int i;
+   if(n->leaf)
+   {
+      for(i=0;i<n->keynum;i++)
+      {
+         if(visit(n->key[i],n->ptr[i],arg)==R_FAILED)
+            return R_FAILED;
+      }
+      return R_SUCCESS;
+   }
+   for(i=0;i<=n->keynum;i++)
+   {
+      if(WalkNode((struct BPNode*)n->ptr[i],visit,arg)==R_FAILED)
+         return R_FAILED;
+   }
+   return R_SUCCESS;
+}
+
+result_t BPTreeWalk(BPTree* tree,result_t (*visit)(uint64_t,void*,void*),void* arg)
+{
+   if(tree->shadow==NULL)
+      return R_SUCCESS;
+   return WalkNode(tree->shadow,visit,arg);
+}
+
+static void FreeNode(struct BPNode* n,void (*release)(void*))
+{
+   unsigned int i;
+   if(n->leaf)
+   {
+      for(i=0;i<n->keynum && release!=NULL;i++)
+         release(n->ptr[i]);
+   }else{
+      for(i=0;i<=n->keynum;i++)
+         FreeNode((struct BPNode*)n->ptr[i],release);
+   }
+   free(n);
+}
+
+void BPTreeDestroy(BPTree* tree)
+{
+   size_t i;
+   //the published nodes which are not in the writer's tree are all retired items.
+   if(tree->shadow!=NULL)
+      FreeNode(tree->shadow,tree->release);
+   for(i=0;i<tree->nretired;i++)
+      tree->retired[i].release(tree->retired[i].ptr);
+   free(tree->retired);
+   tree->retired=NULL;
+   tree->nretired=tree->maxretired=0;
+   tree->root=tree->shadow=NULL;
+   tree->count=0;
+}
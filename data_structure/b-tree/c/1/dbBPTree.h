@@ -0,0 +1,110 @@
+#ifndef DBBPTREE_H_INCLUDED
+#define DBBPTREE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dbUtility.h"
+
+#define BPT_KEYS 15         /* keys in one node, the keys fill a pair of cache lines */
+#define BPT_MAXHEIGHT 32
+
+/*
+ * B+ tree node (256 bytes): the first 128 bytes hold the keys, the next 128 bytes the pointers.
+ * A pair of lines is fetched together by the adjacent line prefetcher, 16 children per node
+ * keep the tree low (7 levels for 10M keys).
+ * Inner node: ptr[i] is the subtree of the keys in [key[i-1], key[i]).
+ * Leaf node:  ptr[i] is the value of key[i].
+ */
+struct BPNode
+{
+  uint64_t key[BPT_KEYS];
+  uint8_t keynum;
+  uint8_t leaf;
+  uint16_t pad;
+  uint32_t gen;             /* generation which made the node */
+  void* ptr[BPT_KEYS+1];
+} __attribute__((aligned(64)));
+
+/*
+ * Memory which is unlinked from the writer's tree, it is retired at the next commit.
+ */
+struct BPRetired
+{
+  void* ptr;
+  void (*release)(void*);
+};
+
+/*
+ * The writer changes a private tree (shadow): a published node is copied at its first change
+ * in a generation, nodes of the current generation are changed in place. BPTreeCommit()
+ * publishes the shadow as the root, so readers search the tree without lock.
+ * The replaced nodes and values are given to 'retire', which must free them when no reader
+ * uses them any more.
+ */
+typedef struct
+{
+  struct BPNode* root;                            /* published tree, searched by readers */
+  struct BPNode* shadow;                          /* writer's tree */
+  unsigned long count;                            /* count of keys in the writer's tree */
+  uint32_t gen;                                   /* current generation */
+  struct BPRetired* retired;
+  size_t nretired,maxretired;
+  void (*retire)(void* ptr,void (*release)(void*));
+  void (*release)(void* value);
+}BPTree;
+
+result_t BPTreeInit(BPTree* tree,void (*retire)(void*,void (*)(void*)),void (*release)(void*));
+/*
+ * Usage: initial an empty tree.
+ * Input:   @param  BPTree* tree ----- the tree
+ *          @param  retire ----- free memory after a grace period
+ *          @param  release ----- free a value
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS
+ */
+void* BPTreeSearch(BPTree* tree,uint64_t key);
+/*
+ * Usage: search the value of 'key' in the published tree, it takes no lock.
+ * Output:  @return void*
+ *                  ------ the value, NULL if not found
+ */
+void* BPTreeFind(BPTree* tree,uint64_t key);
+/*
+ * Usage: search the value of 'key' in the writer's tree (with the changes which are not committed).
+ * Output:  @return void*
+ *                  ------ the value, NULL if not found
+ */
+result_t BPTreeUpdate(BPTree* tree,uint64_t key,void* value);
+/*
+ * Usage: insert 'key', or replace its value (the old value is retired at commit).
+ *        'value' must not be NULL. Writers must be serialized by the caller.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, update success
+ *                  ------ R_FAILED,  no enough memory (the tree is not changed)
+ */
+result_t BPTreeRemove(BPTree* tree,uint64_t key);
+/*
+ * Usage: delete 'key' (its value is retired at commit).
+ *        Writers must be serialized by the caller.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, delete success (or not found)
+ *                  ------ R_FAILED,  no enough memory (the tree is not changed)
+ */
+void BPTreeCommit(BPTree* tree);
+/*
+ * Usage: publish the writer's tree to the readers, and retire the replaced memory.
+ */
+result_t BPTreeWalk(BPTree* tree,result_t (*visit)(uint64_t key,void* value,void* arg),void* arg);
+/*
+ * Usage: call 'visit' for every key of the writer's tree in key order, stop when it returns R_FAILED.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, all keys visited
+ *                  ------ R_FAILED,  stopped by 'visit'
+ */
+void BPTreeDestroy(BPTree* tree);
+/*
+ * Usage: free all the nodes and values at once. No reader may use the tree.
+ *        The values are left if tree->release is NULL (their memory is freed by the caller).
+ */
+
+#endif // DBBPTREE_H_INCLUDED
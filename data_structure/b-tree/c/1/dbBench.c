@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include "dbDomain.h"
+
+#define BENCH_BATCH   (1024*1024)     /* records of one UpdateDomainName() */
+#define BENCH_LOOKUPS 4000000
+#define BENCH_REDIRECT 4              /* every 4th domain is redirected to one of BENCH_IPS addresses */
+#define BENCH_IPS 16
+#define BENCH_RULES 10                /* IP and URL rules: one for BENCH_RULES domains */
+#define BENCH_IP_BATCH 256            /* addresses of one SearchIPv4Batch() */
+
+/*
+ * Benchmark of the index engines: load N domains, search hits and misses, memory and destroy.
+ * A part of the domains are redirected, the redirect IPs repeat like in the real lists.
+ * Every engine runs in its own process, so the RSS of one does not hide the other.
+ * Then the IP prefixes (/16 .. /32) and the URL rules (host or host/path), and their lookups.
+ */
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long RssKB(void)
+{
+    long size = 0, rss = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%ld %ld", &size, &rss) != 2)
+        rss = 0;
+    fclose(fp);
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int MakeDomain(char* buf, unsigned long i, int miss)
+{
+    unsigned long h = (i + 1) * 0x9E3779B97F4A7C15UL;
+    return sprintf(buf, "%s%lx%lu.site%lu.com", miss ? "x" : "", h >> 40, i, i % 97);
+}
+
+static void BenchEngine(unsigned char engine, unsigned long count)
+{
+    char* collection;
+    char name[64];
+    size_t size;
+    unsigned long i, j, found;
+    int len;
+    unsigned char control_type;
+    char* info;
+    struct data_hdr* hdr;
+    double t, load, hit, miss, destroy;
+    long rss = RssKB();
+
+    collection = (char*)malloc(BENCH_BATCH * (sizeof(struct data_hdr) + 64 + 16));
+    if (collection == NULL || InitializeSearchEngine(engine) != R_SUCCESS) {
+        printf("initial engine %d failed\n", engine);
+        exit(1);
+    }
+
+    t = Now();
+    for (i = 0; i < count; i += BENCH_BATCH) {
+        size = 0;
+        for (j = i; j < count && j < i + BENCH_BATCH; j++) {
+            hdr = (struct data_hdr*)(collection + size);
+            len = MakeDomain(collection + size + sizeof(*hdr), j, 0);
+            hdr->control_type = CFLAG_DROP;
+            hdr->opcode_type = OPCODE_ADD;
+            hdr->wildcard = 0;
+            hdr->reserve = 0;
+            hdr->val_length = len;
+            hdr->info_length = 0;
+            if (j % BENCH_REDIRECT == 0) {
+                hdr->control_type = CFLAG_REDIRECT;
+                hdr->info_length = sprintf(collection + size + sizeof(*hdr) + len, "10.0.%lu.1", j / BENCH_REDIRECT % BENCH_IPS);
+            }
+            size += sizeof(*hdr) + len + hdr->info_length;
+        }
+        UpdateDomainName(collection, size, UPDATE_NORMAL);
+    }
+    load = Now() - t;
+    rss = RssKB() - rss;
+
+    found = 0;
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        MakeDomain(name, (i * 2654435761UL) % count, 0);
+        if (SearchDomainName(name, &control_type, &info) == R_FOUND)
+            found++;
+        free(info);
+    }
+    hit = Now() - t;
+    if (found != BENCH_LOOKUPS)
+        printf("engine %d: %lu of %d domains are not found!\n", engine, BENCH_LOOKUPS - found, BENCH_LOOKUPS);
+
+    found = 0;
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        MakeDomain(name, (i * 2654435761UL) % count, 1);
+        if (SearchDomainName(name, &control_type, &info) == R_FOUND)
+            found++;
+        free(info);
+    }
+    miss = Now() - t;
+
+    t = Now();
+    DestroySearchTree();
+    destroy = Now() - t;
+
+    printf("%-12s %10lu %9.2f %11.1f %11.1f %9ld %9.2f\n",
+           engine == ENGINE_HASH_BTREE ? "hash+btree" : "b+tree", count, load,
+           hit * 1e9 / BENCH_LOOKUPS, miss * 1e9 / BENCH_LOOKUPS, rss / 1024, destroy);
+    free(collection);
+}
+
+static uint32_t MakeIP(unsigned long i)
+{
+    return (uint32_t)((i + 1) * 2654435761UL);
+}
+
+static int MakeURL(char* buf, unsigned long i, int miss)
+{
+    if (i % 4 == 0)      /* the whole host */
+        return sprintf(buf, "%shost%lu.example%lu.com", miss ? "x" : "", i, i % 97);
+    return sprintf(buf, "%shost%lu.example%lu.com/dir%lu/page", miss ? "x" : "", i, i % 97, i % 13);
+}
+
+/*
+ * Load 'count' rules of DATA_TYPE_IP or DATA_TYPE_URL, in batches of BENCH_BATCH.
+ */
+static double LoadRules(unsigned char type, char* collection, unsigned long count)
+{
+    struct data_hdr* hdr;
+    unsigned long i, j;
+    uint32_t ip;
+    size_t size;
+    double t = Now();
+    int len;
+
+    for (i = 0; i < count; i += BENCH_BATCH) {
+        size = 0;
+        for (j = i; j < count && j < i + BENCH_BATCH; j++) {
+            hdr = (struct data_hdr*)(collection + size);
+            if (type == DATA_TYPE_IP) {
+                ip = MakeIP(j);
+                len = sprintf(collection + size + sizeof(*hdr), "%u.%u.%u.%u/%lu",
+                              ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, 16 + j % 17);
+            } else
+                len = MakeURL(collection + size + sizeof(*hdr), j, 0);
+            hdr->control_type = CFLAG_DROP;
+            hdr->opcode_type = OPCODE_ADD;
+            hdr->wildcard = 0;
+            hdr->reserve = 0;
+            hdr->val_length = len;
+            hdr->info_length = 0;
+            size += sizeof(*hdr) + len;
+        }
+        if (type == DATA_TYPE_IP)
+            UpdateIPAddress(collection, size);
+        else
+            UpdateURL(collection, size);
+    }
+    return Now() - t;
+}
+
+static void BenchRules(unsigned long count)
+{
+    char* collection;
+    char name[128];
+    char info[64];
+    unsigned long i, found;
+    unsigned char control_type;
+    double t, ipload, urlload, text, binary, batch, rnd, hit, miss;
+    uint32_t ip, ips[BENCH_IP_BATCH];
+    unsigned char control_types[BENCH_IP_BATCH];
+    result_t results[BENCH_IP_BATCH];
+    unsigned long j;
+
+    collection = (char*)malloc(BENCH_BATCH * (sizeof(struct data_hdr) + 64 + 16));
+    if (collection == NULL || InitializeSearchEngine(ENGINE_HASH_BTREE) != R_SUCCESS) {
+        printf("initial rules failed\n");
+        exit(1);
+    }
+    ipload = LoadRules(DATA_TYPE_IP, collection, count);
+    urlload = LoadRules(DATA_TYPE_URL, collection, count);
+
+    /* the addresses of the rules (found), as text and as numbers */
+    found = 0;
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        ip = MakeIP((i * 2654435761UL) % count);
+        sprintf(name, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+        if (SearchIPAddress(name, &control_type, info, sizeof(info)) == R_FOUND)
+            found++;
+    }
+    text = Now() - t;
+    if (found != BENCH_LOOKUPS)
+        printf("ip: %lu of %d addresses are not found!\n", BENCH_LOOKUPS - found, BENCH_LOOKUPS);
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        SearchIPv4Address(MakeIP((i * 2654435761UL) % count), &control_type, info, sizeof(info));
+    binary = Now() - t;
+    found = 0;
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i += BENCH_IP_BATCH) {
+        for (j = 0; j < BENCH_IP_BATCH; j++)
+            ips[j] = MakeIP(((i + j) * 2654435761UL) % count);
+        found += SearchIPv4Batch(ips, BENCH_IP_BATCH, control_types, results);
+    }
+    batch = Now() - t;
+    if (found != (BENCH_LOOKUPS + BENCH_IP_BATCH - 1) / BENCH_IP_BATCH * BENCH_IP_BATCH)
+        printf("ip batch: %lu addresses are found!\n", found);
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        SearchIPv4Address((uint32_t)(i * 0x9E3779B97F4A7C15UL >> 17), &control_type, info, sizeof(info));
+    rnd = Now() - t;
+
+    found = 0;
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        MakeURL(name, (i * 2654435761UL) % count, 0);
+        strcat(name, "/index.html?id=1");
+        if (SearchURL(name, &control_type, info, sizeof(info)) == R_FOUND)
+            found++;
+    }
+    hit = Now() - t;
+    if (found != BENCH_LOOKUPS)
+        printf("url: %lu of %d URLs are not found!\n", BENCH_LOOKUPS - found, BENCH_LOOKUPS);
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        MakeURL(name, (i * 2654435761UL) % count, 1);
+        strcat(name, "/index.html?id=1");
+        SearchURL(name, &control_type, info, sizeof(info));
+    }
+    miss = Now() - t;
+    DestroySearchTree();
+
+    printf("\n%-12s %10s %9s %11s %11s %11s %11s\n", "rules", "rules", "load(s)", "ns/op", "ns/op", "ns/op", "ns/op");
+    printf("%-12s %10lu %9.2f %11.1f %11.1f %11.1f %11.1f   (text, number, batch, random number)\n", "ip", count, ipload,
+           text * 1e9 / BENCH_LOOKUPS, binary * 1e9 / BENCH_LOOKUPS, batch * 1e9 / BENCH_LOOKUPS, rnd * 1e9 / BENCH_LOOKUPS);
+    printf("%-12s %10lu %9.2f %11.1f %11.1f %11s %11s   (hit, miss)\n", "url", count, urlload,
+           hit * 1e9 / BENCH_LOOKUPS, miss * 1e9 / BENCH_LOOKUPS, "", "");
+    free(collection);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned long count = 10000000;
+    unsigned char engines[] = { ENGINE_HASH_BTREE, ENGINE_BPLUS_TREE };
+    unsigned int k;
+    pid_t pid;
+
+    if (argc > 1)
+        count = strtoul(argv[1], NULL, 10);
+    if (count == 0)
+        count = 1;
+
+    printf("%-12s %10s %9s %11s %11s %9s %9s\n",
+           "engine", "domains", "load(s)", "hit(ns/op)", "miss(ns/op)", "rss(MB)", "free(s)");
+    fflush(stdout);
+    for (k = 0; k < sizeof(engines); k++) {
+        pid = fork();
+        if (pid == 0) {
+            BenchEngine(engines[k], count);
+            return 0;
+        }
+        if (pid > 0)
+            waitpid(pid, NULL, 0);
+    }
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        BenchRules(count / BENCH_RULES > 0 ? count / BENCH_RULES : 1);
+        return 0;
+    }
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    return 0;
+}
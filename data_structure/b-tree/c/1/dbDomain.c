@@ -11,12 +11,44 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
 
 #include "dbDomain.h"
+#include "dbBPTree.h"
+#include "dbLog.h"
+#include "dbFilter.h"
+#include "dbHash.h"
+#include "dbArena.h"
+#include "dbStats.h"
+#include "dbLogger.h"
+#include "dbIPTrie.h"
+#include "dbSuffix.h"
+#include "dbURLTable.h"
 
 #define LOCKNUM 10
 #define MAXBUCKETS 65535
 #define SUBMAX 7
+#define READER_SLOTS 64
+#define BATCH_GROUP 32
+#define OVERLAY_MIN 64               /* slots of the smallest overlay of a cache list */
+#define CACHE_LINE 64
+#define COMPACT_INTERVAL 10                /* seconds between two checks of the compactor */
+#define COMPACT_MIN_LOG (16*1024*1024)     /* the log is folded when it is larger than the image and this */
+#define FLUSH_WORKERS 3                    /* threads which apply the shards of an update, with the caller */
+#define RESULT_SETS 1024                   /* result cache of a thread (512KB): sets of RESULT_WAYS entries, power of 2 */
+#define RESULT_WAYS 4
+#define RESULT_NAME_SIZE 64                /* longer names (and infos) are not cached */
+#define RESULT_INFO_SIZE 44
+#define RESULT_FLUSH 1024                  /* lookups of a thread between two updates of the hit counters */
+#define IP_NAME_MAX 64                     /* "address/len" of an IP rule */
+#define BULK_TEXT (1024*1024)              /* names and infos of the staged records, per block */
+
+//key of a domain in the B+ tree engine
+#define BPTREE_KEY(key1,key2) (((uint64_t)(key1)<<32)|((uint64_t)(key2)&0xffffffffULL))
 
 /*
  * (Domain Data in Hash-B-Tree) structure definition
@@ -25,8 +57,8 @@
 typedef struct BlackRecord
 {
    unsigned char control_type; // 数据控制策略（0为丢弃，1为重定向，2为欺骗）
-   char* value_domain;         // 域名
-   char* info;                 // 重定向信息（IP字符串）
+   char* value_domain;         // 域名，紧跟在记录之后（同一块内存）
+   const char* info;           // 重定向信息（IP字符串），在InfoPool中，多条记录共用
    struct BlackRecord *next;   // 后继数据结点
 }BlackRecord,* BRecordList;
 
@@ -57,6 +89,51 @@ typedef struct TempRecord
    struct TempRecord* next;
 }TempRecord,*TempList;
 #pragma pack(pop)
+/*
+ * Records of the log which are staged while the database is loaded (hash engine): the
+ * B-trees are built from them at the end, bottom-up, instead of one insert or delete at a time.
+ */
+struct BulkText
+{
+   struct BulkText* next;
+   size_t used;
+   size_t size;
+   char text[];
+};
+
+struct BulkRecord
+{
+   unsigned long key2;
+   const char* domain;         // in a BulkText block (lowercase)
+   const char* info;           // NULL为没有
+   uint32_t key1;
+   unsigned char control_type;
+   unsigned char opcode_type;
+};
+
+/*
+ * One record of a bucket being built: the old ones (image or tree) first, then the staged
+ * ones in the order of the log, so the last item of a name tells if it is still there.
+ */
+struct BulkItem
+{
+   unsigned long key2;
+   const char* domain;
+   const char* info;
+   uint32_t order;
+   unsigned char control_type;
+   unsigned char opcode_type;
+   unsigned char old;          // the record is in the bucket already
+};
+
+struct BulkScratch
+{
+   struct BulkItem* item;
+   unsigned long* key;         // keys of the new tree and their records
+   struct BlackRecord** chain;
+   size_t size;
+};
+
 /*
  *  B Tree node structure definition
  */
@@ -76,6 +153,7 @@ struct HashNode
 {
   unsigned long members; // 当前Hash桶结点中包含的Domain数
   BTree pb;              // B树根结点
+  int frozen;            // 数据仍在只读快照映像中（pb无效），第一次修改时转换为B树
 };
 /*
  * search result of B-Tree
@@ -85,147 +163,707 @@ typedef struct
   BTNode * pt;         // 所查数据在B树中的位置，如果数据不存在则返回待插入的结点位置
   int i;               // 所查数据在当前结点所有关键字列表中的位置（pt->key[i]），如果数据不存在则返回待插入的关键字位置
   int tag;             // 所查数据是否存在（0为不存在，1为存在）
+  int depth;           // 查找经过的结点数
 }Result, *PResult;
 
 /*
  * Cache structure
  */
+/*
+ * Overlay of a cache list: open addressing on key2, a slot points to the newest record of a
+ * name in the list (a delete is a tombstone: the record with OPCODE_DELETE). Readers probe it
+ * without lock, the writer (CacheLock) fills an empty slot or swaps the record of a name,
+ * a full table is copied into a larger one. At most half of the slots are used.
+ */
+struct Overlay
+{
+  unsigned int size;            // 槽数（2的幂）
+  unsigned int count;           // 不同域名数
+  TempRecord* slot[];
+};
+
 struct CacheList
 {
   TempList list;        //主缓存，立即生效数据添加至主缓存
   TempList templist;    //辅缓存，当清空主缓存时，先将主缓存数据加入辅缓存，然后将辅缓存数据加入Hash-B-Tree
+  struct Overlay* map;        //主缓存的散列索引，读者只查它
+  struct Overlay* tempmap;    //辅缓存的散列索引
+};
+
+/*
+ * Writer side copy of a Hash bucket (copy-on-write).
+ * Readers never see a B-tree which is being modified: the writer clones the bucket
+ * at the first change of a batch, and publishes the clone when the batch is done.
+ */
+struct ShadowNode
+{
+  struct HashNode node;     // 私有副本（members和B树根结点）
+  int dirty;                // 当前批次中是否已复制
+  unsigned long nextdirty;  // 同一分片中下一个被修改的Hash桶（MAXBUCKETS为结束）
+};
+
+/*
+ * Snapshot image (domain.snap) structure definition.
+ * The image is position independent (offsets from the start of file), it is mapped
+ * read only and searched in place, so all the processes share the same pages.
+ * Layout: snap_hdr | snap_bucket[buckets] | key[records] | snap_record[records]
+ *         | snap_record[suffix rules] | snap_record[IP rules] | snap_record[URL rules] | strings
+ * An IP or URL rule is its text ("address/len", "host/path"), it is parsed again when loaded.
+ * Records of one bucket are stored together, sorted by key2 (the B-tree keys).
+ */
+#define SNAPSHOT_MAGIC "VDBSNAP"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_VERSION_NONET 4      // no IP and URL rules, the header ends at ip_off
+#define SNAPSHOT_VERSION_OLDHASH 3    // keys of the old hash functions, rehashed when it is loaded
+
+struct snap_hdr
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t buckets;       // MAXBUCKETS
+  uint64_t log_seq;       // 映像之后的第一条日志的位置（日志段号，段内偏移）
+  uint64_t log_off;
+  uint64_t records;
+  uint64_t bucket_off;
+  uint64_t key_off;
+  uint64_t record_off;
+  uint64_t string_off;
+  uint64_t string_size;
+  uint64_t suffix_off;    // 后缀（通配符）规则
+  uint64_t suffixes;
+  uint64_t ip_off;        // IP前缀规则（版本5）
+  uint64_t ips;
+  uint64_t url_off;       // URL规则（版本5）
+  uint64_t urls;
+};
+
+struct snap_bucket
+{
+  uint32_t first;         // 第一条记录的下标
+  uint32_t members;
+};
+
+struct snap_record
+{
+  uint32_t domain;        // 字符串堆中的偏移
+  uint32_t info;          // 字符串堆中的偏移（0为没有附加信息）
+  uint8_t control_type;
+  uint8_t pad[3];
+};
+
+struct SnapImage
+{
+  void* start;
+  size_t size;
+  const struct snap_bucket* buckets;
+  const uint64_t* keys;
+  const struct snap_record* records;
+  const char* strings;
+  uint64_t log_seq;
+  uint64_t log_off;
+};
+
+/*
+ * Reader registration slot for epoch based reclamation.
+ * count[i] is the number of readers which entered while (GlobalEpoch&1)==i.
+ */
+struct ReaderSlot
+{
+  volatile unsigned long count[2];
+  char pad[CACHE_LINE-2*sizeof(unsigned long)];
+};
+
+/*
+ * Result of a recent search (found or not found), in the result cache of one thread.
+ * It is valid while gen==ResultGen, every update which can change a result bumps ResultGen.
+ */
+struct ResultEntry
+{
+  uint64_t hash;                 // HashLower() of the name
+  unsigned long gen;             // 0 for an empty entry
+  unsigned char result;          // R_FOUND or R_NOTFOUND
+  unsigned char control_type;
+  unsigned char refer;           // CLOCK: used since the hand passed
+  unsigned char hasinfo;
+  char name[RESULT_NAME_SIZE];
+  char info[RESULT_INFO_SIZE];
 };
 
-//upper char convert lower
-static unsigned char maptolower[] = {
-	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-	0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
-	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
-	0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
-	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-	0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
-	0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
-	0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
-	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
-	0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
-	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
-	0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
-	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
-	0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
-	0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
-	0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
-	0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
-	0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
-	0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
-	0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
-	0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7,
-	0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
-	0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
-	0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
-	0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,
-	0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
-	0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
-	0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
-	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
-	0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+struct ResultCache
+{
+  struct ResultEntry entry[RESULT_SETS][RESULT_WAYS];
+  unsigned char hand[RESULT_SETS];
+  unsigned long hits;            // not yet added to ResultHits
+  unsigned long misses;
+};
+
+/*
+ * Memory which is unlinked from the published data, waiting for a grace period.
+ */
+typedef struct RetireNode
+{
+  void* ptr;
+  void (*release)(void*);
+  struct RetireNode* next;
+}RetireNode;
+
+/*
+ * Value of a suffix (wildcard) rule in the trie (dbSuffix.h).
+ */
+struct SuffixRule
+{
+  unsigned char control_type;
+  char* info;                    // 重定向信息（NULL为没有），与规则一起分配
 };
 
+
 //Hash Table & Cache
 struct HashNode* HashTable=NULL;
 struct CacheList* Cache=NULL;
 
-// locks
+// locks (writers only, the search path is lock free)
 pthread_rwlock_t CacheLock;            //Cache list lock.
 pthread_rwlock_t *RecordLock=NULL;     //The search tree locks.
 
+// memory of the index: nodes and records of shard i in TreeArena[i] (under RecordLock[i]),
+// records of the B+ tree engine in ChainArena (under TreeLock), the infos are interned.
+static Arena* TreeArena[LOCKNUM];
+static Arena* ChainArena=NULL;
+static StringPool* InfoPool=NULL;
+
+// copy-on-write & epoch based reclamation
+static struct ShadowNode* ShadowTable=NULL;
+static unsigned long DirtyHead[LOCKNUM];
+static struct ReaderSlot ReaderSlots[READER_SLOTS] __attribute__((aligned(CACHE_LINE)));
+static volatile unsigned long GlobalEpoch=0;
+static unsigned long SlotCursor=0;
+static __thread struct ReaderSlot* MySlot=NULL;
+static RetireNode* RetireList=NULL;
+static pthread_mutex_t RetireLock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t GraceLock=PTHREAD_MUTEX_INITIALIZER;
+
+// result cache of the hot names, one per search thread (no lock, no shared line)
+static volatile unsigned long ResultGen=1;
+static unsigned long ResultHits=0;
+static unsigned long ResultMisses=0;
+static __thread struct ResultCache* MyResults=NULL;
+static pthread_key_t ResultKey;
+static pthread_once_t ResultOnce=PTHREAD_ONCE_INIT;
+
+// read only snapshot image
+static struct SnapImage Image;
+
+// index engine (ENGINE_HASH_BTREE or ENGINE_BPLUS_TREE)
+static unsigned char IndexEngine=ENGINE_HASH_BTREE;
+static BPTree GlobalTree;                 //B+ tree of all the domains, key is BPTREE_KEY
+static unsigned long TreeMembers=0;      //count of domains in GlobalTree
+static pthread_mutex_t TreeLock=PTHREAD_MUTEX_INITIALIZER;   //writers of GlobalTree
+
+// Approximate membership of the exact records (key is BPTREE_KEY), most misses stop at it.
+static Filter* KeyFilter=NULL;
+
+// suffix (wildcard) rules
+static SuffixTrie Suffixes;
+static pthread_mutex_t SuffixLock=PTHREAD_MUTEX_INITIALIZER;  //writers of the suffix trie
+
+// IP and URL rules, the records are in NetArena (written under NetLock)
+static IPTrie IPTable[2];                 //prefixes of IPv4 and IPv6
+static URLTable URLIndex;                 //URL rules (dbURLTable.h)
+static Arena* NetArena=NULL;
+static pthread_mutex_t NetLock=PTHREAD_MUTEX_INITIALIZER;     //writers of IPTable and URLIndex
+
+// write-ahead log & compactor
+static int SnapLoaded=0;                  //the image was loaded by InitializeSearchTree
+static int SnapStale=0;                   //the image has the keys of the old hash, it is written again
+static int LegacyData=0;                  //domain.db (the log of the old versions) exists
+static uint64_t SnapBytes=0;              //size of the last image
+static uint64_t SnapLogMark=0;            //LogWritten() when the last image was made
+static pthread_t Compactor;
+static int CompactorRunning=0;
+static int CompactorStop=0;
+static pthread_mutex_t CompactLock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t CompactCond=PTHREAD_COND_INITIALIZER;
+
+// Worker pool of the updates, one job applies the records of all the shards.
+static struct
+{
+   pthread_t thread[FLUSH_WORKERS];
+   int workers;                    //threads started
+   int stop;
+   unsigned long round;            //bumped for every job
+   TempList* lists;                //records of each shard
+   int reversed;                   //the lists are newest first (cache lists)
+   int next;                       //next shard to take
+   int done;                       //shards finished
+   int count[LOCKNUM];             //records applied in each shard
+   result_t result[LOCKNUM];
+   unsigned long usec[LOCKNUM];    //time of each shard
+}FlushPool;
+static pthread_mutex_t FlushLock=PTHREAD_MUTEX_INITIALIZER;   //state of FlushPool
+static pthread_mutex_t FlushRun=PTHREAD_MUTEX_INITIALIZER;    //one job at a time
+static pthread_cond_t FlushWork=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t FlushDone=PTHREAD_COND_INITIALIZER;
+
+// Staged records of the load, and the buckets which are built from them.
+struct BulkLoad
+{
+   struct BulkRecord* rec;         //in the order of the log
+   size_t count;
+   size_t size;
+   struct BulkText* text;
+   uint32_t* first;                //records of bucket key1: order[first[key1] .. first[key1+1]-1]
+   uint32_t* order;
+   int next;                       //next shard to take
+   result_t result[LOCKNUM];
+};
+static struct BulkLoad Bulk;
+
 // Function declare.
 static result_t
 CreateFromFile(void);
 static result_t
-SearchInList(char* domain, unsigned char* control_type,unsigned long lockindex,unsigned long key2,char** info);
+ReplayRecords(unsigned char type,void* collection,size_t size,void* arg);
+static void StartCompactor(void);
+static void StopCompactor(void);
+static void StartFlushPool(void);
+static void StopFlushPool(void);
+static result_t
+ApplyShards(TempList* lists,int reversed,int* count,int* counts,unsigned long* usec);
+static result_t
+LoadSnapshot(void);
+static void
+UnloadSnapshot(void);
+static result_t
+SearchInImage(char* domain,unsigned char* control_type,unsigned long key1,unsigned long key2,const char** info);
+static result_t
+ThawBucket(unsigned long key1,struct HashNode* bucket);
+static result_t
+BulkStage(struct BulkLoad* b,const char* domain,size_t len,const char* info,size_t ilen,
+	  unsigned char control_type,unsigned char opcode_type);
+static result_t
+BulkBuild(struct BulkLoad* b);
+static void BulkFree(struct BulkLoad* b);
+static void BulkScratchFree(struct BulkScratch* s);
 static result_t
-SearchInBTree(char* domain,unsigned char* control_type,unsigned long key1,unsigned long key2,char** info);
+BuildBucket(unsigned long key1,const struct HashNode* from,const struct BulkLoad* b,const uint32_t* ops,uint32_t nops,
+	    struct BulkScratch* s,struct HashNode* to);
+static result_t
+SearchInList(char* domain, unsigned char* control_type,unsigned long lockindex,unsigned long key2,const char** info);
+static const TempRecord* OverlayFind(const struct Overlay* m,unsigned long key2,const char* domain);
+static result_t OverlayReserve(unsigned long index,unsigned int n);
+static void OverlayPut(struct Overlay* m,TempRecord* pr);
+static result_t
+SearchInBTree(char* domain,unsigned char* control_type,unsigned long key1,unsigned long key2,const char** info);
+static result_t
+MatchRecord(BRecordList pb,char* domain,unsigned char* control_type,const char** info);
 static int
 UpdateToList(void* collection,size_t size);
 static int
 UpdateToBTree(void* collection,size_t size);
 static result_t
-AddDomainName(char* domain,unsigned char control_type,unsigned long key1,unsigned long key2,char* info);
+AddDomainName(char* domain,unsigned char control_type,struct HashNode* bucket,unsigned long key1,unsigned long key2,char* info);
+static result_t
+DeleteDomainName(char* domain,struct HashNode* bucket,unsigned long key1,unsigned long key2);
+// B+ tree engine
+static result_t
+UpdateInBPTree(char* domain,unsigned char control_type,unsigned char opcode_type,unsigned long key1,unsigned long key2,char* info);
+static result_t
+SearchInBPTree(char* domain,unsigned char* control_type,unsigned long key1,unsigned long key2,const char** info);
+static result_t
+ImageToBPTree(void);
+static result_t
+RehashImage(void);
+static void CommitBPTree(void);
+// membership filter
+static inline void FilterCount(unsigned long key1,unsigned long key2,int delta);
+static result_t
+RebuildFilter(uint64_t records);
+static void ResizeFilter(uint64_t records);
+static void GrowFilter(void);
+static uint64_t CountRecords(void);
+// suffix (wildcard) rules
+static result_t
+UpdateSuffixRule(char* domain,unsigned char control_type,unsigned char opcode_type,char* info);
+static result_t
+SearchSuffix(char* domain,unsigned char* control_type,const char** info);
+static result_t
+LookupDomain(char* domain, unsigned char* control_type, const char** info);
+// IP and URL rules
 static result_t
-DeleteDomainName(char* domain,unsigned long key1,unsigned long key2);
+UpdateIPRule(char* text,unsigned char control_type,unsigned char opcode_type,char* info);
+static result_t
+UpdateURLRule(char* url,unsigned char control_type,unsigned char opcode_type,char* info);
+static result_t
+UpdateNetRules(unsigned char type,void* collection,size_t size,int* count);
+static result_t CreateNetRules(void);
+static void DestroyNetRules(int records);
+static char* CopyInfo(const char* info);
+// result cache
+static struct ResultCache* ResultCacheOf(void);
+static const struct ResultEntry*
+ResultProbe(struct ResultCache* rc,uint64_t hash,const char* domain,unsigned long gen);
+static void
+ResultStore(struct ResultCache* rc,uint64_t hash,const char* domain,unsigned long gen,result_t result,
+	    unsigned char control_type,const char* info);
+static inline void ResultInvalidate(void);
+static void LogResultCache(void);
+static void ResetSuffix(void);
+static result_t CreateArenas(void);
+static void DestroyArenas(void);
+static void ReleaseChain(void* br);
+static void ReleaseNow(void* ptr,void (*release)(void*));
+// copy-on-write & epoch based reclamation
+static inline unsigned long ReadLock(void);
+static inline void ReadUnlock(unsigned long idx);
+static void SynchronizeReaders(void);
+static void Retire(void* ptr,void (*release)(void*));
+static void Reclaim(void);
+static struct HashNode* WritableBucket(unsigned long key1);
+static void PublishBuckets(unsigned long index);
+static BTree CloneTree(Arena* arena,BTree bt,BTree parent);
+static void ReleaseTree(void* bt);
+static void ReleaseList(void* list);
 // BTree functions
-static unsigned long hashkey1(char* str);
-static unsigned long hashkey2(char* str);
-static result_t NewRoot(BTree*,unsigned long,BRecordList,BTree);
-static result_t InsertBTNode(BTree*,unsigned long,BRecordList,BTree,int);
+static result_t NewRoot(Arena*,BTree*,unsigned long,BRecordList,BTree);
+static result_t InsertBTNode(Arena*,BTree*,unsigned long,BRecordList,BTree,int);
 static void SearchBTNode(BTree,unsigned long,PResult);
 static void AdjustBTree(BTree*,BTree);
 static void DeleteBTNode(BTree*,BTree,int);
 static void FreeTree(BTree);
+static result_t BuildTree(Arena*,BTree*,const unsigned long*,BRecordList*,size_t);
 // write logs
 static void DBLogging(const char *filePath, const char *logString);
 
-static inline void UPPERTOLOWER(char* str)
+/*
+ * Read side of the epoch based reclamation, it takes no locks.
+ * Every thread is bound to a slot, and counts itself in the half of the slot
+ * which belongs to the current epoch.
+ */
+static inline unsigned long ReadLock(void)
 {
-    while(*str!='\0')
-    {
-        *str=maptolower[(unsigned char)(*str)];
-        str++;
-    }
+   unsigned long idx;
+   if(MySlot==NULL)
+      MySlot=ReaderSlots+(__atomic_fetch_add(&SlotCursor,1,__ATOMIC_RELAXED)%READER_SLOTS);
+   idx=__atomic_load_n(&GlobalEpoch,__ATOMIC_ACQUIRE)&1;
+   __atomic_fetch_add(&(MySlot->count[idx]),1,__ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);     //pairs with the fence in SynchronizeReaders
+   return idx;
+}
+
+static inline void ReadUnlock(unsigned long idx)
+{
+   __atomic_fetch_sub(&(MySlot->count[idx]),1,__ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until every reader which may still see unlinked data has left.
+ * The epoch is flipped twice, so a reader which read the old epoch just before
+ * the first flip is waited in the second round.
+ */
+static void SynchronizeReaders(void)
+{
+   int round,i;
+   unsigned long idx;
+
+   pthread_mutex_lock(&GraceLock);
+   for(round=0;round<2;round++)
+   {
+      idx=__atomic_fetch_add(&GlobalEpoch,1,__ATOMIC_SEQ_CST)&1;
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      for(i=0;i<READER_SLOTS;i++)
+      {
+         while(__atomic_load_n(&(ReaderSlots[i].count[idx]),__ATOMIC_ACQUIRE)!=0)
+            sched_yield();
+      }
+   }
+   pthread_mutex_unlock(&GraceLock);
+}
+
+static void Retire(void* ptr,void (*release)(void*))
+{
+   char logString[256];
+   RetireNode* rn=(RetireNode*)malloc(sizeof(RetireNode));
+   if(rn==NULL)
+   {  //can not defer it, wait for the readers here.
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ Retire @ malloc --- no enough memory!");
+      DBLogging(PROG_ERROR_LOG, logString);
+      SynchronizeReaders();
+      release(ptr);
+      return;
+   }
+   rn->ptr=ptr;
+   rn->release=release;
+   pthread_mutex_lock(&RetireLock);
+   rn->next=RetireList;
+   RetireList=rn;
+   pthread_mutex_unlock(&RetireLock);
+}
+
+/*
+ * Free all the retired memory after a grace period.
+ */
+static void Reclaim(void)
+{
+   RetireNode* rn,*next;
+
+   pthread_mutex_lock(&RetireLock);
+   rn=RetireList;
+   RetireList=NULL;
+   pthread_mutex_unlock(&RetireLock);
+   if(rn==NULL)
+      return;
+
+   SynchronizeReaders();
+   while(rn!=NULL)
+   {
+      next=rn->next;
+      rn->release(rn->ptr);
+      free(rn);
+      rn=next;
+   }
+}
+
+static void ReleaseTree(void* bt)
+{
+   FreeTree((BTree)bt);
+}
+
+static void ReleaseList(void* list)
+{
+   TempRecord* p,*q=(TempList)list;
+   while(q)
+   {
+      p=q;
+      q=q->next;
+      free(p->value_domain);
+      if((p->info)!=NULL)
+         free(p->info);
+      free(p);
+   }
+}
+
+/*
+ * Retire function used while there is no reader (loading), free at once.
+ */
+static void ReleaseNow(void* ptr,void (*release)(void*))
+{
+   release(ptr);
+}
+
+/*
+ * A record and its domain are one object of 'arena', the info is a reference to InfoPool.
+ */
+static BlackRecord* NewRecord(Arena* arena,const char* domain,unsigned char control_type,const char* info)
+{
+   size_t len=strlen(domain)+1;
+   BlackRecord* record=(BlackRecord *)ArenaAlloc(arena,sizeof(BlackRecord)+len);
+   if(record==NULL)
+      return NULL;
+   record->value_domain=(char*)(record+1);
+   memcpy(record->value_domain,domain,len);
+   record->control_type=control_type;
+   record->next=NULL;
+   record->info=NULL;
+   if(info!=NULL && (record->info=PoolIntern(InfoPool,info))==NULL)
+   {
+      ArenaFree(record,sizeof(BlackRecord)+len);
+      return NULL;
+   }
+   return record;
+}
+
+/*
+ * Copy of a record, it shares the info.
+ */
+static BlackRecord* CopyRecord(Arena* arena,const BlackRecord* br)
+{
+   size_t len=strlen(br->value_domain)+1;
+   BlackRecord* record=(BlackRecord *)ArenaAlloc(arena,sizeof(BlackRecord)+len);
+   if(record==NULL)
+      return NULL;
+   record->value_domain=(char*)(record+1);
+   memcpy(record->value_domain,br->value_domain,len);
+   record->control_type=br->control_type;
+   record->next=NULL;
+   record->info=br->info;
+   if(record->info!=NULL)
+      PoolRetain(record->info);
+   return record;
+}
+
+static void FreeRecord(BlackRecord* record)
+{
+   if(record->info!=NULL)
+      PoolRelease(InfoPool,record->info);
+   ArenaFree(record,sizeof(BlackRecord)+strlen(record->value_domain)+1);
+}
+
+static BRecordList CloneRecords(Arena* arena,BRecordList br)
+{
+   BRecordList head=NULL,*tail=&head,record;
+   while(br!=NULL)
+   {
+      record=CopyRecord(arena,br);
+      if(record==NULL)
+         goto err_malloc;
+      *tail=record;
+      tail=&(record->next);
+      br=br->next;
+   }
+   return head;
+
+err_malloc:
+   while(head!=NULL)
+   {
+      record=head;
+      head=head->next;
+      FreeRecord(record);
+   }
+   return NULL;
 }
 
-static unsigned long hashkey1(char* str)
-{ //Used in OpenSSL,it is effective
-  int i,l;
-  unsigned long ret=0;
-  unsigned short* s;
-  if(str!=NULL)
+/*
+ * Deep copy of a B-tree (nodes and records, the infos are shared).
+ * return NULL if there is no enough memory.
+ */
+static BTree CloneTree(Arena* arena,BTree bt,BTree parent)
+{
+   int i;
+   BTree nt=(BTNode*)ArenaAlloc(arena,sizeof(BTNode));
+   if(nt==NULL)
+      return NULL;
+   memset(nt, 0, sizeof(BTNode));
+   nt->parent=parent;
+   //keynum grows with the copied keys, so FreeTree() can always clean a half copy.
+   for(i=1;i<=bt->keynum;i++)
+   {
+      nt->key[i]=bt->key[i];
+      nt->brecord[i]=CloneRecords(arena,bt->brecord[i]);
+      if(nt->brecord[i]==NULL)
+         goto err_clone;
+      nt->keynum=i;
+   }
+   for(i=0;i<=bt->keynum;i++)
    {
-      l=(strlen(str)+1)/2;
-      s=(unsigned short *)str;
-      for(i=0;i<l;i++)
-         ret^=(s[i]<<(i&0x0f));
+      if(bt->ptr[i]==NULL)
+         continue;
+      nt->ptr[i]=CloneTree(arena,bt->ptr[i],nt);
+      if(nt->ptr[i]==NULL)
+         goto err_clone;
    }
-   return ret;
+   return nt;
+
+err_clone:
+   FreeTree(nt);
+   return NULL;
 }
-static unsigned long hashkey2(char* str)
-{  //Used in PHP
-   unsigned long h=0,g;
-   char * strCurrent=str;
-   char * strEnd=str+strlen(str);
-   while(strCurrent<strEnd)
+
+/*
+ * Get the private copy of bucket 'key1' for the current batch.
+ * The caller must hold RecordLock[key1%LOCKNUM] (write).
+ */
+static struct HashNode* WritableBucket(unsigned long key1)
+{
+   struct ShadowNode* sn=ShadowTable+key1;
+   char logString[256];
+
+   if(sn->dirty==0)
    {
-      h=(h<<4)+*strCurrent++;
-      if((g=(h&0xF0000000)))
+      sn->node.members=HashTable[key1].members;
+      sn->node.pb=NULL;
+      sn->node.frozen=0;
+      if(HashTable[key1].frozen)
+      {  //first change of a bucket in the snapshot image
+         if(ThawBucket(key1,&(sn->node))==R_FAILED)
+         {
+            memset(logString, 0, 256);
+            snprintf(logString,256,"[ERROR] dbDomain.c @ WritableBucket @ ThawBucket --- no enough memory!");
+            DBLogging(PROG_ERROR_LOG, logString);
+            return NULL;
+         }
+      }else if(sn->node.members!=0)
       {
-         h=h^(g>>24);
-         h=h^g;
+         sn->node.pb=CloneTree(TreeArena[key1%LOCKNUM],HashTable[key1].pb,NULL);
+         if(sn->node.pb==NULL)
+         {
+            memset(logString, 0, 256);
+            snprintf(logString,256,"[ERROR] dbDomain.c @ WritableBucket @ CloneTree --- no enough memory!");
+            DBLogging(PROG_ERROR_LOG, logString);
+            return NULL;
+         }
+      }
+      sn->dirty=1;
+      sn->nextdirty=DirtyHead[key1%LOCKNUM];
+      DirtyHead[key1%LOCKNUM]=key1;
+   }
+   return &(sn->node);
+}
+
+/*
+ * Make the private copies of shard 'index' visible to the readers,
+ * and retire the old trees. The caller must hold RecordLock[index] (write).
+ */
+static void PublishBuckets(unsigned long index)
+{
+   unsigned long key1=DirtyHead[index],oldmembers;
+   struct ShadowNode* sn;
+   BTree old,pb;
+
+   while(key1!=MAXBUCKETS)
+   {
+      sn=ShadowTable+key1;
+      old=HashTable[key1].pb;
+      oldmembers=HashTable[key1].members;
+      pb=(sn->node.members!=0) ? sn->node.pb : NULL;   //an empty tree has been freed by AdjustBTree
+      //the root is published before the members, see SearchDomainName.
+      __atomic_store_n(&(HashTable[key1].pb),pb,__ATOMIC_RELEASE);
+      if(HashTable[key1].frozen)
+      {  //the image is never changed, nothing to retire.
+         __atomic_store_n(&(HashTable[key1].frozen),0,__ATOMIC_RELEASE);
+         oldmembers=0;
       }
+      __atomic_store_n(&(HashTable[key1].members),sn->node.members,__ATOMIC_RELEASE);
+      if(oldmembers!=0 && old!=NULL)
+         Retire(old,ReleaseTree);
+
+      sn->dirty=0;
+      sn->node.pb=NULL;
+      key1=sn->nextdirty;
    }
-   return h;
+   DirtyHead[index]=MAXBUCKETS;
+}
+
+/*
+ * Find i at p->key[1...n], p->key[i]<=K<p->key[i+1].
+ */
+static inline int NodeIndex(BTree p,unsigned long K)
+{
+   int i,n=p->keynum;
+   if(K>=p->key[1] && K<p->key[n])
+   {
+     for(i=1;i<n;i++)
+     {
+       if(K>=p->key[i] && K<p->key[i+1])
+          break;
+     }
+   }else if(K<p->key[1])
+      i=0;
+   else
+      i=n;
+   return i;
 }
 
 static void SearchBTNode(BTree T,unsigned long K,PResult r)
 {
    BTree p=T,q=NULL;
-   int found=0,i=0,n;
+   int found=0,i=0;
+   r->depth=0;
    while(p && found==0)
    {
       //Search(p,K)----find i at p->key[1...n]
-      n=p->keynum;
-      if(K>=p->key[1] && K<p->key[n])
-      {
-        for(i=1;i<n;i++)
-        {
-          if(K>=p->key[i] && K<p->key[i+1])
-             break;
-        }
-      }else if(K<p->key[1])
-         i=0;
-      else
-         i=n;
+      i=NodeIndex(p,K);
+      r->depth++;
 
       //find the right position
       if(i!=0 && p->key[i]==K)
@@ -247,10 +885,10 @@ static void SearchBTNode(BTree T,unsigned long K,PResult r)
    }
 }
 
-static result_t NewRoot(BTree* T,unsigned long K,BRecordList record,BTree p)
+static result_t NewRoot(Arena* arena,BTree* T,unsigned long K,BRecordList record,BTree p)
 {
     char logString[256];
-    BTree newtree=(BTNode*)malloc(sizeof(BTNode));
+    BTree newtree=(BTNode*)ArenaAlloc(arena,sizeof(BTNode));
     if(newtree==NULL)
     {
        goto err_malloc;
@@ -278,7 +916,7 @@ err_malloc:
    return R_FAILED;
 }
 
-static result_t InsertBTNode(BTree* T,unsigned long K,BRecordList record,BTree q,int i)
+static result_t InsertBTNode(Arena* arena,BTree* T,unsigned long K,BRecordList record,BTree q,int i)
 {
     unsigned long x=K;
     BTree ap=NULL,cq=q;
@@ -303,7 +941,7 @@ static result_t InsertBTNode(BTree* T,unsigned long K,BRecordList record,BTree q
           finished=1;
        else
        { //sqlit the tree cq to two trees: 'cq' and 'ap'.
-          ap=(BTNode*)malloc(sizeof(BTNode));
+          ap=(BTNode*)ArenaAlloc(arena,sizeof(BTNode));
           if(ap==NULL)
           {
              goto err_malloc;
@@ -349,7 +987,7 @@ static result_t InsertBTNode(BTree* T,unsigned long K,BRecordList record,BTree q
     }
     //If 'T' is null or the root has sqlit,then make a new root.
     if(finished==0)
-       return NewRoot(T,x,br,ap);
+       return NewRoot(arena,T,x,br,ap);
     else
        return R_SUCCESS;
 
@@ -360,96 +998,60 @@ err_malloc:
    return R_FAILED;
 }
 static result_t
-AddDomainName(char* domain,unsigned char control_type, unsigned long key1,unsigned long key2,char* info)
+AddDomainName(char* domain,unsigned char control_type,struct HashNode* bucket,unsigned long key1,unsigned long key2,char* info)
 {
    BTree* newbt;
-   Result* pr;
+   Result r;
    BlackRecord *record,*pb,*pre;
+   Arena* arena=TreeArena[key1%LOCKNUM];
    char logString[256];
 
    //Create a new record
-   record=(BlackRecord *)malloc(sizeof(BlackRecord));
+   record=NewRecord(arena,domain,control_type,info);
    if(record==NULL)
    {
 	goto err_malloc;
    }
-   record->value_domain=(char*)malloc((strlen(domain)+1)*sizeof(char));
-   if(record->value_domain==NULL)
-   {
-        free(record);
-        goto err_malloc;
-   }
-   strcpy(record->value_domain,domain);
-   if(info==NULL)
-        record->info=NULL;
-   else
-   {
-        record->info=(char*)malloc((strlen(info)+1)*sizeof(char));
-        if(record->info==NULL)
-        {
-           free(record->value_domain);
-           free(record);
-           goto err_malloc;
-        }
-        strcpy(record->info,info);
-   }
-   record->control_type=control_type;
-   record->next=NULL;
 
    //Add record
-   if(HashTable[key1].members==0)
+   if(bucket->members==0)
    {
        newbt=(BTree*)malloc(sizeof(BTree));
        if(newbt==NULL)
        {
-           free(record->value_domain);
-           free(record);
-           if((record->info)!=NULL)
-               free(record->info);
+           FreeRecord(record);
            goto err_malloc;
        }
-       if(InsertBTNode(newbt,key2,record,NULL,0) == R_FAILED)
+       if(InsertBTNode(arena,newbt,key2,record,NULL,0) == R_FAILED)
        {
            free(newbt);
            goto err_insert;
        }else{
-           HashTable[key1].pb=*newbt;
+           bucket->pb=*newbt;
            free(newbt);
-           HashTable[key1].members++;
+           bucket->members++;
+           FilterCount(key1,key2,1);
        }
     }else {
-       pr=(Result*)malloc(sizeof(Result));
-       if(pr==NULL)
-       {
-          free(record->value_domain);
-          free(record);
-          if((record->info)!=NULL)
-              free(record->info);
-          goto err_malloc;
-       }
-       SearchBTNode(HashTable[key1].pb,key2,pr);
-       if(pr->tag==0)
+       SearchBTNode(bucket->pb,key2,&r);
+       if(r.tag==0)
        {
-          if(InsertBTNode(&(HashTable[key1].pb),key2,record,pr->pt,pr->i) == R_FAILED)
-          {
-               free(pr);
+          if(InsertBTNode(arena,&(bucket->pb),key2,record,r.pt,r.i) == R_FAILED)
                goto err_insert;
-          }
-          HashTable[key1].members++;
+          bucket->members++;
+          FilterCount(key1,key2,1);
        }else{
-         pb=pr->pt->brecord[pr->i];
+         pb=r.pt->brecord[r.i];
          pre=pb;
          while(pb!=NULL)
          {
              if(strcmp(pb->value_domain,domain)==0)
              { // HAVE EXIST!!!
                 pb->control_type=control_type;
-                char* tmp=pb->info;
+                const char* tmp=pb->info;
 		pb->info=record->info;
-                if(tmp!=NULL)
-                   free(tmp);
-                free(record->value_domain);
-                free(record);
+                record->info=tmp;
+                FreeRecord(record);         //with the old info
                 break;
              }
              pre=pb;
@@ -458,10 +1060,10 @@ AddDomainName(char* domain,unsigned char control_type, unsigned long key1,unsign
          if(pb==NULL)
          {
             pre->next=record;
-            HashTable[key1].members++;
+            bucket->members++;
+            FilterCount(key1,key2,1);
          }
       }
-      free(pr);
    }
    return R_SUCCESS;
 
@@ -496,9 +1098,9 @@ static void AdjustBTree(BTree* T,BTree q)
           */
           *T=q->ptr[0];
           (*T)->parent=NULL;
-          free(q);
+          ArenaFree(q,sizeof(BTNode));
        }else if((*T)->keynum==0 && (*T)->ptr[0]==NULL)
-         free(q);
+         ArenaFree(q,sizeof(BTNode));
        return;
     }
     //Begin adjust the tree.
@@ -592,7 +1194,7 @@ static void AdjustBTree(BTree* T,BTree q)
           }
           parent->ptr[parent->keynum]=NULL;
           parent->keynum--;
-          free(q);
+          ArenaFree(q,sizeof(BTNode));
        }else if(i>0 && parent->ptr[i-1]!=NULL)
        { //join to the left brother
           brother=parent->ptr[i-1];
@@ -622,7 +1224,7 @@ static void AdjustBTree(BTree* T,BTree q)
           }
           parent->ptr[parent->keynum]=NULL;
           parent->keynum--;
-          free(q);
+          ArenaFree(q,sizeof(BTNode));
        }else
        { /* its left and right brother all NULL,
           * Normally this condition won't occur,but we still do sth here.
@@ -677,35 +1279,26 @@ static void DeleteBTNode(BTree* T,BTree q,int i)
         }
     }
     (current->keynum)--;
-    free(br->value_domain);
-    if((br->info)!=NULL)
-	free(br->info);
-    free(br);
+    FreeRecord(br);
     AdjustBTree(T,current);
 }
 
-static result_t DeleteDomainName(char* domain,unsigned long key1,unsigned long key2)
+static result_t DeleteDomainName(char* domain,struct HashNode* bucket,unsigned long key1,unsigned long key2)
 {
    BlackRecord * pb,* pre;
-   Result* pr;
-   char logString[256];
+   Result r;
 
-   if(HashTable[key1].members!=0)
+   if(bucket->members!=0)
    {
-        pr=(Result*)malloc(sizeof(Result));
-        if(pr==NULL)
-        {
-           goto err_malloc;
-        }
-        SearchBTNode(HashTable[key1].pb,key2,pr);
-        if(pr->tag!=0)
+        SearchBTNode(bucket->pb,key2,&r);
+        if(r.tag!=0)
         {
-           pb=pr->pt->brecord[pr->i];
+           pb=r.pt->brecord[r.i];
            if(pb->next==NULL && strcmp(pb->value_domain,domain)==0)
            {
-              DeleteBTNode(&(HashTable[key1].pb),pr->pt,pr->i);
-              HashTable[key1].members--;
-              free(pr);
+              DeleteBTNode(&(bucket->pb),r.pt,r.i);
+              bucket->members--;
+              FilterCount(key1,key2,-1);
            }else if(pb->next!=NULL)
            {
               pre=pb;
@@ -718,29 +1311,20 @@ static result_t DeleteDomainName(char* domain,unsigned long key1,unsigned long k
                     else
                     {
                        pre=pb->next;
-                       pr->pt->brecord[pr->i]=pre;
+                       r.pt->brecord[r.i]=pre;
                     }
-                    HashTable[key1].members--;
-                    free(pb->value_domain);          //delete the record
-                    if((pb->info)!=NULL)
-			free(pb->info);
-                    free(pb);
+                    bucket->members--;
+                    FilterCount(key1,key2,-1);
+                    FreeRecord(pb);          //delete the record
                     break;
                  }
                  pre=pb;
                  pb=pb->next;
               }
-              free(pr);
            }
         }
    }
     return R_SUCCESS;
-
-err_malloc:
-   memset(logString, 0, 256);
-   snprintf(logString,256,"[ERROR] dbDomain.c @ DeleteDomainName @ malloc --- no enough memory!");
-   DBLogging(PROG_ERROR_LOG, logString);
-   return R_FAILED;
 }
 
 static void FreeTree(BTree bt)
@@ -757,62 +1341,169 @@ static void FreeTree(BTree bt)
      {
         current=pre;
         pre=pre->next;
-        free(current->value_domain);
-        if((current->info)!=NULL)
-	   free(current->info);
-        free(current);
+        FreeRecord(current);
      }
    }
-   free(bt);
+   ArenaFree(bt,sizeof(BTNode));
 }
 
-static result_t CreateFromFile(void)
+/*
+ * Free the nodes of a tree which is being built, its records are left.
+ */
+static void FreeNodes(BTree bt)
 {
-    int fin,sum=0;
-	void *start;
-	struct stat sb;
-	result_t result;
-	char logString[256];
+   int i;
+   if(bt==NULL)
+     return;
+   for(i=0;i<=bt->keynum;i++)
+     FreeNodes(bt->ptr[i]);
+   ArenaFree(bt,sizeof(BTNode));
+}
 
-    struct data_hdr *hdr;
-	char *domain, *info;
-	unsigned long key1,key2;
+/*
+ * Keys of a tree of height h when every node is full (SUBMAX-1 keys).
+ */
+static uint64_t TreeKeysMax(int h)
+{
+   uint64_t n=1;
+   while(h-->0)
+      n*=SUBMAX;
+   return n-1;
+}
 
-	if(access(DOMAIN_DATA_PATH, F_OK) == -1)        //用于判断文件是否存在
-		return R_SUCCESS;
+/*
+ * Subtree of height h over key[0..n-1], n is between the half full count of that height (the
+ * least AdjustBTree keeps) and the full count: the keys are shared out evenly between as few
+ * children as can hold them, so the nodes are packed and all the leaves are at one depth.
+ */
+static BTree BuildNode(Arena* arena,const unsigned long* key,BRecordList* chain,size_t n,int h,BTree parent)
+{
+   BTree bt=(BTNode*)ArenaAlloc(arena,sizeof(BTNode));
+   size_t c,each,extra,k,i,s=(SUBMAX+1)/2;
 
-    fin=open(DOMAIN_DATA_PATH,O_RDONLY);        
-    if(fin == -1)
-    {
-        /* 访问被禁止 */
-		memset(logString, 0, 256);
-		snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ open --- %s", strerror(errno));
-		goto err_out;
-    }
-	fstat(fin,&sb);     //获取文件信息
-	if(sb.st_size > 0)  //判断文件大小
-		start=mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fin,0);
-	else
-		goto out;
-	if(start== MAP_FAILED)
-	{	/* 判断是否映射成功 */
-		close(fin);
-		memset(logString, 0, 256);
-		snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ mmap --- %s", strerror(errno));
-		goto err_out;
-	}
+   if(bt==NULL)
+      return NULL;
+   memset(bt, 0, sizeof(BTNode));
+   bt->parent=parent;
+   if(h==1)
+   {
+      bt->keynum=n;
+      for(i=1;i<=n;i++)
+      {
+         bt->key[i]=key[i-1];
+         bt->brecord[i]=chain[i-1];
+      }
+      return bt;
+   }
+   c=(n+1+TreeKeysMax(h-1))/(TreeKeysMax(h-1)+1);
+   if(c<2)
+      c=2;
+   if(parent!=NULL && c<s)
+      c=s;
+   each=(n-(c-1))/c;
+   extra=(n-(c-1))%c;
+   //keynum first, so FreeNodes() can always clean a half built node.
+   bt->keynum=c-1;
+   for(i=0;i<c;i++)
+   {
+      k=each+(i<extra);
+      bt->ptr[i]=BuildNode(arena,key,chain,k,h-1,bt);
+      if(bt->ptr[i]==NULL)
+      {
+         FreeNodes(bt);
+         return NULL;
+      }
+      key+=k;
+      chain+=k;
+      if(i+1<c)
+      {
+         bt->key[i+1]=*key++;
+         bt->brecord[i+1]=*chain++;
+      }
+   }
+   return bt;
+}
+
+/*
+ * Build a B-tree of the sorted distinct keys key[0..n-1] and their records in one pass.
+ * The records are not freed if it fails.
+ */
+static result_t BuildTree(Arena* arena,BTree* T,const unsigned long* key,BRecordList* chain,size_t n)
+{
+   char logString[256];
+   int h=1;
+
+   *T=NULL;
+   if(n==0)
+      return R_SUCCESS;
+   while(n>TreeKeysMax(h))
+      h++;
+   *T=BuildNode(arena,key,chain,n,h,NULL);
+   if(*T==NULL)
+   {
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ BuildTree @ malloc --- no enough memory!");
+      DBLogging(PROG_ERROR_LOG, logString);
+      return R_FAILED;
+   }
+   return R_SUCCESS;
+}
+
+/*
+ * Apply one record set (the records of one SaveDataToFile()) while the database is loaded.
+ * 'arg' is the BulkLoad which stages the domains for BulkBuild(), or NULL to apply them here.
+ */
+static result_t ReplayRecords(unsigned char type,void* collection,size_t size,void* arg)
+{
+	size_t sum=0;
+	void *start=collection;
+	result_t result;
+	char logString[256];
+
+	struct data_hdr *hdr;
+	char *domain, *info;
+	unsigned long key1,key2;
+	uint64_t hash;
 
-	while(sum<sb.st_size)
+	if(type!=DATA_TYPE_DOMAIN)
+		return UpdateNetRules(type,collection,size,NULL);
+	while(sum<size)
 	{
 		hdr=(struct data_hdr *)start;
+		if(sum+sizeof(*hdr)>size || sum+sizeof(*hdr)+hdr->val_length+hdr->info_length>size)
+		{
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ ReplayRecords @ check --- broken record set.");
+			goto err_out;
+		}
 		start+=sizeof(*hdr);
 
+		if(arg!=NULL && !hdr->wildcard)
+		{
+			if(hdr->opcode_type!=OPCODE_ADD && hdr->opcode_type!=OPCODE_DELETE)
+			{
+				memset(logString, 0, 256);
+				snprintf(logString,256,"[ERROR] dbDomain.c @ ReplayRecords @ check --- operate type error!");
+				goto err_out;
+			}
+			if(BulkStage((struct BulkLoad*)arg,start,hdr->val_length,hdr->info_length!=0 ? start+hdr->val_length : NULL,
+				     hdr->info_length,hdr->control_type,hdr->opcode_type)==R_FAILED)
+			{
+				memset(logString, 0, 256);
+				snprintf(logString,256,"[ERROR] dbDomain.c @ ReplayRecords @ BulkStage --- no enough memory!");
+				goto err_out;
+			}
+			start+=hdr->val_length+hdr->info_length;
+			sum=sum + hdr->val_length + hdr->info_length + sizeof(*hdr);
+			continue;
+		}
+
 		domain=(char*)malloc(sizeof(char)*(hdr->val_length + 1));
 		if(domain == NULL)
 		{
 			memset(logString, 0, 256);
-			snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ malloc --- %s", strerror(errno));
-			goto err_out0;
+			snprintf(logString,256,"[ERROR] dbDomain.c @ ReplayRecords @ malloc --- %s", strerror(errno));
+			goto err_out;
 		}
  		memcpy(domain,start,hdr->val_length);       //进行二进制内存复制数据
 		domain[hdr->val_length]='\0';
@@ -825,8 +1516,8 @@ static result_t CreateFromFile(void)
 			{
 				free(domain);
 				memset(logString, 0, 256);
-				snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ malloc --- %s", strerror(errno));
-				goto err_out0;
+				snprintf(logString,256,"[ERROR] dbDomain.c @ ReplayRecords @ malloc --- %s", strerror(errno));
+				goto err_out;
 			}
 			memcpy(info,start,hdr->info_length);
 			info[hdr->info_length]='\0';
@@ -834,16 +1525,23 @@ static result_t CreateFromFile(void)
 		}else
 			info=NULL;
 
-		UPPERTOLOWER(domain);
-		key1=(hashkey1(domain))%MAXBUCKETS;
-		key2=hashkey2(domain);
+		hash=HashLower(domain);
+		key1=HASH_KEY1(hash,MAXBUCKETS);
+		key2=HASH_KEY2(hash);
 
-        if(hdr->opcode_type==OPCODE_ADD)
+		//no reader yet, so the bucket is changed in place.
+		if(hdr->wildcard)
+			result=UpdateSuffixRule(domain,hdr->control_type,hdr->opcode_type,info);
+		else if(IndexEngine==ENGINE_BPLUS_TREE)
+			result=UpdateInBPTree(domain,hdr->control_type,hdr->opcode_type,key1,key2,info);
+		else if(HashTable[key1].frozen && ThawBucket(key1,&HashTable[key1])==R_FAILED)
+			result=R_FAILED;
+		else if(hdr->opcode_type==OPCODE_ADD)
 		{
-                     result=AddDomainName(domain,hdr->control_type,key1,key2,info);
+                     result=AddDomainName(domain,hdr->control_type,&HashTable[key1],key1,key2,info);
 		}else if(hdr->opcode_type==OPCODE_DELETE)
 		{
-                     result=DeleteDomainName(domain,key1,key2);
+                     result=DeleteDomainName(domain,&HashTable[key1],key1,key2);
 		}else
 		     result=R_FAILED;
 		/*
@@ -852,11 +1550,11 @@ static result_t CreateFromFile(void)
 		if(result == R_FAILED)
 		{
 			memset(logString, 0, 256);
-			snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ Update_Data --- %s", domain);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ ReplayRecords @ Update_Data --- %s", domain);
 			free(domain);
 			if(info!=NULL)
 				free(info);
-			goto err_out0;
+			goto err_out;
 		}
 		free(domain);
 		if(info!=NULL)
@@ -864,309 +1562,2594 @@ static result_t CreateFromFile(void)
 
 		sum=sum + hdr->val_length + hdr->info_length + sizeof(*hdr);
 	}
-	munmap(start,sb.st_size); /*解除映射*/
-out:
-	close(fin);
 	return R_SUCCESS;
-err_out0:
-	munmap(start,sb.st_size); /*解除映射*/
-	close(fin);
 err_out:
 	DBLogging(PROG_ERROR_LOG, logString);
 	return R_FAILED;
 }
 
-result_t InitializeSearchTree(void)
+static result_t CreateFromFile(void)
 {
-   int i,j,rtn=0;
-   char logString[256];
+    int fin;
+	void *base;
+	struct stat sb;
+	uint64_t seq,off;
+	unsigned long key1;
+	uint32_t i,end;
+	result_t result;
+	struct BulkLoad* bulk=(IndexEngine==ENGINE_BPLUS_TREE) ? NULL : &Bulk;
+	char logString[256];
 
-   if(HashTable!=NULL)
-   {   //Database has exist,then delete it
-	if(DestroySearchTree()!=R_SUCCESS)
-		return R_FAILED;
-   }
-   
-   //initial hash table, data initial as 0
-   HashTable=(struct HashNode*)calloc(MAXBUCKETS, sizeof(struct HashNode));
-   if(HashTable==NULL)
-   {
-	memset(logString, 0, 256);
-	snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ calloc --- %s", strerror(errno));
-	goto err_out;
-   }
+	//the snapshot image holds the log before (log_seq, log_off)
+	memset(&Bulk, 0, sizeof(Bulk));
+	if(LoadSnapshot()!=R_SUCCESS)
+		memset(&Image, 0, sizeof(Image));
+	if(URLIndex.index==NULL)
+	{	//a bad image left no rule tables
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ CreateNetRules --- no enough memory!");
+		goto err_out;
+	}
+	seq=Image.log_seq;
+	off=Image.log_off;
+	SnapLoaded=(Image.start!=NULL);
+	__atomic_store_n(&SnapBytes,Image.size,__ATOMIC_RELAXED);
+	__atomic_store_n(&SnapLogMark,0,__ATOMIC_RELAXED);
+	//the records of the image are counted here (the B+ tree engine counts them while it copies them).
+	KeyFilter=FilterCreate(Image.start!=NULL ? Image.buckets[MAXBUCKETS-1].first+Image.buckets[MAXBUCKETS-1].members : 0);
+	if(KeyFilter==NULL)
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ FilterCreate --- no enough memory!");
+		goto err_out;
+	}
+	if(IndexEngine!=ENGINE_BPLUS_TREE && Image.start!=NULL && !SnapStale)
+	{
+		for(key1=0;key1<MAXBUCKETS;key1++)
+		{
+			end=Image.buckets[key1].first+Image.buckets[key1].members;
+			for(i=Image.buckets[key1].first;i<end;i++)
+				FilterAdd(KeyFilter,BPTREE_KEY(key1,Image.keys[i]));
+		}
+	}
+	if(Image.start!=NULL && (IndexEngine==ENGINE_BPLUS_TREE || SnapStale))
+	{
+		result=SnapStale ? RehashImage() : ImageToBPTree();
+		UnloadSnapshot();
+		if(result==R_FAILED)
+		{
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ %s --- no enough memory!",
+				 SnapStale ? "RehashImage" : "ImageToBPTree");
+			goto err_out;
+		}
+	}
 
-   //initial cache, initial as NULL(0)
-    Cache=(struct CacheList*)calloc(LOCKNUM, sizeof(struct CacheList));
-    if(Cache==NULL)
-    {
-	free(HashTable);
-	memset(logString, 0, 256);
-	snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ calloc --- %s", strerror(errno));
-	goto err_out;
-    }
+	//domain.db of the old versions: it is replayed when there is no image, and folded into the next image.
+	LegacyData=(access(DOMAIN_DATA_PATH, F_OK) == 0);
+	if(LegacyData && !SnapLoaded)
+	{
+		fin=open(DOMAIN_DATA_PATH,O_RDONLY);
+		if(fin == -1)
+		{
+			/* 访问被禁止 */
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ open --- %s", strerror(errno));
+			goto err_out;
+		}
+		fstat(fin,&sb);     //获取文件信息
+		if(sb.st_size>0)
+		{
+			base=mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fin,0);
+			if(base== MAP_FAILED)
+			{	/* 判断是否映射成功 */
+				close(fin);
+				memset(logString, 0, 256);
+				snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ mmap --- %s", strerror(errno));
+				goto err_out;
+			}
+			result=ReplayRecords(DATA_TYPE_DOMAIN,base,sb.st_size,bulk);
+			munmap(base,sb.st_size); /*解除映射*/
+			if(result==R_FAILED)
+			{
+				close(fin);
+				memset(logString, 0, 256);
+				snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ replay --- %s", DOMAIN_DATA_PATH);
+				goto err_out;
+			}
+		}
+		close(fin);
+	}
 
-   //initial the locks
-   rtn = pthread_rwlock_init(&CacheLock, NULL);
-   if(rtn!=0)
-   {
-         free(HashTable);
-         free(Cache);
-	 memset(logString, 0, 256);
-	 snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ pthread_rwlock_init --- cache lock initial error!");
-	 goto err_out;
-   }
-   RecordLock=(pthread_rwlock_t*)malloc(LOCKNUM*sizeof(pthread_rwlock_t));
-   if(RecordLock==NULL)
-   {
-      free(HashTable);
-      free(Cache);
-      pthread_rwlock_destroy(&CacheLock);
-      memset(logString, 0, 256);
-      snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ malloc --- %s", strerror(errno));
-      goto err_out;
-   }
-   for(i=0;i<LOCKNUM;i++)
-   {
-      rtn = pthread_rwlock_init((RecordLock+i), NULL);
-      if(rtn!=0)
-      {
-         free(HashTable);
-         free(Cache);
-          //destory locks which have create
-         pthread_rwlock_destroy(&CacheLock);
-	 for(j=0;j<i;j++)
-    		pthread_rwlock_destroy((RecordLock+j));
-	 free(RecordLock);
-	 memset(logString, 0, 256);
-	 snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ pthread_rwlock_init --- record lock initial error!");
-	 goto err_out;
-      }
-   }
-   //read file,and initial search tree
-   return CreateFromFile();
+	//the updates after the image
+	if(LogOpen(DOMAIN_LOG_DIR,seq,off,ReplayRecords,bulk)==R_FAILED)
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ LogOpen --- %s", DOMAIN_LOG_DIR);
+		goto err_out;
+	}
 
+	//the staged records (the rehashed image, domain.db and the log) are built into the buckets
+	if(bulk!=NULL && BulkBuild(bulk)==R_FAILED)
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ CreateFromFile @ BulkBuild --- no enough memory!");
+		goto err_out;
+	}
+	BulkFree(&Bulk);
+	return R_SUCCESS;
 err_out:
-   DBLogging(PROG_ERROR_LOG, logString);
-   return R_FAILED;
-}
-
-result_t DestroySearchTree(void)
-{
-   int i;
-   if(HashTable==NULL)
-      return R_SUCCESS;
-
-   //Destroy locks
-   for(i=0;i<LOCKNUM;i++)
-        pthread_rwlock_destroy((RecordLock+i));
-   pthread_rwlock_destroy(&CacheLock);
-
-   //Free record locks memory
-    free(RecordLock);
-
-   //Free Cache
-   for(i=0;i<LOCKNUM;i++)
-   {
-      if(Cache[i].list!=NULL)
-      {   //free cachelist
-          TempRecord* p,*q=Cache[i].list;
-	  while(q)
-	  {
-          	p=q;
-		q=q->next;
-		free(p->value_domain);
-		if((p->info)!=NULL)
-			free(p->info);
-		free(p);
-	  }
-      }
-      if(Cache[i].templist!=NULL)
-      {   //free temp list in cache
-          TempRecord* p,*q=Cache[i].templist;
-	  while(q)
-	  {
-          	p=q;
-		q=q->next;
-		free(p->value_domain);
-		if((p->info)!=NULL)
-			free(p->info);
-		free(p);
-	  }
-      }
-   }
-   free(Cache);
-
-   //Free Hash Table
-   for(i=0;i<MAXBUCKETS;i++)
-   {
-      if(HashTable[i].members==0)
-         continue;
-      FreeTree(HashTable[i].pb);
-   }
-   free(HashTable);
-   return R_SUCCESS;
+	BulkFree(&Bulk);
+	DBLogging(PROG_ERROR_LOG, logString);
+	return R_FAILED;
 }
 
-result_t
-SearchDomainName(char* domain, unsigned char* control_type, char** info)
+/*
+ * Map the snapshot image, and let the Hash buckets point to it.
+ * return R_FAILED if there is no valid image.
+ */
+static result_t LoadSnapshot(void)
 {
-   unsigned long key1,key2,lockindex;
-   result_t result=R_NOTFOUND;
-   *info=NULL;
-
-   UPPERTOLOWER(domain);
-   key1=(hashkey1(domain))%MAXBUCKETS;
-   key2=hashkey2(domain);
-   lockindex=key1%LOCKNUM;
+	int fin;
+	struct stat sb;
+	void* start;
+	struct snap_hdr head;
+	const struct snap_hdr* hdr=&head;
+	const struct snap_record* rec;
+	uint64_t i,first,members,rules;
+	char logString[256];
 
-   if(HashTable[key1].members!=0)
-   {    //search in cache list
-	if(Cache[lockindex].list || Cache[lockindex].templist)
+	if(access(DOMAIN_SNAP_PATH, F_OK) == -1)
+		return R_FAILED;
+	fin=open(DOMAIN_SNAP_PATH,O_RDONLY);
+	if(fin == -1)
 	{
-		pthread_rwlock_rdlock(&CacheLock);
-		result=SearchInList(domain,control_type,lockindex,key2,info);
-		pthread_rwlock_unlock(&CacheLock);
-        	if(result==R_INVALID)
-        	{
-        		//found in list ,but is deleting.
-			return R_NOTFOUND;
-		}
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ open --- %s", strerror(errno));
+		goto err_out;
 	}
-	if(result!=R_FOUND)
-	{       //search in B Tree
-        	pthread_rwlock_rdlock((RecordLock+lockindex));
-		result=SearchInBTree(domain,control_type,key1,key2,info);
-		pthread_rwlock_unlock((RecordLock+lockindex));
+	fstat(fin,&sb);
+	if((size_t)sb.st_size < offsetof(struct snap_hdr,ip_off))
+	{
+		close(fin);
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ check --- image is too small.");
+		goto err_out;
+	}
+	//shared mapping: the pages are shared by all the processes which use the image.
+	start=mmap(NULL,sb.st_size,PROT_READ,MAP_SHARED,fin,0);
+	close(fin);
+	if(start == MAP_FAILED)
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ mmap --- %s", strerror(errno));
+		goto err_out;
 	}
-   }
-   if(result == R_FOUND && *control_type == CFLAG_REDIRECT && *info == NULL)
-   {
-        //指定默认重定向地址
-        *info=(char*)malloc(sizeof(char)*(strlen(DEFAULT_REDI_IP)+1));
-	if((*info)!=NULL)
-	     strcpy(*info,DEFAULT_REDI_IP);
-   }
-   return result;
-}
 
-static result_t SearchInList(char* domain, unsigned char* control_type,unsigned long lockindex,
-				unsigned long key2,char** info)
-{   
-    /*
-     *  Return: R_FOUND or R_NOTFOUND
-     */
-     
-   result_t result = R_NOTFOUND;
-   TempRecord* cur=Cache[lockindex].list;
-   while(cur!=NULL)
+	//the header of an image before version 5 ends at ip_off: no IP and URL rules.
+	memset(&head, 0, sizeof(head));
+	memcpy(&head,start,offsetof(struct snap_hdr,ip_off));
+	if(head.version==SNAPSHOT_VERSION && (size_t)sb.st_size>=sizeof(head))
+		memcpy(&head,start,sizeof(head));
+	rules=hdr->suffixes+hdr->ips+hdr->urls;
+	if(memcmp(hdr->magic,SNAPSHOT_MAGIC,sizeof(hdr->magic))!=0
+	   || (hdr->version!=SNAPSHOT_VERSION && hdr->version!=SNAPSHOT_VERSION_NONET && hdr->version!=SNAPSHOT_VERSION_OLDHASH)
+	   || (hdr->version==SNAPSHOT_VERSION && (size_t)sb.st_size<sizeof(head))
+	   || hdr->buckets!=MAXBUCKETS
+	   || hdr->bucket_off+hdr->buckets*sizeof(struct snap_bucket) > (uint64_t)sb.st_size
+	   || hdr->key_off+hdr->records*sizeof(uint64_t) > (uint64_t)sb.st_size
+	   || hdr->record_off+hdr->records*sizeof(struct snap_record) > (uint64_t)sb.st_size
+	   || hdr->suffix_off+hdr->suffixes*sizeof(struct snap_record) > (uint64_t)sb.st_size
+	   || (hdr->ips!=0 && hdr->ip_off!=hdr->suffix_off+hdr->suffixes*sizeof(struct snap_record))
+	   || (hdr->urls!=0 && hdr->url_off!=hdr->suffix_off+(hdr->suffixes+hdr->ips)*sizeof(struct snap_record))
+	   || hdr->suffix_off+rules*sizeof(struct snap_record) > (uint64_t)sb.st_size
+	   || hdr->string_off+hdr->string_size > (uint64_t)sb.st_size || hdr->string_size==0)
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ check --- bad image header.");
+		goto err_unmap;
+	}
+	Image.start=start;
+	Image.size=sb.st_size;
+	Image.buckets=(const struct snap_bucket*)(start+hdr->bucket_off);
+	Image.keys=(const uint64_t*)(start+hdr->key_off);
+	Image.records=(const struct snap_record*)(start+hdr->record_off);
+	Image.strings=(const char*)(start+hdr->string_off);
+	Image.log_seq=hdr->log_seq;
+	Image.log_off=hdr->log_off;
+
+	if(Image.strings[hdr->string_size-1]!='\0')
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ check --- bad string heap.");
+		goto err_unmap;
+	}
+	//the suffix, IP and URL rules follow one another
+	for(i=0;i<hdr->records+rules;i++)
+	{
+		rec=(i<hdr->records) ? Image.records+i : (const struct snap_record*)(start+hdr->suffix_off)+(i-hdr->records);
+		if(rec->domain>=hdr->string_size || rec->info>=hdr->string_size)
+		{
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ check --- bad record %lu.", (unsigned long)i);
+			goto err_unmap;
+		}
+	}
+	for(i=0;i<MAXBUCKETS;i++)
+	{
+		first=Image.buckets[i].first;
+		members=Image.buckets[i].members;
+		if(first+members > hdr->records)
+		{
+			memset(HashTable, 0, MAXBUCKETS*sizeof(struct HashNode));
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ check --- bad bucket %lu.", (unsigned long)i);
+			goto err_unmap;
+		}
+		HashTable[i].members=members;
+		HashTable[i].pb=NULL;
+		HashTable[i].frozen=(members!=0);
+	}
+	//an image of the old hash is only read once, its records are rehashed into the buckets
+	SnapStale=(hdr->version==SNAPSHOT_VERSION_OLDHASH);
+	if(SnapStale)
+		memset(HashTable, 0, MAXBUCKETS*sizeof(struct HashNode));
+	//the suffix rules are few, they are copied into the trie.
+	for(i=0;i<hdr->suffixes;i++)
+	{
+		rec=(const struct snap_record*)(start+hdr->suffix_off)+i;
+		if(UpdateSuffixRule((char*)(Image.strings+rec->domain),rec->control_type,OPCODE_ADD,
+				    rec->info!=0 ? (char*)(Image.strings+rec->info) : NULL) == R_FAILED)
+		{
+			memset(HashTable, 0, MAXBUCKETS*sizeof(struct HashNode));
+			ResetSuffix();
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ suffix --- bad suffix rule %lu.", (unsigned long)i);
+			goto err_unmap;
+		}
+	}
+	//so are the IP and URL rules, parsed as they were in an update.
+	for(i=0;i<hdr->ips+hdr->urls;i++)
+	{
+		rec=(const struct snap_record*)(start+hdr->suffix_off)+hdr->suffixes+i;
+		if(((i<hdr->ips) ? UpdateIPRule : UpdateURLRule)((char*)(Image.strings+rec->domain),rec->control_type,OPCODE_ADD,
+				    rec->info!=0 ? (char*)(Image.strings+rec->info) : NULL) == R_FAILED)
+		{
+			memset(HashTable, 0, MAXBUCKETS*sizeof(struct HashNode));
+			ResetSuffix();
+			DestroyNetRules(1);
+			CreateNetRules();
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ LoadSnapshot @ rule --- bad %s rule %lu.",
+				 (i<hdr->ips) ? "IP" : "URL", (unsigned long)i);
+			goto err_unmap;
+		}
+	}
+	return R_SUCCESS;
+
+err_unmap:
+	munmap(start,sb.st_size);
+	memset(&Image, 0, sizeof(Image));
+err_out:
+	DBLogging(PROG_ERROR_LOG, logString);
+	return R_FAILED;
+}
+
+static void UnloadSnapshot(void)
+{
+	if(Image.start!=NULL)
+		munmap(Image.start,Image.size);
+	memset(&Image, 0, sizeof(Image));
+}
+
+/*
+ * Build the B-tree of a bucket from the snapshot image.
+ * The result is saved in 'bucket' (it may be &HashTable[key1] itself).
+ */
+static result_t ThawBucket(unsigned long key1,struct HashNode* bucket)
+{
+	struct BulkScratch s;
+	struct HashNode tmp;
+	result_t result;
+
+	memset(&s, 0, sizeof(s));
+	result=BuildBucket(key1,&HashTable[key1],NULL,NULL,0,&s,&tmp);
+	BulkScratchFree(&s);
+	if(result==R_SUCCESS)
+		*bucket=tmp;
+	return result;
+}
+
+static result_t BulkReserve(struct BulkScratch* s,size_t n)
+{
+	struct BulkItem* item;
+	unsigned long* key;
+	BRecordList* chain;
+	size_t size=(s->size==0) ? 64 : s->size;
+
+	if(n<=s->size)
+		return R_SUCCESS;
+	while(size<n)
+		size*=2;
+	if((item=(struct BulkItem*)realloc(s->item,size*sizeof(*item)))==NULL)
+		return R_FAILED;
+	s->item=item;
+	if((key=(unsigned long*)realloc(s->key,size*sizeof(*key)))==NULL)
+		return R_FAILED;
+	s->key=key;
+	if((chain=(BRecordList*)realloc(s->chain,size*sizeof(*chain)))==NULL)
+		return R_FAILED;
+	s->chain=chain;
+	s->size=size;
+	return R_SUCCESS;
+}
+
+static void BulkScratchFree(struct BulkScratch* s)
+{
+	free(s->item);
+	free(s->key);
+	free(s->chain);
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Items of the records of a tree, in the order of the keys.
+ */
+static size_t BulkTreeItems(BTree bt,struct BulkItem* item,size_t n)
+{
+	int i;
+	BRecordList br;
+	if(bt==NULL)
+		return n;
+	for(i=0;i<=bt->keynum;i++)
+	{
+		n=BulkTreeItems(bt->ptr[i],item,n);
+		if(i==bt->keynum)
+			break;
+		for(br=bt->brecord[i+1];br!=NULL;br=br->next,n++)
+		{
+			item[n].key2=bt->key[i+1];
+			item[n].domain=br->value_domain;
+			item[n].info=br->info;
+			item[n].order=n;
+			item[n].control_type=br->control_type;
+			item[n].opcode_type=OPCODE_ADD;
+			item[n].old=1;
+		}
+	}
+	return n;
+}
+
+static int CompareBulkItem(const void* a,const void* b)
+{
+	const struct BulkItem* x=(const struct BulkItem*)a;
+	const struct BulkItem* y=(const struct BulkItem*)b;
+	int c;
+
+	if(x->key2!=y->key2)
+		return (x->key2<y->key2) ? -1 : 1;
+	if((c=strcmp(x->domain,y->domain))!=0)
+		return c;
+	return (x->order<y->order) ? -1 : (x->order>y->order);
+}
+
+/*
+ * Build the B-tree of bucket key1 at once: the records of 'from' (the image or its tree),
+ * changed by the staged records ops[0..nops-1] of 'b'. The new bucket is saved in 'to',
+ * 'from' is not changed (its tree is freed by the caller). The names which come or go are
+ * counted in the filter as they are found (a failure stops the load).
+ */
+static result_t
+BuildBucket(unsigned long key1,const struct HashNode* from,const struct BulkLoad* b,const uint32_t* ops,uint32_t nops,
+	    struct BulkScratch* s,struct HashNode* to)
+{
+	Arena* arena=TreeArena[key1%LOCKNUM];
+	const struct snap_bucket* sb=from->frozen ? Image.buckets+key1 : NULL;
+	const struct snap_record* rec;
+	const struct BulkRecord* br;
+	struct BulkItem* it;
+	BlackRecord* record;
+	size_t n=0,i,j,live=0,keys=0;
+	uint32_t k;
+	int old;
+	char logString[256];
+
+	if(BulkReserve(s,(from->frozen ? sb->members : from->members)+nops)==R_FAILED)
+		goto err_malloc;
+	if(from->frozen)
+	{	//the image keeps the records of a bucket sorted by key2
+		for(k=sb->first;k<sb->first+sb->members;k++,n++)
+		{
+			rec=Image.records+k;
+			s->item[n].key2=Image.keys[k];
+			s->item[n].domain=Image.strings+rec->domain;
+			s->item[n].info=(rec->info!=0) ? Image.strings+rec->info : NULL;
+			s->item[n].order=n;
+			s->item[n].control_type=rec->control_type;
+			s->item[n].opcode_type=OPCODE_ADD;
+			s->item[n].old=1;
+		}
+	}else if(from->members!=0)
+		n=BulkTreeItems(from->pb,s->item,0);
+	for(k=0;k<nops;k++,n++)
+	{
+		br=b->rec+ops[k];
+		s->item[n].key2=br->key2;
+		s->item[n].domain=br->domain;
+		s->item[n].info=br->info;
+		s->item[n].order=n;
+		s->item[n].control_type=br->control_type;
+		s->item[n].opcode_type=br->opcode_type;
+		s->item[n].old=0;
+	}
+	//the names of a bucket are distinct, they are only sorted when the log changes them
+	if(nops!=0)
+		qsort(s->item,n,sizeof(struct BulkItem),CompareBulkItem);
+
+	//the last change of a name tells if it is kept, an add and its delete leave nothing
+	for(i=0;i<n;i=j)
+	{
+		old=s->item[i].old;
+		for(j=i+1;j<n && s->item[j].key2==s->item[i].key2 && strcmp(s->item[j].domain,s->item[i].domain)==0;j++)
+			old|=s->item[j].old;
+		it=s->item+j-1;
+		if(it->opcode_type==OPCODE_ADD)
+		{
+			if(!old)
+				FilterCount(key1,it->key2,1);
+			s->item[live++]=*it;
+		}else if(old)
+			FilterCount(key1,it->key2,-1);
+	}
+
+	//the records of one key2 are chained, then the tree is built over the distinct keys
+	for(i=0;i<live;i++)
+	{
+		it=s->item+i;
+		record=NewRecord(arena,it->domain,it->control_type,it->info);
+		if(record==NULL)
+			goto err_record;
+		if(keys!=0 && s->key[keys-1]==it->key2)
+		{
+			record->next=s->chain[keys-1];
+			s->chain[keys-1]=record;
+		}else{
+			s->key[keys]=it->key2;
+			s->chain[keys++]=record;
+		}
+	}
+	if(BuildTree(arena,&(to->pb),s->key,s->chain,keys)==R_FAILED)
+		goto err_record;
+	to->members=live;
+	to->frozen=0;
+	return R_SUCCESS;
+
+err_record:
+	for(i=0;i<keys;i++)
+	{
+		while((record=s->chain[i])!=NULL)
+		{
+			s->chain[i]=record->next;
+			FreeRecord(record);
+		}
+	}
+err_malloc:
+	memset(logString, 0, 256);
+	snprintf(logString,256,"[ERROR] dbDomain.c @ BuildBucket @ malloc --- no enough memory!");
+	DBLogging(PROG_ERROR_LOG, logString);
+	return R_FAILED;
+}
+
+/*
+ * Stage a domain record of the load, its name is lowercased and hashed like in an update.
+ */
+static result_t
+BulkStage(struct BulkLoad* b,const char* domain,size_t len,const char* info,size_t ilen,
+	  unsigned char control_type,unsigned char opcode_type)
+{
+	struct BulkText* t=b->text;
+	struct BulkRecord* rec;
+	size_t need=len+1+(info!=NULL ? ilen+1 : 0),size;
+	char* name;
+	uint64_t hash;
+
+	if(b->count==b->size)
+	{	//the records are numbered with 32 bits
+		if(b->size>=UINT32_MAX/2)
+			return R_FAILED;
+		size=(b->size==0) ? 4096 : b->size*2;
+		if((rec=(struct BulkRecord*)realloc(b->rec,size*sizeof(*rec)))==NULL)
+			return R_FAILED;
+		b->rec=rec;
+		b->size=size;
+	}
+	if(t==NULL || t->size-t->used<need)
+	{
+		size=(need>BULK_TEXT) ? need : BULK_TEXT;
+		if((t=(struct BulkText*)malloc(sizeof(struct BulkText)+size))==NULL)
+			return R_FAILED;
+		t->next=b->text;
+		t->used=0;
+		t->size=size;
+		b->text=t;
+	}
+	name=t->text+t->used;
+	memcpy(name,domain,len);
+	name[len]='\0';
+	hash=HashLower(name);
+
+	rec=b->rec+b->count++;
+	rec->key1=HASH_KEY1(hash,MAXBUCKETS);
+	rec->key2=HASH_KEY2(hash);
+	rec->domain=name;
+	rec->info=NULL;
+	if(info!=NULL)
+	{
+		rec->info=name+len+1;
+		memcpy(name+len+1,info,ilen);
+		name[len+1+ilen]='\0';
+	}
+	rec->control_type=control_type;
+	rec->opcode_type=opcode_type;
+	t->used+=need;
+	return R_SUCCESS;
+}
+
+/*
+ * Take the shards of the load until none is left, and build their buckets (no reader yet,
+ * a bucket is replaced in place).
+ */
+static void* BulkWorker(void* arg)
+{
+	struct BulkLoad* b=(struct BulkLoad*)arg;
+	struct BulkScratch s;
+	struct HashNode tmp;
+	unsigned long key1;
+	int index;
+
+	memset(&s, 0, sizeof(s));
+	while((index=__atomic_fetch_add(&(b->next),1,__ATOMIC_ACQ_REL))<LOCKNUM)
+	{
+		b->result[index]=R_SUCCESS;
+		for(key1=index;key1<MAXBUCKETS;key1+=LOCKNUM)
+		{
+			if(b->first[key1]==b->first[key1+1])
+				continue;
+			if(BuildBucket(key1,&HashTable[key1],b,b->order+b->first[key1],b->first[key1+1]-b->first[key1],&s,&tmp)==R_FAILED)
+			{
+				b->result[index]=R_FAILED;
+				break;
+			}
+			if(!HashTable[key1].frozen && HashTable[key1].members!=0)
+				FreeTree(HashTable[key1].pb);
+			HashTable[key1]=tmp;
+		}
+	}
+	BulkScratchFree(&s);
+	return arg;
+}
+
+/*
+ * Build every bucket which has staged records. The records are grouped by bucket in the
+ * order of the log (counting sort on key1), then the shards are built in parallel (the nodes
+ * of a shard are cut from its arena): a thread per core up to LOCKNUM, the caller works too.
+ */
+static result_t
+BulkBuild(struct BulkLoad* b)
+{
+	pthread_t thread[LOCKNUM];
+	uint32_t* cursor;
+	long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	int workers,max=LOCKNUM-1,index;
+	unsigned long key1,buckets=0;
+	size_t i;
+	struct timeval t1,t2;
+	result_t result=R_SUCCESS;
+	char logString[256];
+
+	if(b->count==0)
+		return R_SUCCESS;
+	gettimeofday(&t1,NULL);
+	b->first=(uint32_t*)calloc(MAXBUCKETS+1,sizeof(uint32_t));
+	b->order=(uint32_t*)malloc(b->count*sizeof(uint32_t));
+	cursor=(uint32_t*)malloc(MAXBUCKETS*sizeof(uint32_t));
+	if(b->first==NULL || b->order==NULL || cursor==NULL)
+	{
+		free(cursor);
+		return R_FAILED;
+	}
+	for(i=0;i<b->count;i++)
+		b->first[b->rec[i].key1+1]++;
+	for(key1=0;key1<MAXBUCKETS;key1++)
+	{
+		buckets+=(b->first[key1+1]!=0);
+		b->first[key1+1]+=b->first[key1];
+		cursor[key1]=b->first[key1];
+	}
+	for(i=0;i<b->count;i++)
+		b->order[cursor[b->rec[i].key1]++]=(uint32_t)i;
+	free(cursor);
+
+	if(cpus>0 && cpus-1<max)     //more threads than cores only wait for each other
+		max=(int)(cpus-1);
+	b->next=0;
+	for(workers=0;workers<max;workers++)
+	{
+		if(pthread_create(thread+workers,NULL,BulkWorker,b)!=0)
+			break;           //the caller builds the shards left
+	}
+	BulkWorker(b);
+	for(index=0;index<workers;index++)
+		pthread_join(thread[index],NULL);
+	for(index=0;index<LOCKNUM;index++)
+	{
+		if(b->result[index]==R_FAILED)
+			result=R_FAILED;
+	}
+	gettimeofday(&t2,NULL);
+	memset(logString, 0, 256);
+	snprintf(logString,256,"Type: DOMAIN.  Bulk load: %lu records into %lu buckets, %d threads, %lu us.",
+		 (unsigned long)b->count, buckets, workers+1,
+		 (unsigned long)((t2.tv_sec-t1.tv_sec)*1000000+(t2.tv_usec-t1.tv_usec)));
+	DBLogging(PROG_UPDATE_LOG, logString);
+	return result;
+}
+
+static void BulkFree(struct BulkLoad* b)
+{
+	struct BulkText* t;
+	while((t=b->text)!=NULL)
+	{
+		b->text=t->next;
+		free(t);
+	}
+	free(b->rec);
+	free(b->first);
+	free(b->order);
+	memset(b, 0, sizeof(*b));
+}
+
+static result_t
+SearchInImage(char* domain,unsigned char* control_type,unsigned long key1,unsigned long key2,const char** info)
+{
+	const struct snap_bucket* sb=Image.buckets+key1;
+	const struct snap_record* rec;
+	uint32_t lo=sb->first,hi=sb->first+sb->members,mid;
+
+	//binary search the first record of 'key2'
+	while(lo<hi)
+	{
+		mid=lo+(hi-lo)/2;
+		if(Image.keys[mid]<key2)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	for(hi=sb->first+sb->members;lo<hi && Image.keys[lo]==key2;lo++)
+	{
+		rec=Image.records+lo;
+		if(strcmp(Image.strings+rec->domain,domain)==0)
+		{
+			*control_type=rec->control_type;
+			if(rec->info!=0)
+				*info=Image.strings+rec->info;
+			return R_FOUND;
+		}
+	}
+	return R_NOTFOUND;
+}
+
+/*
+ * Records of the B+ tree engine are in ChainArena, they are written under TreeLock.
+ */
+static void ReleaseChain(void* br)
+{
+	BlackRecord* p,*q=(BRecordList)br;
+	while(q)
+	{
+		p=q;
+		q=q->next;
+		FreeRecord(p);
+	}
+}
+
+static BRecordList CloneChain(BRecordList br)
+{
+	BRecordList head=NULL,*tail=&head;
+	while(br!=NULL)
+	{
+		*tail=CopyRecord(ChainArena,br);
+		if(*tail==NULL)
+		{
+			ReleaseChain(head);
+			return NULL;
+		}
+		tail=&((*tail)->next);
+		br=br->next;
+	}
+	return head;
+}
+
+/*
+ * Add or delete one domain in the B+ tree engine.
+ * The record list of a key is copied and swapped, the old list is retired.
+ */
+static result_t
+UpdateInBPTree(char* domain,unsigned char control_type,unsigned char opcode_type,unsigned long key1,unsigned long key2,char* info)
+{
+	uint64_t key=BPTREE_KEY(key1,key2);
+	BRecordList old,chain,pb,*link;
+	const char* tmp=NULL;
+	int added;
+	result_t result;
+	char logString[256];
+
+	if(opcode_type!=OPCODE_ADD && opcode_type!=OPCODE_DELETE)
+		return R_FAILED;
+	pthread_mutex_lock(&TreeLock);
+	old=(BRecordList)BPTreeFind(&GlobalTree,key);
+	if(old==NULL && opcode_type==OPCODE_DELETE)
+	{
+		pthread_mutex_unlock(&TreeLock);
+		return R_SUCCESS;
+	}
+	chain=CloneChain(old);
+	if(old!=NULL && chain==NULL)
+		goto err_malloc;
+	for(link=&chain;*link!=NULL;link=&((*link)->next))
+	{
+		if(strcmp((*link)->value_domain,domain)==0)
+			break;
+	}
+
+	if(opcode_type==OPCODE_DELETE)
+	{
+		if(*link==NULL)
+		{	//not found
+			ReleaseChain(chain);
+			pthread_mutex_unlock(&TreeLock);
+			return R_SUCCESS;
+		}
+		pb=*link;
+		*link=pb->next;
+		pb->next=NULL;
+		ReleaseChain(pb);
+		if(chain==NULL)
+			result=BPTreeRemove(&GlobalTree,key);
+		else
+			result=BPTreeUpdate(&GlobalTree,key,chain);
+		if(result==R_FAILED)
+			goto err_malloc;
+		TreeMembers--;
+		FilterCount(key1,key2,-1);
+	}else{
+		added=(*link==NULL);
+		if(!added)
+		{	// HAVE EXIST!!!
+			if(info!=NULL && (tmp=PoolIntern(InfoPool,info))==NULL)
+				goto err_malloc;
+			(*link)->control_type=control_type;
+			if((*link)->info!=NULL)
+				PoolRelease(InfoPool,(*link)->info);
+			(*link)->info=tmp;
+		}else{
+			pb=NewRecord(ChainArena,domain,control_type,info);
+			if(pb==NULL)
+				goto err_malloc;
+			*link=pb;
+		}
+		if(BPTreeUpdate(&GlobalTree,key,chain)==R_FAILED)
+			goto err_malloc;
+		TreeMembers+=added;
+		if(added)
+			FilterCount(key1,key2,1);
+	}
+	pthread_mutex_unlock(&TreeLock);
+	return R_SUCCESS;
+
+err_malloc:
+	ReleaseChain(chain);
+	pthread_mutex_unlock(&TreeLock);
+	memset(logString, 0, 256);
+	snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateInBPTree @ malloc --- no enough memory!");
+	DBLogging(PROG_ERROR_LOG, logString);
+	return R_FAILED;
+}
+
+/*
+ * Make the changes of the B+ tree visible to the readers.
+ */
+static void CommitBPTree(void)
+{
+	pthread_mutex_lock(&TreeLock);
+	BPTreeCommit(&GlobalTree);
+	pthread_mutex_unlock(&TreeLock);
+}
+
+static result_t
+SearchInBPTree(char* domain,unsigned char* control_type,unsigned long key1,unsigned long key2,const char** info)
+{
+	return MatchRecord((BRecordList)BPTreeSearch(&GlobalTree,BPTREE_KEY(key1,key2)),domain,control_type,info);
+}
+
+/*
+ * The B+ tree engine does not search the image in place, its records are copied into the tree.
+ */
+static result_t
+ImageToBPTree(void)
+{
+	const struct snap_record* rec;
+	uint32_t i,end;
+	unsigned long key1;
+
+	for(key1=0;key1<MAXBUCKETS;key1++)
+	{
+		end=Image.buckets[key1].first+Image.buckets[key1].members;
+		for(i=Image.buckets[key1].first;i<end;i++)
+		{
+			rec=Image.records+i;
+			if(UpdateInBPTree((char*)(Image.strings+rec->domain),rec->control_type,OPCODE_ADD,key1,Image.keys[i],
+					  rec->info!=0 ? (char*)(Image.strings+rec->info) : NULL) == R_FAILED)
+				return R_FAILED;
+		}
+		HashTable[key1].members=0;
+		HashTable[key1].frozen=0;
+	}
+	return R_SUCCESS;
+}
+
+/*
+ * The image was written with the keys of the old hash functions: every record is added
+ * again with its new keys (staged for BulkBuild() with the hash engine).
+ */
+static result_t
+RehashImage(void)
+{
+	const struct snap_record* rec;
+	const char* domain;
+	const char* info;
+	uint32_t i,end;
+	unsigned long key1,key2;
+	uint64_t hash;
+	result_t result;
+
+	end=Image.buckets[MAXBUCKETS-1].first+Image.buckets[MAXBUCKETS-1].members;
+	for(i=0;i<end;i++)
+	{
+		rec=Image.records+i;
+		domain=Image.strings+rec->domain;
+		info=(rec->info!=0) ? Image.strings+rec->info : NULL;
+		hash=HashName(domain);      //the image holds lowercase names
+		key1=HASH_KEY1(hash,MAXBUCKETS);
+		key2=HASH_KEY2(hash);
+		if(IndexEngine==ENGINE_BPLUS_TREE)
+			result=UpdateInBPTree((char*)domain,rec->control_type,OPCODE_ADD,key1,key2,(char*)info);
+		else
+			result=BulkStage(&Bulk,domain,strlen(domain),info,info!=NULL ? strlen(info) : 0,rec->control_type,OPCODE_ADD);
+		if(result==R_FAILED)
+			return R_FAILED;
+	}
+	return R_SUCCESS;
+}
+
+/*
+ * Count one record of (key1, key2) more or less in the filter. The writers hold a lock which
+ * SaveSnapshot() takes too, so the filter is not replaced under them.
+ */
+static inline void FilterCount(unsigned long key1,unsigned long key2,int delta)
+{
+	if(KeyFilter==NULL)
+		return;
+	if(delta>0)
+		FilterAdd(KeyFilter,BPTREE_KEY(key1,key2));
+	else
+		FilterRemove(KeyFilter,BPTREE_KEY(key1,key2));
+}
+
+static void FilterTree(Filter* f,unsigned long key1,BTree bt)
+{
+	int i;
+	BRecordList br;
+	if(bt==NULL)
+		return;
+	for(i=0;i<=bt->keynum;i++)
+	{
+		FilterTree(f,key1,bt->ptr[i]);
+		if(i==bt->keynum)
+			break;
+		for(br=bt->brecord[i+1];br!=NULL;br=br->next)
+			FilterAdd(f,BPTREE_KEY(key1,bt->key[i+1]));
+	}
+}
+
+static result_t FilterTreeKey(uint64_t key,void* value,void* arg)
+{
+	BRecordList br;
+	for(br=(BRecordList)value;br!=NULL;br=br->next)
+		FilterAdd((Filter*)arg,key);
+	return R_SUCCESS;
+}
+
+/*
+ * Make a new filter for 'records' records from the whole datebase, and retire the old one.
+ * The writers must be stopped (all the writer locks) or not started yet. The adds which wait
+ * in the cache are counted too, AddListToBTree() takes them out when they are in the trees.
+ */
+static result_t
+RebuildFilter(uint64_t records)
+{
+	Filter* f,*old;
+	unsigned long key1;
+	uint32_t i,end;
+	int index;
+	TempRecord* cur;
+	char logString[256];
+
+	f=FilterCreate(records);
+	if(f==NULL)
+	{	//the old filter is still right, only its size is wrong.
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ RebuildFilter @ FilterCreate --- no enough memory!");
+		DBLogging(PROG_ERROR_LOG, logString);
+		return R_FAILED;
+	}
+	if(IndexEngine==ENGINE_BPLUS_TREE)
+		BPTreeWalk(&GlobalTree,FilterTreeKey,f);
+	for(key1=0;key1<MAXBUCKETS && IndexEngine!=ENGINE_BPLUS_TREE;key1++)
+	{
+		if(HashTable[key1].members==0)
+			continue;
+		if(HashTable[key1].frozen)
+		{
+			end=Image.buckets[key1].first+Image.buckets[key1].members;
+			for(i=Image.buckets[key1].first;i<end;i++)
+				FilterAdd(f,BPTREE_KEY(key1,Image.keys[i]));
+		}else
+			FilterTree(f,key1,HashTable[key1].pb);
+	}
+	for(index=0;index<LOCKNUM;index++)
+	{
+		for(cur=Cache[index].list;cur!=NULL;cur=cur->next)
+		{
+			if(cur->opcode_type==OPCODE_ADD)
+				FilterAdd(f,BPTREE_KEY(cur->key1,cur->key2));
+		}
+		for(cur=Cache[index].templist;cur!=NULL;cur=cur->next)
+		{
+			if(cur->opcode_type==OPCODE_ADD)
+				FilterAdd(f,BPTREE_KEY(cur->key1,cur->key2));
+		}
+	}
+	old=KeyFilter;
+	__atomic_store_n(&KeyFilter,f,__ATOMIC_RELEASE);
+	if(old!=NULL)
+		Retire(old,FilterDestroy);
+	return R_SUCCESS;
+}
+
+/*
+ * Rebuild the filter when the count of records is far from its size.
+ */
+static uint64_t CountRecords(void)
+{
+	uint64_t records=0;
+	unsigned long key1;
+
+	if(IndexEngine==ENGINE_BPLUS_TREE)
+		return TreeMembers;
+	for(key1=0;key1<MAXBUCKETS;key1++)
+		records+=HashTable[key1].members;
+	return records;
+}
+
+static void ResizeFilter(uint64_t records)
+{
+	if(KeyFilter==NULL || records>KeyFilter->capacity*2
+	   || (records*4<KeyFilter->capacity && KeyFilter->capacity>FILTER_MIN_BLOCKS*FILTER_KEYS_BLOCK))
+		RebuildFilter(records);
+}
+
+/*
+ * Rebuild the filter after an update which made it too small (its false positives grow fast).
+ */
+static void GrowFilter(void)
+{
+	int i;
+
+	if(KeyFilter==NULL || __atomic_load_n(&(KeyFilter->keys),__ATOMIC_RELAXED)<=KeyFilter->capacity*2)
+		return;
+	pthread_rwlock_wrlock(&CacheLock);
+	for(i=0;i<LOCKNUM;i++)
+		pthread_rwlock_wrlock((RecordLock+i));
+	pthread_mutex_lock(&TreeLock);
+	ResizeFilter(KeyFilter->keys);
+	pthread_mutex_unlock(&TreeLock);
+	for(i=0;i<LOCKNUM;i++)
+		pthread_rwlock_unlock((RecordLock+i));
+	pthread_rwlock_unlock(&CacheLock);
+}
+
+/*
+ * "*.example.com" and ".example.com" are the same rule as "example.com".
+ */
+static inline char* SuffixName(char* domain)
+{
+   if(domain[0]=='*' && domain[1]=='.')
+      return domain+2;
+   if(domain[0]=='.')
+      return domain+1;
+   return domain;
+}
+
+static result_t
+AddSuffixRule(char* domain,unsigned char control_type,char* info)
+{
+   struct SuffixRule* rule;
+   size_t infolen=(info!=NULL) ? strlen(info)+1 : 0;
+   result_t result;
+   char logString[256];
+
+   rule=(struct SuffixRule*)malloc(sizeof(struct SuffixRule)+infolen);
+   if(rule==NULL)
+      goto err_malloc;
+   rule->control_type=control_type;
+   rule->info=NULL;
+   if(info!=NULL)
+   {
+      rule->info=(char*)(rule+1);
+      memcpy(rule->info,info,infolen);
+   }
+
+   pthread_mutex_lock(&SuffixLock);
+   result=SuffixTrieUpdate(&Suffixes,domain,rule);
+   pthread_mutex_unlock(&SuffixLock);
+   if(result==R_SUCCESS)
+      return R_SUCCESS;
+   free(rule);
+
+err_malloc:
+   memset(logString, 0, 256);
+   snprintf(logString,256,"[ERROR] dbDomain.c @ AddSuffixRule @ malloc --- no enough memory!");
+   DBLogging(PROG_ERROR_LOG, logString);
+   return R_FAILED;
+}
+
+static result_t
+DeleteSuffixRule(char* domain)
+{
+   pthread_mutex_lock(&SuffixLock);
+   SuffixTrieRemove(&Suffixes,domain);
+   pthread_mutex_unlock(&SuffixLock);
+   return R_SUCCESS;
+}
+
+static result_t
+UpdateSuffixRule(char* domain,unsigned char control_type,unsigned char opcode_type,char* info)
+{
+   char logString[256];
+
+   domain=SuffixName(domain);
+   if(SuffixTrieCheck(domain)==R_FAILED)
+   {
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateSuffixRule @ check --- bad suffix rule '%.150s'.", domain);
+      DBLogging(PROG_ERROR_LOG, logString);
+      return R_FAILED;
+   }
+   if(opcode_type==OPCODE_ADD)
+      return AddSuffixRule(domain,control_type,info);
+   else if(opcode_type==OPCODE_DELETE)
+      return DeleteSuffixRule(domain);
+   return R_FAILED;
+}
+
+/*
+ * Find the longest suffix rule of 'domain'. The caller must be in a read section.
+ */
+static result_t
+SearchSuffix(char* domain,unsigned char* control_type,const char** info)
+{
+   const struct SuffixRule* rule=(const struct SuffixRule*)SuffixTrieSearch(&Suffixes,domain);
+   if(rule==NULL)
+      return R_NOTFOUND;
+   *control_type=rule->control_type;
+   *info=rule->info;
+   return R_FOUND;
+}
+
+/*
+ * Free all the suffix rules, no reader may use them. Until the database is loaded the old
+ * nodes are freed at once (no reader yet).
+ */
+static void ResetSuffix(void)
+{
+   SuffixTrieDestroy(&Suffixes);
+   SuffixTrieInit(&Suffixes,ReleaseNow,free);
+}
+
+/*
+ * IP rules: "address" or "address/len" of IPv4 or IPv6 (DATA_TYPE_IP).
+ * The prefixes are in a poptrie (dbIPTrie.h) per family, its values are the records.
+ */
+static void ReleaseNetRecord(void* br)
+{
+   FreeRecord((BlackRecord*)br);
+}
+
+/*
+ * Parse an IP rule, '*family' is 0 for IPv4, 1 for IPv6. An address without length is
+ * a host (/32, /128). The bits after the length are cleared.
+ */
+static result_t ParseIP(const char* text,ipkey_t* key,unsigned int* len,int* family)
+{
+   char addr[IP_NAME_MAX];
+   const char* slash=strchr(text,'/'),*p;
+   size_t n=(slash!=NULL) ? (size_t)(slash-text) : strlen(text);
+   unsigned char b[16];
+   int i;
+
+   if(n==0 || n>=sizeof(addr))
+      return R_FAILED;
+   memcpy(addr,text,n);
+   addr[n]='\0';
+   *family=(strchr(addr,':')!=NULL);
+   if(inet_pton(*family ? AF_INET6 : AF_INET,addr,b)!=1)
+      return R_FAILED;
+   *key=0;
+   for(i=0;i<(*family ? 16 : 4);i++)
+      *key|=(ipkey_t)b[i]<<(IPT_MAXWIDTH-8-8*i);
+   *len=*family ? 128 : 32;
+   if(slash!=NULL)
+   {
+      for(p=slash+1,n=0;*p>='0' && *p<='9' && n<=IPT_MAXWIDTH;p++)
+         n=n*10+(*p-'0');
+      if(p==slash+1 || *p!='\0' || n>*len)
+         return R_FAILED;
+      *len=n;
+   }
+   if(*len<IPT_MAXWIDTH)
+      *key&=~(~(ipkey_t)0>>*len);
+   return R_SUCCESS;
+}
+
+/*
+ * The text of a rule in the records and the image: "192.168.0.0/16", "2001:db8::/32".
+ */
+static void IPName(ipkey_t key,unsigned int len,int family,char* name)
+{
+   char addr[INET6_ADDRSTRLEN];
+   unsigned char b[16];
+   int i;
+
+   for(i=0;i<16;i++)
+      b[i]=(unsigned char)(key>>(IPT_MAXWIDTH-8-8*i));
+   inet_ntop(family ? AF_INET6 : AF_INET,b,addr,sizeof(addr));
+   snprintf(name,IP_NAME_MAX,"%s/%u",addr,len);
+}
+
+static result_t
+UpdateIPRule(char* text,unsigned char control_type,unsigned char opcode_type,char* info)
+{
+   ipkey_t key;
+   unsigned int len;
+   int family;
+   char name[IP_NAME_MAX];
+   BlackRecord* record;
+   result_t result=R_FAILED;
+   char logString[256];
+
+   if(ParseIP(text,&key,&len,&family)==R_FAILED)
+   {
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateIPRule @ check --- bad IP rule '%.150s'.", text);
+      DBLogging(PROG_ERROR_LOG, logString);
+      return R_FAILED;
+   }
+   pthread_mutex_lock(&NetLock);
+   if(opcode_type==OPCODE_DELETE)
+      result=IPTrieRemove(&IPTable[family],key,len);
+   else if(opcode_type==OPCODE_ADD)
+   {
+      IPName(key,len,family,name);
+      record=NewRecord(NetArena,name,control_type,info);
+      if(record!=NULL && (result=IPTrieUpdate(&IPTable[family],key,len,record))==R_FAILED)
+         FreeRecord(record);
+   }
+   pthread_mutex_unlock(&NetLock);
+   if(result==R_FAILED)
+   {
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateIPRule @ update --- %.150s failed.", text);
+      DBLogging(PROG_ERROR_LOG, logString);
+   }
+   return result;
+}
+
+/*
+ * The longest prefix of 'key', the caller must be in a read section.
+ */
+static inline result_t
+LookupIP(ipkey_t key,int family,unsigned char* control_type,const char** info)
+{
+   const BlackRecord* record=(const BlackRecord*)IPTrieSearch(&IPTable[family],key);
+   if(record==NULL)
+      return R_NOTFOUND;
+   *control_type=record->control_type;
+   *info=record->info;
+   if(record->control_type==CFLAG_REDIRECT && record->info==NULL)
+      *info=DEFAULT_REDI_IP;
+   return R_FOUND;
+}
+
+/*
+ * URL rules: "host" or "host/path" (DATA_TYPE_URL), in a hash table of the normalized rules
+ * (dbURLTable.h), its values are the records.
+ */
+static const char* NetRecordKey(const void* br)
+{
+   return ((const BlackRecord*)br)->value_domain;
+}
+
+static result_t
+UpdateURLRule(char* url,unsigned char control_type,unsigned char opcode_type,char* info)
+{
+   BlackRecord* record;
+   char key[URL_NAME_MAX];
+   size_t hostlen;
+   result_t result=R_FAILED;
+   char logString[256];
+
+   if(URLNormalize(url,key,sizeof(key),&hostlen)<0 || (opcode_type!=OPCODE_ADD && opcode_type!=OPCODE_DELETE))
+   {
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateURLRule @ check --- bad URL rule '%.150s'.", url);
+      DBLogging(PROG_ERROR_LOG, logString);
+      return R_FAILED;
+   }
+   pthread_mutex_lock(&NetLock);
+   if(opcode_type==OPCODE_DELETE)
+      result=URLTableRemove(&URLIndex,key);
+   else
+   {
+      record=NewRecord(NetArena,key,control_type,info);
+      if(record!=NULL && (result=URLTableUpdate(&URLIndex,record))==R_FAILED)
+         FreeRecord(record);
+   }
+   pthread_mutex_unlock(&NetLock);
+   if(result==R_FAILED)
+   {
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateURLRule @ malloc --- no enough memory!");
+      DBLogging(PROG_ERROR_LOG, logString);
+   }
+   return result;
+}
+
+/*
+ * The rule of the longest path prefix of 'url', the caller must be in a read section.
+ */
+static result_t
+LookupURL(char* url,unsigned char* control_type,const char** info)
+{
+   const BlackRecord* record=(const BlackRecord*)URLTableSearch(&URLIndex,url);
+   if(record==NULL)
+      return R_NOTFOUND;
+   *control_type=record->control_type;
+   *info=record->info;
+   if(record->control_type==CFLAG_REDIRECT && record->info==NULL)
+      *info=DEFAULT_REDI_IP;
+   return R_FOUND;
+}
+
+/*
+ * Apply a record set of IP or URL rules. A bad rule is logged and skipped, so it does not stop
+ * the replay of the log. '*count' (if not NULL) receives the count of the rules applied.
+ */
+static result_t
+UpdateNetRules(unsigned char type,void* collection,size_t size,int* count)
+{
+   char* start=(char*)collection;
+   char value[URL_NAME_MAX+1],info[INFO_MAX_SIZE];
+   struct data_hdr hdr;
+   size_t sum=0;
+   int n=0;
+   char logString[256];
+
+   if(type!=DATA_TYPE_IP && type!=DATA_TYPE_URL)
+   {
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateNetRules @ check --- unknown data type %d.", type);
+      goto err_out;
+   }
+   while(sum<size)
+   {
+      if(sum+sizeof(hdr)>size)
+         goto err_broken;
+      memcpy(&hdr,start+sum,sizeof(hdr));
+      if(sum+sizeof(hdr)+hdr.val_length+hdr.info_length>size)
+         goto err_broken;
+      sum+=sizeof(hdr);
+      if(hdr.val_length>URL_NAME_MAX)
+      {
+         memset(logString, 0, 256);
+         snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateNetRules @ check --- rule of %u bytes is too long.", hdr.val_length);
+         DBLogging(PROG_ERROR_LOG, logString);
+         sum+=hdr.val_length+hdr.info_length;
+         continue;
+      }
+      memcpy(value,start+sum,hdr.val_length);
+      value[hdr.val_length]='\0';
+      sum+=hdr.val_length;
+      memcpy(info,start+sum,hdr.info_length);
+      info[hdr.info_length]='\0';
+      sum+=hdr.info_length;
+      if(((type==DATA_TYPE_IP) ? UpdateIPRule : UpdateURLRule)(value,hdr.control_type,hdr.opcode_type,
+                                                             hdr.info_length!=0 ? info : NULL)==R_SUCCESS)
+         n++;
+   }
+   if(count!=NULL)
+      *count=n;
+   return R_SUCCESS;
+
+err_broken:
+   memset(logString, 0, 256);
+   snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateNetRules @ check --- broken record set.");
+err_out:
+   if(count!=NULL)
+      *count=n;
+   DBLogging(PROG_ERROR_LOG, logString);
+   return R_FAILED;
+}
+
+/*
+ * Empty IP and URL rules. The tries free their old nodes at once until the database is
+ * loaded (no reader yet).
+ */
+static result_t CreateNetRules(void)
+{
+   if(IPTrieInit(&IPTable[0],32,ReleaseNow,ReleaseNetRecord)==R_FAILED)
+      return R_FAILED;
+   if(IPTrieInit(&IPTable[1],IPT_MAXWIDTH,ReleaseNow,ReleaseNetRecord)==R_FAILED)
+   {
+      IPTrieDestroy(&IPTable[0]);
+      return R_FAILED;
+   }
+   if(URLTableInit(&URLIndex,NetRecordKey,ReleaseNow,ReleaseNetRecord)==R_FAILED)
+   {
+      IPTrieDestroy(&IPTable[0]);
+      IPTrieDestroy(&IPTable[1]);
+      return R_FAILED;
+   }
+   return R_SUCCESS;
+}
+
+/*
+ * Free the IP and URL rules, no reader may use them. The records are freed one by one if
+ * 'records' is set, else they are left to DestroyArenas().
+ */
+static void DestroyNetRules(int records)
+{
+   size_t i;
+   for(i=0;i<2;i++)
+   {
+      if(!records)
+         IPTable[i].release=NULL;
+      IPTrieDestroy(&IPTable[i]);
+   }
+   if(!records)
+      URLIndex.release=NULL;
+   URLTableDestroy(&URLIndex);
+}
+
+/*
+ * Arenas of the index and the pool of the infos.
+ */
+static result_t CreateArenas(void)
+{
+   int i;
+   for(i=0;i<LOCKNUM;i++)
+   {
+      if((TreeArena[i]=ArenaCreate())==NULL)
+         goto err_arena;
+   }
+   if((ChainArena=ArenaCreate())==NULL || (NetArena=ArenaCreate())==NULL || (InfoPool=PoolCreate())==NULL)
+      goto err_arena;
+   return R_SUCCESS;
+
+err_arena:
+   DestroyArenas();
+   return R_FAILED;
+}
+
+/*
+ * Free all the nodes and records at once, no tree may use them any more.
+ */
+static void DestroyArenas(void)
+{
+   int i;
+   for(i=0;i<LOCKNUM;i++)
+   {
+      ArenaDestroy(TreeArena[i]);
+      TreeArena[i]=NULL;
+   }
+   ArenaDestroy(ChainArena);
+   ChainArena=NULL;
+   ArenaDestroy(NetArena);
+   NetArena=NULL;
+   PoolDestroy(InfoPool);
+   InfoPool=NULL;
+}
+
+result_t InitializeSearchTree(void)
+{
+   return InitializeSearchEngine(ENGINE_HASH_BTREE);
+}
+
+result_t InitializeSearchEngine(unsigned char engine)
+{
+   int i,j,rtn=0;
+   char logString[256];
+   char oldPath[256];
+
+   if(HashTable!=NULL)
+   {   //Database has exist,then delete it
+	if(DestroySearchTree()!=R_SUCCESS)
+		return R_FAILED;
+   }
+   if(engine!=ENGINE_HASH_BTREE && engine!=ENGINE_BPLUS_TREE)
+   {
+	memset(logString, 0, 256);
+	snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchEngine @ engine --- unknown engine %d!", engine);
+	goto err_out;
+   }
+   IndexEngine=engine;
+
+   //initial hash table, data initial as 0
+   HashTable=(struct HashNode*)calloc(MAXBUCKETS, sizeof(struct HashNode));
+   if(HashTable==NULL)
+   {
+	memset(logString, 0, 256);
+	snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ calloc --- %s", strerror(errno));
+	goto err_out;
+   }
+
+   //initial the private copies used by writers
+   ShadowTable=(struct ShadowNode*)calloc(MAXBUCKETS, sizeof(struct ShadowNode));
+   if(ShadowTable==NULL)
+   {
+	free(HashTable);
+	memset(logString, 0, 256);
+	snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ calloc --- %s", strerror(errno));
+	goto err_out;
+   }
+   for(i=0;i<LOCKNUM;i++)
+	DirtyHead[i]=MAXBUCKETS;
+
+   //initial cache, initial as NULL(0)
+    Cache=(struct CacheList*)calloc(LOCKNUM, sizeof(struct CacheList));
+    if(Cache==NULL)
+    {
+	free(HashTable);
+	free(ShadowTable);
+	memset(logString, 0, 256);
+	snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ calloc --- %s", strerror(errno));
+	goto err_out;
+    }
+
+   //initial the locks
+   rtn = pthread_rwlock_init(&CacheLock, NULL);
+   if(rtn!=0)
+   {
+         free(HashTable);
+         free(ShadowTable);
+         free(Cache);
+	 memset(logString, 0, 256);
+	 snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ pthread_rwlock_init --- cache lock initial error!");
+	 goto err_out;
+   }
+   RecordLock=(pthread_rwlock_t*)malloc(LOCKNUM*sizeof(pthread_rwlock_t));
+   if(RecordLock==NULL)
+   {
+      free(HashTable);
+      free(ShadowTable);
+      free(Cache);
+      pthread_rwlock_destroy(&CacheLock);
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ malloc --- %s", strerror(errno));
+      goto err_out;
+   }
+   for(i=0;i<LOCKNUM;i++)
+   {
+      rtn = pthread_rwlock_init((RecordLock+i), NULL);
+      if(rtn!=0)
+      {
+         free(HashTable);
+         free(ShadowTable);
+         free(Cache);
+          //destory locks which have create
+         pthread_rwlock_destroy(&CacheLock);
+	 for(j=0;j<i;j++)
+    		pthread_rwlock_destroy((RecordLock+j));
+	 free(RecordLock);
+	 memset(logString, 0, 256);
+	 snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ pthread_rwlock_init --- record lock initial error!");
+	 goto err_out;
+      }
+   }
+   if(CreateArenas()==R_FAILED)
+   {
+      free(HashTable);
+      free(ShadowTable);
+      free(Cache);
+      pthread_rwlock_destroy(&CacheLock);
+      for(i=0;i<LOCKNUM;i++)
+         pthread_rwlock_destroy((RecordLock+i));
+      free(RecordLock);
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ CreateArenas --- no enough memory!");
+      goto err_out;
+   }
+   if(CreateNetRules()==R_FAILED)
+   {
+      free(HashTable);
+      free(ShadowTable);
+      free(Cache);
+      pthread_rwlock_destroy(&CacheLock);
+      for(i=0;i<LOCKNUM;i++)
+         pthread_rwlock_destroy((RecordLock+i));
+      free(RecordLock);
+      DestroyArenas();
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ CreateNetRules --- no enough memory!");
+      goto err_out;
+   }
+   if(StatsOpen()==R_FAILED)
+   {  //not fatal, the statistics are only in this process
+      memset(logString, 0, 256);
+      snprintf(logString,256,"[ERROR] dbDomain.c @ InitializeSearchTree @ StatsOpen --- no statistics page in the share memory.");
+      DBLogging(PROG_ERROR_LOG, logString);
+   }
+   StartFlushPool();
+   SuffixTrieInit(&Suffixes,ReleaseNow,free);
+   //read file,and initial search tree (no reader yet, the old B+ tree nodes are freed at once)
+   BPTreeInit(&GlobalTree,ReleaseNow,ReleaseChain);
+   TreeMembers=0;
+   rtn=CreateFromFile();
+   BPTreeCommit(&GlobalTree);
+   GlobalTree.retire=Retire;
+   IPTable[0].retire=IPTable[1].retire=URLIndex.retire=Suffixes.retire=Retire;
+   if(rtn==R_SUCCESS)
+      ResizeFilter(CountRecords());    //the log may have added many records after the image
+   Reclaim();
+   if(rtn==R_SUCCESS && LegacyData && (SnapLoaded || SaveSnapshot()==R_SUCCESS))
+   {  //domain.db is folded into the image
+      snprintf(oldPath,256,"%s.old",DOMAIN_DATA_PATH);
+      rename(DOMAIN_DATA_PATH,oldPath);
+   }
+   if(rtn==R_SUCCESS && SnapStale && SaveSnapshot()==R_SUCCESS)
+      SnapStale=0;           //the image has the new keys now
+   if(rtn==R_SUCCESS)
+      StartCompactor();
+   ResultInvalidate();       //results cached from a database of before
+   return rtn;
+
+err_out:
+   DBLogging(PROG_ERROR_LOG, logString);
+   return R_FAILED;
+}
+
+result_t DestroySearchTree(void)
+{
+   int i;
+   if(HashTable==NULL)
+      return R_SUCCESS;
+
+   //no snapshot while the database is freed, then close the log
+   StopCompactor();
+   LogClose();
+   StopFlushPool();
+
+   //Free the memory which is waiting for readers
+   Reclaim();
+   FilterDestroy(KeyFilter);
+   KeyFilter=NULL;
+   free(ShadowTable);
+   ShadowTable=NULL;
+
+   //Destroy locks
+   for(i=0;i<LOCKNUM;i++)
+        pthread_rwlock_destroy((RecordLock+i));
+   pthread_rwlock_destroy(&CacheLock);
+
+   //Free record locks memory
+    free(RecordLock);
+
+   //Free Cache
+   for(i=0;i<LOCKNUM;i++)
+   {
+      if(Cache[i].list!=NULL)
+      {   //free cachelist
+          TempRecord* p,*q=Cache[i].list;
+	  while(q)
+	  {
+          	p=q;
+		q=q->next;
+		free(p->value_domain);
+		if((p->info)!=NULL)
+			free(p->info);
+		free(p);
+	  }
+      }
+      if(Cache[i].templist!=NULL)
+      {   //free temp list in cache
+          TempRecord* p,*q=Cache[i].templist;
+	  while(q)
+	  {
+          	p=q;
+		q=q->next;
+		free(p->value_domain);
+		if((p->info)!=NULL)
+			free(p->info);
+		free(p);
+	  }
+      }
+      free(Cache[i].map);
+      free(Cache[i].tempmap);
+   }
+   free(Cache);
+
+   //Free Hash Table, the trees and the records of the B+ tree are freed with their arenas
+   free(HashTable);
+   HashTable=NULL;
+   GlobalTree.release=NULL;
+   BPTreeDestroy(&GlobalTree);
+   TreeMembers=0;
+   DestroyNetRules(0);
+   DestroyArenas();
+   ResetSuffix();
+   UnloadSnapshot();
+   ResultInvalidate();
+   StatsClose();
+   LoggerFlush();
+   return R_SUCCESS;
+}
+
+/*
+ * Search 'domain' in the cache lists, the index and the suffix rules. '*info' points into
+ * the stored record, it is valid until the read section ends.
+ */
+static result_t
+LookupDomain(char* domain, unsigned char* control_type, const char** info)
+{
+   unsigned long key1,key2,lockindex,gen;
+   uint64_t hash;
+   result_t result=R_NOTFOUND;
+   Filter* filter;
+   int pending;
+   struct ResultCache* rc;
+   const struct ResultEntry* hit;
+   *info=NULL;
+
+   hash=HashLower(domain);
+   //a hot name is answered by the result cache of the thread
+   gen=__atomic_load_n(&ResultGen,__ATOMIC_ACQUIRE);
+   rc=ResultCacheOf();
+   if(rc!=NULL && (hit=ResultProbe(rc,hash,domain,gen))!=NULL)
+   {
+	if(hit->result==R_FOUND)
+	{
+		*control_type=hit->control_type;
+		*info=hit->hasinfo ? hit->info : NULL;
+	}
+	return hit->result;
+   }
+   key1=HASH_KEY1(hash,MAXBUCKETS);
+   key2=HASH_KEY2(hash);
+   lockindex=key1%LOCKNUM;
+
+   //an empty bucket (and no quick update) is cheaper to check, then a name which is not in
+   //the filter has no exact record (the filter counts the quick adds too).
+   filter=__atomic_load_n(&KeyFilter,__ATOMIC_ACQUIRE);
+   pending=(__atomic_load_n(&(Cache[lockindex].map),__ATOMIC_ACQUIRE) ||
+	    __atomic_load_n(&(Cache[lockindex].tempmap),__ATOMIC_ACQUIRE));
+   if((IndexEngine==ENGINE_BPLUS_TREE || pending || __atomic_load_n(&(HashTable[key1].members),__ATOMIC_ACQUIRE)!=0) &&
+      (filter==NULL || FilterMayContain(filter,BPTREE_KEY(key1,key2))))
+   {    //search in cache list
+	if(pending && (result=SearchInList(domain,control_type,lockindex,key2,info))!=R_NOTFOUND)
+		StatsCount(STAT_OVERLAY_HIT,1);
+	if(result==R_INVALID)
+	{	//found in list ,but is deleting.
+		StatsCount(STAT_INVALID,1);
+		result=R_NOTFOUND;
+	}else if(result!=R_FOUND)
+	{       //search in B Tree (or in the snapshot image, or in the B+ tree)
+		if(IndexEngine==ENGINE_BPLUS_TREE)
+			result=SearchInBPTree(domain,control_type,key1,key2,info);
+		else if(__atomic_load_n(&(HashTable[key1].frozen),__ATOMIC_ACQUIRE))
+			result=SearchInImage(domain,control_type,key1,key2,info);
+		else
+			result=SearchInBTree(domain,control_type,key1,key2,info);
+	}
+   }
+   if(result!=R_FOUND && __atomic_load_n(&(Suffixes.nrules),__ATOMIC_RELAXED)!=0)
+	result=SearchSuffix(domain,control_type,info);     //no exact record, the longest suffix rule
+   if(result == R_FOUND && *control_type == CFLAG_REDIRECT && *info == NULL)
+	*info=DEFAULT_REDI_IP;                           //指定默认重定向地址
+   if(rc!=NULL)
+	ResultStore(rc,hash,domain,gen,result,*control_type,*info);
+   return result;
+}
+
+static void ReleaseResults(void* rc)
+{
+   free(rc);
+}
+
+static void CreateResultKey(void)
+{
+   pthread_key_create(&ResultKey,ReleaseResults);
+}
+
+/*
+ * The result cache of the calling thread, it is freed when the thread exits.
+ * NULL if there is no memory for it (the thread searches without cache).
+ */
+static struct ResultCache* ResultCacheOf(void)
+{
+   struct ResultCache* rc=MyResults;
+
+   if(rc!=NULL)
+      return rc;
+   pthread_once(&ResultOnce,CreateResultKey);
+   rc=(struct ResultCache*)calloc(1,sizeof(struct ResultCache));
+   if(rc==NULL)
+      return NULL;
+   pthread_setspecific(ResultKey,rc);
+   MyResults=rc;
+   return rc;
+}
+
+/*
+ * Count one lookup, the counts of a thread are added to the global ones now and then.
+ */
+static inline void ResultCount(struct ResultCache* rc,int hit)
+{
+   if(hit)
+      rc->hits++;
+   else
+      rc->misses++;
+   if(rc->hits+rc->misses<RESULT_FLUSH)
+      return;
+   __atomic_add_fetch(&ResultHits,rc->hits,__ATOMIC_RELAXED);
+   __atomic_add_fetch(&ResultMisses,rc->misses,__ATOMIC_RELAXED);
+   StatsCount(STAT_RESULT_HIT,rc->hits);
+   StatsCount(STAT_RESULT_MISS,rc->misses);
+   rc->hits=0;
+   rc->misses=0;
+}
+
+static const struct ResultEntry*
+ResultProbe(struct ResultCache* rc,uint64_t hash,const char* domain,unsigned long gen)
+{
+   struct ResultEntry* e=rc->entry[hash&(RESULT_SETS-1)];
+   int i;
+
+   for(i=0;i<RESULT_WAYS;i++)
+   {
+      if(e[i].gen==gen && e[i].hash==hash && strcmp(e[i].name,domain)==0)
+      {
+         e[i].refer=1;
+         ResultCount(rc,1);
+         return e+i;
+      }
+   }
+   ResultCount(rc,0);
+   return NULL;
+}
+
+/*
+ * Save the result of a search made at generation 'gen'. The victim is an entry of an older
+ * generation, else the first one the CLOCK hand finds not used since it passed.
+ */
+static void
+ResultStore(struct ResultCache* rc,uint64_t hash,const char* domain,unsigned long gen,result_t result,
+	    unsigned char control_type,const char* info)
+{
+   unsigned long set=hash&(RESULT_SETS-1);
+   struct ResultEntry* e=rc->entry[set];
+   size_t len=strlen(domain),ilen=0;
+   int i,victim=-1;
+
+   if(len>=RESULT_NAME_SIZE || (result!=R_FOUND && result!=R_NOTFOUND))
+      return;
+   if(result==R_FOUND && info!=NULL && (ilen=strlen(info))>=RESULT_INFO_SIZE)
+      return;
+   for(i=0;i<RESULT_WAYS && victim<0;i++)
+   {
+      if(e[i].gen!=gen)
+         victim=i;
+   }
+   while(victim<0)
+   {
+      i=rc->hand[set];
+      rc->hand[set]=(i+1)%RESULT_WAYS;
+      if(e[i].refer)
+         e[i].refer=0;
+      else
+         victim=i;
+   }
+   e+=victim;
+   e->hash=hash;
+   e->gen=gen;
+   e->result=result;
+   e->refer=0;
+   memcpy(e->name,domain,len+1);
+   e->hasinfo=0;
+   if(result==R_FOUND)
+   {
+      e->control_type=control_type;
+      if(info!=NULL)
+      {
+         memcpy(e->info,info,ilen+1);
+         e->hasinfo=1;
+      }
+   }
+}
+
+/*
+ * All the cached results are old after an update (called when the update is visible).
+ */
+static inline void ResultInvalidate(void)
+{
+   __atomic_add_fetch(&ResultGen,1,__ATOMIC_RELEASE);
+}
+
+/*
+ * Write the hit rate of the result caches since the last call to the update log.
+ */
+static void LogResultCache(void)
+{
+   unsigned long hits,misses;
+   char logString[256];
+
+   hits=__atomic_exchange_n(&ResultHits,0,__ATOMIC_RELAXED);
+   misses=__atomic_exchange_n(&ResultMisses,0,__ATOMIC_RELAXED);
+   if(hits+misses==0)
+      return;
+   memset(logString, 0, 256);
+   snprintf(logString,256,"Type: DOMAIN.  Result cache: %lu hits, %lu misses (%.1f%% hit).",
+            hits, misses, 100.0*hits/(hits+misses));
+   DBLogging(PROG_UPDATE_LOG, logString);
+}
+
+static char* CopyInfo(const char* info)
+{
+   char* copy;
+
+   if(info==NULL)
+      return NULL;
+   copy=(char*)malloc(sizeof(char)*(strlen(info)+1));
+   if(copy!=NULL)
+      strcpy(copy,info);
+   return copy;
+}
+
+/*
+ * Latency and result of one search, for the statistics page.
+ */
+static inline void CountSearch(uint64_t start,result_t result)
+{
+   StatsValue(STAT_HIST_SEARCH,StatsNow()-start);
+   StatsCount(result==R_FOUND ? STAT_FOUND : STAT_NOTFOUND,1);
+}
+
+result_t
+SearchDomainName(char* domain, unsigned char* control_type, char** info)
+{
+   const char* view;
+   unsigned long epoch;
+   uint64_t start=StatsNow();
+   result_t result;
+
+   //no lock here: writers never change the published data, they copy and swap it.
+   epoch=ReadLock();
+   result=LookupDomain(domain,control_type,&view);
+   *info=(result==R_FOUND) ? CopyInfo(view) : NULL;
+   ReadUnlock(epoch);
+   CountSearch(start,result);
+   return result;
+}
+
+result_t
+SearchDomainNameBuffer(char* domain, unsigned char* control_type, char* info, size_t size)
+{
+   const char* view;
+   unsigned long epoch;
+   uint64_t start=StatsNow();
+   result_t result;
+   size_t len=0;
+
+   epoch=ReadLock();
+   result=LookupDomain(domain,control_type,&view);
+   if(result==R_FOUND && view!=NULL && size!=0)
+   {
+      len=strlen(view);
+      if(len>=size)
+         len=size-1;
+      memcpy(info,view,len);
+   }
+   ReadUnlock(epoch);
+   if(size!=0)
+      info[len]='\0';
+   CountSearch(start,result);
+   return result;
+}
+
+/*
+ * Copy the info of a record into the caller's buffer, in the read section.
+ */
+static inline void CopyView(const char* view,char* info,size_t size)
+{
+   size_t len=0;
+   if(size==0)
+      return;
+   if(view!=NULL)
+   {
+      len=strlen(view);
+      if(len>=size)
+         len=size-1;
+      memcpy(info,view,len);
+   }
+   info[len]='\0';
+}
+
+result_t
+SearchIPAddress(char* ip, unsigned char* control_type, char* info, size_t size)
+{
+   const char* view=NULL;
+   unsigned long epoch;
+   uint64_t start=StatsNow();
+   unsigned int len;
+   int family;
+   ipkey_t key;
+   result_t result=R_NOTFOUND;
+
+   if(ParseIP(ip,&key,&len,&family)==R_SUCCESS)
+   {
+      epoch=ReadLock();
+      result=LookupIP(key,family,control_type,&view);
+      CopyView(result==R_FOUND ? view : NULL,info,size);
+      ReadUnlock(epoch);
+   }else
+      CopyView(NULL,info,size);
+   CountSearch(start,result);
+   return result;
+}
+
+result_t
+SearchIPv4Address(uint32_t ip, unsigned char* control_type, char* info, size_t size)
+{
+   const char* view=NULL;
+   unsigned long epoch;
+   uint64_t start=StatsNow();
+   result_t result;
+
+   epoch=ReadLock();
+   result=LookupIP((ipkey_t)ip<<(IPT_MAXWIDTH-32),0,control_type,&view);
+   CopyView(result==R_FOUND ? view : NULL,info,size);
+   ReadUnlock(epoch);
+   CountSearch(start,result);
+   return result;
+}
+
+size_t
+SearchIPv4Batch(const uint32_t* ips,size_t n,unsigned char* control_types,result_t* results)
+{
+   ipkey_t addr[BATCH_GROUP];
+   void* value[BATCH_GROUP];
+   const BlackRecord* record;
+   unsigned long epoch;
+   size_t base,j,m,found=0;
+
+   //one read section for the whole batch.
+   epoch=ReadLock();
+   for(base=0;base<n;base+=BATCH_GROUP)
    {
-      if((cur->key2)==key2 && strcmp(cur->value_domain,domain)==0)
+      m=(n-base<BATCH_GROUP) ? n-base : BATCH_GROUP;
+      for(j=0;j<m;j++)
+         addr[j]=(ipkey_t)ips[base+j]<<(IPT_MAXWIDTH-32);
+      IPTrieSearchBatch(&IPTable[0],addr,m,value);
+      for(j=0;j<m;j++)
+      {
+         if(value[j]!=NULL)
+            __builtin_prefetch(value[j]);
+      }
+      for(j=0;j<m;j++)
       {
-	 if(cur->opcode_type==OPCODE_DELETE)
-		return R_INVALID;
-
-         *control_type=cur->control_type;
-         if((cur->info)!=NULL)
-	 {
-             *info=(char*)malloc(sizeof(char)*(strlen(cur->info)+1));
-	     if((*info)!=NULL)
-	        strcpy(*info,cur->info);
-  	 }
-	 return R_FOUND;
+         record=(const BlackRecord*)value[j];
+         results[base+j]=R_NOTFOUND;
+         if(record==NULL)
+            continue;
+         results[base+j]=R_FOUND;
+         control_types[base+j]=record->control_type;
+         found++;
       }
-      cur=cur->next;
    }
+   ReadUnlock(epoch);
+   StatsCount(STAT_FOUND,found);
+   StatsCount(STAT_NOTFOUND,n-found);
+   return found;
+}
+
+result_t
+SearchURL(char* url, unsigned char* control_type, char* info, size_t size)
+{
+   const char* view=NULL;
+   unsigned long epoch;
+   uint64_t start=StatsNow();
+   result_t result;
+
+   epoch=ReadLock();
+   result=LookupURL(url,control_type,&view);
+   CopyView(result==R_FOUND ? view : NULL,info,size);
+   ReadUnlock(epoch);
+   CountSearch(start,result);
+   return result;
+}
+
+size_t
+SearchDomainNameBatch(char** domains,size_t n,unsigned char* control_types,char** infos,result_t* results)
+{
+   unsigned long key1[BATCH_GROUP],key2[BATCH_GROUP],epoch,gen;
+   uint64_t hash[BATCH_GROUP];
+   BTree node[BATCH_GROUP];
+   Filter* filter;
+   const char* view[BATCH_GROUP];
+   unsigned char cached[BATCH_GROUP];
+   struct ResultCache* rc;
+   const struct ResultEntry* hit;
+   size_t base,j,m,found=0;
+   unsigned long lockindex;
+   int active,i,pending;
 
-   cur=Cache[lockindex].templist;
-   while(cur!=NULL)
+   //one read section for the whole batch.
+   epoch=ReadLock();
+   gen=__atomic_load_n(&ResultGen,__ATOMIC_ACQUIRE);
+   rc=ResultCacheOf();
+   filter=__atomic_load_n(&KeyFilter,__ATOMIC_ACQUIRE);
+   for(base=0;base<n;base+=BATCH_GROUP)
    {
-      if((cur->key2)==key2 && strcmp(cur->value_domain,domain)==0)
+      m=(n-base<BATCH_GROUP) ? n-base : BATCH_GROUP;
+
+      //stage 1: hash all the keys, answer the hot names from the result cache,
+      //and prefetch the filter blocks and the Hash buckets.
+      for(j=0;j<m;j++)
+      {
+         view[j]=NULL;
+         results[base+j]=R_NOTFOUND;
+         hash[j]=HashLower(domains[base+j]);
+         cached[j]=0;
+         if(rc!=NULL && (hit=ResultProbe(rc,hash[j],domains[base+j],gen))!=NULL)
+         {
+            cached[j]=1;
+            results[base+j]=hit->result;
+            if(hit->result==R_FOUND)
+            {
+               control_types[base+j]=hit->control_type;
+               view[j]=hit->hasinfo ? hit->info : NULL;
+            }
+            continue;
+         }
+         key1[j]=HASH_KEY1(hash[j],MAXBUCKETS);
+         key2[j]=HASH_KEY2(hash[j]);
+         if(filter!=NULL)
+            __builtin_prefetch(FilterBlockOf(filter,FilterHash(BPTREE_KEY(key1[j],key2[j]))),0,1);
+         __builtin_prefetch(HashTable+key1[j],0,1);
+      }
+
+      //stage 2: cache list and snapshot image, and prefetch the B-tree roots.
+      for(j=0;j<m;j++)
+      {
+         node[j]=NULL;
+         if(cached[j])
+            continue;
+         lockindex=key1[j]%LOCKNUM;
+         pending=(__atomic_load_n(&(Cache[lockindex].map),__ATOMIC_ACQUIRE) ||
+                  __atomic_load_n(&(Cache[lockindex].tempmap),__ATOMIC_ACQUIRE));
+         if(IndexEngine!=ENGINE_BPLUS_TREE && !pending && __atomic_load_n(&(HashTable[key1[j]].members),__ATOMIC_ACQUIRE)==0)
+            continue;
+         if(filter!=NULL && !FilterMayContain(filter,BPTREE_KEY(key1[j],key2[j])))
+            continue;
+         if(pending)
+         {
+            results[base+j]=SearchInList(domains[base+j],control_types+base+j,lockindex,key2[j],view+j);
+            if(results[base+j]!=R_NOTFOUND)
+               StatsCount(STAT_OVERLAY_HIT,1);
+            if(results[base+j]==R_INVALID)
+            {  //found in list ,but is deleting.
+               StatsCount(STAT_INVALID,1);
+               results[base+j]=R_NOTFOUND;
+               continue;
+            }
+            if(results[base+j]==R_FOUND)
+               continue;
+         }
+         if(IndexEngine==ENGINE_BPLUS_TREE)
+         {  //one node per level, no walk to interleave
+            results[base+j]=SearchInBPTree(domains[base+j],control_types+base+j,key1[j],key2[j],view+j);
+            continue;
+         }
+         if(__atomic_load_n(&(HashTable[key1[j]].frozen),__ATOMIC_ACQUIRE))
+         {
+            results[base+j]=SearchInImage(domains[base+j],control_types+base+j,key1[j],key2[j],view+j);
+            continue;
+         }
+         node[j]=__atomic_load_n(&(HashTable[key1[j]].pb),__ATOMIC_ACQUIRE);
+         if(node[j]!=NULL)
+         {
+            __builtin_prefetch(&(node[j]->keynum),0,1);
+            __builtin_prefetch(&(node[j]->key[SUBMAX/2+1]),0,1);
+         }
+      }
+
+      //stage 3: walk down all the trees one level per round, so the misses overlap.
+      do{
+         active=0;
+         for(j=0;j<m;j++)
+         {
+            if(node[j]==NULL)
+               continue;
+            i=NodeIndex(node[j],key2[j]);
+            if(i!=0 && node[j]->key[i]==key2[j])
+            {
+               results[base+j]=MatchRecord(node[j]->brecord[i],domains[base+j],control_types+base+j,view+j);
+               node[j]=NULL;
+               continue;
+            }
+            node[j]=node[j]->ptr[i];
+            if(node[j]!=NULL)
+            {
+               __builtin_prefetch(&(node[j]->keynum),0,1);
+               __builtin_prefetch(&(node[j]->key[SUBMAX/2+1]),0,1);
+               active++;
+            }
+         }
+      }while(active);
+
+      //stage 4: the names without exact record, by suffix rules.
+      if(__atomic_load_n(&(Suffixes.nrules),__ATOMIC_RELAXED)!=0)
+      {
+         for(j=0;j<m;j++)
+         {
+            if(results[base+j]!=R_FOUND && !cached[j])
+               results[base+j]=SearchSuffix(domains[base+j],control_types+base+j,view+j);
+         }
+      }
+
+      //copy the infos out of the records before the read section ends.
+      for(j=0;j<m;j++)
+      {
+         infos[base+j]=NULL;
+         if(results[base+j]!=R_FOUND)
+            continue;
+         found++;
+         if(control_types[base+j]==CFLAG_REDIRECT && view[j]==NULL)
+            view[j]=DEFAULT_REDI_IP;          //指定默认重定向地址
+         infos[base+j]=CopyInfo(view[j]);
+      }
+
+      //the views of the cached results are copied, the cache can be changed now.
+      for(j=0;j<m && rc!=NULL;j++)
       {
-       	 if(cur->opcode_type==OPCODE_DELETE)
-		return R_INVALID;
-
-         *control_type=cur->control_type;
-         if((cur->info)!=NULL)
-	 {
-             *info=(char*)malloc(sizeof(char)*(strlen(cur->info)+1));
-	     if((*info)!=NULL)
-	        strcpy(*info,cur->info);
-  	 }
-         return R_FOUND;
+         if(!cached[j])
+            ResultStore(rc,hash[j],domains[base+j],gen,results[base+j],control_types[base+j],view[j]);
       }
-      cur=cur->next;
    }
-   return result;
+   ReadUnlock(epoch);
+   StatsCount(STAT_FOUND,found);
+   StatsCount(STAT_NOTFOUND,n-found);
+   return found;
 }
 
-static result_t
-SearchInBTree(char* domain, unsigned char* control_type,unsigned long key1,unsigned long key2,char** info)
+static result_t SearchInList(char* domain, unsigned char* control_type,unsigned long lockindex,
+				unsigned long key2,const char** info)
+{   
+    /*
+     *  Return: R_FOUND, R_INVALID (deleted) or R_NOTFOUND
+     */
+
+   const TempRecord* cur;
+
+   //the list first, then the temp list: a name is in one of them while they are switched.
+   cur=OverlayFind(__atomic_load_n(&(Cache[lockindex].map),__ATOMIC_ACQUIRE),key2,domain);
+   if(cur==NULL)
+      cur=OverlayFind(__atomic_load_n(&(Cache[lockindex].tempmap),__ATOMIC_ACQUIRE),key2,domain);
+   if(cur==NULL)
+      return R_NOTFOUND;
+   if(cur->opcode_type==OPCODE_DELETE)
+      return R_INVALID;
+   *control_type=cur->control_type;
+   *info=cur->info;
+   return R_FOUND;
+}
+
+/*
+ * The newest record of 'domain' in an overlay, NULL if none.
+ */
+static const TempRecord* OverlayFind(const struct Overlay* m,unsigned long key2,const char* domain)
 {
-   Result* pr;
-   result_t result=R_NOTFOUND;
-   BlackRecord * pb;
-   char logString[256];
+   const TempRecord* cur;
+   unsigned int i;
 
-   pr=(Result*)malloc(sizeof(Result));
-   if(pr==NULL)
+   if(m==NULL)
+      return NULL;
+   for(i=key2&(m->size-1);(cur=__atomic_load_n(m->slot+i,__ATOMIC_ACQUIRE))!=NULL;i=(i+1)&(m->size-1))
    {
-      memset(logString, 0, 256);
-      snprintf(logString,256,"[ERROR] dbDomain.c @ SearchInBTree @ malloc --- %s", strerror(errno));
-      goto err_out;
+      if(cur->key2==key2 && strcmp(cur->value_domain,domain)==0)
+         return cur;
+   }
+   return NULL;
+}
+
+/*
+ * Make room for 'n' more names in the overlay of list 'index' (CacheLock is held).
+ * A larger table is published with all the names, the old one is freed after the readers.
+ */
+static result_t OverlayReserve(unsigned long index,unsigned int n)
+{
+   struct Overlay* old=Cache[index].map,*m;
+   unsigned int size=OVERLAY_MIN,i;
+   unsigned long need=(old!=NULL ? old->count : 0)+(unsigned long)n;
+
+   if(old!=NULL && need*2<=old->size)
+      return R_SUCCESS;
+   while(size<need*2)
+      size<<=1;
+   m=(struct Overlay*)calloc(1,sizeof(struct Overlay)+size*sizeof(TempRecord*));
+   if(m==NULL)
+      return R_FAILED;
+   m->size=size;
+   for(i=0;old!=NULL && i<old->size;i++)
+   {
+      if(old->slot[i]!=NULL)
+         OverlayPut(m,old->slot[i]);
    }
-   SearchBTNode(HashTable[key1].pb,key2,pr);
-   if(pr->tag!=0)
+   __atomic_store_n(&(Cache[index].map),m,__ATOMIC_RELEASE);
+   if(old!=NULL)
+      Retire(old,free);
+   return R_SUCCESS;
+}
+
+/*
+ * 'pr' becomes the newest record of its name (the table has room, CacheLock is held).
+ */
+static void OverlayPut(struct Overlay* m,TempRecord* pr)
+{
+   TempRecord* cur;
+   unsigned int i;
+
+   for(i=pr->key2&(m->size-1);(cur=m->slot[i])!=NULL;i=(i+1)&(m->size-1))
    {
-       pb=pr->pt->brecord[pr->i];
-       while(pb)
-       {
-            if(strcmp(pb->value_domain,domain)==0)
-            {
-                *control_type=pb->control_type;
-           	if((pb->info)!=NULL)
-		{
-         	    *info=(char*)malloc(sizeof(char)*(strlen(pb->info)+1));
-	  	    if((*info)!=NULL)
-	  	        strcpy(*info,pb->info);
-  	 	}
-                result=R_FOUND;
-                break;
-            }
-            pb=pb->next;
-       }
+      if(cur->key2==pr->key2 && strcmp(cur->value_domain,pr->value_domain)==0)
+         break;
    }
-   free(pr);
-   return result;
+   if(cur==NULL)
+      m->count++;
+   __atomic_store_n(m->slot+i,pr,__ATOMIC_RELEASE);
+}
 
-err_out:
-   DBLogging(PROG_ERROR_LOG, logString);
+/*
+ * Find 'domain' in the record list of one B-tree key.
+ */
+static result_t
+MatchRecord(BRecordList pb,char* domain,unsigned char* control_type,const char** info)
+{
+   while(pb)
+   {
+        if(strcmp(pb->value_domain,domain)==0)
+        {
+            *control_type=pb->control_type;
+            *info=pb->info;
+            return R_FOUND;
+        }
+        pb=pb->next;
+   }
    return R_NOTFOUND;
 }
 
+static result_t
+SearchInBTree(char* domain, unsigned char* control_type,unsigned long key1,unsigned long key2,const char** info)
+{
+   Result r;
+
+   SearchBTNode(__atomic_load_n(&(HashTable[key1].pb),__ATOMIC_ACQUIRE),key2,&r);
+   StatsValue(STAT_HIST_DEPTH,r.depth);
+   if(r.tag==0)
+       return R_NOTFOUND;
+   return MatchRecord(r.pt->brecord[r.i],domain,control_type,info);
+}
+
 int UpdateDomainName(void* collection,size_t size,unsigned char tag)
 {
+    uint64_t start=StatsNow();
+    int sum;
+
     if(tag==UPDATE_NORMAL)
-	return UpdateToBTree(collection,size);  //normal update
+	sum=UpdateToBTree(collection,size);  //normal update
     else if(tag==UPDATE_QUICK)
-	return UpdateToList(collection,size);   //fast update
+	sum=UpdateToList(collection,size);   //fast update
     else
 	return 0;
+    StatsValue(STAT_HIST_UPDATE,StatsNow()-start);
+    StatsCount(STAT_UPDATED,sum);
+    return sum;
+}
+
+int UpdateIPAddress(void* collection,size_t size)
+{
+    uint64_t start=StatsNow();
+    int sum=0;
+
+    UpdateNetRules(DATA_TYPE_IP,collection,size,&sum);
+    Reclaim();
+    StatsValue(STAT_HIST_UPDATE,StatsNow()-start);
+    StatsCount(STAT_UPDATED,sum);
+    return sum;
+}
+
+int UpdateURL(void* collection,size_t size)
+{
+    uint64_t start=StatsNow();
+    int sum=0;
+
+    UpdateNetRules(DATA_TYPE_URL,collection,size,&sum);
+    Reclaim();
+    StatsValue(STAT_HIST_UPDATE,StatsNow()-start);
+    StatsCount(STAT_UPDATED,sum);
+    return sum;
+}
+
+/*
+ * Apply one record to the writable copy of its bucket (or the B+ tree).
+ * The caller must hold RecordLock[rec->key1%LOCKNUM] (write). Return 1 if the record is counted.
+ */
+static int ApplyRecord(TempRecord* rec,result_t* result)
+{
+	struct HashNode* bucket;
+	char logString[256];
+
+	if(IndexEngine==ENGINE_BPLUS_TREE)
+	{
+		if(UpdateInBPTree(rec->value_domain,rec->control_type,rec->opcode_type,rec->key1,rec->key2,rec->info) == R_FAILED)
+		{
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ ApplyRecord @ UPDATE --- update %s failed.", rec->value_domain);
+			DBLogging(PROG_ERROR_LOG, logString);
+			*result = R_FAILED;
+		}
+		return 1;
+	}
+	if((bucket=WritableBucket(rec->key1))==NULL)
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ ApplyRecord @ UPDATE --- update %s failed.", rec->value_domain);
+		DBLogging(PROG_ERROR_LOG, logString);
+		*result = R_FAILED;
+		return 0;
+	}
+	if(rec->opcode_type==OPCODE_ADD)
+	{
+		if(AddDomainName(rec->value_domain,rec->control_type,bucket,rec->key1,rec->key2,rec->info) == R_FAILED)
+		{
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ ApplyRecord @ UPDATE --- add %s failed.", rec->value_domain);
+			DBLogging(PROG_ERROR_LOG, logString);
+			*result = R_FAILED;
+		}
+		return 1;
+	}
+	if(rec->opcode_type==OPCODE_DELETE)
+	{
+		if(DeleteDomainName(rec->value_domain,bucket,rec->key1,rec->key2) == R_FAILED)
+		{
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ ApplyRecord @ UPDATE --- delete %s failed.", rec->value_domain);
+			DBLogging(PROG_ERROR_LOG, logString);
+			*result = R_FAILED;
+		}
+		return 1;
+	}
+	memset(logString, 0, 256);
+	snprintf(logString,256,"[ERROR] dbDomain.c @ ApplyRecord @ UPDATE --- operate type error!");
+	DBLogging(PROG_ERROR_LOG, logString);
+	*result = R_FAILED;
+	return 0;
+}
+
+/*
+ * Apply the records of shard 'index' in the order they arrived, under one acquisition of its
+ * record lock (the readers do not take it), then publish the new trees of the shard.
+ */
+static int ApplyShard(int index,TempList list,int reversed,result_t* result)
+{
+	TempRecord** order=NULL,*cur;
+	int n=0,i,count=0;
+	char logString[256];
+
+	*result=R_SUCCESS;
+	if(list==NULL)
+		return 0;
+	if(reversed)
+	{	//the cache list is newest first, an add and a delete of one name must keep their order.
+		for(cur=list;cur!=NULL;cur=cur->next)
+			n++;
+		order=(TempRecord**)malloc(n*sizeof(TempRecord*));
+		if(order==NULL)
+		{
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ ApplyShard @ malloc --- no enough memory, shard %d is applied newest first!", index);
+			DBLogging(PROG_ERROR_LOG, logString);
+		}else{
+			for(cur=list,i=n;cur!=NULL;cur=cur->next)
+				order[--i]=cur;
+		}
+	}
+
+	pthread_rwlock_wrlock((RecordLock+index));
+	if(order!=NULL)
+	{
+		for(i=0;i<n;i++)
+			count+=ApplyRecord(order[i],result);
+	}else{
+		for(cur=list;cur!=NULL;cur=cur->next)
+			count+=ApplyRecord(cur,result);
+	}
+	PublishBuckets(index);
+	pthread_rwlock_unlock((RecordLock+index));
+
+	free(order);
+	return count;
+}
+
+/*
+ * Take the shards of the current job until none is left.
+ */
+static void TakeShards(void)
+{
+	int index;
+	struct timeval t1,t2;
+
+	while((index=__atomic_fetch_add(&(FlushPool.next),1,__ATOMIC_ACQ_REL))<LOCKNUM)
+	{
+		gettimeofday(&t1,NULL);
+		FlushPool.count[index]=ApplyShard(index,FlushPool.lists[index],FlushPool.reversed,FlushPool.result+index);
+		gettimeofday(&t2,NULL);
+		FlushPool.usec[index]=(t2.tv_sec-t1.tv_sec)*1000000+(t2.tv_usec-t1.tv_usec);
+
+		pthread_mutex_lock(&FlushLock);
+		if(++FlushPool.done==LOCKNUM)
+			pthread_cond_signal(&FlushDone);
+		pthread_mutex_unlock(&FlushLock);
+	}
+}
+
+static void* FlushWorker(void* arg)
+{
+	unsigned long round=0;
+
+	pthread_mutex_lock(&FlushLock);
+	while(1)
+	{
+		while(!FlushPool.stop && FlushPool.round==round)
+			pthread_cond_wait(&FlushWork,&FlushLock);
+		if(FlushPool.stop)
+			break;
+		round=FlushPool.round;
+		pthread_mutex_unlock(&FlushLock);
+		TakeShards();
+		pthread_mutex_lock(&FlushLock);
+	}
+	pthread_mutex_unlock(&FlushLock);
+	return arg;
+}
+
+static void StartFlushPool(void)
+{
+	char logString[256];
+	long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	int max=FLUSH_WORKERS;
+
+	if(cpus>0 && cpus-1<max)   //more threads than cores only wait for each other
+		max=(int)(cpus-1);
+	FlushPool.stop=0;
+	FlushPool.round=0;
+	FlushPool.next=LOCKNUM;
+	for(FlushPool.workers=0;FlushPool.workers<max;FlushPool.workers++)
+	{
+		if(pthread_create(FlushPool.thread+FlushPool.workers,NULL,FlushWorker,NULL)!=0)
+		{	//the caller applies the shards left.
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ StartFlushPool @ pthread_create --- %d of %d workers.", FlushPool.workers, FLUSH_WORKERS);
+			DBLogging(PROG_ERROR_LOG, logString);
+			break;
+		}
+	}
+}
+
+static void StopFlushPool(void)
+{
+	int i;
+
+	pthread_mutex_lock(&FlushLock);
+	FlushPool.stop=1;
+	pthread_cond_broadcast(&FlushWork);
+	pthread_mutex_unlock(&FlushLock);
+	for(i=0;i<FlushPool.workers;i++)
+		pthread_join(FlushPool.thread[i],NULL);
+	FlushPool.workers=0;
+}
+
+/*
+ * Apply the records of every shard on the worker pool, the caller works too and returns
+ * when all the shards are published. 'counts' and 'usec' (LOCKNUM items, may be NULL)
+ * receive the records and the time of each shard.
+ */
+static result_t ApplyShards(TempList* lists,int reversed,int* count,int* counts,unsigned long* usec)
+{
+	int index;
+	result_t result=R_SUCCESS;
+
+	pthread_mutex_lock(&FlushRun);
+	pthread_mutex_lock(&FlushLock);
+	FlushPool.lists=lists;
+	FlushPool.reversed=reversed;
+	FlushPool.done=0;
+	__atomic_store_n(&(FlushPool.next),0,__ATOMIC_RELEASE);
+	FlushPool.round++;
+	pthread_cond_broadcast(&FlushWork);
+	pthread_mutex_unlock(&FlushLock);
+
+	TakeShards();
+
+	pthread_mutex_lock(&FlushLock);
+	while(FlushPool.done<LOCKNUM)
+		pthread_cond_wait(&FlushDone,&FlushLock);
+	pthread_mutex_unlock(&FlushLock);
+
+	*count=0;
+	for(index=0;index<LOCKNUM;index++)
+	{
+		*count+=FlushPool.count[index];
+		if(FlushPool.result[index]==R_FAILED)
+			result=R_FAILED;
+	}
+	if(counts!=NULL)
+		memcpy(counts,FlushPool.count,sizeof(FlushPool.count));
+	if(usec!=NULL)
+		memcpy(usec,FlushPool.usec,sizeof(FlushPool.usec));
+	if(IndexEngine==ENGINE_BPLUS_TREE)
+		CommitBPTree();
+	pthread_mutex_unlock(&FlushRun);
+	return result;
 }
 
-static int UpdateToList(void* collection,size_t size)
-{
-    int index=0, count = 0;
+static int UpdateToList(void* collection,size_t size){
+    int index=0, count = 0, suffix = 0, grown = 0;
     size_t sum=0;
     void* start=collection;
     struct data_hdr *hdr;
     TempList groups[LOCKNUM];
     TempList ends[LOCKNUM];
+    unsigned int sizes[LOCKNUM];
+    struct Overlay* map;
+    TempRecord* cur,*prev,*next;
+    uint64_t hash;
     char logString[256];
     //get tokens from collection.
 
     memset(groups, 0, LOCKNUM*sizeof(TempList));
     memset(ends, 0, LOCKNUM*sizeof(TempList));
+    memset(sizes, 0, sizeof(sizes));
 
     while(sum<size)
     {
@@ -1198,33 +4181,77 @@ static int UpdateToList(void* collection,size_t size)
 	}else
 		pr->info=NULL;
 
-	UPPERTOLOWER(pr->value_domain);
-	pr->key1=(hashkey1(pr->value_domain))%MAXBUCKETS;
-	pr->key2=hashkey2(pr->value_domain);
+	hash=HashLower(pr->value_domain);
+	sum=sum + hdr->val_length + hdr->info_length + sizeof(*hdr);
+	count++;
+	if(hdr->wildcard)
+	{	//the suffix trie is updated at once, the rule does not wait in the cache.
+		if(UpdateSuffixRule(pr->value_domain,pr->control_type,pr->opcode_type,pr->info) == R_FAILED)
+		{
+			memset(logString, 0, 256);
+			snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateToList @ UPDATE --- suffix rule %s failed.", pr->value_domain);
+			DBLogging(PROG_ERROR_LOG, logString);
+		}
+		suffix++;
+		pr->next=NULL;
+		ReleaseList(pr);
+		continue;
+	}
+	pr->key1=HASH_KEY1(hash,MAXBUCKETS);
+	pr->key2=HASH_KEY2(hash);
 
+	//in the order they arrived, a later record of a name replaces it in the overlay.
+	pr->next=NULL;
 	if(groups[(pr->key1)%LOCKNUM]==NULL)
-		ends[(pr->key1)%LOCKNUM]=pr;
-        pr->next=groups[(pr->key1)%LOCKNUM];
-	groups[(pr->key1)%LOCKNUM]=pr;
-
-	count++;
-	sum=sum + hdr->val_length + hdr->info_length + sizeof(*hdr);
+		groups[(pr->key1)%LOCKNUM]=pr;
+	else
+		ends[(pr->key1)%LOCKNUM]->next=pr;
+	ends[(pr->key1)%LOCKNUM]=pr;
+	sizes[(pr->key1)%LOCKNUM]++;
     }
 
-    //get the lock,and update.
+    //get the lock,and update (the adds are counted in the filter until they are flushed).
     pthread_rwlock_wrlock(&CacheLock);
     for(index=0;index<LOCKNUM;++index)
     {
 	if(groups[index]==NULL)
 		continue;
-	(ends[index])->next=Cache[index].list;
-        Cache[index].list=groups[index];
+	map=Cache[index].map;
+	if(OverlayReserve(index,sizes[index])==R_FAILED)
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateToList @ OverlayReserve --- no enough memory, %u records lost!", sizes[index]);
+		DBLogging(PROG_ERROR_LOG, logString);
+		count-=sizes[index];
+		ReleaseList(groups[index]);
+		continue;
+	}
+	for(cur=groups[index];cur!=NULL;cur=cur->next)
+	{
+		if(cur->opcode_type==OPCODE_ADD)
+			FilterCount(cur->key1,cur->key2,1);
+		OverlayPut(Cache[index].map,cur);
+	}
+	grown|=(Cache[index].map!=map && map!=NULL);
+	//the list is newest first (AddListToBTree), the readers only use the overlay.
+	for(cur=groups[index],prev=Cache[index].list;cur!=NULL;cur=next)
+	{
+		next=cur->next;
+		cur->next=prev;
+		prev=cur;
+	}
+        __atomic_store_n(&(Cache[index].list),prev,__ATOMIC_RELEASE);
     }
     pthread_rwlock_unlock(&CacheLock);
+    ResultInvalidate();
+    //free the replaced suffix rules and overlays when no reader uses them.
+    if(suffix || grown)
+        Reclaim();
 
     return count;
 
 err_malloc:
+   ResultInvalidate();       //suffix rules may have changed
    memset(logString, 0, 256);
    snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateToList @ malloc --- no enough memory!");
    DBLogging(PROG_ERROR_LOG, logString);
@@ -1233,15 +4260,18 @@ err_malloc:
 
 static int UpdateToBTree(void* collection,size_t size)
 {
-    int index=0,count = 0;
+    int index=0,count = 0,applied = 0;
     size_t sum=0;
     void* start=collection;
     struct data_hdr *hdr;
     TempList groups[LOCKNUM];
+    TempList ends[LOCKNUM];
+    uint64_t hash;
     char logString[256];
 
     //get tokens from collection.
     memset(groups, 0, LOCKNUM*sizeof(TempList));
+    memset(ends, 0, LOCKNUM*sizeof(TempList));
     while(sum<size)
     {
 	TempRecord* pr=(TempRecord*)malloc(sizeof(TempRecord));
@@ -1272,77 +4302,49 @@ static int UpdateToBTree(void* collection,size_t size)
 	}else
 		pr->info=NULL;
 
-	UPPERTOLOWER(pr->value_domain);
-	pr->key1=(hashkey1(pr->value_domain))%MAXBUCKETS;
-	pr->key2=hashkey2(pr->value_domain);
-
-        pr->next=groups[(pr->key1)%LOCKNUM];
-	groups[(pr->key1)%LOCKNUM]=pr;
-
+	hash=HashLower(pr->value_domain);
 	sum=sum + hdr->val_length + hdr->info_length + sizeof(*hdr);
-    }
-
-    //get locks and update.
-    for(index=0;index<LOCKNUM;++index)
-    {
-    	if(groups[index]==NULL)
-		continue;
-	pthread_rwlock_wrlock((RecordLock+index));
-	TempRecord* pre,*cur;
-	pre=cur=groups[index];
-        while(cur!=NULL)
+	if(hdr->wildcard)
 	{
-        	cur=cur->next;
-		if(pre->opcode_type==OPCODE_ADD)
-		{
-			if(AddDomainName(pre->value_domain,pre->control_type,pre->key1,pre->key2,pre->info) == R_FAILED)
-			{
-				memset(logString, 0, 256);
-				snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateToBTree @ UPDATE --- add %s failed.", pre->value_domain);
-				DBLogging(PROG_ERROR_LOG, logString);
-			}
-			count++;
-		}else if(pre->opcode_type==OPCODE_DELETE)
+		if(UpdateSuffixRule(pr->value_domain,pr->control_type,pr->opcode_type,pr->info) == R_FAILED)
 		{
-			if(DeleteDomainName(pre->value_domain,pre->key1,pre->key2) == R_FAILED)
-			{
-				memset(logString, 0, 256);
-				snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateToBTree @ UPDATE --- delete %s failed.", pre->value_domain);
-				DBLogging(PROG_ERROR_LOG, logString);
-			}
-			count++;
-		}else{
 			memset(logString, 0, 256);
-			snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateToBTree @ UPDATE --- operate type error!");
+			snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateToBTree @ UPDATE --- suffix rule %s failed.", pr->value_domain);
 			DBLogging(PROG_ERROR_LOG, logString);
 		}
-
-		free(pre->value_domain);
-		if((pre->info)!=NULL)
-			free(pre->info);
-		free(pre);
-	        pre=cur;
+		count++;
+		pr->next=NULL;
+		ReleaseList(pr);
+		continue;
 	}
-	pthread_rwlock_unlock((RecordLock+index));
+	pr->key1=HASH_KEY1(hash,MAXBUCKETS);
+	pr->key2=HASH_KEY2(hash);
+
+	//keep the order of the records, a later record of a name wins.
+	pr->next=NULL;
+	if(groups[(pr->key1)%LOCKNUM]==NULL)
+		groups[(pr->key1)%LOCKNUM]=pr;
+	else
+		ends[(pr->key1)%LOCKNUM]->next=pr;
+	ends[(pr->key1)%LOCKNUM]=pr;
     }
+
+    //apply the shards in parallel, one lock acquisition per shard.
+    ApplyShards(groups,0,&applied,NULL,NULL);
+    count+=applied;
+    ResultInvalidate();
+    LogResultCache();
+    for(index=0;index<LOCKNUM;++index)
+	ReleaseList(groups[index]);
+    GrowFilter();
+    //free the old trees when no reader uses them.
+    Reclaim();
     return count;
 
 out_mem:
+   ResultInvalidate();       //suffix rules may have changed
    for(index=0;index<LOCKNUM;++index)
-    {  // free resource.
-    	if(groups[index]==NULL)
-		continue;
-	TempRecord* pre,*cur;
-	pre=cur=groups[index];
-        while(cur!=NULL)
-	{
-		free(pre->value_domain);
-		if((pre->info)!=NULL)
-			free(pre->info);
-		free(pre);
-	        pre=cur;
-	}
-   }
+	ReleaseList(groups[index]);   // free resource.
    memset(logString, 0, 256);
    snprintf(logString,256,"[ERROR] dbDomain.c @ UpdateToBTree @ malloc --- no enough memory!");
    DBLogging(PROG_ERROR_LOG, logString);
@@ -1351,119 +4353,600 @@ out_mem:
 
 result_t AddListToBTree(void)
 {
-    int index=0;
+    int index=0, count=0, len=0;
+    int counts[LOCKNUM];
+    unsigned long usec[LOCKNUM];
     result_t result = R_SUCCESS;
     TempList temp[LOCKNUM];
-    char logString[256];
+    struct Overlay* maps[LOCKNUM];
+    TempRecord* cur;
+    uint64_t start=StatsNow();
+    char logString[512];
 
-    //copy to temp
+    //copy to temp (templist first, so a reader always finds the records in one of them)
     pthread_rwlock_wrlock(&CacheLock);
     for(index=0;index<LOCKNUM;++index)
     {
-       Cache[index].templist=Cache[index].list;
-       Cache[index].list=NULL;
+       __atomic_store_n(&(Cache[index].templist),Cache[index].list,__ATOMIC_RELEASE);
+       __atomic_store_n(&(Cache[index].tempmap),Cache[index].map,__ATOMIC_RELEASE);
+       __atomic_store_n(&(Cache[index].list),NULL,__ATOMIC_RELEASE);
+       __atomic_store_n(&(Cache[index].map),NULL,__ATOMIC_RELEASE);
+       temp[index]=Cache[index].templist;
+       maps[index]=Cache[index].tempmap;
     }
     pthread_rwlock_unlock(&CacheLock);
 
-    //Add list to BTree.
-    for(index=0;index<LOCKNUM;++index)
+    //Add list to BTree, the shards in parallel (the cache lists are newest first).
+    result=ApplyShards(temp,1,&count,counts,usec);
+    if(count!=0)
     {
-        //first step: copy to temp list
-        temp[index]=Cache[index].templist;
-
-	//next step: add to Btree.
-    if(temp[index]==NULL)
-	{
-            continue;
-	}
-	TempRecord* cur;
-	cur=temp[index];
-        while(cur!=NULL)
-	{
-                pthread_rwlock_wrlock((RecordLock+index));
-		if(cur->opcode_type==OPCODE_ADD)
-		{
-                     if(AddDomainName(cur->value_domain,cur->control_type,cur->key1,cur->key2,cur->info) == R_FAILED)
-                     {
-				memset(logString, 0, 256);
-				snprintf(logString,256,"[ERROR] dbDomain.c @ AddListToBTree @ UPDATE --- add %s failed.", cur->value_domain);
-				DBLogging(PROG_ERROR_LOG, logString);
-				result = R_FAILED;
-                     }
-		}else if(cur->opcode_type==OPCODE_DELETE)
-		{
-               	     if(DeleteDomainName(cur->value_domain,cur->key1,cur->key2) == R_FAILED)
-                     {
-				memset(logString, 0, 256);
-				snprintf(logString,256,"[ERROR] dbDomain.c @ AddListToBTree @ UPDATE --- delete %s failed.", cur->value_domain);
-				DBLogging(PROG_ERROR_LOG, logString);
-				result = R_FAILED;
-                     }
-		}else{
-			memset(logString, 0, 256);
-			snprintf(logString,256,"[ERROR] dbDomain.c @ AddListToBTree @ UPDATE --- operate type error!");
-			DBLogging(PROG_ERROR_LOG, logString);
-			result = R_FAILED;
-                }
-                pthread_rwlock_unlock((RecordLock+index));
-
-                cur=cur->next;
-	}
+	len=snprintf(logString,512,"Type: DOMAIN.  Flush: %d records.  Shards (records/us):", count);
+	for(index=0;index<LOCKNUM && len<512;++index)
+	    len+=snprintf(logString+len,512-len," %d/%lu", counts[index], usec[index]);
+	DBLogging(PROG_UPDATE_LOG, logString);
     }
+    //the flushed records are answered by the index from now on
+    ResultInvalidate();
+    LogResultCache();
 
-    //flush list.
+    //flush list, the adds are counted by the trees now.
     pthread_rwlock_wrlock(&CacheLock);
     for(index=0;index<LOCKNUM;++index)
     {
-       Cache[index].templist=NULL;
+       __atomic_store_n(&(Cache[index].tempmap),NULL,__ATOMIC_RELEASE);
+       __atomic_store_n(&(Cache[index].templist),NULL,__ATOMIC_RELEASE);
+       for(cur=temp[index];cur!=NULL;cur=cur->next)
+       {
+          if(cur->opcode_type==OPCODE_ADD)
+             FilterCount(cur->key1,cur->key2,-1);
+       }
     }
     pthread_rwlock_unlock(&CacheLock);
 
-    //free temp list.
+    //free temp list and old trees, when no reader uses them.
     for(index=0;index<LOCKNUM;++index)
     {
+        if(maps[index]!=NULL)
+            Retire(maps[index],free);
         if(temp[index]==NULL)
 	{
             continue;
 	}
-        TempRecord* pre,*cur;
-	pre=cur=temp[index];
-        while(cur!=NULL)
-	{
-        	cur=cur->next;
-		free(pre->value_domain);
-		if((pre->info)!=NULL)
-                    free(pre->info);
-		free(pre);
-	        pre=cur;
-	}
+        Retire(temp[index],ReleaseList);
     }
-    return result;;
+    GrowFilter();
+    Reclaim();
+    StatsValue(STAT_HIST_FLUSH,StatsNow()-start);
+    return result;
 }
 
 result_t
 SaveToFile(void* collection,size_t size)
 {
-        int fin;
-	size_t sz=0;
+	return LogAppend(DATA_TYPE_DOMAIN,collection,size);
+}
 
-	fin=open(DOMAIN_DATA_PATH,O_WRONLY|O_CREAT|O_APPEND,666);
-	sz=write(fin,collection,size);
-	close(fin);
+result_t
+SaveDataToFile(unsigned char data_type,void* collection,size_t size)
+{
+	return LogAppend(data_type,collection,size);
+}
+
+result_t
+SetLogPolicy(unsigned char sync,unsigned int interval_ms)
+{
+	if(sync!=LOG_SYNC_NONE && sync!=LOG_SYNC_INTERVAL && sync!=LOG_SYNC_ALWAYS)
+		return R_FAILED;
+	LogSetPolicy(sync,interval_ms);
+	return R_SUCCESS;
+}
+
+/*
+ * Fold the log into a new image when the log after the image is larger than the image,
+ * so the replay at the start is bounded by the size of the data, not by its history.
+ */
+static void* CompactLog(void* arg)
+{
+   struct timespec ts;
+   uint64_t limit;
+   int i,dirty;
+
+   pthread_mutex_lock(&CompactLock);
+   while(!CompactorStop)
+   {
+      clock_gettime(CLOCK_REALTIME,&ts);
+      ts.tv_sec+=COMPACT_INTERVAL;
+      pthread_cond_timedwait(&CompactCond,&CompactLock,&ts);
+      if(CompactorStop)
+         break;
+      limit=__atomic_load_n(&SnapBytes,__ATOMIC_RELAXED);
+      if(limit<COMPACT_MIN_LOG)
+         limit=COMPACT_MIN_LOG;
+      if(LogWritten()-__atomic_load_n(&SnapLogMark,__ATOMIC_RELAXED)<limit)
+         continue;
+      //a quick update is waiting for AddListToBTree(), try at the next round.
+      for(i=0,dirty=0;i<LOCKNUM;i++)
+      {
+         if(__atomic_load_n(&(Cache[i].list),__ATOMIC_ACQUIRE) || __atomic_load_n(&(Cache[i].templist),__ATOMIC_ACQUIRE))
+            dirty=1;
+      }
+      if(dirty)
+         continue;
+      pthread_mutex_unlock(&CompactLock);
+      SaveSnapshot();
+      pthread_mutex_lock(&CompactLock);
+   }
+   pthread_mutex_unlock(&CompactLock);
+   return arg;
+}
+
+static void StartCompactor(void)
+{
+   char logString[256];
+
+   CompactorStop=0;
+   if(pthread_create(&Compactor,NULL,CompactLog,NULL)==0)
+   {
+      CompactorRunning=1;
+      return;
+   }
+   memset(logString, 0, 256);
+   snprintf(logString,256,"[ERROR] dbDomain.c @ StartCompactor @ pthread_create --- the log is not compacted.");
+   DBLogging(PROG_ERROR_LOG, logString);
+}
+
+static void StopCompactor(void)
+{
+   if(!CompactorRunning)
+      return;
+   pthread_mutex_lock(&CompactLock);
+   CompactorStop=1;
+   pthread_cond_signal(&CompactCond);
+   pthread_mutex_unlock(&CompactLock);
+   pthread_join(Compactor,NULL);
+   CompactorRunning=0;
+}
+
+/*
+ * Buffered writer of one region of the snapshot file.
+ */
+struct SnapWriter
+{
+  int fd;
+  uint64_t off;           // 下一次写入的文件偏移
+  size_t len;
+  char buf[65536];
+};
+
+#define INTERN_SIZE 4096
+/*
+ * Context of SaveSnapshot, the info strings (redirect IP) are interned.
+ */
+struct SnapContext
+{
+  struct SnapWriter* keys;
+  struct SnapWriter* records;
+  struct SnapWriter* strings;
+  uint64_t string_off;
+  uint64_t count;
+  char* intern[INTERN_SIZE];
+  uint32_t internoff[INTERN_SIZE];
+  // B+ tree engine: records of the current bucket, sorted by key2 before they are written
+  struct snap_bucket* buckets;
+  unsigned long bucket;
+  struct SnapPending* pending;
+  size_t npending,maxpending;
+  uint64_t rules;         // IP and URL rules written
+};
+
+struct SnapPending
+{
+  unsigned long key2;
+  BRecordList br;
+};
 
-	return sz == size ? R_SUCCESS : R_FAILED;
+static result_t SnapFlush(struct SnapWriter* w)
+{
+   size_t done=0;
+   ssize_t sz;
+   while(done<w->len)
+   {
+      sz=pwrite(w->fd,w->buf+done,w->len-done,w->off+done);
+      if(sz<=0)
+         return R_FAILED;
+      done+=sz;
+   }
+   w->off+=w->len;
+   w->len=0;
+   return R_SUCCESS;
+}
+
+static result_t SnapWrite(struct SnapWriter* w,const void* data,size_t size)
+{
+   size_t n;
+   while(size>0)
+   {
+      if(w->len==sizeof(w->buf) && SnapFlush(w)==R_FAILED)
+         return R_FAILED;
+      n=sizeof(w->buf)-w->len;
+      if(n>size)
+         n=size;
+      memcpy(w->buf+w->len,data,n);
+      w->len+=n;
+      data=(const char*)data+n;
+      size-=n;
+   }
+   return R_SUCCESS;
+}
+
+/*
+ * Append a string to the string heap, return its offset (0 if failed).
+ */
+static uint32_t SnapString(struct SnapContext* ctx,const char* str)
+{
+   uint64_t off=ctx->strings->off+ctx->strings->len-ctx->string_off;
+   if(off+strlen(str)+1 > UINT32_MAX)
+      return 0;
+   if(SnapWrite(ctx->strings,str,strlen(str)+1)==R_FAILED)
+      return 0;
+   return (uint32_t)off;
+}
+
+static uint32_t SnapInfo(struct SnapContext* ctx,const char* info)
+{
+   unsigned long h=HashName(info)%INTERN_SIZE,n;
+   for(n=0;n<INTERN_SIZE && ctx->intern[h]!=NULL;n++,h=(h+1)%INTERN_SIZE)
+   {
+      if(strcmp(ctx->intern[h],info)==0)
+         return ctx->internoff[h];
+   }
+   if(n==INTERN_SIZE)         //table is full, do not intern it.
+      return SnapString(ctx,info);
+   ctx->internoff[h]=SnapString(ctx,info);
+   if(ctx->internoff[h]!=0)
+      ctx->intern[h]=strdup(info);
+   return ctx->internoff[h];
+}
+
+static result_t SnapRecord(struct SnapContext* ctx,uint64_t key,const char* domain,const char* info,unsigned char control_type)
+{
+   struct snap_record rec;
+   memset(&rec, 0, sizeof(rec));
+   rec.control_type=control_type;
+   rec.domain=SnapString(ctx,domain);
+   if(rec.domain==0)
+      return R_FAILED;
+   if(info!=NULL && (rec.info=SnapInfo(ctx,info))==0)
+      return R_FAILED;
+   if(SnapWrite(ctx->keys,&key,sizeof(key))==R_FAILED || SnapWrite(ctx->records,&rec,sizeof(rec))==R_FAILED)
+      return R_FAILED;
+   ctx->count++;
+   return R_SUCCESS;
+}
+
+/*
+ * Write the records of a B-tree in key order.
+ */
+static result_t SnapTree(struct SnapContext* ctx,BTree bt)
+{
+   int i;
+   BRecordList br;
+   if(bt==NULL)
+      return R_SUCCESS;
+   for(i=0;i<=bt->keynum;i++)
+   {
+      if(SnapTree(ctx,bt->ptr[i])==R_FAILED)
+         return R_FAILED;
+      if(i==bt->keynum)
+         break;
+      for(br=bt->brecord[i+1];br!=NULL;br=br->next)
+      {
+         if(SnapRecord(ctx,bt->key[i+1],br->value_domain,br->info,br->control_type)==R_FAILED)
+            return R_FAILED;
+      }
+   }
+   return R_SUCCESS;
+}
+
+static int ComparePending(const void* a,const void* b)
+{
+   unsigned long x=((const struct SnapPending*)a)->key2,y=((const struct SnapPending*)b)->key2;
+   return x<y ? -1 : (x>y);
+}
+
+/*
+ * Write the pending records of one bucket (B+ tree engine).
+ * The tree only keeps the low 32 bits of key2, so the full key2 is hashed again and sorted.
+ */
+static result_t SnapPendingFlush(struct SnapContext* ctx)
+{
+   size_t i;
+   if(ctx->npending==0)
+      return R_SUCCESS;
+   qsort(ctx->pending,ctx->npending,sizeof(struct SnapPending),ComparePending);
+   ctx->buckets[ctx->bucket].first=ctx->count;
+   for(i=0;i<ctx->npending;i++)
+   {
+      if(SnapRecord(ctx,ctx->pending[i].key2,ctx->pending[i].br->value_domain,ctx->pending[i].br->info,
+                    ctx->pending[i].br->control_type)==R_FAILED)
+         return R_FAILED;
+   }
+   ctx->buckets[ctx->bucket].members=ctx->npending;
+   ctx->npending=0;
+   return R_SUCCESS;
+}
+
+static result_t SnapTreeKey(uint64_t key,void* value,void* arg)
+{
+   struct SnapContext* ctx=(struct SnapContext*)arg;
+   struct SnapPending* p;
+   BRecordList br;
+
+   if((key>>32)!=ctx->bucket)
+   {  //the keys are in bucket order, the last bucket is done.
+      if(SnapPendingFlush(ctx)==R_FAILED)
+         return R_FAILED;
+      ctx->bucket=key>>32;
+   }
+   for(br=(BRecordList)value;br!=NULL;br=br->next)
+   {
+      if(ctx->npending==ctx->maxpending)
+      {
+         p=(struct SnapPending*)realloc(ctx->pending,(ctx->maxpending*2+64)*sizeof(struct SnapPending));
+         if(p==NULL)
+            return R_FAILED;
+         ctx->pending=p;
+         ctx->maxpending=ctx->maxpending*2+64;
+      }
+      ctx->pending[ctx->npending].key2=HASH_KEY2(HashName(br->value_domain));
+      ctx->pending[ctx->npending++].br=br;
+   }
+   return R_SUCCESS;
+}
+
+/*
+ * Write one suffix rule.
+ */
+static result_t SnapSuffixRule(const char* name,void* value,void* arg)
+{
+   struct SnapContext* ctx=(struct SnapContext*)arg;
+   const struct SuffixRule* rule=(const struct SuffixRule*)value;
+   struct snap_record rec;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.control_type=rule->control_type;
+   rec.domain=SnapString(ctx,name);
+   if(rec.domain==0)
+      return R_FAILED;
+   if(rule->info!=NULL && (rec.info=SnapInfo(ctx,rule->info))==0)
+      return R_FAILED;
+   if(SnapWrite(ctx->records,&rec,sizeof(rec))==R_FAILED)
+      return R_FAILED;
+   ctx->rules++;
+   return R_SUCCESS;
+}
+
+/*
+ * Write one IP or URL rule (its text).
+ */
+static result_t SnapNetRecord(struct SnapContext* ctx,const BlackRecord* br)
+{
+   struct snap_record rec;
+   memset(&rec, 0, sizeof(rec));
+   rec.control_type=br->control_type;
+   rec.domain=SnapString(ctx,br->value_domain);
+   if(rec.domain==0)
+      return R_FAILED;
+   if(br->info!=NULL && (rec.info=SnapInfo(ctx,br->info))==0)
+      return R_FAILED;
+   if(SnapWrite(ctx->records,&rec,sizeof(rec))==R_FAILED)
+      return R_FAILED;
+   ctx->rules++;
+   return R_SUCCESS;
+}
+
+static result_t SnapIPRule(ipkey_t prefix,unsigned int len,void* value,void* arg)
+{
+   (void)prefix;           //the text of the record has them
+   (void)len;
+   return SnapNetRecord((struct SnapContext*)arg,(const BlackRecord*)value);
+}
+
+static result_t SnapURLRule(void* value,void* arg)
+{
+   return SnapNetRecord((struct SnapContext*)arg,(const BlackRecord*)value);
+}
+
+result_t SaveSnapshot(void)
+{
+   int fd=-1,i,locked=0;
+   unsigned long key1;
+   uint32_t j,end;
+   uint64_t records=0,mark;
+   struct snap_hdr hdr;
+   struct snap_bucket* buckets=NULL;
+   struct SnapContext ctx;
+   const struct snap_record* rec;
+   char logString[256];
+   char tmpPath[256];
+
+   memset(&ctx, 0, sizeof(ctx));
+   memset(logString, 0, 256);
+   snprintf(tmpPath,256,"%s.tmp",DOMAIN_SNAP_PATH);
+
+   //stop the writers, the image must match the size of domain.db
+   pthread_rwlock_wrlock(&CacheLock);
+   for(i=0;i<LOCKNUM;i++)
+      pthread_rwlock_wrlock((RecordLock+i));
+   pthread_mutex_lock(&TreeLock);
+   pthread_mutex_lock(&SuffixLock);
+   pthread_mutex_lock(&NetLock);
+   locked=1;
+   for(i=0;i<LOCKNUM;i++)
+   {
+      if(Cache[i].list!=NULL || Cache[i].templist!=NULL)
+      {
+         snprintf(logString,256,"[ERROR] dbDomain.c @ SaveSnapshot @ Cache --- quick update is not flushed.");
+         goto err_out;
+      }
+   }
+   memset(&hdr, 0, sizeof(hdr));
+   //the image holds the log before the new segment, the frames in it are replayed at the start.
+   if(LogRoll(&hdr.log_seq,&hdr.log_off)==R_FAILED)
+   {
+      snprintf(logString,256,"[ERROR] dbDomain.c @ SaveSnapshot @ LogRoll --- the log is not open.");
+      goto err_out;
+   }
+   mark=LogWritten();
+   records=CountRecords();
+
+   buckets=(struct snap_bucket*)calloc(MAXBUCKETS, sizeof(struct snap_bucket));
+   ctx.keys=(struct SnapWriter*)malloc(sizeof(struct SnapWriter));
+   ctx.records=(struct SnapWriter*)malloc(sizeof(struct SnapWriter));
+   ctx.strings=(struct SnapWriter*)malloc(sizeof(struct SnapWriter));
+   if(buckets==NULL || ctx.keys==NULL || ctx.records==NULL || ctx.strings==NULL)
+   {
+      snprintf(logString,256,"[ERROR] dbDomain.c @ SaveSnapshot @ malloc --- no enough memory!");
+      goto err_out;
+   }
+   fd=open(tmpPath,O_WRONLY|O_CREAT|O_TRUNC,0644);
+   if(fd==-1)
+   {
+      snprintf(logString,256,"[ERROR] dbDomain.c @ SaveSnapshot @ open --- %s", strerror(errno));
+      goto err_out;
+   }
+
+   memcpy(hdr.magic,SNAPSHOT_MAGIC,sizeof(hdr.magic));
+   hdr.version=SNAPSHOT_VERSION;
+   hdr.buckets=MAXBUCKETS;
+   hdr.records=records;
+   hdr.bucket_off=sizeof(hdr);
+   hdr.key_off=hdr.bucket_off+MAXBUCKETS*sizeof(struct snap_bucket);
+   hdr.record_off=hdr.key_off+records*sizeof(uint64_t);
+   hdr.suffix_off=hdr.record_off+records*sizeof(struct snap_record);
+   hdr.suffixes=Suffixes.nrules;
+   hdr.ip_off=hdr.suffix_off+hdr.suffixes*sizeof(struct snap_record);
+   hdr.ips=IPTable[0].nrules+IPTable[1].nrules;
+   hdr.url_off=hdr.ip_off+hdr.ips*sizeof(struct snap_record);
+   hdr.urls=URLIndex.nrules;
+   hdr.string_off=hdr.url_off+hdr.urls*sizeof(struct snap_record);
+   ctx.keys->fd=ctx.records->fd=ctx.strings->fd=fd;
+   ctx.keys->len=ctx.records->len=ctx.strings->len=0;
+   ctx.keys->off=hdr.key_off;
+   ctx.records->off=hdr.record_off;
+   ctx.strings->off=ctx.string_off=hdr.string_off;
+   if(SnapWrite(ctx.strings,"",1)==R_FAILED)       //offset 0 means no string
+      goto err_write;
+
+   if(IndexEngine==ENGINE_BPLUS_TREE)
+   {
+      ctx.buckets=buckets;
+      if(BPTreeWalk(&GlobalTree,SnapTreeKey,&ctx)==R_FAILED || SnapPendingFlush(&ctx)==R_FAILED)
+         goto err_write;
+      for(key1=0;key1<MAXBUCKETS;key1++)
+      {  //empty buckets start where the last bucket ends
+         if(buckets[key1].members==0)
+            buckets[key1].first=(key1==0) ? 0 : buckets[key1-1].first+buckets[key1-1].members;
+      }
+   }
+   for(key1=0;key1<MAXBUCKETS && IndexEngine!=ENGINE_BPLUS_TREE;key1++)
+   {
+      buckets[key1].first=ctx.count;
+      if(HashTable[key1].members==0)
+         continue;
+      if(HashTable[key1].frozen)
+      {
+         end=Image.buckets[key1].first+Image.buckets[key1].members;
+         for(j=Image.buckets[key1].first;j<end;j++)
+         {
+            rec=Image.records+j;
+            if(SnapRecord(&ctx,Image.keys[j],Image.strings+rec->domain,
+                          rec->info!=0 ? Image.strings+rec->info : NULL,rec->control_type)==R_FAILED)
+               goto err_write;
+         }
+      }else if(SnapTree(&ctx,HashTable[key1].pb)==R_FAILED)
+         goto err_write;
+      buckets[key1].members=ctx.count-buckets[key1].first;
+   }
+   //the suffix rules follow the records
+   if(SuffixTrieWalk(&Suffixes,SnapSuffixRule,&ctx)==R_FAILED || ctx.rules!=hdr.suffixes)
+      goto err_write;
+   //then the IP and URL rules
+   if(IPTrieWalk(&IPTable[0],SnapIPRule,&ctx)==R_FAILED || IPTrieWalk(&IPTable[1],SnapIPRule,&ctx)==R_FAILED
+      || ctx.rules!=hdr.suffixes+hdr.ips)
+      goto err_write;
+   if(URLTableWalk(&URLIndex,SnapURLRule,&ctx)==R_FAILED || ctx.rules!=hdr.suffixes+hdr.ips+hdr.urls)
+      goto err_write;
+   if(SnapFlush(ctx.keys)==R_FAILED || SnapFlush(ctx.records)==R_FAILED || SnapFlush(ctx.strings)==R_FAILED)
+      goto err_write;
+   hdr.string_size=ctx.strings->off-hdr.string_off;
+   if(ctx.count!=records
+      || pwrite(fd,buckets,MAXBUCKETS*sizeof(struct snap_bucket),hdr.bucket_off)!=MAXBUCKETS*sizeof(struct snap_bucket)
+      || pwrite(fd,&hdr,sizeof(hdr),0)!=sizeof(hdr) || fsync(fd)!=0)
+      goto err_write;
+   close(fd);
+   fd=-1;
+   //replace the old image atomically, processes which mapped it keep their pages.
+   if(rename(tmpPath,DOMAIN_SNAP_PATH)!=0)
+   {
+      snprintf(logString,256,"[ERROR] dbDomain.c @ SaveSnapshot @ rename --- %s", strerror(errno));
+      goto err_out;
+   }
+   *strrchr(tmpPath,'/')='\0';
+   LogSyncDir(tmpPath);
+   //the segments before the image are not needed any more.
+   LogPurge(hdr.log_seq);
+   __atomic_store_n(&SnapBytes,hdr.string_off+hdr.string_size,__ATOMIC_RELAXED);
+   __atomic_store_n(&SnapLogMark,mark,__ATOMIC_RELAXED);
+   //the writers are stopped, a good time to fit the filter to the datebase.
+   ResizeFilter(records);
+
+   pthread_mutex_unlock(&NetLock);
+   pthread_mutex_unlock(&SuffixLock);
+   pthread_mutex_unlock(&TreeLock);
+   for(i=0;i<LOCKNUM;i++)
+      pthread_rwlock_unlock((RecordLock+i));
+   pthread_rwlock_unlock(&CacheLock);
+   for(i=0;i<INTERN_SIZE;i++)
+      free(ctx.intern[i]);
+   free(ctx.pending);
+   free(ctx.keys);
+   free(ctx.records);
+   free(ctx.strings);
+   free(buckets);
+   Reclaim();
+   return R_SUCCESS;
+
+err_write:
+   snprintf(logString,256,"[ERROR] dbDomain.c @ SaveSnapshot @ write --- %s", errno ? strerror(errno) : "image is too large");
+err_out:
+   if(locked)
+   {
+      pthread_mutex_unlock(&NetLock);
+      pthread_mutex_unlock(&SuffixLock);
+      pthread_mutex_unlock(&TreeLock);
+      for(i=0;i<LOCKNUM;i++)
+         pthread_rwlock_unlock((RecordLock+i));
+      pthread_rwlock_unlock(&CacheLock);
+   }
+   if(fd!=-1)
+   {
+      close(fd);
+      unlink(tmpPath);
+   }
+   for(i=0;i<INTERN_SIZE;i++)
+      free(ctx.intern[i]);
+   free(ctx.pending);
+   free(ctx.keys);
+   free(ctx.records);
+   free(ctx.strings);
+   free(buckets);
+   DBLogging(PROG_ERROR_LOG, logString);
+   return R_FAILED;
 }
 
 static void
 DBLogging(const char *filePath, const char *logString )
 {
-	char timeLog[32];
-	FILE *LogFile;
-	time_t now = time(NULL);
-	strftime(timeLog,sizeof(timeLog),"%d/%b/%Y:%H:%M:%S %Z",localtime(&now));
-
-	if((LogFile = fopen(filePath,"a+")) == NULL) { perror("fopen");  return; }
-	fprintf(LogFile,"[%s]  ",timeLog);
-	fprintf(LogFile,"%s\n",logString);
-	fclose(LogFile);
+	LoggerWrite(filePath,logString);      //queued, written by the thread of dbLogger.c
 }
@@ -2,19 +2,33 @@
 #define DBDOMAIN_H_INCLUDED
 
 #include <sys/types.h>
+#include <stdint.h>
 #include "dbUtility.h"
 
 result_t InitializeSearchTree(void);
 /*
  * Usage: Read record from file (file in FILEPATH),and initial the blacklist datebase.
+ *        The searches and updates are counted in the statistics page (dbStats.h), ./dbTop reads it.
  * Inout:   @param  void
  * Output:  @return result_t
  *                  ------ R_SUCCESS, initial success
  *                  ------ R_FAILED,  initial failed
  */
+result_t InitializeSearchEngine(unsigned char engine);
+/*
+ * Usage: Same as InitializeSearchTree(), and select the index engine.
+ *        ENGINE_HASH_BTREE: Hash table of small B-trees (the default of InitializeSearchTree).
+ *        ENGINE_BPLUS_TREE: one B+ tree keyed on a 64-bit hash, the keys of a node fill one cache line.
+ * Inout:   @param  unsigned char engine ----- ENGINE_HASH_BTREE or ENGINE_BPLUS_TREE
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, initial success
+ *                  ------ R_FAILED,  initial failed
+ */
 result_t DestroySearchTree(void);
 /*
  * Usage: Destroy the blacklist datebase, and free the resources(memory and locks).
+ *        The nodes and records are in slab arenas (one per shard), they are freed at once.
+ *        It returns after the queued lines of the logs (dbLogger.h) are written.
  * Inout:   @param  void
  * Output:  @return result_t
  *                  ------ R_SUCCESS, free resource success
@@ -23,6 +37,11 @@ result_t DestroySearchTree(void);
 result_t SearchDomainName(char* domain, unsigned char* control_type,char** info);
 /*
  * Usage: For search domain name in the blacklist datebase.
+ *        It takes no lock, updates are published by copy-on-write (epoch based reclamation).
+ *        A counting Bloom filter of the records answers most misses with one cache line.
+ *        Every thread keeps the recent results (found or not) of the hot names, an update
+ *        makes them old at once.
+ *        A name without its own record gets the longest suffix rule which covers it.
  * Input: @param  char* domain ----- domain name
  *        @param  unsigned char* control_type ----- store the return value (control type)
  *        @param  char** info ----- save the additional information of record (redirect IP)
@@ -30,18 +49,108 @@ result_t SearchDomainName(char* domain, unsigned char* control_type,char** info)
  *                ----- R_FOUND,found the name.
  *                ----- R_NOTFOUND, not found.
  */
+result_t SearchDomainNameBuffer(char* domain, unsigned char* control_type,char* info,size_t size);
+/*
+ * Usage: Same as SearchDomainName(), but the information of the record is copied into the
+ *        caller's buffer, so the search allocates no memory.
+ * Input: @param  char* domain ----- domain name
+ *        @param  unsigned char* control_type ----- store the return value (control type)
+ *        @param  char* info ----- buffer of the additional information (redirect IP), "" if none
+ *        @param  size_t size ----- size of 'info', INFO_MAX_SIZE always holds the whole information
+ * Output: @return result_t
+ *                ----- R_FOUND,found the name.
+ *                ----- R_NOTFOUND, not found.
+ */
+size_t SearchDomainNameBatch(char** domains,size_t n,unsigned char* control_types,char** infos,result_t* results);
+/*
+ * Usage: Search a batch of domain names, the B-tree walks of the batch are interleaved and
+ *        prefetched, so the cache misses of different names overlap.
+ * Input: @param  char** domains ----- domain names
+ *        @param  size_t n ----- count of domain names
+ *        @param  unsigned char* control_types ----- store the control type of each name (n items)
+ *        @param  char** infos ----- save the additional information of each name (n items, free it)
+ *        @param  result_t* results ----- save the result of each name (n items), R_FOUND or R_NOTFOUND
+ * Output: @return size_t
+ *                ----- count of names which are found
+ */
+result_t SearchIPAddress(char* ip, unsigned char* control_type,char* info,size_t size);
+/*
+ * Usage: Search the longest prefix rule (CIDR) of an IPv4 or IPv6 address, in a poptrie
+ *        (dbIPTrie.h): a /32 of IPv4 is found in 5 memory accesses. It takes no lock.
+ * Input: @param  char* ip ----- "192.168.1.1" or "2001:db8::1"
+ *        @param  unsigned char* control_type ----- store the return value (control type)
+ *        @param  char* info ----- buffer of the additional information, "" if none
+ *        @param  size_t size ----- size of 'info'
+ * Output: @return result_t
+ *                ----- R_FOUND, a prefix covers the address.
+ *                ----- R_NOTFOUND, not found (or not an address).
+ */
+result_t SearchIPv4Address(uint32_t ip, unsigned char* control_type,char* info,size_t size);
+/*
+ * Usage: Same as SearchIPAddress(), the IPv4 address is a number in host byte order
+ *        (0xC0A80101 is 192.168.1.1), so nothing is parsed.
+ */
+size_t SearchIPv4Batch(const uint32_t* ips,size_t n,unsigned char* control_types,result_t* results);
+/*
+ * Usage: Search a batch of IPv4 addresses (numbers in host byte order), the trie walks of the
+ *        batch are interleaved and prefetched in one read section, so the cache misses of
+ *        different addresses overlap. The infos are not copied (SearchIPv4Address() does).
+ * Input: @param  const uint32_t* ips ----- addresses
+ *        @param  size_t n ----- count of addresses
+ *        @param  unsigned char* control_types ----- store the control type of each address (n items)
+ *        @param  result_t* results ----- save the result of each address (n items), R_FOUND or R_NOTFOUND
+ * Output: @return size_t
+ *                ----- count of addresses which are found
+ */
+result_t SearchURL(char* url, unsigned char* control_type,char* info,size_t size);
+/*
+ * Usage: Search the rule of the longest path prefix of a URL. The URL is normalized first: the
+ *        scheme, user, port, query and fragment are dropped and the host is in lower case, so
+ *        "http://WWW.Example.com:8080/a/b.html?x=1" is "www.example.com/a/b.html". The rule
+ *        "www.example.com/a" covers it (a path covers what is under it), so does the rule
+ *        "www.example.com" (the whole host), not "www.example.com/a/b" nor "example.com".
+ *        The hosts of the rules are in a filter, most misses stop there. It takes no lock.
+ * Input: @param  char* url ----- the URL, with or without scheme
+ *        @param  unsigned char* control_type ----- store the return value (control type)
+ *        @param  char* info ----- buffer of the additional information, "" if none
+ *        @param  size_t size ----- size of 'info'
+ * Output: @return result_t
+ *                ----- R_FOUND, found a rule.
+ *                ----- R_NOTFOUND, not found.
+ */
 int UpdateDomainName(void* collection,size_t size,unsigned char tag);
 /*
  * Usage: For update data(add,delete or renew) to blacklist datebase.
  * Input: @param  void* collection ----- record set (exclude set-header)
  * 	  @param  size_t size  ----- data size of records (bytes)
  *        @param  unsigned char tag ----- operation type(normal or fast)
+ *        The records of a quick update are found at once through a hash overlay of the cache,
+ *        until AddListToBTree() moves them into the index.
+ *        A record with the wildcard bit is a suffix rule ("example.com" or "*.example.com"),
+ *        it matches the domain and all its subdomains, and takes effect at once in both ways.
+ * Output: @return int
+ *                 ------ count of records which update success
+ */
+int UpdateIPAddress(void* collection,size_t size);
+/*
+ * Usage: Add or delete IP rules (DATA_TYPE_IP), the value of a record is "address" or
+ *        "address/len" (IPv4 or IPv6). They take effect at once, there is no quick way.
+ *        A bad rule is logged and skipped.
+ * Input: @param  void* collection ----- record set (exclude set-header)
+ * 	  @param  size_t size  ----- data size of records (bytes)
  * Output: @return int
  *                 ------ count of records which update success
  */
+int UpdateURL(void* collection,size_t size);
+/*
+ * Usage: Same as UpdateIPAddress(), for the URL rules (DATA_TYPE_URL), the value of a record
+ *        is a host or a host and a path (see SearchURL()).
+ */
 result_t AddListToBTree(void);
 /*
- * Usage: flush Cache, and add records to BTee.
+ * Usage: flush Cache, and add records to BTee. The shards are applied in parallel by a small
+ *        worker pool, each under one acquisition of its lock, the records in the order they
+ *        arrived. The records and time of each shard are written to the update log.
  * Inout:   @param  void
  * Output:  @return result_t
  *                  ------ R_SUCCESS, operste success
@@ -49,14 +158,42 @@ result_t AddListToBTree(void);
  */
 result_t SaveToFile(void* collection,size_t size);
 /*
- * Usage: Write the update data to file.
+ * Usage: Write the update data to the write-ahead log (DOMAIN_LOG_DIR), one CRC protected
+ *        frame per call. InitializeSearchTree() opens the log, and replays the part of it
+ *        which is newer than the snapshot image.
  * Input: @param  void* collection ----- record set (exclude set-header)
  * 	  @param  size_t size  ----- data size of records (bytes)
  * Output: @return result_t
- *                 ------ R_SUCCESS, save success
+ *                 ------ R_SUCCESS, save success (on disk if the policy is LOG_SYNC_ALWAYS)
  *                 ------ R_FAILED, save failed
  */
-
-
+result_t SaveDataToFile(unsigned char data_type,void* collection,size_t size);
+/*
+ * Usage: Same as SaveToFile() (which writes DATA_TYPE_DOMAIN), for a record set of any type.
+ *        The frames are replayed into the engine of their type.
+ * Input: @param  unsigned char data_type ----- DATA_TYPE_DOMAIN, DATA_TYPE_IP or DATA_TYPE_URL
+ */
+result_t SetLogPolicy(unsigned char sync,unsigned int interval_ms);
+/*
+ * Usage: Select when the log is flushed to disk.
+ *        LOG_SYNC_NONE:     the OS writes the pages back.
+ *        LOG_SYNC_INTERVAL: fdatasync every 'interval_ms' (the default, 100 ms).
+ *        LOG_SYNC_ALWAYS:   SaveToFile() waits for the disk, the callers which wait at the same
+ *                           time share one fdatasync (group commit).
+ * Output: @return result_t
+ *                 ------ R_SUCCESS
+ *                 ------ R_FAILED, unknown policy
+ */
+result_t SaveSnapshot(void);
+/*
+ * Usage: Write the whole datebase to a compact image (DOMAIN_SNAP_PATH), InitializeSearchTree()
+ *        maps it read only and only replays the log which is newer than the image; the older
+ *        log segments are deleted. A background thread calls it when the log after the image
+ *        is larger than the image. The quick update must have been flushed (AddListToBTree).
+ * Inout:   @param  void
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, save success
+ *                  ------ R_FAILED,  save failed
+ */
 
 #endif // DBDOMAIN_H_INCLUDED
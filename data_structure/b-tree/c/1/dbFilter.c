@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbFilter.h"
+
+Filter* FilterCreate(uint64_t keys)
+{
+   Filter* f;
+   void* p=NULL;
+   uint64_t blocks=FILTER_MIN_BLOCKS;
+
+   while(blocks*FILTER_KEYS_BLOCK<keys)
+      blocks<<=1;
+   f=(Filter*)malloc(sizeof(Filter));
+   if(f==NULL)
+      return NULL;
+   if(posix_memalign(&p,64,blocks*sizeof(struct FilterBlock))!=0)
+   {
+      free(f);
+      return NULL;
+   }
+   memset(p, 0, blocks*sizeof(struct FilterBlock));
+   f->block=(struct FilterBlock*)p;
+   f->mask=blocks-1;
+   f->capacity=blocks*FILTER_KEYS_BLOCK;
+   f->keys=0;
+   return f;
+}
+
+/*
+ * Add 'delta' (+1 or -1) to the counters of 'key', a saturated counter is not changed.
+ */
+static void Count(Filter* f,uint64_t key,int delta)
+{
+   uint64_t h=FilterHash(key),w,n,*word;
+   struct FilterBlock* b=(struct FilterBlock*)FilterBlockOf(f,h);
+   unsigned int c,shift,v;
+   int i;
+
+   for(i=0,h>>=22;i<FILTER_PROBES;i++,h>>=7)
+   {
+      c=h&0x7f;
+      word=b->word+(c>>4);
+      shift=(c&0xf)*4;
+      w=__atomic_load_n(word,__ATOMIC_RELAXED);
+      do{
+         v=(w>>shift)&0xf;
+         if(v==FILTER_SATURATED || (delta<0 && v==0))
+            break;
+         n=(w&~(0xfULL<<shift))|((uint64_t)(v+delta)<<shift);
+      }while(!__atomic_compare_exchange_n(word,&w,n,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+   }
+}
+
+void FilterAdd(Filter* f,uint64_t key)
+{
+   Count(f,key,1);
+   __atomic_add_fetch(&(f->keys),1,__ATOMIC_RELAXED);
+}
+
+void FilterRemove(Filter* f,uint64_t key)
+{
+   Count(f,key,-1);
+   __atomic_sub_fetch(&(f->keys),1,__ATOMIC_RELAXED);
+}
+
+void FilterDestroy(void* f)
+{
+   if(f==NULL)
+      return;
+   free(((Filter*)f)->block);
+   free(f);
+}
@@ -0,0 +1,84 @@
+#ifndef DBFILTER_H_INCLUDED
+#define DBFILTER_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dbUtility.h"
+
+#define FILTER_PROBES 6          /* counters of a key, all in one block */
+#define FILTER_KEYS_BLOCK 12     /* keys per block the filter is sized for (about 1% false positive) */
+#define FILTER_MIN_BLOCKS 4096   /* 256KB */
+#define FILTER_SATURATED 0xf     /* a full counter is never decremented again */
+
+/*
+ * Counting blocked Bloom filter: a key selects one block (a cache line of 128 counters of
+ * 4 bits) and sets FILTER_PROBES counters in it, so a lookup touches one line.
+ * The counters let a key be removed again. A counter which reaches FILTER_SATURATED is left
+ * there, so removing never gives a false negative (the filter is rebuilt from time to time).
+ * Readers take no lock, writers change the counters with atomic operations.
+ */
+struct FilterBlock
+{
+  uint64_t word[8];
+} __attribute__((aligned(64)));
+
+typedef struct
+{
+  uint64_t mask;                 /* blocks-1, the count of blocks is a power of 2 */
+  uint64_t capacity;             /* keys the filter was sized for */
+  uint64_t keys;                 /* keys added and not removed */
+  struct FilterBlock* block;
+}Filter;
+
+static inline uint64_t FilterHash(uint64_t key)
+{  //splitmix64 finalizer, the keys of the index are poor in the high bits
+  key^=key>>30;
+  key*=0xbf58476d1ce4e5b9ULL;
+  key^=key>>27;
+  key*=0x94d049bb133111ebULL;
+  key^=key>>31;
+  return key;
+}
+
+static inline const struct FilterBlock* FilterBlockOf(const Filter* f,uint64_t hash)
+{
+  return f->block+(hash&f->mask);     //the probes take the bits from 22 up
+}
+
+static inline int FilterMayContain(const Filter* f,uint64_t key)
+{
+  uint64_t h=FilterHash(key),w;
+  const struct FilterBlock* b=FilterBlockOf(f,h);
+  unsigned int c;
+  int i;
+
+  for(i=0,h>>=22;i<FILTER_PROBES;i++,h>>=7)
+  {
+    c=h&0x7f;
+    w=__atomic_load_n(b->word+(c>>4),__ATOMIC_RELAXED);
+    if(((w>>((c&0xf)*4))&0xf)==0)
+      return 0;
+  }
+  return 1;
+}
+
+Filter* FilterCreate(uint64_t keys);
+/*
+ * Usage: create an empty filter for about 'keys' keys (at least FILTER_MIN_BLOCKS blocks).
+ * Output:  @return Filter*
+ *                  ------ the filter, NULL if no enough memory
+ */
+void FilterAdd(Filter* f,uint64_t key);
+/*
+ * Usage: count one more record of 'key'. f->keys tells when the filter is too small.
+ */
+void FilterRemove(Filter* f,uint64_t key);
+/*
+ * Usage: count one record of 'key' less, it must have been added.
+ */
+void FilterDestroy(void* f);
+/*
+ * Usage: free the filter (a release function for Retire()).
+ */
+
+#endif // DBFILTER_H_INCLUDED
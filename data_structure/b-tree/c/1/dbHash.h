@@ -0,0 +1,107 @@
+#ifndef DBHASH_H_INCLUDED
+#define DBHASH_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * 64-bit hash of the domain names (wyhash construction: 128-bit multiply and fold).
+ * The name is lowercased 8 bytes at a time in the same pass, so a lookup reads it once.
+ * key1 (the bucket) takes the high bits, key2 (the key in the B-tree) is the whole hash,
+ * and BPTREE_KEY keeps its low 32 bits, so the two keys do not depend on each other.
+ */
+#define HASH_SEED 0xa0761d6478bd642fULL
+#define HASH_P1   0xe7037ed1a0b428dbULL
+#define HASH_P2   0x8ebc6af09c88c6e3ULL
+
+static inline uint64_t HashMix(uint64_t a,uint64_t b)
+{
+  __uint128_t r=(__uint128_t)a*b;
+  return (uint64_t)r^(uint64_t)(r>>64);
+}
+
+/*
+ * Lowercase the 8 ASCII letters of a word (same as the old maptolower table: only 'A'..'Z').
+ */
+static inline uint64_t LowerWord(uint64_t w)
+{
+  uint64_t low=w&0x7f7f7f7f7f7f7f7fULL;
+  uint64_t ge_a=low+0x3f3f3f3f3f3f3f3fULL;         //bit 7 set if >= 'A'
+  uint64_t gt_z=low+0x2525252525252525ULL;         //bit 7 set if >  'Z'
+  return w|(((ge_a^gt_z)&~w&0x8080808080808080ULL)>>2);
+}
+
+static inline uint64_t LoadTail(const char* p,size_t n)
+{
+  uint64_t w=0;
+  memcpy(&w,p,n);
+  return w;
+}
+
+/*
+ * Hash 'len' bytes, 'lower' also lowercases them in place.
+ */
+static inline uint64_t HashBytes(char* str,size_t len,int lower)
+{
+  uint64_t h=HASH_SEED^(len*HASH_P2),a,b;
+  size_t n=len;
+  char* p=str;
+
+  for(;n>16;n-=16,p+=16)
+  {
+    memcpy(&a,p,8);
+    memcpy(&b,p+8,8);
+    if(lower)
+    {
+      a=LowerWord(a);
+      b=LowerWord(b);
+      memcpy(p,&a,8);
+      memcpy(p+8,&b,8);
+    }
+    h=HashMix(a^HASH_P1,b^h);
+  }
+  //the last 1..16 bytes
+  if(n>8)
+  {
+    memcpy(&a,p,8);
+    b=LoadTail(p+8,n-8);
+    if(lower)
+    {
+      a=LowerWord(a);
+      b=LowerWord(b);
+      memcpy(p,&a,8);
+      memcpy(p+8,&b,n-8);
+    }
+  }else{
+    a=LoadTail(p,n);
+    b=0;
+    if(lower)
+    {
+      a=LowerWord(a);
+      memcpy(p,&a,n);
+    }
+  }
+  return HashMix(HASH_P1^len,HashMix(a^HASH_P1,b^h));
+}
+
+static inline uint64_t HashLower(char* str)
+{
+  return HashBytes(str,strlen(str),1);
+}
+/*
+ * Usage: lowercase 'str' in place and return its hash.
+ */
+
+static inline uint64_t HashName(const char* str)
+{
+  return HashBytes((char*)str,strlen(str),0);
+}
+/*
+ * Usage: hash of a name which is lowercase already (it is not written).
+ */
+
+#define HASH_KEY1(h,buckets) ((unsigned long)(((h)>>32)%(buckets)))
+#define HASH_KEY2(h) ((unsigned long)(h))
+
+#endif // DBHASH_H_INCLUDED
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "dbUtility.h"
+#include "dbLog.h"
+#include "dbHash.h"
+
+#define MAXBUCKETS 65535           /* same as dbDomain.c */
+#define LOCKNUM    10
+#define SIZE_BINS  12              /* bucket sizes 0, 1, 2, 3-4, 5-8, ... */
+#define CHAIN_BINS 5               /* names of one key: 1, 2, 3, 4, 5+ */
+
+/*
+ * Distribution of the keys of the domains in a domain.db (or in segments of the write-ahead
+ * log): occupancy of the Hash buckets, records per bucket, and the chains of names which
+ * share one key, for the old hash functions and for the 64-bit hash.
+ * Usage: ./dbHashStat [domain.db | domain.log/<seq>.log ...]
+ */
+
+struct NameSet
+{
+  char** slot;
+  uint64_t* hash;
+  size_t size;                     /* power of 2 */
+  size_t count;
+};
+
+struct KeyPair
+{
+  unsigned long key1;
+  unsigned long key2;
+};
+
+//the hash functions of the old versions
+static unsigned long OldKey1(const char* str)
+{
+  int i,l;
+  unsigned long ret=0;
+  const unsigned short* s=(const unsigned short*)str;
+  l=(strlen(str)+1)/2;
+  for(i=0;i<l;i++)
+     ret^=(s[i]<<(i&0x0f));
+  return ret%MAXBUCKETS;
+}
+
+static unsigned long OldKey2(const char* str)
+{
+  unsigned long h=0,g;
+  while(*str!='\0')
+  {
+     h=(h<<4)+*str++;
+     if((g=(h&0xF0000000)))
+     {
+        h=h^(g>>24);
+        h=h^g;
+     }
+  }
+  return h;
+}
+
+static int SetGrow(struct NameSet* set)
+{
+  struct NameSet n;
+  size_t i,j;
+
+  n.size=set->size ? set->size*2 : 1024;
+  n.count=set->count;
+  n.slot=(char**)calloc(n.size,sizeof(char*));
+  n.hash=(uint64_t*)malloc(n.size*sizeof(uint64_t));
+  if(n.slot==NULL || n.hash==NULL)
+  {
+     free(n.slot);
+     free(n.hash);
+     return -1;
+  }
+  for(i=0;i<set->size;i++)
+  {
+     if(set->slot[i]==NULL)
+        continue;
+     for(j=set->hash[i]&(n.size-1);n.slot[j]!=NULL;j=(j+1)&(n.size-1))
+        ;
+     n.slot[j]=set->slot[i];
+     n.hash[j]=set->hash[i];
+  }
+  free(set->slot);
+  free(set->hash);
+  *set=n;
+  return 0;
+}
+
+/*
+ * Add or delete a (lowercase) name, the set keeps the names which are in the database at the end.
+ */
+static int SetUpdate(struct NameSet* set,char* name,int del)
+{
+  uint64_t h=HashName(name);
+  size_t i,j,k;
+
+  if((set->count+1)*2>set->size && SetGrow(set)!=0)
+     return -1;
+  for(i=h&(set->size-1);set->slot[i]!=NULL;i=(i+1)&(set->size-1))
+     if(set->hash[i]==h && strcmp(set->slot[i],name)==0)
+        break;
+  if(!del)
+  {
+     if(set->slot[i]!=NULL)
+        return 0;
+     if((set->slot[i]=strdup(name))==NULL)
+        return -1;
+     set->hash[i]=h;
+     set->count++;
+     return 0;
+  }
+  if(set->slot[i]==NULL)
+     return 0;
+  free(set->slot[i]);
+  set->slot[i]=NULL;
+  set->count--;
+  //backward shift, the later names of the cluster stay reachable
+  for(j=(i+1)&(set->size-1);set->slot[j]!=NULL;j=(j+1)&(set->size-1))
+  {
+     k=set->hash[j]&(set->size-1);
+     if((j>i && (k<=i || k>j)) || (j<i && k<=i && k>j))
+     {
+        set->slot[i]=set->slot[j];
+        set->hash[i]=set->hash[j];
+        set->slot[j]=NULL;
+        i=j;
+     }
+  }
+  return 0;
+}
+
+static int ReadRecords(struct NameSet* set,const char* start,size_t size,unsigned long* suffix)
+{
+  const struct data_hdr* hdr;
+  char name[65536];
+  size_t sum=0;
+
+  while(sum+sizeof(*hdr)<=size)
+  {
+     hdr=(const struct data_hdr*)(start+sum);
+     if(sum+sizeof(*hdr)+hdr->val_length+hdr->info_length>size)
+        return -1;
+     memcpy(name,start+sum+sizeof(*hdr),hdr->val_length);
+     name[hdr->val_length]='\0';
+     HashLower(name);
+     sum+=sizeof(*hdr)+hdr->val_length+hdr->info_length;
+     if(hdr->wildcard)
+     {  //suffix rules are in the trie, not in the buckets
+        (*suffix)++;
+        continue;
+     }
+     if(SetUpdate(set,name,hdr->opcode_type==OPCODE_DELETE)!=0)
+        return -1;
+  }
+  return 0;
+}
+
+static int ReadFile(struct NameSet* set,const char* path,unsigned long* suffix)
+{
+  FILE* fp;
+  char* data;
+  long size;
+  size_t off;
+  const struct log_frame_hdr* frame;
+  int rtn=0;
+
+  fp=fopen(path,"rb");
+  if(fp==NULL)
+  {
+     perror(path);
+     return -1;
+  }
+  fseek(fp,0,SEEK_END);
+  size=ftell(fp);
+  fseek(fp,0,SEEK_SET);
+  data=(char*)malloc(size>0 ? size : 1);
+  if(data==NULL || fread(data,1,size,fp)!=(size_t)size)
+  {
+     fprintf(stderr,"%s: read failed\n",path);
+     fclose(fp);
+     free(data);
+     return -1;
+  }
+  fclose(fp);
+
+  if((size_t)size>=sizeof(struct log_segment_hdr) && memcmp(data,LOG_SEGMENT_MAGIC,sizeof(LOG_SEGMENT_MAGIC))==0)
+  {  //a log segment: one record set per frame, a torn frame ends it, only the domains count
+     for(off=sizeof(struct log_segment_hdr);off+sizeof(*frame)<=(size_t)size;off+=sizeof(*frame)+LOG_FRAME_SIZE(frame->size))
+     {
+        frame=(const struct log_frame_hdr*)(data+off);
+        if(LOG_FRAME_SIZE(frame->size)==0 || off+sizeof(*frame)+LOG_FRAME_SIZE(frame->size)>(size_t)size)
+           break;
+        if(LOG_FRAME_TYPE(frame->size)!=DATA_TYPE_DOMAIN)
+           continue;
+        if(ReadRecords(set,data+off+sizeof(*frame),LOG_FRAME_SIZE(frame->size),suffix)!=0)
+        {
+           rtn=-1;
+           break;
+        }
+     }
+  }else
+     rtn=ReadRecords(set,data,size,suffix);
+  if(rtn!=0)
+     fprintf(stderr,"%s: broken records\n",path);
+  free(data);
+  return rtn;
+}
+
+static int CompareKey(const void* a,const void* b)
+{
+  const struct KeyPair* x=(const struct KeyPair*)a;
+  const struct KeyPair* y=(const struct KeyPair*)b;
+  if(x->key1!=y->key1)
+     return x->key1<y->key1 ? -1 : 1;
+  if(x->key2!=y->key2)
+     return x->key2<y->key2 ? -1 : 1;
+  return 0;
+}
+
+/*
+ * Chains of names with the same key, 'mask' is applied to key2 (the B+ tree keeps 32 bits).
+ */
+static void PrintChains(struct KeyPair* keys,size_t n,unsigned long mask,const char* label)
+{
+  unsigned long bins[CHAIN_BINS];
+  size_t i,j,longest=0;
+  int b;
+
+  for(i=0;i<n;i++)
+     keys[i].key2&=mask;
+  qsort(keys,n,sizeof(*keys),CompareKey);
+  memset(bins,0,sizeof(bins));
+  for(i=0;i<n;i=j)
+  {
+     for(j=i+1;j<n && keys[j].key1==keys[i].key1 && keys[j].key2==keys[i].key2;j++)
+        ;
+     b=(j-i>=CHAIN_BINS) ? CHAIN_BINS-1 : (int)(j-i-1);
+     bins[b]++;
+     if(j-i>longest)
+        longest=j-i;
+  }
+  printf("  %-22s 1:%lu  2:%lu  3:%lu  4:%lu  5+:%lu  longest %lu\n",label,
+         bins[0],bins[1],bins[2],bins[3],bins[4],(unsigned long)longest);
+}
+
+static void Report(const char* title,const struct NameSet* set,int old)
+{
+  unsigned int* members;
+  unsigned long bins[SIZE_BINS],shard[LOCKNUM],used=0,most=0,low,high;
+  struct KeyPair* keys;
+  size_t i,n=0;
+  uint64_t h;
+  double expect;
+  int b;
+
+  members=(unsigned int*)calloc(MAXBUCKETS,sizeof(unsigned int));
+  keys=(struct KeyPair*)malloc((set->count ? set->count : 1)*sizeof(*keys));
+  if(members==NULL || keys==NULL)
+  {
+     fprintf(stderr,"no enough memory\n");
+     exit(1);
+  }
+  memset(shard,0,sizeof(shard));
+  for(i=0;i<set->size;i++)
+  {
+     if(set->slot[i]==NULL)
+        continue;
+     if(old)
+     {
+        keys[n].key1=OldKey1(set->slot[i]);
+        keys[n].key2=OldKey2(set->slot[i]);
+     }else{
+        h=set->hash[i];
+        keys[n].key1=HASH_KEY1(h,MAXBUCKETS);
+        keys[n].key2=HASH_KEY2(h);
+     }
+     members[keys[n].key1]++;
+     shard[keys[n].key1%LOCKNUM]++;
+     n++;
+  }
+
+  memset(bins,0,sizeof(bins));
+  for(i=0;i<MAXBUCKETS;i++)
+  {
+     for(b=0;b<SIZE_BINS-1 && (b==0 ? members[i]>0 : members[i]>(1UL<<(b-1)));b++)
+        ;
+     bins[b]++;
+     used+=(members[i]!=0);
+     if(members[i]>most)
+        most=members[i];
+  }
+  expect=MAXBUCKETS*(1.0-exp(-(double)n/MAXBUCKETS));
+  low=high=shard[0];
+  for(i=1;i<LOCKNUM;i++)
+  {
+     if(shard[i]<low)
+        low=shard[i];
+     if(shard[i]>high)
+        high=shard[i];
+  }
+
+  printf("%s\n",title);
+  printf("  buckets used           %lu of %d (random hash: %.0f), largest %lu, mean %.2f\n",
+         used,MAXBUCKETS,expect,most,used ? (double)n/used : 0.0);
+  printf("  records per shard      min %lu  max %lu\n",low,high);
+  printf("  records per bucket    ");
+  for(b=0;b<SIZE_BINS;b++)
+  {
+     if(bins[b]==0)
+        continue;
+     if(b<=1)
+        printf(" %d:%lu",b,bins[b]);
+     else if(b==SIZE_BINS-1)
+        printf(" %lu+:%lu",(1UL<<(b-2))+1,bins[b]);
+     else if(b==2)
+        printf(" 2:%lu",bins[b]);
+     else
+        printf(" %lu-%lu:%lu",(1UL<<(b-2))+1,1UL<<(b-1),bins[b]);
+  }
+  printf("\n");
+  PrintChains(keys,n,~0UL,"key chains (B-tree)");
+  PrintChains(keys,n,0xffffffffUL,"key chains (B+ tree)");
+  free(keys);
+  free(members);
+}
+
+int main(int argc, char* argv[])
+{
+  struct NameSet set;
+  unsigned long suffix=0;
+  int i;
+
+  memset(&set,0,sizeof(set));
+  if(SetGrow(&set)!=0)
+     return 1;
+  if(argc<2)
+  {
+     if(ReadFile(&set,DOMAIN_DATA_PATH,&suffix)!=0)
+        return 1;
+  }
+  for(i=1;i<argc;i++)
+     if(ReadFile(&set,argv[i],&suffix)!=0)
+        return 1;
+
+  printf("domains %lu, suffix rules %lu, buckets %d\n",(unsigned long)set.count,suffix,MAXBUCKETS);
+  Report("old hash (OpenSSL / PHP)",&set,1);
+  Report("64-bit hash",&set,0);
+  return 0;
+}
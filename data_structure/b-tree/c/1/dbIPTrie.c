@@ -0,0 +1,565 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbIPTrie.h"
+
+#define IPT_SLOTS (1U<<IPT_STRIDE)
+
+/*
+ * Memory of one change: the new arrays (freed if the change fails), and the arrays which
+ * are replaced (retired when the change is published).
+ */
+struct IPChange
+{
+  void** fresh;
+  size_t nfresh,maxfresh;
+  void** old;
+  size_t nold,maxold;
+};
+
+static result_t Keep(void*** list,size_t* n,size_t* max,void* ptr)
+{
+   void** p;
+   if(ptr==NULL)
+      return R_SUCCESS;
+   if(*n==*max)
+   {
+      p=(void**)realloc(*list,(*max*2+64)*sizeof(void*));
+      if(p==NULL)
+         return R_FAILED;
+      *list=p;
+      *max=*max*2+64;
+   }
+   (*list)[(*n)++]=ptr;
+   return R_SUCCESS;
+}
+
+static void* NewArray(struct IPChange* c,size_t size)
+{
+   void* p=malloc(size);
+   if(p!=NULL && Keep(&(c->fresh),&(c->nfresh),&(c->maxfresh),p)==R_FAILED)
+   {
+      free(p);
+      return NULL;
+   }
+   return p;
+}
+
+static inline result_t Replaced(struct IPChange* c,void* ptr)
+{
+   return Keep(&(c->old),&(c->nold),&(c->maxold),ptr);
+}
+
+static inline ipkey_t Mask(ipkey_t key,unsigned int len)
+{
+   return len==0 ? 0 : key&(~(ipkey_t)0<<(IPT_MAXWIDTH-len));
+}
+
+/*
+ * Slot of 'key' in a node which starts at 'bit'.
+ */
+static inline unsigned int Slot(ipkey_t key,unsigned int bit)
+{
+   return (unsigned int)((key<<bit)>>(IPT_MAXWIDTH-IPT_STRIDE));
+}
+
+static inline size_t RuleHash(ipkey_t prefix,unsigned int len,size_t size)
+{
+   uint64_t h=((uint64_t)(prefix>>64)*0x9E3779B97F4A7C15ULL)^((uint64_t)prefix*0xC2B2AE3D27D4EB4FULL)^len;
+   h^=h>>29;
+   h*=0xbf58476d1ce4e5b9ULL;
+   h^=h>>32;
+   return h&(size-1);
+}
+
+static struct IPRule* RuleFind(IPTrie* t,ipkey_t prefix,unsigned int len)
+{
+   struct IPRule* rule;
+   if(t->lens[len]==0)
+      return NULL;
+   for(rule=t->rules[RuleHash(prefix,len,t->size)];rule!=NULL;rule=rule->next)
+   {
+      if(rule->len==len && rule->prefix==prefix)
+         return rule;
+   }
+   return NULL;
+}
+
+static void RuleLink(IPTrie* t,struct IPRule* rule)
+{
+   size_t h=RuleHash(rule->prefix,rule->len,t->size);
+   rule->next=t->rules[h];
+   t->rules[h]=rule;
+   t->nrules++;
+   t->lens[rule->len]++;
+}
+
+static void RuleUnlink(IPTrie* t,struct IPRule* rule)
+{
+   struct IPRule** p=t->rules+RuleHash(rule->prefix,rule->len,t->size);
+   while(*p!=rule)
+      p=&((*p)->next);
+   *p=rule->next;
+   t->nrules--;
+   t->lens[rule->len]--;
+}
+
+static struct IPRule* RuleAdd(IPTrie* t,ipkey_t prefix,unsigned int len,void* value)
+{
+   struct IPRule** table,*rule,*next;
+   size_t i,size=t->size*2,h;
+
+   rule=(struct IPRule*)malloc(sizeof(struct IPRule));
+   if(rule==NULL)
+      return NULL;
+   rule->prefix=prefix;
+   rule->len=len;
+   rule->value=value;
+   if(t->nrules>=t->size && (table=(struct IPRule**)calloc(size,sizeof(struct IPRule*)))!=NULL)
+   {  //no new table: the chains are longer, that is all
+      for(i=0;i<t->size;i++)
+      {
+         for(next=t->rules[i];next!=NULL;)
+         {
+            struct IPRule* r=next;
+            next=r->next;
+            h=RuleHash(r->prefix,r->len,size);
+            r->next=table[h];
+            table[h]=r;
+         }
+      }
+      free(t->rules);
+      t->rules=table;
+      t->size=size;
+   }
+   RuleLink(t,rule);
+   return rule;
+}
+
+/*
+ * Value of the longest prefix of the slot 's' of a node, the prefixes of the node (the lengths
+ * bit+1 .. bit+IPT_STRIDE), 'def' if none.
+ */
+static void* SlotValue(IPTrie* t,ipkey_t base,unsigned int bit,unsigned int s,void* def)
+{
+   struct IPRule* rule;
+   unsigned int r,len;
+
+   for(r=IPT_STRIDE;r>=1;r--)
+   {
+      len=bit+r;
+      if(len>t->width || t->lens[len]==0)
+         continue;
+      rule=RuleFind(t,base|((ipkey_t)(s>>(IPT_STRIDE-r))<<(IPT_MAXWIDTH-len)),len);
+      if(rule!=NULL)
+         return rule->value;
+   }
+   return def;
+}
+
+/*
+ * SlotValue() of the slots lo .. hi-1, the prefixes from the shortest to the longest: one
+ * probe per prefix of the node which covers a part of the range.
+ */
+static void Paint(IPTrie* t,ipkey_t base,unsigned int bit,unsigned int lo,unsigned int hi,void* def,void** leaf)
+{
+   struct IPRule* rule;
+   unsigned int r,len,s,e,size;
+
+   for(s=lo;s<hi;s++)
+      leaf[s]=def;
+   for(r=1;r<=IPT_STRIDE;r++)
+   {
+      len=bit+r;
+      if(len>t->width)
+         break;
+      if(t->lens[len]==0)
+         continue;
+      size=1U<<(IPT_STRIDE-r);
+      for(s=lo&~(size-1);s<hi;s+=size)
+      {
+         rule=RuleFind(t,base|((ipkey_t)(s>>(IPT_STRIDE-r))<<(IPT_MAXWIDTH-len)),len);
+         if(rule==NULL)
+            continue;
+         for(e=(s<lo) ? lo : s;e<s+size && e<hi;e++)
+            leaf[e]=rule->value;
+      }
+   }
+}
+
+/*
+ * Value of the longest prefix (at most IPT_ROOT_BITS long) of the root entry 'i'.
+ */
+static void* RootValue(IPTrie* t,size_t i)
+{
+   struct IPRule* rule;
+   int len;
+
+   for(len=IPT_ROOT_BITS;len>=0;len--)
+   {
+      if(t->lens[len]==0)
+         continue;
+      rule=RuleFind(t,Mask((ipkey_t)i<<(IPT_MAXWIDTH-IPT_ROOT_BITS),len),len);
+      if(rule!=NULL)
+         return rule->value;
+   }
+   return NULL;
+}
+
+/*
+ * The values of the slots without child.
+ */
+static void Expand(const struct IPNode* node,void** leaf)
+{
+   unsigned int s;
+   int k=-1;
+   for(s=0;s<IPT_SLOTS;s++)
+   {
+      if((node->childmap>>s)&1)
+         continue;
+      if((node->leafmap>>s)&1)
+         k++;
+      leaf[s]=node->leaf[k];
+   }
+}
+
+/*
+ * Build the node which starts at 'bit' under 'base' again, after the prefix (prefix, len)
+ * changed in the table. 'old' is the node before (NULL if none), 'def' the value which the
+ * nodes above push into it. Only the children which the change reaches are built again, the
+ * others are copied. A child without prefix is dropped.
+ */
+static result_t Build(IPTrie* t,struct IPChange* c,const struct IPNode* old,void* def,ipkey_t base,
+                      unsigned int bit,ipkey_t prefix,unsigned int len,struct IPNode* out)
+{
+   void* leaf[IPT_SLOTS];
+   void* d;
+   struct IPNode child[IPT_SLOTS],nc;
+   const struct IPNode* oc;
+   uint64_t childmap=0,leafmap=0;
+   unsigned int s,lo=0,hi=0,ps=IPT_SLOTS,n=0,m=0,k=0;
+
+   if(len<=bit)
+      hi=IPT_SLOTS;                          //the whole node is under the prefix
+   else if(len<=bit+IPT_STRIDE)
+   {                                         //the prefix is one of this node
+      lo=Slot(prefix,bit);
+      hi=lo+(1U<<(bit+IPT_STRIDE-len));
+   }else
+      ps=Slot(prefix,bit);                   //the prefix is under one child
+
+   for(s=0;s<IPT_SLOTS;s++)
+      leaf[s]=def;
+   if(old!=NULL)
+      Expand(old,leaf);
+   Paint(t,base,bit,lo,hi,def,leaf);
+
+   for(s=0;s<IPT_SLOTS;s++)
+   {
+      oc=(old!=NULL && ((old->childmap>>s)&1)) ? old->child+k++ : NULL;
+      if(oc==NULL && s!=ps)
+         continue;
+      if(oc!=NULL && s!=ps && (s<lo || s>=hi))
+      {
+         child[n++]=*oc;
+         childmap|=1ULL<<s;
+         continue;
+      }
+      d=(s>=lo && s<hi) ? leaf[s] : SlotValue(t,base,bit,s,def);
+      if(Build(t,c,oc,d,base|((ipkey_t)s<<(IPT_MAXWIDTH-bit-IPT_STRIDE)),bit+IPT_STRIDE,prefix,len,&nc)==R_FAILED)
+         return R_FAILED;
+      if(nc.childmap==0 && nc.leafmap==1 && nc.leaf[0]==d)
+      {  //no prefix under the slot any more
+         leaf[s]=d;
+         if(Replaced(c,nc.leaf)==R_FAILED)
+            return R_FAILED;
+         continue;
+      }
+      child[n++]=nc;
+      childmap|=1ULL<<s;
+   }
+
+   //runs of equal values, in place (m<=s)
+   for(s=0;s<IPT_SLOTS;s++)
+   {
+      if((childmap>>s)&1)
+         continue;
+      if(m==0 || leaf[s]!=leaf[m-1])
+      {
+         leafmap|=1ULL<<s;
+         leaf[m++]=leaf[s];
+      }
+   }
+   out->childmap=childmap;
+   out->leafmap=leafmap;
+   out->child=NULL;
+   out->leaf=NULL;
+   if(n!=0)
+   {
+      if((out->child=(struct IPNode*)NewArray(c,n*sizeof(struct IPNode)))==NULL)
+         return R_FAILED;
+      memcpy(out->child,child,n*sizeof(struct IPNode));
+   }
+   if(m!=0)
+   {
+      if((out->leaf=(void**)NewArray(c,m*sizeof(void*)))==NULL)
+         return R_FAILED;
+      memcpy(out->leaf,leaf,m*sizeof(void*));
+   }
+   if(old!=NULL && (Replaced(c,old->child)==R_FAILED || Replaced(c,old->leaf)==R_FAILED))
+      return R_FAILED;
+   return R_SUCCESS;
+}
+
+/*
+ * Publish the root entries of the prefix (prefix, len) again, after it changed in the table.
+ */
+static result_t Change(IPTrie* t,ipkey_t prefix,unsigned int len)
+{
+   struct IPChange c;
+   struct IPNode nc,*node;
+   uintptr_t* entry,e;
+   size_t lo,hi,i;
+   void* d;
+   result_t result=R_FAILED;
+
+   memset(&c, 0, sizeof(c));
+   lo=(size_t)(prefix>>(IPT_MAXWIDTH-IPT_ROOT_BITS));
+   hi=lo+((len<IPT_ROOT_BITS) ? (1UL<<(IPT_ROOT_BITS-len)) : 1);
+   entry=(uintptr_t*)malloc((hi-lo)*sizeof(uintptr_t));
+   if(entry==NULL)
+      return R_FAILED;
+   for(i=lo;i<hi;i++)
+   {
+      e=t->root[i];
+      d=RootValue(t,i);
+      if((e&1)==0 && len<=IPT_ROOT_BITS)
+      {
+         entry[i-lo]=(uintptr_t)d;
+         continue;
+      }
+      if(Build(t,&c,(e&1) ? (const struct IPNode*)(e-1) : NULL,d,(ipkey_t)i<<(IPT_MAXWIDTH-IPT_ROOT_BITS),
+               IPT_ROOT_BITS,prefix,len,&nc)==R_FAILED)
+         goto out;
+      if(nc.childmap==0 && nc.leafmap==1 && nc.leaf[0]==d)
+      {
+         entry[i-lo]=(uintptr_t)d;
+         if(Replaced(&c,nc.leaf)==R_FAILED)
+            goto out;
+      }else
+      {
+         if((node=(struct IPNode*)NewArray(&c,sizeof(struct IPNode)))==NULL)
+            goto out;
+         *node=nc;
+         entry[i-lo]=(uintptr_t)node|1;
+      }
+      if((e&1) && Replaced(&c,(void*)(e-1))==R_FAILED)
+         goto out;
+   }
+   for(i=lo;i<hi;i++)
+      __atomic_store_n(t->root+i,entry[i-lo],__ATOMIC_RELEASE);
+   for(i=0;i<c.nold;i++)
+      t->retire(c.old[i],free);
+   result=R_SUCCESS;
+
+out:
+   for(i=0;result==R_FAILED && i<c.nfresh;i++)
+      free(c.fresh[i]);
+   free(c.fresh);
+   free(c.old);
+   free(entry);
+   return result;
+}
+
+result_t IPTrieInit(IPTrie* trie,unsigned int width,void (*retire)(void*,void (*)(void*)),void (*release)(void*))
+{
+   memset(trie, 0, sizeof(IPTrie));
+   if(width!=32 && width!=IPT_MAXWIDTH)
+      return R_FAILED;
+   trie->width=width;
+   trie->retire=retire;
+   trie->release=release;
+   trie->size=IPT_RULES_MIN;
+   trie->root=(uintptr_t*)calloc(1UL<<IPT_ROOT_BITS,sizeof(uintptr_t));
+   trie->rules=(struct IPRule**)calloc(trie->size,sizeof(struct IPRule*));
+   if(trie->root==NULL || trie->rules==NULL)
+   {
+      free(trie->root);
+      free(trie->rules);
+      memset(trie, 0, sizeof(IPTrie));
+      return R_FAILED;
+   }
+   return R_SUCCESS;
+}
+
+void IPTrieSearchBatch(const IPTrie* trie,const ipkey_t* addr,size_t n,void** values)
+{
+   const struct IPNode* node[IPT_BATCH];
+   void* const* slot[IPT_BATCH];
+   unsigned int bit[IPT_BATCH],s;
+   uintptr_t e;
+   size_t base,i,m;
+   int active;
+
+   for(base=0;base<n;base+=IPT_BATCH)
+   {
+      m=(n-base<IPT_BATCH) ? n-base : IPT_BATCH;
+      for(i=0;i<m;i++)
+         __builtin_prefetch(trie->root+(size_t)(addr[base+i]>>(IPT_MAXWIDTH-IPT_ROOT_BITS)));
+      for(i=0;i<m;i++)
+      {
+         e=__atomic_load_n(trie->root+(size_t)(addr[base+i]>>(IPT_MAXWIDTH-IPT_ROOT_BITS)),__ATOMIC_ACQUIRE);
+         node[i]=NULL;
+         slot[i]=NULL;
+         values[base+i]=(void*)e;
+         if(e&1)
+         {
+            node[i]=(const struct IPNode*)(e-1);
+            bit[i]=IPT_ROOT_BITS;
+            __builtin_prefetch(node[i]);
+         }
+      }
+      //one level of every walk per round, a walk which ends prefetches its value.
+      do
+      {
+         active=0;
+         for(i=0;i<m;i++)
+         {
+            if(node[i]==NULL)
+               continue;
+            s=(unsigned int)((addr[base+i]<<bit[i])>>(IPT_MAXWIDTH-IPT_STRIDE));
+            if(((node[i]->childmap>>s)&1)==0)
+            {
+               slot[i]=node[i]->leaf+__builtin_popcountll(node[i]->leafmap&((2ULL<<s)-1))-1;
+               __builtin_prefetch(slot[i]);
+               node[i]=NULL;
+               continue;
+            }
+            node[i]=node[i]->child+__builtin_popcountll(node[i]->childmap&((1ULL<<s)-1));
+            bit[i]+=IPT_STRIDE;
+            __builtin_prefetch(node[i]);
+            active=1;
+         }
+      }while(active);
+      for(i=0;i<m;i++)
+      {
+         if(slot[i]!=NULL)
+            values[base+i]=*slot[i];
+      }
+   }
+}
+
+void* IPTrieFind(IPTrie* trie,ipkey_t prefix,unsigned int len)
+{
+   struct IPRule* rule;
+   if(len>trie->width)
+      return NULL;
+   rule=RuleFind(trie,Mask(prefix,len),len);
+   return rule!=NULL ? rule->value : NULL;
+}
+
+result_t IPTrieUpdate(IPTrie* trie,ipkey_t prefix,unsigned int len,void* value)
+{
+   struct IPRule* rule;
+   void* old=NULL;
+
+   if(len>trie->width || value==NULL || ((uintptr_t)value&1))
+      return R_FAILED;
+   prefix=Mask(prefix,len);
+   rule=RuleFind(trie,prefix,len);
+   if(rule!=NULL)
+   {
+      old=rule->value;
+      rule->value=value;
+   }else if((rule=RuleAdd(trie,prefix,len,value))==NULL)
+      return R_FAILED;
+   if(Change(trie,prefix,len)==R_FAILED)
+   {  //the trie is not changed, neither is the table
+      if(old!=NULL)
+         rule->value=old;
+      else
+      {
+         RuleUnlink(trie,rule);
+         free(rule);
+      }
+      return R_FAILED;
+   }
+   if(old!=NULL && trie->release!=NULL)
+      trie->retire(old,trie->release);
+   return R_SUCCESS;
+}
+
+result_t IPTrieRemove(IPTrie* trie,ipkey_t prefix,unsigned int len)
+{
+   struct IPRule* rule;
+
+   if(len>trie->width)
+      return R_SUCCESS;
+   prefix=Mask(prefix,len);
+   rule=RuleFind(trie,prefix,len);
+   if(rule==NULL)
+      return R_SUCCESS;
+   RuleUnlink(trie,rule);
+   if(Change(trie,prefix,len)==R_FAILED)
+   {
+      RuleLink(trie,rule);
+      return R_FAILED;
+   }
+   if(trie->release!=NULL)
+      trie->retire(rule->value,trie->release);
+   free(rule);
+   return R_SUCCESS;
+}
+
+result_t IPTrieWalk(IPTrie* trie,result_t (*visit)(ipkey_t prefix,unsigned int len,void* value,void* arg),void* arg)
+{
+   struct IPRule* rule;
+   size_t i;
+
+   for(i=0;i<trie->size;i++)
+   {
+      for(rule=trie->rules[i];rule!=NULL;rule=rule->next)
+      {
+         if(visit(rule->prefix,rule->len,rule->value,arg)==R_FAILED)
+            return R_FAILED;
+      }
+   }
+   return R_SUCCESS;
+}
+
+static void FreeNode(struct IPNode* node)
+{
+   int i,n=__builtin_popcountll(node->childmap);
+   for(i=0;i<n;i++)
+      FreeNode(node->child+i);
+   free(node->child);
+   free(node->leaf);
+}
+
+void IPTrieDestroy(IPTrie* trie)
+{
+   struct IPRule* rule,*next;
+   size_t i;
+
+   for(i=0;trie->root!=NULL && i<(1UL<<IPT_ROOT_BITS);i++)
+   {
+      if(trie->root[i]&1)
+      {
+         FreeNode((struct IPNode*)(trie->root[i]-1));
+         free((void*)(trie->root[i]-1));
+      }
+   }
+   for(i=0;trie->rules!=NULL && i<trie->size;i++)
+   {
+      for(rule=trie->rules[i];rule!=NULL;rule=next)
+      {
+         next=rule->next;
+         if(trie->release!=NULL)
+            trie->release(rule->value);
+         free(rule);
+      }
+   }
+   free(trie->root);
+   free(trie->rules);
+   memset(trie, 0, sizeof(IPTrie));
+}
@@ -0,0 +1,136 @@
+#ifndef DBIPTRIE_H_INCLUDED
+#define DBIPTRIE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dbUtility.h"
+
+#define IPT_ROOT_BITS 16            /* the first bits of an address index the root table */
+#define IPT_STRIDE    6             /* bits of one node, its maps are one 64-bit word each */
+#define IPT_MAXWIDTH  128
+#define IPT_RULES_MIN 1024          /* buckets of the smallest prefix table */
+#define IPT_BATCH     16            /* walks of IPTrieSearchBatch() which are interleaved */
+
+/*
+ * An address (or prefix) is one 128-bit number, the first bit of the address is the highest
+ * bit: an IPv4 address is in the high 32 bits, the rest is 0.
+ */
+typedef unsigned __int128 ipkey_t;
+
+/*
+ * Poptrie (multibit trie compressed with popcount) for the longest prefix match.
+ * The first IPT_ROOT_BITS bits index the root table, an entry is the value of the longest
+ * prefix (no node below) or a node (low bit set). A node covers the next IPT_STRIDE bits:
+ * bit s of childmap tells that slot s has a child, the children of a node are one array in
+ * slot order. The other slots hold the value of their longest prefix (the prefixes of the
+ * nodes above are pushed down into them), leafmap marks where a run of equal values starts,
+ * so a node with few prefixes keeps few values.
+ * A lookup reads the root entry and one node per IPT_STRIDE bits, and one value at the end:
+ * 5 memory accesses for a /32 of IPv4.
+ *
+ * Readers take no lock: the writer builds the changed nodes again (the path from the root
+ * entry to the prefix, and the nodes under it) and swaps the root entry, the replaced arrays
+ * are given to 'retire', which must free them when no reader uses them any more.
+ * The prefixes themselves are kept in a hash table of the writer, the nodes are built from it.
+ */
+struct IPNode
+{
+  uint64_t childmap;            /* slots with a child */
+  uint64_t leafmap;             /* slots (without child) where a run of values starts */
+  struct IPNode* child;         /* popcount(childmap) nodes */
+  void** leaf;                  /* popcount(leafmap) values, NULL is no prefix */
+};
+
+struct IPRule
+{
+  ipkey_t prefix;               /* bits after 'len' are 0 */
+  void* value;
+  struct IPRule* next;
+  uint8_t len;
+};
+
+typedef struct
+{
+  uintptr_t* root;                              /* 1<<IPT_ROOT_BITS entries */
+  unsigned int width;                           /* 32 (IPv4) or 128 (IPv6) */
+  struct IPRule** rules;                        /* writer side: the prefixes */
+  size_t nrules,size;
+  unsigned long lens[IPT_MAXWIDTH+1];           /* prefixes of every length */
+  void (*retire)(void* ptr,void (*release)(void*));
+  void (*release)(void* value);
+}IPTrie;
+
+result_t IPTrieInit(IPTrie* trie,unsigned int width,void (*retire)(void*,void (*)(void*)),void (*release)(void*));
+/*
+ * Usage: initial an empty trie of 'width' bits addresses.
+ * Input:   @param  IPTrie* trie ----- the trie
+ *          @param  unsigned int width ----- 32 or 128
+ *          @param  retire ----- free memory after a grace period
+ *          @param  release ----- free a value
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS
+ *                  ------ R_FAILED,  no enough memory
+ */
+static inline void* IPTrieSearch(const IPTrie* trie,ipkey_t addr)
+{
+  uintptr_t e=__atomic_load_n(trie->root+(size_t)(addr>>(IPT_MAXWIDTH-IPT_ROOT_BITS)),__ATOMIC_ACQUIRE);
+  const struct IPNode* node;
+  unsigned int bit=IPT_ROOT_BITS,s;
+
+  if((e&1)==0)
+    return (void*)e;
+  node=(const struct IPNode*)(e-1);
+  while(1)
+  {
+    s=(unsigned int)((addr<<bit)>>(IPT_MAXWIDTH-IPT_STRIDE));
+    if(((node->childmap>>s)&1)==0)
+      return node->leaf[__builtin_popcountll(node->leafmap&((2ULL<<s)-1))-1];
+    node=node->child+__builtin_popcountll(node->childmap&((1ULL<<s)-1));
+    bit+=IPT_STRIDE;
+  }
+}
+/*
+ * Usage: the value of the longest prefix of 'addr' in the published trie, it takes no lock
+ *        (the caller keeps the memory from being freed, like for BPTreeSearch).
+ * Output:  @return void*
+ *                  ------ the value, NULL if no prefix matches
+ */
+void IPTrieSearchBatch(const IPTrie* trie,const ipkey_t* addr,size_t n,void** values);
+/*
+ * Usage: IPTrieSearch() of n addresses, the walks of IPT_BATCH addresses at a time are
+ *        interleaved and prefetched, so their cache misses overlap.
+ * Input:   @param  void** values ----- receive the value of each address (n items)
+ */
+void* IPTrieFind(IPTrie* trie,ipkey_t prefix,unsigned int len);
+/*
+ * Usage: the value of exactly this prefix (writer side).
+ * Output:  @return void*
+ *                  ------ the value, NULL if not found
+ */
+result_t IPTrieUpdate(IPTrie* trie,ipkey_t prefix,unsigned int len,void* value);
+/*
+ * Usage: insert a prefix, or replace its value (the old value is retired). The bits after
+ *        'len' are ignored. 'value' must not be NULL, its low bit must be 0, and a value
+ *        belongs to one prefix only. Writers must be serialized by the caller.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, the change is published
+ *                  ------ R_FAILED,  bad length, or no enough memory (the trie is not changed)
+ */
+result_t IPTrieRemove(IPTrie* trie,ipkey_t prefix,unsigned int len);
+/*
+ * Usage: delete a prefix (its value is retired). Writers must be serialized by the caller.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, delete success (or not found)
+ *                  ------ R_FAILED,  no enough memory (the trie is not changed)
+ */
+result_t IPTrieWalk(IPTrie* trie,result_t (*visit)(ipkey_t prefix,unsigned int len,void* value,void* arg),void* arg);
+/*
+ * Usage: call 'visit' for every prefix (in no order), stop when it returns R_FAILED.
+ */
+void IPTrieDestroy(IPTrie* trie);
+/*
+ * Usage: free all the nodes and values at once. No reader may use the trie.
+ *        The values are left if trie->release is NULL (their memory is freed by the caller).
+ */
+
+#endif // DBIPTRIE_H_INCLUDED
@@ -0,0 +1,603 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "dbLog.h"
+#include "dbLogger.h"
+
+#define LOG_PATH_MAX 256
+#define LOG_DIR_MAX (LOG_PATH_MAX-32)  /* room for "/<seq>.log" */
+#define LOG_INTERVAL_DEFAULT 100      /* ms between two fdatasync of LOG_SYNC_INTERVAL */
+
+/*
+ * State of the log. 'written' and 'synced' count bytes since LogOpen(), so the appenders
+ * which wait for the disk compare their own end with 'synced' (group commit).
+ */
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          // 'synced' or 'stop' changed
+  int fd;                       // current segment, -1 if the log is closed
+  uint64_t seq;
+  uint64_t off;                 // end of the current segment
+  uint64_t written;
+  uint64_t synced;
+  int syncing;                  // one thread calls fdatasync for all
+  int stop;
+  int flusher;                  // the thread of LOG_SYNC_INTERVAL is running
+  pthread_t thread;
+  unsigned char policy;
+  unsigned int interval;
+  char dir[LOG_DIR_MAX];
+} Log={PTHREAD_MUTEX_INITIALIZER,PTHREAD_COND_INITIALIZER,-1,0,0,0,0,0,0,0,0,
+       LOG_SYNC_INTERVAL,LOG_INTERVAL_DEFAULT,""};
+
+static void Logging(const char *filePath, const char *logString);
+
+#ifndef __SSE4_2__
+static uint32_t CrcTable[256];
+static pthread_once_t CrcOnce=PTHREAD_ONCE_INIT;
+
+static void CrcInit(void)
+{
+   uint32_t i,j,c;
+   for(i=0;i<256;i++)
+   {
+      c=i;
+      for(j=0;j<8;j++)
+         c=(c&1) ? (c>>1)^0x82F63B78 : c>>1;
+      CrcTable[i]=c;
+   }
+}
+#endif
+
+/*
+ * CRC-32C (Castagnoli), the crc32 instruction of SSE4.2 computes it 8 bytes at a time.
+ */
+static uint32_t Crc32c(uint32_t crc,const void* data,size_t len)
+{
+   const unsigned char* p=(const unsigned char*)data;
+
+   crc=~crc;
+#ifdef __SSE4_2__
+   uint64_t c=crc,v;
+   while(len>=8)
+   {
+      memcpy(&v,p,8);
+      c=_mm_crc32_u64(c,v);
+      p+=8;
+      len-=8;
+   }
+   crc=(uint32_t)c;
+   while(len--)
+      crc=_mm_crc32_u8(crc,*p++);
+#else
+   pthread_once(&CrcOnce,CrcInit);
+   while(len--)
+      crc=CrcTable[(crc^*p++)&0xff]^(crc>>8);
+#endif
+   return ~crc;
+}
+
+static inline uint32_t FrameCrc(uint32_t word,const void* data)
+{
+   return Crc32c(Crc32c(0,&word,sizeof(word)),data,LOG_FRAME_SIZE(word));
+}
+
+static void SegmentPath(char* path,uint64_t seq)
+{
+   snprintf(path,LOG_PATH_MAX,"%s/%016llx.log",Log.dir,(unsigned long long)seq);
+}
+
+result_t LogSyncDir(const char* dir)
+{
+   int fd=open(dir,O_RDONLY|O_DIRECTORY);
+   result_t result=R_SUCCESS;
+   if(fd==-1)
+      return R_FAILED;
+   if(fsync(fd)!=0)
+      result=R_FAILED;
+   close(fd);
+   return result;
+}
+
+/*
+ * Create the segment 'seq' and write its header, return the file or -1.
+ */
+static int CreateSegment(uint64_t seq)
+{
+   struct log_segment_hdr hdr;
+   char path[LOG_PATH_MAX];
+   char logString[LOGGER_LINE];
+   int fd;
+
+   SegmentPath(path,seq);
+   fd=open(path,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0644);
+   if(fd==-1)
+      goto err_out;
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic,LOG_SEGMENT_MAGIC,sizeof(LOG_SEGMENT_MAGIC));
+   hdr.version=LOG_SEGMENT_VERSION;
+   hdr.seq=seq;
+   if(write(fd,&hdr,sizeof(hdr))!=sizeof(hdr) || fdatasync(fd)!=0 || LogSyncDir(Log.dir)!=R_SUCCESS)
+   {
+      close(fd);
+      unlink(path);
+      goto err_out;
+   }
+   return fd;
+
+err_out:
+   memset(logString, 0, LOGGER_LINE);
+   snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ CreateSegment @ %s --- %s", path, strerror(errno));
+   Logging(PROG_ERROR_LOG, logString);
+   return -1;
+}
+
+static int CompareSeq(const void* a,const void* b)
+{
+   uint64_t x=*(const uint64_t*)a,y=*(const uint64_t*)b;
+   return (x>y)-(x<y);
+}
+
+/*
+ * Sequence numbers of the segments in the directory, in order. return the count, -1 on error.
+ */
+static long ListSegments(uint64_t** list)
+{
+   DIR* dir;
+   struct dirent* ent;
+   uint64_t* seqs=NULL,*p;
+   size_t count=0,max=0;
+   char* end;
+   unsigned long long seq;
+
+   *list=NULL;
+   dir=opendir(Log.dir);
+   if(dir==NULL)
+      return -1;
+   while((ent=readdir(dir))!=NULL)
+   {
+      if(strlen(ent->d_name)!=20 || strcmp(ent->d_name+16,".log")!=0)
+         continue;
+      seq=strtoull(ent->d_name,&end,16);
+      if(end!=ent->d_name+16)
+         continue;
+      if(count==max)
+      {
+         max=max ? max*2 : 16;
+         p=(uint64_t*)realloc(seqs,max*sizeof(uint64_t));
+         if(p==NULL)
+         {
+            free(seqs);
+            closedir(dir);
+            return -1;
+         }
+         seqs=p;
+      }
+      seqs[count++]=seq;
+   }
+   closedir(dir);
+   if(count>1)
+      qsort(seqs,count,sizeof(uint64_t),CompareSeq);
+   *list=seqs;
+   return count;
+}
+
+/*
+ * Apply the frames of one segment from 'off'. A broken frame is cut off if it is in the
+ * last segment (a write which did not finish), otherwise the log is broken.
+ */
+static result_t ReplaySegment(uint64_t seq,uint64_t off,int last,LogApply apply,void* arg)
+{
+   const struct log_segment_hdr* hdr;
+   struct log_frame_hdr frame;
+   struct stat sb;
+   char path[LOG_PATH_MAX];
+   char logString[LOGGER_LINE];
+   void* base=NULL;
+   uint64_t pos;
+   uint32_t size;
+   int fd;
+
+   memset(logString, 0, LOGGER_LINE);
+   SegmentPath(path,seq);
+   fd=open(path,O_RDWR);
+   if(fd==-1 || fstat(fd,&sb)!=0)
+   {
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ ReplaySegment @ open --- %s: %s", path, strerror(errno));
+      goto err_out;
+   }
+   if((uint64_t)sb.st_size<sizeof(*hdr))
+   {
+      if(!last)
+      {
+         snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ ReplaySegment @ check --- %s is too small.", path);
+         goto err_out;
+      }
+      close(fd);          //the header was not written, the segment is created again
+      unlink(path);
+      return R_SUCCESS;
+   }
+   base=mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+   if(base==MAP_FAILED)
+   {
+      base=NULL;
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ ReplaySegment @ mmap --- %s", strerror(errno));
+      goto err_out;
+   }
+   hdr=(const struct log_segment_hdr*)base;
+   if(memcmp(hdr->magic,LOG_SEGMENT_MAGIC,sizeof(LOG_SEGMENT_MAGIC))!=0
+      || hdr->version<1 || hdr->version>LOG_SEGMENT_VERSION || hdr->seq!=seq)
+   {
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ ReplaySegment @ check --- bad header of %s.", path);
+      goto err_out;
+   }
+
+   pos=(off>sizeof(*hdr)) ? off : sizeof(*hdr);
+   while(pos<(uint64_t)sb.st_size)
+   {
+      if(pos+sizeof(frame)>(uint64_t)sb.st_size)
+         goto torn;
+      memcpy(&frame,(char*)base+pos,sizeof(frame));
+      size=LOG_FRAME_SIZE(frame.size);
+      if(size==0 || pos+sizeof(frame)+size>(uint64_t)sb.st_size
+         || FrameCrc(frame.size,(char*)base+pos+sizeof(frame))!=frame.crc)
+         goto torn;
+      if(apply(LOG_FRAME_TYPE(frame.size),(char*)base+pos+sizeof(frame),size,arg)==R_FAILED)
+      {
+         snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ ReplaySegment @ apply --- %s at %llu.", path, (unsigned long long)pos);
+         goto err_out;
+      }
+      pos+=sizeof(frame)+size;
+      Log.written+=sizeof(frame)+size;
+   }
+   munmap(base,sb.st_size);
+   close(fd);
+   return R_SUCCESS;
+
+torn:
+   if(!last)
+   {
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ ReplaySegment @ crc --- %s is broken at %llu.", path, (unsigned long long)pos);
+      goto err_out;
+   }
+   snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ ReplaySegment @ crc --- torn frame at the tail of %s (%llu bytes), cut off.",
+            path, (unsigned long long)(sb.st_size-pos));
+   Logging(PROG_ERROR_LOG, logString);
+   munmap(base,sb.st_size);
+   if(ftruncate(fd,pos)!=0 || fdatasync(fd)!=0)
+   {
+      memset(logString, 0, LOGGER_LINE);
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ ReplaySegment @ ftruncate --- %s", strerror(errno));
+      base=NULL;
+      goto err_out;
+   }
+   close(fd);
+   return R_SUCCESS;
+
+err_out:
+   if(base!=NULL)
+      munmap(base,sb.st_size);
+   if(fd!=-1)
+      close(fd);
+   Logging(PROG_ERROR_LOG, logString);
+   return R_FAILED;
+}
+
+/*
+ * Wait until the first 'target' bytes are on disk. The first waiter calls fdatasync for all
+ * the frames written so far, the others wait for it. Called with Log.lock.
+ */
+static result_t SyncTo(uint64_t target)
+{
+   uint64_t upto;
+   int fd,rtn;
+
+   while(Log.synced<target)
+   {
+      if(Log.syncing)
+      {
+         pthread_cond_wait(&Log.cond,&Log.lock);
+         continue;
+      }
+      Log.syncing=1;
+      upto=Log.written;
+      fd=Log.fd;
+      pthread_mutex_unlock(&Log.lock);
+      rtn=fdatasync(fd);
+      pthread_mutex_lock(&Log.lock);
+      Log.syncing=0;
+      if(rtn==0 && upto>Log.synced)
+         Log.synced=upto;
+      pthread_cond_broadcast(&Log.cond);
+      if(rtn!=0)
+         return R_FAILED;
+   }
+   return R_SUCCESS;
+}
+
+/*
+ * Start the next segment, the current one is synced first. Called with Log.lock.
+ */
+static result_t NextSegment(void)
+{
+   int fd;
+
+   while(Log.syncing)          //fdatasync may be running on the current segment
+      pthread_cond_wait(&Log.cond,&Log.lock);
+   if(fdatasync(Log.fd)!=0)
+      return R_FAILED;
+   Log.synced=Log.written;
+   pthread_cond_broadcast(&Log.cond);
+   fd=CreateSegment(Log.seq+1);
+   if(fd==-1)
+      return R_FAILED;
+   close(Log.fd);
+   Log.fd=fd;
+   Log.seq++;
+   Log.off=sizeof(struct log_segment_hdr);
+   return R_SUCCESS;
+}
+
+static void* Flusher(void* arg)
+{
+   struct timespec ts;
+
+   pthread_mutex_lock(&Log.lock);
+   while(!Log.stop)
+   {
+      clock_gettime(CLOCK_REALTIME,&ts);
+      ts.tv_sec+=Log.interval/1000;
+      ts.tv_nsec+=(Log.interval%1000)*1000000L;
+      if(ts.tv_nsec>=1000000000L)
+      {
+         ts.tv_sec++;
+         ts.tv_nsec-=1000000000L;
+      }
+      pthread_cond_timedwait(&Log.cond,&Log.lock,&ts);
+      if(!Log.stop && Log.policy==LOG_SYNC_INTERVAL && Log.fd!=-1 && Log.synced<Log.written)
+         SyncTo(Log.written);
+   }
+   pthread_mutex_unlock(&Log.lock);
+   return arg;
+}
+
+result_t LogOpen(const char* dir,uint64_t seq,uint64_t off,LogApply apply,void* arg)
+{
+   uint64_t* list;
+   char path[LOG_PATH_MAX];
+   char logString[LOGGER_LINE];
+   long count,i;
+   uint64_t next=seq;
+   int fd;
+
+   LogClose();
+   if(strlen(dir)>=LOG_DIR_MAX)
+   {
+      memset(logString, 0, LOGGER_LINE);
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ LogOpen @ check --- directory '%.200s...' is too long.", dir);
+      Logging(PROG_ERROR_LOG, logString);
+      return R_FAILED;
+   }
+   snprintf(Log.dir,LOG_DIR_MAX,"%s",dir);
+   if(mkdir(Log.dir,0755)!=0 && errno!=EEXIST)
+   {
+      memset(logString, 0, LOGGER_LINE);
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ LogOpen @ mkdir --- %s", strerror(errno));
+      Logging(PROG_ERROR_LOG, logString);
+      return R_FAILED;
+   }
+   count=ListSegments(&list);
+   if(count<0)
+   {
+      memset(logString, 0, LOGGER_LINE);
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ LogOpen @ opendir --- %s", strerror(errno));
+      Logging(PROG_ERROR_LOG, logString);
+      return R_FAILED;
+   }
+
+   Log.written=0;
+   for(i=0;i<count;i++)
+   {
+      if(list[i]<seq)
+      {  //folded into the snapshot, the compactor stopped before deleting it
+         SegmentPath(path,list[i]);
+         unlink(path);
+         continue;
+      }
+      if(list[i]!=next)
+      {
+         memset(logString, 0, LOGGER_LINE);
+         snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ LogOpen @ check --- segment %llx is missing.", (unsigned long long)next);
+         Logging(PROG_ERROR_LOG, logString);
+         free(list);
+         return R_FAILED;
+      }
+      if(ReplaySegment(list[i],(list[i]==seq) ? off : 0,i==count-1,apply,arg)==R_FAILED)
+      {
+         free(list);
+         return R_FAILED;
+      }
+      next=list[i]+1;
+   }
+   free(list);
+
+   //append to a new segment, the tail of the old one may be a cut off frame.
+   fd=CreateSegment(next);
+   if(fd==-1)
+      return R_FAILED;
+   pthread_mutex_lock(&Log.lock);
+   Log.fd=fd;
+   Log.seq=next;
+   Log.off=sizeof(struct log_segment_hdr);
+   Log.synced=Log.written;
+   Log.stop=0;
+   if(pthread_create(&Log.thread,NULL,Flusher,NULL)==0)
+      Log.flusher=1;
+   pthread_mutex_unlock(&Log.lock);
+   return R_SUCCESS;
+}
+
+result_t LogAppend(unsigned char type,const void* data,size_t size)
+{
+   struct log_frame_hdr frame;
+   struct iovec iov[2];
+   uint64_t end;
+   result_t result=R_SUCCESS;
+   ssize_t sz;
+   char logString[LOGGER_LINE];
+
+   if(size==0 || size+sizeof(frame)+sizeof(struct log_segment_hdr)>LOG_SEGMENT_SIZE
+      || type>LOG_FRAME_TYPE(~0U))
+      return R_FAILED;
+   frame.size=(uint32_t)type<<LOG_FRAME_TYPE_SHIFT|(uint32_t)size;
+   frame.crc=FrameCrc(frame.size,data);
+   iov[0].iov_base=&frame;
+   iov[0].iov_len=sizeof(frame);
+   iov[1].iov_base=(void*)data;
+   iov[1].iov_len=size;
+
+   pthread_mutex_lock(&Log.lock);
+   if(Log.fd==-1)
+   {
+      pthread_mutex_unlock(&Log.lock);
+      return R_FAILED;
+   }
+   if(Log.off+sizeof(frame)+size>LOG_SEGMENT_SIZE && NextSegment()==R_FAILED)
+   {
+      memset(logString, 0, LOGGER_LINE);
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ LogAppend @ segment --- %s", strerror(errno));
+      goto err_out;
+   }
+   sz=writev(Log.fd,iov,2);
+   if(sz!=(ssize_t)(sizeof(frame)+size))
+   {  //do not leave a part of the frame before the next one
+      memset(logString, 0, LOGGER_LINE);
+      snprintf(logString,LOGGER_LINE,"[ERROR] dbLog.c @ LogAppend @ write --- %s", sz<0 ? strerror(errno) : "short write");
+      if(sz>0 && ftruncate(Log.fd,Log.off)!=0)
+      {  //a frame after the broken one would be lost at the replay, stop logging.
+         while(Log.syncing)
+            pthread_cond_wait(&Log.cond,&Log.lock);
+         close(Log.fd);
+         Log.fd=-1;
+      }
+      goto err_out;
+   }
+   Log.off+=sz;
+   Log.written+=sz;
+   end=Log.written;
+   if(Log.policy==LOG_SYNC_ALWAYS)
+      result=SyncTo(end);
+   pthread_mutex_unlock(&Log.lock);
+   return result;
+
+err_out:
+   pthread_mutex_unlock(&Log.lock);
+   Logging(PROG_ERROR_LOG, logString);
+   return R_FAILED;
+}
+
+result_t LogSync(void)
+{
+   result_t result=R_FAILED;
+
+   pthread_mutex_lock(&Log.lock);
+   if(Log.fd!=-1)
+      result=SyncTo(Log.written);
+   pthread_mutex_unlock(&Log.lock);
+   return result;
+}
+
+result_t LogRoll(uint64_t* seq,uint64_t* off)
+{
+   result_t result=R_FAILED;
+
+   pthread_mutex_lock(&Log.lock);
+   if(Log.fd!=-1 && NextSegment()==R_SUCCESS)
+   {
+      *seq=Log.seq;
+      *off=Log.off;
+      result=R_SUCCESS;
+   }
+   pthread_mutex_unlock(&Log.lock);
+   return result;
+}
+
+void LogPurge(uint64_t seq)
+{
+   uint64_t* list;
+   char path[LOG_PATH_MAX];
+   long count,i;
+
+   count=ListSegments(&list);
+   for(i=0;i<count && list[i]<seq;i++)
+   {
+      SegmentPath(path,list[i]);
+      unlink(path);
+   }
+   free(list);
+   LogSyncDir(Log.dir);
+}
+
+uint64_t LogWritten(void)
+{
+   uint64_t written;
+
+   pthread_mutex_lock(&Log.lock);
+   written=Log.written;
+   pthread_mutex_unlock(&Log.lock);
+   return written;
+}
+
+void LogSetPolicy(unsigned char sync,unsigned int interval_ms)
+{
+   pthread_mutex_lock(&Log.lock);
+   Log.policy=sync;
+   Log.interval=interval_ms ? interval_ms : LOG_INTERVAL_DEFAULT;
+   pthread_cond_broadcast(&Log.cond);       //the flusher waits with the new interval
+   pthread_mutex_unlock(&Log.lock);
+}
+
+void LogClose(void)
+{
+   int flusher;
+
+   pthread_mutex_lock(&Log.lock);
+   Log.stop=1;
+   flusher=Log.flusher;
+   Log.flusher=0;
+   pthread_cond_broadcast(&Log.cond);
+   pthread_mutex_unlock(&Log.lock);
+   if(flusher)
+      pthread_join(Log.thread,NULL);
+
+   pthread_mutex_lock(&Log.lock);
+   while(Log.syncing)
+      pthread_cond_wait(&Log.cond,&Log.lock);
+   if(Log.fd!=-1)
+   {
+      fdatasync(Log.fd);
+      close(Log.fd);
+      Log.fd=-1;
+   }
+   pthread_mutex_unlock(&Log.lock);
+}
+
+static void
+Logging(const char *filePath, const char *logString )
+{
+	LoggerWrite(filePath,logString);      //queued, written by the thread of dbLogger.c
+}
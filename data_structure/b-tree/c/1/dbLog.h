@@ -0,0 +1,92 @@
+#ifndef DBLOG_H_INCLUDED
+#define DBLOG_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dbUtility.h"
+
+#define LOG_SEGMENT_SIZE (64*1024*1024)     /* a segment is closed when the next frame does not fit */
+#define LOG_SEGMENT_MAGIC "VDBLOG"
+#define LOG_SEGMENT_VERSION 2             /* 2: typed frames, segments of version 1 are read too */
+
+#define LOG_FRAME_TYPE_SHIFT 28
+#define LOG_FRAME_SIZE(word) ((word)&((1U<<LOG_FRAME_TYPE_SHIFT)-1))
+#define LOG_FRAME_TYPE(word) ((unsigned char)((word)>>LOG_FRAME_TYPE_SHIFT))
+
+/*
+ * Write-ahead log of the update record sets, in segment files '<dir>/<seq:016x>.log'.
+ * Layout of a segment: log_segment_hdr | frame | frame | ...
+ * A frame is log_frame_hdr and one record set (the records of one SaveDataToFile()), the crc
+ * (CRC-32C) covers the size and the records, so a torn write at the tail is detected.
+ * The high bits of the size word are the data type of the records (DATA_TYPE_*), always 0
+ * (DATA_TYPE_DOMAIN) in a segment of version 1.
+ * A position in the log is (seq, offset in the segment).
+ */
+struct log_segment_hdr
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t pad;
+  uint64_t seq;
+};
+
+struct log_frame_hdr
+{
+  uint32_t size;          // 数据类型(高4位) | 记录集字节数
+  uint32_t crc;
+};
+
+typedef result_t (*LogApply)(unsigned char type,void* data,size_t size,void* arg);
+
+result_t LogOpen(const char* dir,uint64_t seq,uint64_t off,LogApply apply,void* arg);
+/*
+ * Usage: replay the log from the position (seq, off), then open a new segment for appending.
+ *        A torn frame at the tail of the last segment is cut off, the segments before 'seq'
+ *        are already in the snapshot and are deleted.
+ * Input:   @param  const char* dir ----- directory of the segments (created if not exist)
+ *          @param  uint64_t seq, off ----- position of the first frame to replay
+ *          @param  apply ----- called with the type and the records of every frame, R_FAILED
+ *                              stops the replay
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS
+ *                  ------ R_FAILED,  broken log, I/O error, or a too long dir
+ */
+result_t LogAppend(unsigned char type,const void* data,size_t size);
+/*
+ * Usage: append one frame of records of 'type'. With LOG_SYNC_ALWAYS it returns when the frame is on disk, the
+ *        appenders which wait at the same time share one fdatasync (group commit).
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS
+ *                  ------ R_FAILED,  the frame is not written
+ */
+result_t LogSync(void);
+/*
+ * Usage: wait until all the appended frames are on disk.
+ */
+result_t LogRoll(uint64_t* seq,uint64_t* off);
+/*
+ * Usage: close the current segment and start a new one, '*seq' and '*off' receive the
+ *        position of the new segment's first frame. All the frames before it are on disk.
+ */
+void LogPurge(uint64_t seq);
+/*
+ * Usage: delete the segments before 'seq' (they are folded into the snapshot).
+ */
+uint64_t LogWritten(void);
+/*
+ * Usage: bytes of the frames replayed and appended since LogOpen().
+ */
+void LogSetPolicy(unsigned char sync,unsigned int interval_ms);
+/*
+ * Usage: LOG_SYNC_NONE, LOG_SYNC_INTERVAL (fdatasync every 'interval_ms') or LOG_SYNC_ALWAYS.
+ */
+void LogClose(void);
+/*
+ * Usage: sync and close the current segment.
+ */
+result_t LogSyncDir(const char* dir);
+/*
+ * Usage: fsync a directory, so the files created or renamed in it survive a crash.
+ */
+
+#endif // DBLOG_H_INCLUDED
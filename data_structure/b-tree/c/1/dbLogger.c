@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "dbLogger.h"
+#include "dbHash.h"
+
+#define STAMP_SIZE 48
+
+/*
+ * A slot of the ring is free for the producer of ticket t when seq==t (t%LOGGER_SLOTS is the
+ * slot), and is ready for the writer when seq==t+1; the writer gives it back with seq=t+LOGGER_SLOTS.
+ */
+struct LogEntry
+{
+   volatile uint64_t seq;
+   time_t when;
+   unsigned int length;            // 消息字节数（含'\n'）
+   char path[LOGGER_PATH];
+   char text[LOGGER_LINE];
+};
+
+struct LogFile
+{
+   char path[LOGGER_PATH];
+   int fd;                         // -1为未打开
+};
+
+/*
+ * Messages of one place in the current second, for one thread.
+ */
+struct LogLimit
+{
+   uint64_t key;
+   time_t second;
+   unsigned int count;
+   unsigned int suppressed;
+};
+
+static struct LogEntry Ring[LOGGER_SLOTS];
+static uint64_t Tail __attribute__((aligned(64)))=0;    //next ticket of the producers
+static uint64_t Head __attribute__((aligned(64)))=0;    //next message of the writer
+static unsigned long Dropped=0;                          //the ring was full
+static int Running=0;                                    //1 the writer runs, -1 no writer (write at once)
+static int Stopping=0;
+static int Registered=0;                                 //atexit and pthread_atfork are set
+static pthread_t Writer;
+static pthread_mutex_t StartLock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t WakeLock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WakeCond=PTHREAD_COND_INITIALIZER;   //the writer waits for messages
+static pthread_cond_t DoneCond=PTHREAD_COND_INITIALIZER;   //LoggerFlush waits for the writer
+static __thread struct LogLimit Limits[LOGGER_LIMITS];
+
+//writer thread only
+static struct LogFile Files[LOGGER_FILES];
+static time_t StampTime=-1;
+static char Stamp[STAMP_SIZE];
+static size_t StampLen=0;
+
+/*
+ * "[time]  " of a message, formatted again only when the second changes.
+ */
+static size_t FormatStamp(time_t when,char* buf)
+{
+   char timeLog[32];
+   struct tm tm;
+
+   if(when!=StampTime)
+   {
+      localtime_r(&when,&tm);
+      strftime(timeLog,sizeof(timeLog),"%d/%b/%Y:%H:%M:%S %Z",&tm);
+      StampLen=snprintf(Stamp,STAMP_SIZE,"[%s]  ",timeLog);
+      StampTime=when;
+   }
+   memcpy(buf,Stamp,StampLen);
+   return StampLen;
+}
+
+static int FileOf(const char* path)
+{
+   int i,slot=-1;
+
+   for(i=0;i<LOGGER_FILES;i++)
+   {
+      if(Files[i].fd!=-1 && strcmp(Files[i].path,path)==0)
+         return Files[i].fd;
+      if(Files[i].fd==-1 && slot<0)
+         slot=i;
+   }
+   if(slot<0)
+   {  //all open, close the first one
+      slot=0;
+      close(Files[0].fd);
+      Files[0].fd=-1;
+   }
+   Files[slot].fd=open(path,O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC,0644);
+   if(Files[slot].fd==-1)
+   {
+      perror("open");
+      return -1;
+   }
+   snprintf(Files[slot].path,LOGGER_PATH,"%s",path);
+   return Files[slot].fd;
+}
+
+static void CloseFiles(void)
+{
+   int i;
+   for(i=0;i<LOGGER_FILES;i++)
+   {
+      if(Files[i].fd!=-1)
+         close(Files[i].fd);
+      Files[i].fd=-1;
+   }
+}
+
+/*
+ * Write the messages which are ready (at most LOGGER_BATCH), the messages of a file with one
+ * writev. Return the count of messages.
+ */
+static int Drain(void)
+{
+   struct LogEntry* batch[LOGGER_BATCH];
+   char stamps[LOGGER_BATCH][STAMP_SIZE];
+   size_t stamplen[LOGGER_BATCH];
+   struct iovec iov[2*LOGGER_BATCH];
+   unsigned char done[LOGGER_BATCH];
+   uint64_t head=__atomic_load_n(&Head,__ATOMIC_RELAXED);
+   int n,i,j,k,fd;
+
+   for(n=0;n<LOGGER_BATCH;n++)
+   {
+      batch[n]=Ring+(head+n)%LOGGER_SLOTS;
+      if(__atomic_load_n(&(batch[n]->seq),__ATOMIC_ACQUIRE)!=head+n+1)
+         break;
+      stamplen[n]=FormatStamp(batch[n]->when,stamps[n]);
+      done[n]=0;
+   }
+   for(i=0;i<n;i++)
+   {
+      if(done[i])
+         continue;
+      //message i and the later ones of the same file
+      for(k=0,j=i;j<n;j++)
+      {
+         if(done[j] || strcmp(batch[j]->path,batch[i]->path)!=0)
+            continue;
+         iov[k].iov_base=stamps[j];
+         iov[k++].iov_len=stamplen[j];
+         iov[k].iov_base=batch[j]->text;
+         iov[k++].iov_len=batch[j]->length;
+         done[j]=1;
+      }
+      if((fd=FileOf(batch[i]->path))!=-1 && writev(fd,iov,k)==-1)
+         perror("writev");
+   }
+   for(i=0;i<n;i++)
+      __atomic_store_n(&(batch[i]->seq),head+i+LOGGER_SLOTS,__ATOMIC_RELEASE);
+   __atomic_store_n(&Head,head+n,__ATOMIC_RELEASE);
+   return n;
+}
+
+static void WriteDropped(void)
+{
+   unsigned long n=__atomic_exchange_n(&Dropped,0,__ATOMIC_RELAXED);
+   char line[STAMP_SIZE+128];
+   size_t len;
+   int fd;
+
+   if(n==0 || (fd=FileOf(PROG_ERROR_LOG))==-1)
+      return;
+   len=FormatStamp(time(NULL),line);
+   len+=snprintf(line+len,sizeof(line)-len,"[ERROR] dbLogger.c @ LoggerWrite --- %lu messages are lost, the log ring was full.\n",n);
+   if(write(fd,line,len)==-1)
+      perror("write");
+}
+
+static void* WriterMain(void* arg)
+{
+   struct timespec ts;
+   int n;
+
+   while(1)
+   {
+      n=Drain();
+      WriteDropped();
+      pthread_mutex_lock(&WakeLock);
+      pthread_cond_broadcast(&DoneCond);
+      if(n==0 && Stopping && __atomic_load_n(&Head,__ATOMIC_RELAXED)==__atomic_load_n(&Tail,__ATOMIC_ACQUIRE))
+      {
+         pthread_mutex_unlock(&WakeLock);
+         break;
+      }
+      if(n==0 && !Stopping)
+      {
+         clock_gettime(CLOCK_REALTIME,&ts);
+         ts.tv_nsec+=LOGGER_IDLE_MS*1000000L;
+         ts.tv_sec+=ts.tv_nsec/1000000000L;
+         ts.tv_nsec%=1000000000L;
+         pthread_cond_timedwait(&WakeCond,&WakeLock,&ts);
+      }
+      pthread_mutex_unlock(&WakeLock);
+      if(n==0 && Stopping)
+         sched_yield();          //a producer is still copying its message
+   }
+   CloseFiles();
+   return arg;
+}
+
+/*
+ * The child of fork() has no writer thread, the messages of the parent are not its own.
+ */
+static void ForkChild(void)
+{
+   int i;
+
+   pthread_mutex_init(&StartLock,NULL);
+   pthread_mutex_init(&WakeLock,NULL);
+   pthread_cond_init(&WakeCond,NULL);
+   pthread_cond_init(&DoneCond,NULL);
+   if(Running==1)
+   {
+      for(i=0;i<LOGGER_FILES;i++)
+      {
+         if(Files[i].fd!=-1)
+            close(Files[i].fd);
+      }
+   }
+   Running=0;
+}
+
+static int Start(void)
+{
+   int i,running;
+
+   pthread_mutex_lock(&StartLock);
+   if(Running==0)
+   {
+      for(i=0;i<LOGGER_SLOTS;i++)
+         Ring[i].seq=i;
+      Head=Tail=0;
+      Stopping=0;
+      for(i=0;i<LOGGER_FILES;i++)
+         Files[i].fd=-1;
+      StampTime=-1;
+      if(pthread_create(&Writer,NULL,WriterMain,NULL)==0)
+      {
+         if(!Registered)
+         {
+            atexit(LoggerStop);
+            pthread_atfork(NULL,NULL,ForkChild);
+            Registered=1;
+         }
+         __atomic_store_n(&Running,1,__ATOMIC_RELEASE);
+      }else
+         __atomic_store_n(&Running,-1,__ATOMIC_RELEASE);
+   }
+   running=Running;
+   pthread_mutex_unlock(&StartLock);
+   return running;
+}
+
+/*
+ * Without writer thread: the old way, open, write and close.
+ */
+static void WriteNow(const char* filePath,const char* text,size_t len)
+{
+   char timeLog[32];
+   FILE *LogFile;
+   struct tm tm;
+   time_t now = time(NULL);
+
+   localtime_r(&now,&tm);
+   strftime(timeLog,sizeof(timeLog),"%d/%b/%Y:%H:%M:%S %Z",&tm);
+   if((LogFile = fopen(filePath,"a+")) == NULL) { perror("fopen");  return; }
+   fprintf(LogFile,"[%s]  %.*s",timeLog,(int)len,text);
+   fclose(LogFile);
+}
+
+/*
+ * Copy one line into the ring, 0 if the ring is full.
+ */
+static int Enqueue(const char* filePath,const char* text,size_t len,time_t now)
+{
+   struct LogEntry* e;
+   uint64_t pos,seq;
+   int64_t dif;
+
+   pos=__atomic_load_n(&Tail,__ATOMIC_RELAXED);
+   while(1)
+   {
+      e=Ring+pos%LOGGER_SLOTS;
+      seq=__atomic_load_n(&(e->seq),__ATOMIC_ACQUIRE);
+      dif=(int64_t)(seq-pos);
+      if(dif==0)
+      {
+         if(__atomic_compare_exchange_n(&Tail,&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+            break;
+      }else if(dif<0)
+      {
+         __atomic_add_fetch(&Dropped,1,__ATOMIC_RELAXED);
+         return 0;
+      }else
+         pos=__atomic_load_n(&Tail,__ATOMIC_RELAXED);
+   }
+   e->when=now;
+   snprintf(e->path,LOGGER_PATH,"%s",filePath);
+   memcpy(e->text,text,len);
+   e->length=len;
+   __atomic_store_n(&(e->seq),pos+1,__ATOMIC_RELEASE);
+   //the writer wakes up by itself, unless many messages wait
+   if(pos+1-__atomic_load_n(&Head,__ATOMIC_RELAXED)>=LOGGER_BATCH)
+      pthread_cond_signal(&WakeCond);
+   return 1;
+}
+
+/*
+ * Count a message of its place, 0 if it is over LOGGER_BURST in this second.
+ * '*suppressed' is the count of the messages of the place which were not written.
+ */
+static int Limit(const char* filePath,const char* place,size_t len,time_t now,unsigned int* suppressed)
+{
+   uint64_t key=HashBytes((char*)place,len,0)^HashName(filePath);
+   struct LogLimit* l=Limits;
+   int i;
+
+   *suppressed=0;
+   for(i=0;i<LOGGER_LIMITS && Limits[i].key!=key;i++)
+   {
+      if(Limits[i].second<l->second)
+         l=Limits+i;
+   }
+   if(i<LOGGER_LIMITS)
+      l=Limits+i;
+   else
+   {  //a new place takes the one which was quiet for the longest time
+      l->key=key;
+      l->second=now;
+      l->count=0;
+      l->suppressed=0;
+   }
+   if(l->second!=now)
+   {
+      *suppressed=l->suppressed;
+      l->second=now;
+      l->count=0;
+      l->suppressed=0;
+   }
+   if(++(l->count)>LOGGER_BURST)
+   {
+      l->suppressed++;
+      return 0;
+   }
+   return 1;
+}
+
+static void Queue(const char* filePath,char* line,size_t len,time_t now)
+{
+   int running=__atomic_load_n(&Running,__ATOMIC_ACQUIRE);
+
+   if(len>=LOGGER_LINE)
+   {  //cut, keep the '\n'
+      len=LOGGER_LINE-1;
+      line[len-1]='\n';
+   }
+   if(running==0)
+      running=Start();
+   if(running!=1)
+      WriteNow(filePath,line,len);
+   else
+      Enqueue(filePath,line,len,now);
+}
+
+void LoggerWrite(const char* filePath,const char* logString)
+{
+   char line[LOGGER_LINE];
+   const char* end=strstr(logString," --- ");
+   size_t place;
+   unsigned int suppressed;
+   time_t now=time(NULL);
+
+   place=(end!=NULL) ? (size_t)(end-logString) : strlen(logString);
+   if(!Limit(filePath,logString,place,now,&suppressed))
+      return;
+   if(suppressed!=0)
+      Queue(filePath,line,snprintf(line,LOGGER_LINE,"%.*s --- %u more messages like this were suppressed.\n",
+            (int)(place<LOGGER_LINE/2 ? place : LOGGER_LINE/2),logString,suppressed),now);
+   Queue(filePath,line,snprintf(line,LOGGER_LINE,"%s\n",logString),now);
+}
+
+void LoggerFlush(void)
+{
+   uint64_t target=__atomic_load_n(&Tail,__ATOMIC_ACQUIRE);
+
+   pthread_mutex_lock(&WakeLock);
+   while(__atomic_load_n(&Running,__ATOMIC_ACQUIRE)==1 && __atomic_load_n(&Head,__ATOMIC_ACQUIRE)<target)
+   {
+      pthread_cond_signal(&WakeCond);
+      pthread_cond_wait(&DoneCond,&WakeLock);
+   }
+   pthread_mutex_unlock(&WakeLock);
+}
+
+void LoggerStop(void)
+{
+   pthread_mutex_lock(&StartLock);
+   if(Running==1)
+   {
+      pthread_mutex_lock(&WakeLock);
+      Stopping=1;
+      pthread_cond_signal(&WakeCond);
+      pthread_mutex_unlock(&WakeLock);
+      pthread_join(Writer,NULL);
+      __atomic_store_n(&Running,0,__ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&StartLock);
+}
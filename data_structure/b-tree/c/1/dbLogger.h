@@ -0,0 +1,40 @@
+#ifndef DBLOGGER_H_INCLUDED
+#define DBLOGGER_H_INCLUDED
+
+#include "dbUtility.h"
+
+#define LOGGER_SLOTS 1024            /* messages which can wait in the ring, power of 2 */
+#define LOGGER_LINE  512             /* longer messages are cut */
+#define LOGGER_PATH  128
+#define LOGGER_BATCH 64              /* messages of one writev */
+#define LOGGER_FILES 8               /* log files kept open by the writer */
+#define LOGGER_IDLE_MS 100           /* the writer checks the ring at least this often */
+#define LOGGER_BURST 10              /* messages of one place per second and thread, the rest is counted */
+#define LOGGER_LIMITS 16             /* places a thread limits at the same time */
+
+/*
+ * The program and error logs (PROG_ERROR_LOG, PROG_UPDATE_LOG ...) are written by a background
+ * thread. A caller copies its message into a lock-free ring (many producers, one consumer) and
+ * returns, it never waits for the disk or a lock; a message is dropped (and counted) when the
+ * ring is full. The writer keeps the files open, formats the time once per second and writes
+ * the messages of a file with one writev.
+ * The messages of one place (the text before " --- ") are limited to LOGGER_BURST per second
+ * in every thread, the number of the suppressed ones is written with the next one.
+ */
+
+void LoggerWrite(const char* filePath,const char* logString);
+/*
+ * Usage: queue one line for 'filePath' (the writer is started by the first call).
+ *        If the writer thread can not be started, the line is written at once.
+ */
+void LoggerFlush(void);
+/*
+ * Usage: wait until the lines queued before the call are written.
+ */
+void LoggerStop(void);
+/*
+ * Usage: write the queued lines, stop the writer and close the files (called at exit too).
+ *        A later LoggerWrite() starts it again.
+ */
+
+#endif // DBLOGGER_H_INCLUDED
@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "dbStats.h"
+
+static struct stats_page* StatsPage=NULL;
+static int StatsShared=0;                        //StatsPage is in the share memory
+static __thread struct stats_page* MyPage=NULL;  //page of MySlot
+static __thread struct stats_slot* MySlot=NULL;
+
+static void InitPage(struct stats_page* page)
+{
+   memset(page, 0, sizeof(struct stats_page));
+   page->version=STATS_VERSION;
+   page->slots=STATS_SLOTS;
+   page->buckets=STATS_BUCKETS;
+   page->hists=STAT_HISTS;
+   page->counters=STAT_COUNTERS;
+   page->started=time(NULL);
+   __atomic_store_n(&(page->magic),STATS_MAGIC,__ATOMIC_RELEASE);
+}
+
+struct stats_page* StatsAttach(int create)
+{
+   struct stats_page* page;
+   struct timespec pause={0, 1000000};
+   key_t key;
+   int id,created=0,i;
+
+   key=ftok(KEY_PATH, STATS_MEM_KEY);
+   if(key==-1)
+      return NULL;
+   id=-1;
+   if(create)
+   {
+      id=shmget(key,sizeof(struct stats_page),IPC_CREAT|IPC_EXCL|0644);
+      created=(id!=-1);
+   }
+   if(id==-1 && (create==0 || errno==EEXIST))
+      id=shmget(key,sizeof(struct stats_page),0);
+   if(id==-1)
+      return NULL;
+   page=(struct stats_page*)shmat(id, 0, create ? 0 : SHM_RDONLY);
+   if(page==(void*)(-1))
+      return NULL;
+   if(created)
+   {
+      InitPage(page);
+      return page;
+   }
+   // 创建者可能还在初始化
+   for(i=0; i<1000 && __atomic_load_n(&(page->magic),__ATOMIC_ACQUIRE)!=STATS_MAGIC; i++)
+      nanosleep(&pause,NULL);
+   if(page->magic!=STATS_MAGIC || page->version!=STATS_VERSION || page->slots!=STATS_SLOTS ||
+      page->buckets!=STATS_BUCKETS || page->hists!=STAT_HISTS || page->counters!=STAT_COUNTERS)
+   {
+      shmdt(page);
+      return NULL;
+   }
+   return page;
+}
+
+void StatsDetach(struct stats_page* page)
+{
+   if(page!=NULL)
+      shmdt(page);
+}
+
+result_t StatsOpen(void)
+{
+   struct stats_page* page;
+
+   if(StatsPage!=NULL)
+      return StatsShared ? R_SUCCESS : R_FAILED;
+   page=StatsAttach(1);
+   if(page!=NULL)
+   {
+      StatsShared=1;
+      __atomic_store_n(&StatsPage,page,__ATOMIC_RELEASE);
+      return R_SUCCESS;
+   }
+   //no share memory: count anyway, StatsSnapshot() still works
+   page=(struct stats_page*)malloc(sizeof(struct stats_page));
+   if(page!=NULL)
+   {
+      InitPage(page);
+      StatsShared=0;
+      __atomic_store_n(&StatsPage,page,__ATOMIC_RELEASE);
+   }
+   return R_FAILED;
+}
+
+void StatsClose(void)
+{
+   struct stats_page* page=StatsPage;
+
+   if(page==NULL)
+      return;
+   __atomic_store_n(&StatsPage,NULL,__ATOMIC_RELEASE);
+   if(StatsShared)
+      StatsDetach(page);
+   else
+      free(page);
+   StatsShared=0;
+}
+
+/*
+ * Slot of the calling thread, a thread takes the next one the first time it counts.
+ */
+static inline struct stats_slot* SlotOf(struct stats_page* page)
+{
+   if(MyPage!=page)
+   {
+      MySlot=page->slot+__atomic_fetch_add(&(page->next_slot),1,__ATOMIC_RELAXED)%STATS_SLOTS;
+      MyPage=page;
+   }
+   return MySlot;
+}
+
+uint64_t StatsNow(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+void StatsCount(unsigned int counter,uint64_t n)
+{
+   struct stats_page* page=__atomic_load_n(&StatsPage,__ATOMIC_ACQUIRE);
+
+   if(page==NULL || counter>=STAT_COUNTERS)
+      return;
+   __atomic_add_fetch(SlotOf(page)->counter+counter,n,__ATOMIC_RELAXED);
+}
+
+/*
+ * Bucket of a value: the values under 16 have one bucket each, then every power of 2 is cut
+ * in 1<<STATS_SUB_BITS buckets.
+ */
+static inline unsigned int BucketOf(uint64_t value)
+{
+   unsigned int e,b;
+
+   if(value<(2ULL<<STATS_SUB_BITS))
+      return value;
+   e=63-__builtin_clzll(value)-STATS_SUB_BITS;
+   b=(e<<STATS_SUB_BITS)+(unsigned int)(value>>e);
+   return b<STATS_BUCKETS ? b : STATS_BUCKETS-1;
+}
+
+uint64_t StatsBucketValue(unsigned int bucket)
+{
+   unsigned int e;
+
+   if(bucket<(2U<<STATS_SUB_BITS))
+      return bucket;
+   e=(bucket>>STATS_SUB_BITS)-1;
+   return (uint64_t)((bucket&((1U<<STATS_SUB_BITS)-1))+(1U<<STATS_SUB_BITS))<<e;
+}
+
+void StatsValue(unsigned int hist,uint64_t value)
+{
+   struct stats_page* page=__atomic_load_n(&StatsPage,__ATOMIC_ACQUIRE);
+
+   if(page==NULL || hist>=STAT_HISTS)
+      return;
+   __atomic_add_fetch(SlotOf(page)->hist[hist]+BucketOf(value),1,__ATOMIC_RELAXED);
+}
+
+void StatsSum(const struct stats_page* page,struct stats_snapshot* snap)
+{
+   unsigned int i,j,k;
+
+   memset(snap, 0, sizeof(struct stats_snapshot));
+   snap->started=page->started;
+   for(i=0;i<STATS_SLOTS;i++)
+   {
+      for(j=0;j<STAT_COUNTERS;j++)
+         snap->counter[j]+=__atomic_load_n(page->slot[i].counter+j,__ATOMIC_RELAXED);
+      for(j=0;j<STAT_HISTS;j++)
+         for(k=0;k<STATS_BUCKETS;k++)
+            snap->hist[j][k]+=__atomic_load_n(page->slot[i].hist[j]+k,__ATOMIC_RELAXED);
+   }
+}
+
+result_t StatsSnapshot(struct stats_snapshot* snap)
+{
+   struct stats_page* page=__atomic_load_n(&StatsPage,__ATOMIC_ACQUIRE);
+
+   if(page==NULL)
+      return R_FAILED;
+   StatsSum(page,snap);
+   return R_SUCCESS;
+}
+
+uint64_t StatsPercentile(const uint64_t* hist,double percent)
+{
+   uint64_t total=0,sum=0,rank;
+   unsigned int i;
+
+   for(i=0;i<STATS_BUCKETS;i++)
+      total+=hist[i];
+   if(total==0)
+      return 0;
+   rank=(uint64_t)(percent/100.0*total+0.5);
+   if(rank==0)
+      rank=1;
+   for(i=0;i<STATS_BUCKETS-1;i++)
+   {
+      sum+=hist[i];
+      if(sum>=rank)
+         return StatsBucketValue(i+1)-1;      //the largest value of the bucket
+   }
+   return StatsBucketValue(STATS_BUCKETS-1);
+}
@@ -0,0 +1,120 @@
+#ifndef DBSTATS_H_INCLUDED
+#define DBSTATS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dbUtility.h"
+
+#define STATS_MAGIC   0x56444253     /* "VDBS" */
+#define STATS_VERSION 1
+#define STATS_SLOTS   64             /* threads which count in a slot of their own */
+#define STATS_SUB_BITS 3             /* 8 buckets per power of 2, a value is known within 12.5% */
+#define STATS_BUCKETS 256            /* values up to 2^34 (17 s in ns), larger ones in the last bucket */
+
+//histograms
+#define STAT_HIST_SEARCH 0           /* SearchDomainName, SearchDomainNameBuffer (ns) */
+#define STAT_HIST_DEPTH  1           /* nodes visited by a search of the Hash-B-Tree */
+#define STAT_HIST_UPDATE 2           /* UpdateDomainName (ns) */
+#define STAT_HIST_FLUSH  3           /* AddListToBTree (ns) */
+#define STAT_HISTS       4
+
+//counters
+#define STAT_FOUND       0           /* searches (single and batch) */
+#define STAT_NOTFOUND    1
+#define STAT_INVALID     2           /* deleted by a quick update which is not flushed yet */
+#define STAT_OVERLAY_HIT 3           /* answered by the overlay of the cache lists */
+#define STAT_RESULT_HIT  4           /* answered by the result cache of the thread */
+#define STAT_RESULT_MISS 5
+#define STAT_UPDATED     6           /* records of UpdateDomainName */
+#define STAT_COUNTERS    7
+
+/*
+ * Statistics page in the share memory (key STATS_MEM_KEY), a tool (dbTop) attaches it read
+ * only while the process runs. A thread counts in its own slot with atomic adds on its own
+ * cache lines, so nothing is locked and the slots are only summed by the reader. More threads
+ * than STATS_SLOTS (or more processes) share the slots, which stays correct.
+ */
+struct stats_slot
+{
+  uint64_t counter[STAT_COUNTERS];
+  uint64_t hist[STAT_HISTS][STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct stats_page
+{
+  volatile uint32_t magic;           /* set when the page is initialized */
+  uint32_t version;
+  uint32_t slots;
+  uint32_t buckets;
+  uint32_t hists;
+  uint32_t counters;
+  uint64_t started;                  /* time() of the first process, or of the last reset */
+  uint32_t next_slot;                /* slot of the next thread */
+  struct stats_slot slot[STATS_SLOTS];
+};
+
+/*
+ * Sum of the slots.
+ */
+struct stats_snapshot
+{
+  uint64_t started;
+  uint64_t counter[STAT_COUNTERS];
+  uint64_t hist[STAT_HISTS][STATS_BUCKETS];
+};
+
+result_t StatsOpen(void);
+/*
+ * Usage: attach the statistics page (created by the first process).
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, the page is in the share memory
+ *                  ------ R_FAILED,  no share memory, the process counts in private memory
+ */
+void StatsClose(void);
+/*
+ * Usage: detach the page, nothing is counted any more. No thread may be counting.
+ */
+struct stats_page* StatsAttach(int create);
+/*
+ * Usage: attach the page of the share memory, read only if 'create' is 0 (for a tool).
+ * Output:  @return struct stats_page*
+ *                  ------ the page, NULL if it does not exist or is of another version
+ */
+void StatsDetach(struct stats_page* page);
+/*
+ * Usage: detach a page of StatsAttach().
+ */
+uint64_t StatsNow(void);
+/*
+ * Usage: monotonic clock in ns, for StatsValue().
+ */
+void StatsCount(unsigned int counter,uint64_t n);
+/*
+ * Usage: add 'n' to a counter (STAT_FOUND ...).
+ */
+void StatsValue(unsigned int hist,uint64_t value);
+/*
+ * Usage: count one value (STAT_HIST_SEARCH ...).
+ */
+void StatsSum(const struct stats_page* page,struct stats_snapshot* snap);
+/*
+ * Usage: sum the slots of 'page' into 'snap'. The counts are read without stopping the writers.
+ */
+result_t StatsSnapshot(struct stats_snapshot* snap);
+/*
+ * Usage: StatsSum() of the page of this process.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS
+ *                  ------ R_FAILED,  StatsOpen() was not called
+ */
+uint64_t StatsBucketValue(unsigned int bucket);
+/*
+ * Usage: the smallest value of a bucket.
+ */
+uint64_t StatsPercentile(const uint64_t* hist,double percent);
+/*
+ * Usage: the value under which 'percent' of a histogram is (within the precision of a bucket).
+ *        0 if the histogram is empty.
+ */
+
+#endif // DBSTATS_H_INCLUDED
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbSuffix.h"
+
+static inline unsigned long LabelHash(const char* label,size_t len)
+{  //FNV-1a
+   unsigned long h=2166136261UL;
+   size_t i;
+   for(i=0;i<len;i++)
+      h=(h^(unsigned char)label[i])*16777619UL;
+   return h;
+}
+
+/*
+ * Find the child 'label' in '*children', it takes no lock.
+ */
+static struct SuffixNode* SuffixChild(struct SuffixTable* const* children,const char* label,size_t len)
+{
+   struct SuffixTable* t=__atomic_load_n(children,__ATOMIC_ACQUIRE);
+   struct SuffixNode* c;
+   unsigned long i;
+   if(t==NULL)
+      return NULL;
+   for(i=LabelHash(label,len)&(t->size-1);(c=__atomic_load_n(&(t->slot[i]),__ATOMIC_ACQUIRE))!=NULL;i=(i+1)&(t->size-1))
+   {
+      if(c->len==len && memcmp(c->label,label,len)==0)
+         return c;
+   }
+   return NULL;
+}
+
+static void SuffixPut(struct SuffixTable* t,struct SuffixNode* child)
+{
+   unsigned long i=LabelHash(child->label,child->len)&(t->size-1);
+   while(t->slot[i]!=NULL)
+      i=(i+1)&(t->size-1);
+   __atomic_store_n(&(t->slot[i]),child,__ATOMIC_RELEASE);
+   t->count++;
+}
+
+/*
+ * Make a table of 'size' slots with the children of 't' (except 'skip').
+ */
+static struct SuffixTable* SuffixCopy(struct SuffixTable* t,unsigned int size,struct SuffixNode* skip)
+{
+   unsigned int i;
+   struct SuffixTable* nt=(struct SuffixTable*)calloc(1,sizeof(struct SuffixTable)+size*sizeof(struct SuffixNode*));
+   if(nt==NULL)
+      return NULL;
+   nt->size=size;
+   for(i=0;t!=NULL && i<t->size;i++)
+   {
+      if(t->slot[i]!=NULL && t->slot[i]!=skip)
+         SuffixPut(nt,t->slot[i]);
+   }
+   return nt;
+}
+
+/*
+ * Add a child to '*children'.
+ */
+static result_t SuffixInsert(SuffixTrie* trie,struct SuffixTable** children,struct SuffixNode* child)
+{
+   struct SuffixTable* t=*children,*nt;
+   if(t!=NULL && (t->count+1)*4<=t->size*3)
+   {
+      SuffixPut(t,child);
+      return R_SUCCESS;
+   }
+   nt=SuffixCopy(t,t==NULL ? 4 : t->size*2,NULL);
+   if(nt==NULL)
+      return R_FAILED;
+   SuffixPut(nt,child);
+   __atomic_store_n(children,nt,__ATOMIC_RELEASE);
+   if(t!=NULL)
+      trie->retire(t,free);
+   return R_SUCCESS;
+}
+
+/*
+ * Remove a child of '*children'.
+ */
+static result_t SuffixRemove(SuffixTrie* trie,struct SuffixTable** children,struct SuffixNode* child)
+{
+   struct SuffixTable* t=*children,*nt=NULL;
+   if(t->count>1 && (nt=SuffixCopy(t,t->size,child))==NULL)
+      return R_FAILED;
+   __atomic_store_n(children,nt,__ATOMIC_RELEASE);
+   trie->retire(t,free);
+   return R_SUCCESS;
+}
+
+/*
+ * The children of path[depth], the top table for the root.
+ */
+static inline struct SuffixTable** Children(SuffixTrie* trie,struct SuffixNode** path,int depth)
+{
+   return (depth==0) ? &(trie->top) : &(path[depth]->children);
+}
+
+/*
+ * Walk the labels of 'name' from the right. path[0] is the root (NULL), path[i] the node of
+ * the i-th label. The nodes which are not found are created if 'create' is set.
+ * return the depth of the name, -1 if it is not found (or no enough memory).
+ */
+static int SuffixPath(SuffixTrie* trie,const char* name,struct SuffixNode** path,int create)
+{
+   struct SuffixNode* child;
+   const char* end=name+strlen(name),*label;
+   int depth=0;
+
+   path[0]=NULL;
+   while(end>name)
+   {
+      label=end;
+      while(label>name && label[-1]!='.')
+         label--;
+      child=SuffixChild(Children(trie,path,depth),label,end-label);
+      if(child==NULL && create)
+      {
+         child=(struct SuffixNode*)malloc(sizeof(struct SuffixNode)+(end-label)+1);
+         if(child==NULL)
+            return -1;
+         child->value=NULL;
+         child->children=NULL;
+         child->len=end-label;
+         memcpy(child->label,label,end-label);
+         child->label[end-label]='\0';
+         if(SuffixInsert(trie,Children(trie,path,depth),child)==R_FAILED)
+         {
+            free(child);
+            return -1;
+         }
+      }
+      if(child==NULL)
+         return -1;
+      path[++depth]=child;
+      end=(label>name) ? label-1 : label;
+   }
+   return depth;
+}
+
+void SuffixTrieInit(SuffixTrie* trie,void (*retire)(void*,void (*)(void*)),void (*release)(void*))
+{
+   memset(trie, 0, sizeof(SuffixTrie));
+   trie->retire=retire;
+   trie->release=release;
+}
+
+result_t SuffixTrieCheck(const char* name)
+{
+   size_t len=strlen(name);
+   if(len==0 || len>=SUFFIX_NAME_MAX || name[0]=='.' || name[len-1]=='.' || strstr(name,"..")!=NULL)
+      return R_FAILED;
+   return R_SUCCESS;
+}
+
+void* SuffixTrieSearch(const SuffixTrie* trie,const char* domain)
+{
+   struct SuffixTable* const* children=&(trie->top);
+   struct SuffixNode* node;
+   void* value,*best=NULL;
+   const char* end=domain+strlen(domain),*label;
+
+   while(end>domain)
+   {
+      label=end;
+      while(label>domain && label[-1]!='.')
+         label--;
+      node=SuffixChild(children,label,end-label);
+      if(node==NULL)
+         break;
+      value=__atomic_load_n(&(node->value),__ATOMIC_ACQUIRE);
+      if(value!=NULL)
+         best=value;
+      children=&(node->children);
+      end=(label>domain) ? label-1 : label;
+   }
+   return best;
+}
+
+result_t SuffixTrieUpdate(SuffixTrie* trie,const char* name,void* value)
+{
+   struct SuffixNode* path[SUFFIX_NAME_MAX+1];
+   void* old;
+   int depth;
+
+   if(SuffixTrieCheck(name)==R_FAILED || (depth=SuffixPath(trie,name,path,1))<=0)
+      return R_FAILED;
+   old=path[depth]->value;
+   __atomic_store_n(&(path[depth]->value),value,__ATOMIC_RELEASE);
+   if(old!=NULL)
+      trie->retire(old,trie->release);
+   else
+      __atomic_fetch_add(&(trie->nrules),1,__ATOMIC_RELAXED);
+   return R_SUCCESS;
+}
+
+result_t SuffixTrieRemove(SuffixTrie* trie,const char* name)
+{
+   struct SuffixNode* path[SUFFIX_NAME_MAX+1],*node;
+   void* old;
+   int depth,i;
+
+   if(strlen(name)>=SUFFIX_NAME_MAX)
+      return R_SUCCESS;
+   depth=SuffixPath(trie,name,path,0);
+   if(depth<=0 || (old=path[depth]->value)==NULL)
+      return R_SUCCESS;
+   __atomic_store_n(&(path[depth]->value),NULL,__ATOMIC_RELEASE);
+   trie->retire(old,trie->release);
+   __atomic_fetch_sub(&(trie->nrules),1,__ATOMIC_RELAXED);
+
+   //drop the nodes which have no rule and no child any more.
+   for(i=depth;i>0;i--)
+   {
+      node=path[i];
+      if(node->value!=NULL || node->children!=NULL)
+         break;
+      if(SuffixRemove(trie,Children(trie,path,i-1),node)==R_FAILED)
+         break;              //no enough memory, an empty node does no harm.
+      trie->retire(node,free);
+   }
+   return R_SUCCESS;
+}
+
+/*
+ * Visit the rules under the table 't', name[pos...] is the name of its parent ("" for the top).
+ */
+static result_t WalkTable(const struct SuffixTable* t,char* name,int pos,int top,
+                          result_t (*visit)(const char*,void*,void*),void* arg)
+{
+   const struct SuffixNode* child;
+   unsigned int i;
+   int cpos;
+
+   for(i=0;i<t->size;i++)
+   {
+      child=t->slot[i];
+      if(child==NULL)
+         continue;
+      //child name is "label.parent" (no dot after a top level label)
+      cpos=pos-child->len-!top;
+      if(cpos<0)
+         return R_FAILED;
+      memcpy(name+cpos,child->label,child->len);
+      if(!top)
+         name[cpos+child->len]='.';
+      if(child->value!=NULL && visit(name+cpos,child->value,arg)==R_FAILED)
+         return R_FAILED;
+      if(child->children!=NULL && WalkTable(child->children,name,cpos,0,visit,arg)==R_FAILED)
+         return R_FAILED;
+   }
+   return R_SUCCESS;
+}
+
+result_t SuffixTrieWalk(SuffixTrie* trie,result_t (*visit)(const char* name,void* value,void* arg),void* arg)
+{
+   char name[SUFFIX_NAME_MAX+1];
+
+   name[SUFFIX_NAME_MAX]='\0';
+   if(trie->top==NULL)
+      return R_SUCCESS;
+   return WalkTable(trie->top,name,SUFFIX_NAME_MAX,1,visit,arg);
+}
+
+static void FreeTable(SuffixTrie* trie,struct SuffixTable* t)
+{
+   unsigned int i;
+   for(i=0;i<t->size;i++)
+   {
+      if(t->slot[i]==NULL)
+         continue;
+      if(t->slot[i]->children!=NULL)
+         FreeTable(trie,t->slot[i]->children);
+      if(t->slot[i]->value!=NULL && trie->release!=NULL)
+         trie->release(t->slot[i]->value);
+      free(t->slot[i]);
+   }
+   free(t);
+}
+
+void SuffixTrieDestroy(SuffixTrie* trie)
+{
+   if(trie->top!=NULL)
+      FreeTable(trie,trie->top);
+   trie->top=NULL;
+   trie->nrules=0;
+}
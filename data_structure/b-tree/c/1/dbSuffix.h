@@ -0,0 +1,89 @@
+#ifndef DBSUFFIX_H_INCLUDED
+#define DBSUFFIX_H_INCLUDED
+
+#include <stddef.h>
+#include "dbUtility.h"
+
+#define SUFFIX_NAME_MAX 256         /* max length of a suffix rule */
+
+/*
+ * Suffix (wildcard) rules, in a trie of reversed labels: "a.example.com" is com -> example -> a.
+ * The children of a node are an open addressing table hashed by their label.
+ * Readers walk it without lock. A published child table is only changed by filling an empty
+ * slot (a probe sees NULL or the whole child), other changes copy the table; the replaced
+ * tables, nodes and values are given to 'retire', which must free them when no reader uses
+ * them any more.
+ */
+struct SuffixTable
+{
+  unsigned int size;            /* slots (power of 2, at least 1/4 of them empty) */
+  unsigned int count;
+  struct SuffixNode* slot[];
+};
+
+struct SuffixNode
+{
+  void* value;                  /* rule of the node (and all its subdomains), NULL is no rule */
+  struct SuffixTable* children;
+  unsigned short len;
+  char label[];
+};
+
+typedef struct
+{
+  struct SuffixTable* top;                      /* the top level labels */
+  unsigned long nrules;
+  void (*retire)(void* ptr,void (*release)(void*));
+  void (*release)(void* value);
+}SuffixTrie;
+
+void SuffixTrieInit(SuffixTrie* trie,void (*retire)(void*,void (*)(void*)),void (*release)(void*));
+/*
+ * Usage: initial an empty trie.
+ * Input:   @param  SuffixTrie* trie ----- the trie
+ *          @param  retire ----- free memory after a grace period
+ *          @param  release ----- free a value
+ */
+result_t SuffixTrieCheck(const char* name);
+/*
+ * Usage: check a rule: not empty, shorter than SUFFIX_NAME_MAX and no empty label
+ *        ("a..b.com", ".com" and "com." are bad).
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, a good rule
+ *                  ------ R_FAILED,  a bad rule
+ */
+void* SuffixTrieSearch(const SuffixTrie* trie,const char* domain);
+/*
+ * Usage: the value of the longest suffix rule of 'domain' (whole labels only), one table
+ *        probe per label, no memory allocated. It takes no lock (the caller keeps the memory
+ *        from being freed).
+ * Output:  @return void*
+ *                  ------ the value, NULL if no rule matches
+ */
+result_t SuffixTrieUpdate(SuffixTrie* trie,const char* name,void* value);
+/*
+ * Usage: insert a rule, or replace its value (the old value is retired). 'value' must not be
+ *        NULL. Writers must be serialized by the caller.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, the change is published
+ *                  ------ R_FAILED,  bad rule (SuffixTrieCheck), or no enough memory
+ */
+result_t SuffixTrieRemove(SuffixTrie* trie,const char* name);
+/*
+ * Usage: delete a rule (its value is retired), and the nodes which are left without rule
+ *        and child. Writers must be serialized by the caller.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, delete success (or not found)
+ */
+result_t SuffixTrieWalk(SuffixTrie* trie,result_t (*visit)(const char* name,void* value,void* arg),void* arg);
+/*
+ * Usage: call 'visit' for every rule (a node before its children, else in no order), stop
+ *        when it returns R_FAILED. Writers must be serialized by the caller.
+ */
+void SuffixTrieDestroy(SuffixTrie* trie);
+/*
+ * Usage: free all the nodes and values at once, the trie is empty. No reader may use the trie.
+ *        The values are left if trie->release is NULL (their memory is freed by the caller).
+ */
+
+#endif // DBSUFFIX_H_INCLUDED
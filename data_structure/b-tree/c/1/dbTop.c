@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "dbStats.h"
+
+/*
+ * Statistics of the running venusDB processes, read from the page in the share memory.
+ * Usage: ./dbTop              totals since the start (or the last reset)
+ *        ./dbTop <seconds>    the rates and latencies of every interval, until it is killed
+ *        ./dbTop -r           reset the counters
+ */
+
+static const char* HistName[STAT_HISTS]={"search","B-tree depth","update","flush"};
+static const int HistTime[STAT_HISTS]={1,0,1,1};
+
+static void Value(char* buf,size_t size,uint64_t v,int time)
+{
+  if(!time)
+     snprintf(buf,size,"%lu",(unsigned long)v);
+  else if(v<10000)
+     snprintf(buf,size,"%luns",(unsigned long)v);
+  else if(v<10000000)
+     snprintf(buf,size,"%.1fus",v/1e3);
+  else if(v<10000000000ULL)
+     snprintf(buf,size,"%.1fms",v/1e6);
+  else
+     snprintf(buf,size,"%.1fs",v/1e9);
+}
+
+static void Report(const struct stats_snapshot* s,double seconds)
+{
+  static const double pct[]={50,90,99,99.9,100};
+  const uint64_t* c=s->counter;
+  uint64_t total,lookups=c[STAT_RESULT_HIT]+c[STAT_RESULT_MISS];
+  char buf[32];
+  unsigned int i,j;
+
+  total=c[STAT_FOUND]+c[STAT_NOTFOUND];
+  printf("searches %lu",(unsigned long)total);
+  if(seconds>0)
+     printf(" (%.0f/s)",total/seconds);
+  printf("  found %lu  notfound %lu  invalid %lu  overlay hits %lu\n",(unsigned long)c[STAT_FOUND],
+         (unsigned long)c[STAT_NOTFOUND],(unsigned long)c[STAT_INVALID],(unsigned long)c[STAT_OVERLAY_HIT]);
+  printf("result cache %lu hits, %lu misses (%.1f%% hit)  updated records %lu\n",(unsigned long)c[STAT_RESULT_HIT],
+         (unsigned long)c[STAT_RESULT_MISS],lookups ? 100.0*c[STAT_RESULT_HIT]/lookups : 0.0,
+         (unsigned long)c[STAT_UPDATED]);
+  printf("%-14s %12s %9s %9s %9s %9s %9s\n","","count","p50","p90","p99","p99.9","max");
+  for(i=0;i<STAT_HISTS;i++)
+  {
+     for(total=0,j=0;j<STATS_BUCKETS;j++)
+        total+=s->hist[i][j];
+     printf("%-14s %12lu",HistName[i],(unsigned long)total);
+     for(j=0;j<sizeof(pct)/sizeof(pct[0]);j++)
+     {
+        Value(buf,sizeof(buf),StatsPercentile(s->hist[i],pct[j]),HistTime[i]);
+        printf(" %9s",total ? buf : "-");
+     }
+     printf("\n");
+  }
+  fflush(stdout);
+}
+
+static void Delta(struct stats_snapshot* d,const struct stats_snapshot* now,const struct stats_snapshot* old)
+{
+  unsigned int i,j;
+
+  d->started=now->started;
+  for(i=0;i<STAT_COUNTERS;i++)
+     d->counter[i]=now->counter[i]-old->counter[i];
+  for(i=0;i<STAT_HISTS;i++)
+     for(j=0;j<STATS_BUCKETS;j++)
+        d->hist[i][j]=now->hist[i][j]-old->hist[i][j];
+}
+
+int main(int argc, char* argv[])
+{
+  struct stats_page* page;
+  struct stats_snapshot* snap,*old,*delta;
+  char started[64];
+  time_t t;
+  int interval=0;
+
+  if(argc>1 && strcmp(argv[1],"-r")==0)
+  {
+     page=StatsAttach(1);
+     if(page==NULL)
+     {
+        fprintf(stderr,"no statistics page (key %s, %d)\n",KEY_PATH,STATS_MEM_KEY);
+        return 1;
+     }
+     //the writers keep counting, a count of the reset moment may be lost
+     memset(page->slot, 0, sizeof(page->slot));
+     page->started=time(NULL);
+     StatsDetach(page);
+     return 0;
+  }
+  if(argc>1)
+     interval=atoi(argv[1]);
+  page=StatsAttach(0);
+  if(page==NULL)
+  {
+     fprintf(stderr,"no statistics page (key %s, %d), is venusDB running?\n",KEY_PATH,STATS_MEM_KEY);
+     return 1;
+  }
+  snap=(struct stats_snapshot*)malloc(sizeof(*snap));
+  old=(struct stats_snapshot*)malloc(sizeof(*old));
+  delta=(struct stats_snapshot*)malloc(sizeof(*delta));
+  if(snap==NULL || old==NULL || delta==NULL)
+  {
+     fprintf(stderr,"no enough memory\n");
+     return 1;
+  }
+
+  StatsSum(page,snap);
+  t=(time_t)snap->started;
+  strftime(started,sizeof(started),"%d/%b/%Y:%H:%M:%S",localtime(&t));
+  printf("since %s\n",started);
+  Report(snap,interval>0 ? 0 : (double)(time(NULL)-t));
+  while(interval>0)
+  {
+     memcpy(old,snap,sizeof(*snap));
+     sleep(interval);
+     StatsSum(page,snap);
+     Delta(delta,snap,old);
+     printf("\n");
+     Report(delta,interval);
+  }
+  StatsDetach(page);
+  return 0;
+}
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbURLTable.h"
+#include "dbHash.h"
+
+int URLNormalize(const char* url,char* out,size_t size,size_t* hostlen)
+{
+   const char* p=url,*s,*host,*end;
+   size_t n=0,k;
+
+   k=strcspn(url,"/?#");
+   s=strstr(url,"://");
+   if(s!=NULL && (size_t)(s-url)<k)
+      p=s+3;
+   k=strcspn(p,"/?#");
+   end=p+k;
+   for(host=end;host>p && host[-1]!='@';host--)
+      ;
+   if(host[0]=='[')
+   {  //IPv6 literal
+      s=memchr(host,']',end-host);
+      if(s==NULL)
+         return -1;
+      s++;
+   }else{
+      for(s=end;s>host && s[-1]!=':';s--)
+         ;
+      s=(s>host) ? s-1 : end;
+   }
+   for(;host<s && n+1<size;host++)
+      out[n++]=(*host>='A' && *host<='Z') ? *host+('a'-'A') : *host;
+   if(host<s)
+      return -1;
+   while(n>0 && out[n-1]=='.')
+      n--;
+   if(n==0)
+      return -1;
+   *hostlen=n;
+   k=strcspn(end,"?#");
+   while(k>0 && end[k-1]=='/')
+      k--;
+   if(n+k+1>size)
+      return -1;
+   memcpy(out+n,end,k);
+   n+=k;
+   out[n]='\0';
+   return (int)n;
+}
+
+static struct URLIndex* IndexCreate(size_t size)
+{
+   struct URLIndex* t=(struct URLIndex*)calloc(1,sizeof(struct URLIndex)+size*sizeof(struct URLSlot));
+   if(t==NULL)
+      return NULL;
+   t->size=size;
+   t->hosts=FilterCreate(size/2);
+   if(t->hosts==NULL)
+   {
+      free(t);
+      return NULL;
+   }
+   return t;
+}
+
+/*
+ * The table only, its values are moved to the next table or retired one by one.
+ */
+static void ReleaseIndex(void* index)
+{
+   struct URLIndex* t=(struct URLIndex*)index;
+   FilterDestroy(t->hosts);
+   free(t);
+}
+
+/*
+ * Slot of the rule 'key', t->size if not found. It takes no lock.
+ */
+static size_t IndexFind(const URLTable* table,const struct URLIndex* t,const char* key,size_t len,uint64_t hash)
+{
+   const void* value;
+   const char* name;
+   size_t i;
+
+   for(i=hash&(t->size-1);(value=__atomic_load_n(&(t->slot[i].value),__ATOMIC_ACQUIRE))!=NULL;i=(i+1)&(t->size-1))
+   {
+      if(value!=URL_TOMB && t->slot[i].hash==hash
+         && strncmp(name=table->key(value),key,len)==0 && name[len]=='\0')
+         return i;
+   }
+   return t->size;
+}
+
+/*
+ * Add a new rule, the caller leaves a free slot.
+ */
+static void IndexPut(const URLTable* table,struct URLIndex* t,uint64_t hash,void* value)
+{
+   const char* name=table->key(value);
+   size_t i=hash&(t->size-1);
+   while(t->slot[i].value!=NULL)
+      i=(i+1)&(t->size-1);
+   FilterAdd(t->hosts,HashBytes((char*)name,strcspn(name,"/"),0));
+   t->slot[i].hash=hash;
+   __atomic_store_n(&(t->slot[i].value),value,__ATOMIC_RELEASE);
+   t->used++;
+}
+
+/*
+ * Copy the rules into a table with room for as many again, without the tombs.
+ */
+static struct URLIndex* IndexGrow(const URLTable* table)
+{
+   struct URLIndex* t=table->index,*nt;
+   size_t size=URL_TABLE_MIN,i;
+
+   while(size<(table->nrules+1)*4)
+      size*=2;
+   if((nt=IndexCreate(size))==NULL)
+      return NULL;
+   for(i=0;i<t->size;i++)
+   {
+      if(t->slot[i].value!=NULL && t->slot[i].value!=URL_TOMB)
+         IndexPut(table,nt,t->slot[i].hash,t->slot[i].value);
+   }
+   return nt;
+}
+
+result_t URLTableInit(URLTable* table,const char* (*key)(const void*),void (*retire)(void*,void (*)(void*)),void (*release)(void*))
+{
+   memset(table, 0, sizeof(URLTable));
+   if((table->index=IndexCreate(URL_TABLE_MIN))==NULL)
+      return R_FAILED;
+   table->key=key;
+   table->retire=retire;
+   table->release=release;
+   return R_SUCCESS;
+}
+
+void* URLTableSearch(const URLTable* table,const char* url)
+{
+   const struct URLIndex* t=__atomic_load_n(&(table->index),__ATOMIC_ACQUIRE);
+   void* value;
+   char key[URL_NAME_MAX];
+   size_t hostlen,i;
+   int len;
+
+   len=URLNormalize(url,key,sizeof(key),&hostlen);
+   if(len<0 || t==NULL || !FilterMayContain(t->hosts,HashBytes(key,hostlen,0)))
+      return NULL;
+   while(1)
+   {
+      i=IndexFind(table,t,key,len,HashBytes(key,len,0));
+      if(i<t->size && (value=__atomic_load_n(&(t->slot[i].value),__ATOMIC_ACQUIRE))!=URL_TOMB && value!=NULL)
+         return value;
+      if((size_t)len==hostlen)
+         return NULL;
+      do
+         len--;
+      while((size_t)len>hostlen && key[len]!='/');
+   }
+}
+
+result_t URLTableUpdate(URLTable* table,void* value)
+{
+   struct URLIndex* t=table->index,*nt;
+   const char* key=table->key(value);
+   size_t len=strlen(key),i;
+   uint64_t hash=HashBytes((char*)key,len,0);
+   void* old;
+
+   i=IndexFind(table,t,key,len,hash);
+   if(i<t->size)
+   {  //a new value of the rule
+      old=t->slot[i].value;
+      __atomic_store_n(&(t->slot[i].value),value,__ATOMIC_RELEASE);
+      table->retire(old,table->release);
+      return R_SUCCESS;
+   }
+   if((t->used+1)*4>t->size*3)
+   {
+      if((nt=IndexGrow(table))==NULL)
+         return R_FAILED;
+      __atomic_store_n(&(table->index),nt,__ATOMIC_RELEASE);
+      table->retire(t,ReleaseIndex);
+      t=nt;
+   }
+   IndexPut(table,t,hash,value);
+   __atomic_fetch_add(&(table->nrules),1,__ATOMIC_RELAXED);
+   return R_SUCCESS;
+}
+
+result_t URLTableRemove(URLTable* table,const char* key)
+{
+   struct URLIndex* t=table->index;
+   size_t len=strlen(key),i;
+   void* old;
+
+   i=IndexFind(table,t,key,len,HashBytes((char*)key,len,0));
+   if(i<t->size)
+   {
+      old=t->slot[i].value;
+      __atomic_store_n(&(t->slot[i].value),URL_TOMB,__ATOMIC_RELEASE);
+      FilterRemove(t->hosts,HashBytes((char*)key,strcspn(key,"/"),0));
+      table->retire(old,table->release);
+      __atomic_fetch_sub(&(table->nrules),1,__ATOMIC_RELAXED);
+   }
+   return R_SUCCESS;
+}
+
+result_t URLTableWalk(URLTable* table,result_t (*visit)(void* value,void* arg),void* arg)
+{
+   struct URLIndex* t=table->index;
+   size_t i;
+
+   for(i=0;t!=NULL && i<t->size;i++)
+   {
+      if(t->slot[i].value!=NULL && t->slot[i].value!=URL_TOMB && visit(t->slot[i].value,arg)==R_FAILED)
+         return R_FAILED;
+   }
+   return R_SUCCESS;
+}
+
+void URLTableDestroy(URLTable* table)
+{
+   struct URLIndex* t=table->index;
+   size_t i;
+
+   if(t==NULL)
+      return;
+   for(i=0;table->release!=NULL && i<t->size;i++)
+   {
+      if(t->slot[i].value!=NULL && t->slot[i].value!=URL_TOMB)
+         table->release(t->slot[i].value);
+   }
+   ReleaseIndex(t);
+   table->index=NULL;
+   table->nrules=0;
+}
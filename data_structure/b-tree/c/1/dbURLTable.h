@@ -0,0 +1,101 @@
+#ifndef DBURLTABLE_H_INCLUDED
+#define DBURLTABLE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dbUtility.h"
+#include "dbFilter.h"
+
+#define URL_NAME_MAX  2048          /* max length of a normalized URL (host/path) */
+#define URL_TABLE_MIN 1024          /* slots of the smallest table, power of 2 */
+#define URL_TOMB      ((void*)1)    /* value of a deleted slot */
+
+/*
+ * URL rules: "host" or "host/path", the rule of a path covers the path and everything under
+ * it ("example.com/a" covers "example.com/a/b.html", not "example.com/ab").
+ * Open addressing table of the normalized rules (hashed with HashBytes), and a filter of their
+ * hosts. Readers take no lock: a slot is filled once (the hash, then the value), a deleted
+ * value leaves a tomb, and a full table is copied into a new one which is swapped; the
+ * replaced tables and values are given to 'retire', which must free them when no reader uses
+ * them any more.
+ */
+struct URLSlot
+{
+  uint64_t hash;
+  void* value;                  /* NULL is empty, URL_TOMB is deleted */
+};
+
+struct URLIndex
+{
+  size_t size;                  /* power of 2 */
+  size_t used;                  /* slots which are not empty (tombs too) */
+  Filter* hosts;                /* hash of the host of every rule */
+  struct URLSlot slot[];
+};
+
+typedef struct
+{
+  struct URLIndex* index;                       /* the published table */
+  unsigned long nrules;
+  const char* (*key)(const void* value);        /* the normalized rule of a value */
+  void (*retire)(void* ptr,void (*release)(void*));
+  void (*release)(void* value);
+}URLTable;
+
+int URLNormalize(const char* url,char* out,size_t size,size_t* hostlen);
+/*
+ * Usage: "http://User@WWW.Example.COM.:8080/a/b/?q=1#x" is "www.example.com/a/b": no scheme,
+ *        user, port, query or fragment, the host in lower case, no dot after the host nor
+ *        slash at the end.
+ * Input:   @param  char* out ----- receive the normalized URL, 'size' bytes
+ *          @param  size_t* hostlen ----- receive the length of the host
+ * Output:  @return int
+ *                  ------ the length of the normalized URL
+ *                  ------ -1, not a URL or too long
+ */
+result_t URLTableInit(URLTable* table,const char* (*key)(const void*),void (*retire)(void*,void (*)(void*)),void (*release)(void*));
+/*
+ * Usage: initial an empty table.
+ * Input:   @param  URLTable* table ----- the table
+ *          @param  key ----- the normalized rule of a value
+ *          @param  retire ----- free memory after a grace period
+ *          @param  release ----- free a value
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS
+ *                  ------ R_FAILED,  no enough memory
+ */
+void* URLTableSearch(const URLTable* table,const char* url);
+/*
+ * Usage: the value of the longest path prefix of 'url': the whole path, then the path up to
+ *        each '/' from the right, then the host. The filter of the hosts answers most misses
+ *        at once. It takes no lock (the caller keeps the memory from being freed).
+ * Output:  @return void*
+ *                  ------ the value, NULL if no rule matches
+ */
+result_t URLTableUpdate(URLTable* table,void* value);
+/*
+ * Usage: insert the rule of 'value' (table->key), or replace its value (the old value is
+ *        retired). 'value' must not be NULL nor URL_TOMB. Writers must be serialized by the
+ *        caller.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, the change is published
+ *                  ------ R_FAILED,  no enough memory (the table is not changed)
+ */
+result_t URLTableRemove(URLTable* table,const char* key);
+/*
+ * Usage: delete a normalized rule (its value is retired). Writers must be serialized by the
+ *        caller.
+ * Output:  @return result_t
+ *                  ------ R_SUCCESS, delete success (or not found)
+ */
+result_t URLTableWalk(URLTable* table,result_t (*visit)(void* value,void* arg),void* arg);
+/*
+ * Usage: call 'visit' for every rule (in no order), stop when it returns R_FAILED.
+ */
+void URLTableDestroy(URLTable* table);
+/*
+ * Usage: free the table and the values at once. No reader may use the table.
+ *        The values are left if table->release is NULL (their memory is freed by the caller).
+ */
+
+#endif // DBURLTABLE_H_INCLUDED
@@ -24,6 +24,13 @@ typedef int result_t;                 /* Function return type */
 #define CFLAG_REDIRECT  1                       /* control type of data (redirect) */
 #define CFLAG_CHEAT	2                       /* control type of data (cheat) */
 
+#define LOG_SYNC_NONE      0                    /* write-ahead log: write only, the OS flushes the pages */
+#define LOG_SYNC_INTERVAL  1                    /* write-ahead log: fdatasync every interval (default) */
+#define LOG_SYNC_ALWAYS    2                    /* write-ahead log: fdatasync before SaveToFile() returns */
+
+#define ENGINE_HASH_BTREE  0                    /* index engine (Hash table of B-trees) */
+#define ENGINE_BPLUS_TREE  1                    /* index engine (one B+ tree, 64-bit keys) */
+
 #pragma pack(push,1)
 /*
 ** header of a set of update records.(include: update type, data type, and  all records size <bytes> )
@@ -43,21 +50,28 @@ struct data_hdr
 {
 	unsigned char control_type:2,       //位段操作
 		      opcode_type:2,
-		      reserve:4;
+		      wildcard:1,       /* suffix rule: matches the domain and all its subdomains */
+		      reserve:3;
 	unsigned short  val_length;    /* size of data (domain or IP  or URL) */
 	unsigned char	info_length;   /* size of addition data (redirect IP) */
 };
 #pragma pack(pop)
 
+#define INFO_MAX_SIZE 256                       /* info_length is one byte: info and its '\0' */
+
 #define KEY_PATH "/home/shaw/Data/"
-#define SHARE_SIZE  1024*1024
-#define  SHARE_MEM_KEY  10
+#define SHARE_SIZE  (1024*1024)          /* one slot of the update ring (one record set) */
+#define RING_SLOTS  16                    /* record sets which can wait in the update ring */
+#define  SHARE_MEM_KEY  13                /* the ring (key 10 was the single buffer of the old versions) */
 #define  SEM_SEND_KEY   11
 #define  SEM_RECV_KEY   12
+#define  STATS_MEM_KEY  14                /* statistics page of the search and update paths (dbTop) */
 
 #define DEFAULT_REDI_IP  "172.16.15.140"
 
 #define DOMAIN_DATA_PATH "/home/shaw/Data/domain.db"
+#define DOMAIN_SNAP_PATH "/home/shaw/Data/domain.snap"
+#define DOMAIN_LOG_DIR   "/home/shaw/Data/domain.log"
 
 #define PROG_ERROR_LOG "/home/shaw/Data/Logs/ErrorLog.txt"
 #define PROG_UPDATE_LOG "/home/shaw/Data/Logs/UpdateLog.txt"
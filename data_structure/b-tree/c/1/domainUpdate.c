@@ -9,14 +9,16 @@
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "domainUpdate.h"
 #include "dbDomain.h"
+#include "dbLogger.h"
 
-static char *share_region=NULL;
+static struct update_ring *share_region=NULL;
 static int share_id=-1;
 const int num_sems = 1; 	         /* number of semaphores in set */
-static int sem_send, sem_recv;	         /* semaphore */
+static int sem_send, sem_recv;	         /* semaphore: producers wait for a free slot, consumer waits for a set */
 pthread_t update_thread;
 
 #ifndef semun
@@ -29,30 +31,39 @@ union semun {
 #endif
 
 static void Logging(const char *filePath, const char *logString);
-static void ProcessUpdate(void *buffer);
+static int ProcessUpdate(void *buffer,uint32_t size);
 static int InitSem(void);	        /* initial semaphore */
+static int InitRing(int created);	/* initial (or check) the ring */
 static int semaphore_p(int sem_id);	/* P() */
-static int semaphore_v(int sem_id);	/* V() */
+static int semaphore_v(int sem_id,int n);	/* V() */
 
+/*
+ * The semaphores are only doorbells, the state is in the ring, so every wake up checks the
+ * ring again and an extra count is harmless. No SEM_UNDO: a process which exits must not
+ * take back a V() which the other side has not consumed yet.
+ */
 static int semaphore_p(int sem_id)
 {
 	struct sembuf sem_b;
 
 	sem_b.sem_num = 0;
 	sem_b.sem_op = -1;	       /* P() */
-	sem_b.sem_flg = SEM_UNDO;
-	if (semop(sem_id, &sem_b, 1) == -1)
-		return -1;
+	sem_b.sem_flg = 0;
+	while (semop(sem_id, &sem_b, 1) == -1)
+	{
+		if(errno != EINTR)
+			return -1;
+	}
 	return 0;
 }
 
-static int semaphore_v(int sem_id)
+static int semaphore_v(int sem_id,int n)
 {
 	struct sembuf sem_b;
 
 	sem_b.sem_num = 0;
-	sem_b.sem_op = +1;	      /* V() */
-	sem_b.sem_flg = SEM_UNDO;
+	sem_b.sem_op = n;	      /* V() */
+	sem_b.sem_flg = 0;
 	if (semop(sem_id, &sem_b, 1) == -1)
 		return -1;
 	return 0;
@@ -76,7 +87,7 @@ static int InitSem(void)
 	sem_send = semget(sem_key1, num_sems, IPC_CREAT|IPC_EXCL|0660);
 	if(sem_send != -1)
 	{
-		sem_union.val = 1;
+		sem_union.val = 0;
 		if (semctl(sem_send, 0, SETVAL, sem_union) == -1)
 		{
 			memset(logString, 0, 256);
@@ -104,10 +115,10 @@ static int InitSem(void)
 		}
 	}else{
 		sem_recv = semget(sem_key2, num_sems, 0);
-		if(sem_send == -1)
+		if(sem_recv == -1)
 		{
 			memset(logString, 0, 256);
-			snprintf(logString,256,"[ERROR] shareMem.c @ InitSem @ semget --- %s", strerror(errno));
+			snprintf(logString,256,"[ERROR] domainUpdate.c @ InitSem @ semget --- %s", strerror(errno));
 			goto err_out;
 		}
 	}
@@ -118,25 +129,134 @@ err_out:
 	return -1;
 }
 
+static int InitRing(int created)
+{
+	struct update_ring *ring=share_region;
+	struct timespec pause={0, 1000000};
+	char logString[256];
+	uint32_t i;
+
+	if(created)
+	{
+		ring->version=RING_VERSION;
+		ring->slots=RING_SLOTS;
+		ring->slot_size=SHARE_SIZE;
+		ring->tail=0;
+		ring->waiting=0;
+		ring->head=0;
+		ring->sleeping=0;
+		for(i=0; i<RING_SLOTS; i++)
+			ring->slot[i].seq=i;
+		__atomic_store_n(&(ring->magic),RING_MAGIC,__ATOMIC_RELEASE);
+		return 0;
+	}
+
+	// 创建者可能还在初始化
+	for(i=0; i<1000 && __atomic_load_n(&(ring->magic),__ATOMIC_ACQUIRE)!=RING_MAGIC; i++)
+		nanosleep(&pause,NULL);
+	if(ring->magic!=RING_MAGIC||ring->version!=RING_VERSION||ring->slots!=RING_SLOTS||ring->slot_size!=SHARE_SIZE)
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] domainUpdate.c @ InitRing --- share memory is not an update ring of this version");
+		Logging(PROG_ERROR_LOG, logString);
+		return -1;
+	}
+	return 0;
+}
+
+result_t PushUpdate(const void* set,size_t size)
+{
+	struct update_ring *ring=share_region;
+	struct ring_slot *slot;
+	uint64_t pos, seq;
+	int64_t dif;
+	int ret;
+
+	if(ring==NULL||size<sizeof(struct record_set_hdr)||size>SHARE_SIZE)
+		return R_FAILED;
+
+	pos=__atomic_load_n(&(ring->tail),__ATOMIC_RELAXED);
+	while(1)
+	{
+		slot=&(ring->slot[pos%RING_SLOTS]);
+		seq=__atomic_load_n(&(slot->seq),__ATOMIC_ACQUIRE);
+		dif=(int64_t)(seq-pos);
+		if(dif==0)
+		{
+			if(__atomic_compare_exchange_n(&(ring->tail),&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+				break;
+		}else if(dif<0){
+			// 环满, 等消费者释放槽位
+			__atomic_add_fetch(&(ring->waiting),1,__ATOMIC_SEQ_CST);
+			seq=__atomic_load_n(&(slot->seq),__ATOMIC_SEQ_CST);
+			ret=0;
+			if((int64_t)(seq-pos)<0)
+				ret=semaphore_p(sem_send);
+			__atomic_sub_fetch(&(ring->waiting),1,__ATOMIC_SEQ_CST);
+			if(ret==-1)
+				return R_FAILED;
+			pos=__atomic_load_n(&(ring->tail),__ATOMIC_RELAXED);
+		}else{
+			pos=__atomic_load_n(&(ring->tail),__ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(slot->data,set,size);
+	slot->size=size;
+	__atomic_store_n(&(slot->seq),pos+1,__ATOMIC_SEQ_CST);
+
+	if(__atomic_exchange_n(&(ring->sleeping),0,__ATOMIC_SEQ_CST))
+		semaphore_v(sem_recv,1);
+	return R_SUCCESS;
+}
+
+/*
+ * Wait until the slot of 'head' is ready, R_FAILED if the semaphore is broken.
+ */
+static result_t WaitUpdate(struct update_ring *ring,uint64_t head)
+{
+	struct ring_slot *slot=&(ring->slot[head%RING_SLOTS]);
+
+	while(__atomic_load_n(&(slot->seq),__ATOMIC_ACQUIRE)!=head+1)
+	{
+		__atomic_store_n(&(ring->sleeping),1,__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&(slot->seq),__ATOMIC_SEQ_CST)==head+1)
+		{
+			// 生产者若已清除标志, 信号量多一次计数, 下次等待时多检查一次即可
+			__atomic_store_n(&(ring->sleeping),0,__ATOMIC_RELAXED);
+			break;
+		}
+		if(semaphore_p(sem_recv)==-1)
+			return R_FAILED;
+	}
+	return R_SUCCESS;
+}
+
 void* UpdateCreate(void *arg)
 {
-	//receive data from shared memory.
+	//receive record sets from the ring in shared memory.
+	struct update_ring *ring;
+	struct ring_slot *slot;
 	char logString[256];
-        int oldtype, ret, retry=0;
+	int oldtype, retry=0, quick, n, waiting;
+	uint64_t head, i;
+        struct timeval t1,t2;
+        struct timezone tz;
+	unsigned long flush_t;
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS,&oldtype);
 
 	while(1)
 	{
-		ret = semaphore_p(sem_recv);
-		if(ret == -1)
+		ring=share_region;
+		if(ring==NULL||WaitUpdate(ring,__atomic_load_n(&(ring->head),__ATOMIC_RELAXED))==R_FAILED)
 		{
-			memset(logString, 0, 256);
 			if(retry < 3)
 			{
 				InitShm();	//尝试重新创建信号量及共享内存
 				retry++;
 				continue;
 			}else{
+				memset(logString, 0, 256);
 				snprintf(logString,256,"[ERROR] domainUpdate.c @ UpdateCreate @ semaphore_p --- semaphore maybe destory, resume failed!");
 				Logging(PROG_ERROR_LOG, logString);
 				return (void*)(-1);
@@ -144,10 +264,34 @@ void* UpdateCreate(void *arg)
 		}
 		retry = 0;
 
-		ProcessUpdate(share_region);
+		// 处理已就绪的记录集(最多RING_BATCH个), 快速更新只在批末合并一次
+		head=ring->head;
+		quick=0;
+		for(n=0; n<RING_BATCH; n++)
+		{
+			slot=&(ring->slot[(head+n)%RING_SLOTS]);
+			if(__atomic_load_n(&(slot->seq),__ATOMIC_ACQUIRE)!=head+n+1)
+				break;
+			quick|=ProcessUpdate(slot->data,slot->size);
+		}
+		if(quick)
+		{
+			gettimeofday (&t1,&tz);
+			AddListToBTree();
+			gettimeofday (&t2,&tz);
+			flush_t = (t2.tv_sec-t1.tv_sec)*1000000+(t2.tv_usec-t1.tv_usec);
+			memset(logString, 0, 256);
+			snprintf(logString,256,"Type: DOMAIN.  Sets: %d.  Update-Type: QUICK FLUSH\n\
+			    Time-Flush:  %lu us\n", n, flush_t);
+			Logging(PROG_UPDATE_LOG, logString);
+		}
 
-		ret = semaphore_v(sem_send);
-		if(ret == -1)
+		// 释放槽位(已写入日志), 唤醒等待空槽的生产者
+		for(i=0; i<(uint64_t)n; i++)
+			__atomic_store_n(&(ring->slot[(head+i)%RING_SLOTS].seq),head+i+RING_SLOTS,__ATOMIC_SEQ_CST);
+		__atomic_store_n(&(ring->head),head+n,__ATOMIC_RELAXED);
+		waiting=__atomic_load_n(&(ring->waiting),__ATOMIC_SEQ_CST);
+		if(waiting>0&&semaphore_v(sem_send,waiting)==-1)
 		{
 			InitShm();	    // 尝试重新创建信号量及共享内存
 			retry++;
@@ -156,60 +300,74 @@ void* UpdateCreate(void *arg)
 	return arg;
 }
 
-static void ProcessUpdate(void *buffer)
+/*
+ * Apply one record set and write it to the log, return 1 if the quick update needs a flush.
+ */
+static int ProcessUpdate(void *buffer,uint32_t size)
 {
 	struct record_set_hdr *recdhdr;
 	int sum=0;
         struct timeval t1,t2;
         struct timezone tz;
-	unsigned long update_t, flush_t;
+	unsigned long update_t;
+	const char* type;
 	char logString[256];
 
         recdhdr=(struct record_set_hdr *)buffer;
+	if(size<sizeof(*recdhdr)||recdhdr->recd_size>size-sizeof(*recdhdr))
+	{
+		memset(logString, 0, 256);
+		snprintf(logString,256,"[ERROR] domainUpdate.c @ ProcessUpdate --- broken record set (%u bytes)", size);
+		Logging(PROG_ERROR_LOG, logString);
+		return 0;
+	}
 
-        if(recdhdr->data_type==DATA_TYPE_DOMAIN)
+	gettimeofday (&t1,&tz);
+	//the IP and URL rules take effect at once, whatever the update type.
+	if(recdhdr->data_type==DATA_TYPE_DOMAIN)
 	{
-		gettimeofday (&t1,&tz);
+		type="DOMAIN";
 		sum=UpdateDomainName(buffer+sizeof(*recdhdr), recdhdr->recd_size,recdhdr->update_type);
-		gettimeofday(&t2,&tz);
-		update_t = (t2.tv_sec-t1.tv_sec)*1000000+(t2.tv_usec-t1.tv_usec);
+	}else if(recdhdr->data_type==DATA_TYPE_IP)
+	{
+		type="IP";
+		sum=UpdateIPAddress(buffer+sizeof(*recdhdr), recdhdr->recd_size);
+	}else if(recdhdr->data_type==DATA_TYPE_URL)
+	{
+		type="URL";
+		sum=UpdateURL(buffer+sizeof(*recdhdr), recdhdr->recd_size);
+	}else
+		return 0;
+	gettimeofday(&t2,&tz);
+	update_t = (t2.tv_sec-t1.tv_sec)*1000000+(t2.tv_usec-t1.tv_usec);
 
-		if(sum == 0)
-		{
-			snprintf(logString,256,"Type: DOMAIN.   <<FAILED>>   Update-Type: QUICK\n\
-			    Time-Valid:  %lu us   Time-Total:  %lu us\n", update_t, update_t);
-			goto out;
-		}
+	memset(logString, 0, 256);
+	if(sum == 0)
+	{
+		snprintf(logString,256,"Type: %s.   <<FAILED>>   Update-Type: %s\n\
+		    Time-Valid:  %lu us   Time-Total:  %lu us\n",
+		    type, recdhdr->update_type==UPDATE_QUICK?"QUICK":"NORMAL", update_t, update_t);
+		Logging(PROG_UPDATE_LOG, logString);
+		return 0;
+	}
 
-       		 //write data to file;
-        	SaveToFile(buffer+sizeof(*recdhdr),recdhdr->recd_size);
+	//write data to file;
+	SaveDataToFile(recdhdr->data_type,buffer+sizeof(*recdhdr),recdhdr->recd_size);
 
-		if(recdhdr->update_type==UPDATE_QUICK)
-		{
-        	        gettimeofday (&t1,&tz);
-			AddListToBTree();
-			gettimeofday (&t2,&tz);
-			flush_t = (t2.tv_sec-t1.tv_sec)*1000000+(t2.tv_usec-t1.tv_usec);
-			memset(logString, 0, 256);
-			snprintf(logString,256,"Type: DOMAIN.  Counts: %u.  Update-Type: QUICK\n\
-			    Time-Valid:  %lu us   Time-Total:  %lu us\n", sum, update_t, update_t+flush_t);
-			goto out;
-		}else{
-			memset(logString, 0, 256);
-			snprintf(logString,256,"Type: DOMAIN.  Counts: %u.  Update-Type: NORMAL\n \
-			    Time-Valid:  %lu us   Time-Total:  %lu us\n", sum, update_t, update_t);
-			goto out;
-		}
-	}
-out:
+	snprintf(logString,256,"Type: %s.  Counts: %u.  Update-Type: %s\n\
+	    Time-Valid:  %lu us   Time-Total:  %lu us\n",
+	    type, sum, recdhdr->update_type==UPDATE_QUICK?"QUICK":"NORMAL", update_t, update_t);
 	Logging(PROG_UPDATE_LOG, logString);
+	return recdhdr->data_type==DATA_TYPE_DOMAIN && recdhdr->update_type==UPDATE_QUICK;
 }
 
 result_t InitShm(void)
 {
 	key_t mem_key;
 	char logString[256];
+	int created=1;
 
+	DetShm();
 	mem_key = ftok(KEY_PATH, SHARE_MEM_KEY);
     if(mem_key==-1)
 	{
@@ -217,7 +375,12 @@ result_t InitShm(void)
 		snprintf(logString,256,"[ERROR] domainUpdate.c @ InitShm @ ftok --- %s", strerror(errno));
 		goto err_out;
 	}
-	share_id=shmget(mem_key,SHARE_SIZE,IPC_CREAT|0660);
+	share_id=shmget(mem_key,sizeof(struct update_ring),IPC_CREAT|IPC_EXCL|0660);
+	if(share_id==-1&&errno==EEXIST)
+	{
+		created=0;
+		share_id=shmget(mem_key,sizeof(struct update_ring),0660);
+	}
         if(share_id==-1)
 	{
 		memset(logString, 0, 256);
@@ -226,13 +389,17 @@ result_t InitShm(void)
 	}
 	if((share_region=shmat(share_id, 0, 0))==(void *)(-1))
 	{
+		share_region=NULL;
 		memset(logString, 0, 256);
 		snprintf(logString,256,"[ERROR] domainUpdate.c @ InitShm @ shmat --- %s", strerror(errno));
 		goto err_out;
 	}
 	// 初始化信号量
-	if(InitSem() == -1)
-		return -1;
+	if(InitSem() == -1||InitRing(created) == -1)
+	{
+		DetShm();
+		return R_FAILED;
+	}
 
 	return R_SUCCESS;
 err_out:
@@ -245,19 +412,12 @@ result_t DetShm(void)
 	// detach from share memory.
 	if(share_region!=NULL)
 		shmdt(share_region);
+	share_region=NULL;
 	return R_SUCCESS;
 }
 
 static void
 Logging(const char *filePath, const char *logString )
 {
-	char timeLog[32];
-	FILE *LogFile;
-	time_t now = time(NULL);
-	strftime(timeLog,sizeof(timeLog),"%d/%b/%Y:%H:%M:%S %Z",localtime(&now));
-
-	if((LogFile = fopen(filePath,"a+")) == NULL) { perror("fopen");  return; }
-	fprintf(LogFile,"[%s]  ",timeLog);
-	fprintf(LogFile,"%s\n",logString);
-	fclose(LogFile);
+	LoggerWrite(filePath,logString);      //queued, written by the thread of dbLogger.c
 }
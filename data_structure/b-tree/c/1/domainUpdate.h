@@ -2,13 +2,47 @@
 #define DOMAINUPDATE_H_INCLUDED
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
 #include "dbUtility.h"
 
+#define RING_MAGIC   0x56444252           /* "VDBR" */
+#define RING_VERSION 1
+#define RING_BATCH   8                    /* record sets applied before one flush of the quick update */
+
+/*
+ * Ring of update slots in the share memory, many producers (feeder processes) and one consumer
+ * (the update thread). A slot holds one record set (record_set_hdr and its records).
+ * Slot i is free for the producer of ticket t when seq==t (t%RING_SLOTS==i), and is ready for
+ * the consumer when seq==t+1; the consumer gives it back with seq=t+RING_SLOTS.
+ * The semaphores only wake the sides which sleep: sem_recv the consumer, sem_send the producers.
+ */
+struct ring_slot
+{
+	volatile uint64_t seq;
+	uint32_t size;                 /* bytes of data */
+	uint32_t pad;
+	char data[SHARE_SIZE];
+} __attribute__((aligned(64)));
+
+struct update_ring
+{
+	volatile uint32_t magic;       /* set when the ring is initialized */
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slot_size;
+	volatile uint64_t tail __attribute__((aligned(64)));   /* next ticket of the producers */
+	volatile uint32_t waiting;                              /* producers which wait for a free slot */
+	volatile uint64_t head __attribute__((aligned(64)));   /* next ticket of the consumer */
+	volatile uint32_t sleeping;                             /* the consumer waits for sem_recv */
+	struct ring_slot slot[RING_SLOTS];
+};
+
 extern pthread_t update_thread;
 
 result_t InitShm(void);
 /*
- * Usage: initial Share memory, attach to share memory.
+ * Usage: initial Share memory, attach to share memory (the ring is initialized by the first process).
  * @param   void  --- null
  * @return  result_t
              ---- R_SUCCESS: initial success;
@@ -22,10 +56,21 @@ result_t DetShm(void);
              ---- R_SUCCESS: operate success;
              ---- R_FAILED: operate failed
  */
+result_t PushUpdate(const void* set,size_t size);
+/*
+ * Usage: put one record set into the ring (for the feeder processes, after InitShm).
+ *        It waits only when all the slots are full.
+ * @param   const void* set --- record_set_hdr and the records
+ * @param   size_t size --- bytes of 'set', at most SHARE_SIZE
+ * @return  result_t
+             ---- R_SUCCESS: the set is queued;
+             ---- R_FAILED: the set is too large, or the ring is not attached
+ */
 
 void* UpdateCreate(void *arg);
 /*
- * Usage: process update of url (used for thread)
+ * Usage: process update of url (used for thread). The ready record sets are applied in batches,
+ *        the quick update is flushed once per batch.
  * @param   void *arg --- nothing
  * @return  void* --- nothing
  */
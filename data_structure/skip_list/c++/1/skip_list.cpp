@@ -4,6 +4,14 @@
 #include <stdio.h>
 #include <fstream>
 #include <iomanip>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -13,30 +21,70 @@ struct node
 {
     int key;         //关键码
     int newlevel;    //级数
-    struct node *forward[MAXlevel];
+    struct node *forward[1];    //按级数分配newlevel+1个指针
 };
 
+#define NODESIZE(newlevel) (offsetof(struct node,forward)+((newlevel)+1)*sizeof(struct node *))
+#define POOLCHUNK (1<<20)
+
+struct pool                      //节点池：每个级数一条空闲链，节点从大块内存中切出
+{
+    struct node *freelist[MAXlevel+1];
+    char *cur,*end;              //当前块的剩余空间
+};
+
+#define DBMAGIC   "SKIPLIST"     //node.db 的文件格式，见 save()
+#define DBVERSION 1
+#define DBHEAD    32
+#define DBRECORD  5              //关键码 int32 + 级数 uint8
+#define DBBUFFER  (1<<20)        //读写缓冲
+#define DBALIGN   4096           //O_DIRECT 的对齐单位
+
+struct mapview                   //mmap 的只读文件
+{
+    const unsigned char *base;
+    size_t size;
+    uint64_t count;              //记录数
+};
+
+static struct pool nodepool;
+static uint64_t randstate;       //级数产生器（xorshift64*）的状态
+
 int randX(int &level);                                //按指数分布的随机级数产生函数
 struct node *inilialization(int &level,int &total);                        //初始化
 void insert (struct node *head,int key,int &level,int newlevel);           //插入
 void output(struct node *head,int level);                                  //输出函数
 bool delnode (node *head,int &level);                                      //删除函数
 struct node *search(struct node *head,int key,int level);    //查找函数
-void save(struct node *head,FILE *fp);                                     //保存链表函数
-struct node *load(FILE *fp,int &plevel);                                  //恢复链表函数
+bool save(struct node *head,int level,const char *path,bool direct);     //保存链表函数
+struct node *load(const char *path,int &plevel);                          //恢复链表函数
+void append(struct node **last,struct node *p);                           //节点接在各级链的尾部
+void destroy(struct node *head);                                           //释放链表
+bool mapopen(const char *path,struct mapview &view,bool verify);          //只读 mmap 文件
+bool mapsearch(const struct mapview &view,int key);                       //在 mmap 的文件中查找
+void mapclose(struct mapview &view);
+void bench();                                                              //存储与恢复的性能测试
 int Max (struct node *);
+struct node *newnode(int newlevel);                                        //分配节点
+void freenode(struct node *p);                                             //释放节点
 
-int main()
+int main(int argc,char *argv[])
 {
     int i=0,level,newlevel,total,key,&plevel=level,&ptotal=total;
     struct node *h=NULL,*p;
     FILE *fp;
 
     srand((unsigned int)time(0));
+    randstate=((uint64_t)time(0)<<32)^(uintptr_t)&randstate;
     h=inilialization(plevel,ptotal);
+    if(argc>1&&!strcmp(argv[1],"bench"))    //skip_list bench：只做性能测试
+    {
+        bench();
+        return 0;
+    }
 
     cout<<"输入您的选择："<<endl;
-    cout<<"0、退出 1、插入 2、检索 3、删除 4、遍历 5、存储 6、恢复 7、清空文件"<<endl;
+    cout<<"0、退出 1、插入 2、检索 3、删除 4、遍历 5、存储 6、恢复 7、清空文件 8、性能测试"<<endl;
 
     while(i==0)
     {
@@ -77,24 +125,24 @@ int main()
                 output(h,level);
                 break;
             case '5':
-                if((fp=fopen("node.db","wb"))==NULL)/* 只写打开或建立一个二进制文件，只允许写数据  */
-                {
-                    cout<<"打不开文件，按任意键退出!!"<<endl;
-                    getchar();
-                    exit(-1);
-                }
-                save(h,fp);
-                fclose(fp);
+                if(save(h,level,"node.db",false))
+                    cout<<"保存成功"<<endl;
+                else
+                    cout<<"保存失败"<<endl;
                 break;
             case '6':
-                if((fp=fopen("node.db","rb"))==NULL)/* 只读打开一个二进制文件，只允许读数据  */
+                if((p=load("node.db",newlevel))==NULL)
                 {
-                    cout<<"打不开文件，按任意键退出!"<<endl;
-                    getchar();
-                    exit(-1);
+                    cout<<"文件不存在或已损坏"<<endl;
+                    break;
                 }
-                h=load(fp,plevel);
-                fclose(fp);
+                destroy(h);
+                h=p;
+                level=newlevel;
+                output(h,level);
+                break;
+            case '8':
+                bench();
                 break;
             case '7':
                 if((fp=fopen("node.db","ab+"))==NULL)
@@ -112,20 +160,53 @@ int main()
                 break;
             default:
                 cout<<"输入您的选择："<<endl;
-                cout<<"0、退出 1、插入 2、检索 3、删除 4、遍历 5、存储 6、恢复 7、清空文件"<<endl;
+                cout<<"0、退出 1、插入 2、检索 3、删除 4、遍历 5、存储 6、恢复 7、清空文件 8、性能测试"<<endl;
         }
     }
     
     return 0;
 }
 
-int randX(int &level)             //按指数分布的随机级数产生函数
+struct node *newnode(int newlevel)         //从节点池中取一个newlevel级的节点
 {
-    int i,j,t;
-    t=rand();
-    for(i=0,j=2;i<MAXlevel;i++,j+=j) 
-        if(t>RAND_MAX/j) 
-            break;
+    struct node *p=nodepool.freelist[newlevel];
+    size_t size=NODESIZE(newlevel);
+
+    if(p)
+        nodepool.freelist[newlevel]=p->forward[0];
+    else
+    {
+        if(nodepool.end-nodepool.cur<(ptrdiff_t)size)   //块已用完（剩余的零头不再使用）
+        {
+            nodepool.cur=(char *)malloc(POOLCHUNK);
+            if(!nodepool.cur)
+                exit(-1);
+            nodepool.end=nodepool.cur+POOLCHUNK;
+        }
+        p=(struct node *)nodepool.cur;
+        nodepool.cur+=size;
+    }
+    p->newlevel=newlevel;
+    return p;
+}
+
+void freenode(struct node *p)              //节点放回所属级数的空闲链
+{
+    p->forward[0]=nodepool.freelist[p->newlevel];
+    nodepool.freelist[p->newlevel]=p;
+}
+
+int randX(int &level)             //按指数分布的随机级数产生函数：一个随机数的前导0个数，p=1/2
+{
+    int i;
+    uint64_t t;
+    randstate^=randstate>>12;
+    randstate^=randstate<<25;
+    randstate^=randstate>>27;
+    t=randstate*0x2545F4914F6CDD1DULL;    //高位的质量最好，所以数前导0
+    i=__builtin_clzll(t|1);
+    if(i>MAXlevel-1)
+        i=MAXlevel-1;
     if(i>level) 
         level=i;
 
@@ -137,8 +218,10 @@ struct node *inilialization(int &level,int &total)      //初始化
     int i;
     struct node *head;
 
-    head = new(struct node);
-    for(i=0;i<MAXlevel;i++) 
+    head = (struct node *)malloc(NODESIZE(MAXlevel));    //头节点有全部MAXlevel+1级
+    if(!head)
+        exit(-1);
+    for(i=0;i<=MAXlevel;i++) 
         head->forward[i]=0;
     head->key=0;
     head->newlevel=0;
@@ -166,11 +249,8 @@ void insert (struct node *head,int key,int &level,int newlevel)          //插
             p=p->forward[i];
         updata[i]=p;                     //updata[i]记录了搜索过程中在各级走过的最大节点位置
     }
-    p=new(struct node);
+    p=newnode(newlevel);
     p->key=key;                                         //设置新节点
-    p->newlevel=newlevel;
-    for(i=0;i<MAXlevel;i++) 
-        p->forward[i]=0;
     for(i=0;i<=newlevel;i++)                             //插入是从最高的newlevel层链直至0层链
     {
         p->forward[i]=updata[i]->forward[i];             //插入到分配的级数链
@@ -236,6 +316,8 @@ bool delnode (node *head,int &level) //删除成功返回true,否则返回false
             }
             i--;
         }
+        if(r!=head)                     //search()对关键码0返回头节点，头节点不能放回节点池
+            freenode(r);
         level=Max(head);
         head->newlevel=level;
         return(true);
@@ -252,7 +334,6 @@ int Max(struct node *head)            //求最大级数
 {
     int i=MAXlevel,level;
     struct node *p;
-    p=new(node);
     p=head;
     level=0;
     
@@ -307,46 +388,418 @@ void output(struct node *head,int level)         //输出函数
     }
 }
 
-struct node *load(FILE *fp,int &plevel)        //从文件中恢复链表
-{   
-    int ptotal=0;
-    plevel=0;
-    struct node *p,*head,*head1;
-    
-    head=new(struct node);
-    p=(struct node *)malloc(sizeof(node)); //申请一个节点空间
-    if(!p)
-        exit(-1);
-    head=inilialization(plevel,ptotal);
-    fread(p,sizeof(struct node),1,fp); //预读一次文件
-    plevel=p->newlevel;
-    while(!feof(fp))       //不是结尾，则插入链表
+/*
+ * node.db 格式（小端存储，与机器无关）：
+ *   文件头 DBHEAD 字节：魔数 "SKIPLIST"、版本、最大级数、记录数、保留字、以上内容的 CRC32
+ *   记录数条记录：关键码 int32 + 级数 uint8，按关键码升序
+ *   文件尾 4 字节：全部记录的 CRC32
+ * 按关键码顺序一遍写出、一遍读入：恢复时每层的节点直接接在该层的尾部，不需要检索。
+ */
+static void put32(unsigned char *p,uint32_t v)
+{
+    p[0]=v; p[1]=v>>8; p[2]=v>>16; p[3]=v>>24;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return p[0]|(uint32_t)p[1]<<8|(uint32_t)p[2]<<16|(uint32_t)p[3]<<24;
+}
+
+static uint32_t crctable[8][256];
+
+uint32_t crc32(uint32_t crc,const unsigned char *p,size_t n)      //CRC32（IEEE 802.3），每次查表 8 字节
+{
+    uint32_t c,lo,hi;
+    int i,j;
+
+    if(!crctable[0][1])
     {
-        insert(head,p->key,plevel,p->newlevel);
-        p=(struct node *)malloc(sizeof(node));
-        if(!p)
-            exit(-1);
-        fread(p,sizeof(struct node),1,fp); //继续读文件
+        for(i=0;i<256;i++)
+        {
+            for(c=i,j=0;j<8;j++)
+                c=c&1?0xEDB88320U^(c>>1):c>>1;
+            crctable[0][i]=c;
+        }
+        for(i=0;i<256;i++)
+            for(j=1;j<8;j++)
+                crctable[j][i]=crctable[0][crctable[j-1][i]&0xFF]^(crctable[j-1][i]>>8);
     }
-    head1=head->forward[0];
-    output(head1,plevel);
-    
-    return head1;
+    crc=~crc;
+    for(;n>=8;n-=8,p+=8)
+    {
+        lo=crc^get32(p);
+        hi=get32(p+4);
+        crc=crctable[7][lo&0xFF]^crctable[6][(lo>>8)&0xFF]^crctable[5][(lo>>16)&0xFF]^crctable[4][lo>>24]
+           ^crctable[3][hi&0xFF]^crctable[2][(hi>>8)&0xFF]^crctable[1][(hi>>16)&0xFF]^crctable[0][hi>>24];
+    }
+    while(n--)
+        crc=crctable[0][(crc^*p++)&0xFF]^(crc>>8);
+    return ~crc;
 }
 
-void save(struct node *head,FILE *fp)          //保存链表至文件
+static void makehead(unsigned char *p,int level,uint64_t count)      //填写文件头
 {
-    struct node *p;
-    p=head;
-    if(!p->forward[0])  
-        cout<<"空表，请先输入数据再保存！"<<endl;
+    memcpy(p,DBMAGIC,8);
+    put32(p+8,DBVERSION);
+    put32(p+12,level);
+    put32(p+16,(uint32_t)count);
+    put32(p+20,(uint32_t)(count>>32));
+    put32(p+24,0);
+    put32(p+28,crc32(0,p,28));
+}
+
+static bool checkhead(const unsigned char *p,uint64_t &count)         //检查文件头，取出记录数
+{
+    if(memcmp(p,DBMAGIC,8)||get32(p+28)!=crc32(0,p,28)||get32(p+8)!=DBVERSION||get32(p+12)>=MAXlevel)
+        return false;
+    count=get32(p+16)|(uint64_t)get32(p+20)<<32;
+    return true;
+}
+
+static bool writeall(int fd,const unsigned char *p,size_t n)
+{
+    ssize_t r;
+
+    while(n>0)
+    {
+        if((r=write(fd,p,n))<0)
+        {
+            if(errno==EINTR)
+                continue;
+            return false;
+        }
+        p+=r;
+        n-=r;
+    }
+    return true;
+}
+
+static ssize_t readall(int fd,unsigned char *p,size_t n)             //读满n字节，文件结束时可以少
+{
+    size_t done=0;
+    ssize_t r;
+
+    while(done<n)
+    {
+        if((r=read(fd,p+done,n-done))<0)
+        {
+            if(errno==EINTR)
+                continue;
+            return -1;
+        }
+        if(r==0)
+            break;
+        done+=r;
+    }
+    return done;
+}
+
+static bool syncdir(const char *path)               //把 path 所在目录 fsync，使改名落盘
+{
+    char dir[1024];
+    const char *slash=strrchr(path,'/');
+    bool ok;
+    int fd;
+
+    if(!slash)
+        strcpy(dir,".");
+    else if(slash==path)
+        strcpy(dir,"/");
+    else if((size_t)(slash-path)<sizeof(dir))
+    {
+        memcpy(dir,path,slash-path);
+        dir[slash-path]='\0';
+    }
     else
+        return false;
+    if((fd=open(dir,O_RDONLY|O_DIRECTORY))<0)
+        return false;
+    ok=fsync(fd)==0;
+    close(fd);
+    return ok;
+}
+
+/*
+ * 保存链表至文件：先写到 path.tmp，fdatasync 后改名，再 fsync 目录，所以原文件不会写坏一半。
+ * direct 为真时用 O_DIRECT 绕过页缓存（缓冲区和每次写的长度按 DBALIGN 对齐，
+ * 最后补齐的部分再截掉）；文件系统不支持时退回普通的缓冲写。
+ */
+bool save(struct node *head,int level,const char *path,bool direct)
+{
+    char tmp[1024];
+    unsigned char *buf;
+    struct node *p;
+    uint64_t count=0;
+    uint32_t crc=0;
+    size_t n=DBHEAD,done=DBHEAD;     //buf 中 done 之前的记录已算入 crc
+    bool ok=true;
+    int fd=-1;
+
+    if(snprintf(tmp,sizeof(tmp),"%s.tmp",path)>=(int)sizeof(tmp)||posix_memalign((void **)&buf,DBALIGN,DBBUFFER))
+        return false;
+    for(p=head->forward[0];p;p=p->forward[0])
+        count++;
+    if(direct)
+        fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT,0644);
+    if(fd<0)
+    {
+        direct=false;
+        fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    }
+    if(fd<0)
+    {
+        free(buf);
+        return false;
+    }
+    makehead(buf,level,count);
+    for(p=head->forward[0];ok&&p;p=p->forward[0])
     {
-        while(p)
+        put32(buf+n,(uint32_t)p->key);
+        buf[n+4]=(unsigned char)p->newlevel;
+        n+=DBRECORD;
+        if(n>DBBUFFER-DBRECORD-4)        //缓冲区满，写出对齐的部分，余下的移到开头
         {
-            fwrite(p,sizeof(struct node),1,fp);//每次写入一个长度是stu字节数的纪录
-            p=p->forward[0];
+            size_t out=direct?n/DBALIGN*DBALIGN:n;
+            crc=crc32(crc,buf+done,n-done);
+            ok=writeall(fd,buf,out);
+            memmove(buf,buf+out,n-out);
+            n-=out;
+            done=n;
+        }
+    }
+    crc=crc32(crc,buf+done,n-done);
+    put32(buf+n,crc);
+    n+=4;
+    if(ok)
+    {
+        size_t out=direct?(n+DBALIGN-1)/DBALIGN*DBALIGN:n;
+        memset(buf+n,0,out-n);
+        ok=writeall(fd,buf,out);
+    }
+    free(buf);
+    if(ok&&direct)
+        ok=ftruncate(fd,DBHEAD+count*DBRECORD+4)==0;
+    if(ok)
+        ok=fdatasync(fd)==0;                     //数据和长度落盘后才能改名（O_DIRECT 也不保证长度）
+    if(close(fd)!=0)
+        ok=false;
+    if(ok)
+        ok=rename(tmp,path)==0&&syncdir(path);   //改名本身也要落盘
+    if(!ok)
+        unlink(tmp);
+    return ok;
+}
+
+void append(struct node **last,struct node *p)      //节点接在各级链的尾部（按关键码顺序建表）
+{
+    int i;
+
+    for(i=0;i<=p->newlevel;i++)
+    {
+        p->forward[i]=0;
+        last[i]->forward[i]=p;
+        last[i]=p;
+    }
+}
+
+void destroy(struct node *head)                    //释放全部节点和头节点
+{
+    struct node *p,*q;
+
+    for(p=head->forward[0];p;p=q)
+    {
+        q=p->forward[0];
+        freenode(p);
+    }
+    free(head);
+}
+
+/*
+ * 从文件中恢复链表：一遍顺序读入，每个节点接在各级链的尾部，不做检索。
+ * 文件头、记录顺序或 CRC 不对时返回 NULL（已建的节点释放掉）。
+ */
+struct node *load(const char *path,int &plevel)
+{
+    struct node *head,*last[MAXlevel+1],*p;
+    unsigned char *buf,head_buf[DBHEAD];
+    uint64_t count,done=0;
+    uint32_t crc=0;
+    size_t n=0,i;
+    ssize_t r;
+    int fd,total=0,level=0,key=0;
+    bool ok;
+
+    if((fd=open(path,O_RDONLY))<0)
+        return NULL;
+    if(readall(fd,head_buf,DBHEAD)!=DBHEAD||!checkhead(head_buf,count)||!(buf=(unsigned char *)malloc(DBBUFFER)))
+    {
+        close(fd);
+        return NULL;
+    }
+    head=inilialization(level,total);
+    for(i=0;i<=MAXlevel;i++)
+        last[i]=head;
+    ok=true;
+    while(ok&&done<count)
+    {
+        if((r=readall(fd,buf+n,DBBUFFER-n))<=0)
+        {
+            ok=false;
+            break;
+        }
+        n+=r;
+        for(i=0;done<count&&i+DBRECORD<=n;i+=DBRECORD,done++)
+        {
+            int k=(int)get32(buf+i),l=buf[i+4];
+            if(l>=MAXlevel||(done>0&&k<key))        //级数越界或没有按关键码排序
+            {
+                ok=false;
+                break;
+            }
+            key=k;
+            p=newnode(l);
+            p->key=k;
+            append(last,p);
+            if(l>level)
+                level=l;
         }
-        cout<<"保存成功"<<endl;
+        crc=crc32(crc,buf,i);
+        memmove(buf,buf+i,n-i);                    //不完整的记录（或文件尾）留到下次
+        n-=i;
+    }
+    if(ok&&(n>4||(n<4&&readall(fd,buf+n,4-n)!=(ssize_t)(4-n))))   //文件尾只有 CRC
+        ok=false;
+    if(ok&&get32(buf)!=crc)
+        ok=false;
+    free(buf);
+    close(fd);
+    if(!ok)
+    {
+        destroy(head);
+        return NULL;
+    }
+    head->newlevel=level;
+    plevel=level;
+    return head;
+}
+
+/*
+ * 只读地 mmap 文件，在记录上二分查找，不建链表。
+ * verify 为真时先核对全部记录的 CRC（否则只检查文件头和长度，页面用到时才读入）。
+ */
+bool mapopen(const char *path,struct mapview &view,bool verify)
+{
+    struct stat st;
+    void *base;
+    int fd;
+
+    if((fd=open(path,O_RDONLY))<0)
+        return false;
+    if(fstat(fd,&st)!=0||st.st_size<DBHEAD+4
+       ||(base=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    view.base=(const unsigned char *)base;
+    view.size=st.st_size;
+    if(!checkhead(view.base,view.count)||view.size!=DBHEAD+view.count*DBRECORD+4
+       ||(verify&&get32(view.base+view.size-4)!=crc32(0,view.base+DBHEAD,view.count*DBRECORD)))
+    {
+        mapclose(view);
+        return false;
+    }
+    return true;
+}
+
+bool mapsearch(const struct mapview &view,int key)  //二分查找关键码
+{
+    uint64_t lo=0,hi=view.count,mid;
+
+    while(lo<hi)
+    {
+        mid=lo+(hi-lo)/2;
+        if((int)get32(view.base+DBHEAD+mid*DBRECORD)<key)
+            lo=mid+1;
+        else
+            hi=mid;
+    }
+    return lo<view.count&&(int)get32(view.base+DBHEAD+lo*DBRECORD)==key;
+}
+
+void mapclose(struct mapview &view)
+{
+    munmap((void *)view.base,view.size);
+    view.base=NULL;
+}
+
+static double now()                                //单调时钟，毫秒
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec*1000.0+t.tv_nsec/1000000.0;
+}
+
+void bench()                                        //存储与恢复 10^7 个节点的性能测试
+{
+    const int count=10000000;
+    struct node *head,*last[MAXlevel+1],*p;
+    struct mapview view;
+    int i,level=0,total=0,found=0;
+    double t;
+
+    head=inilialization(level,total);
+    for(i=0;i<=MAXlevel;i++)
+        last[i]=head;
+    t=now();
+    for(i=0;i<count;i++)
+    {
+        p=newnode(randX(level));
+        p->key=2*i;
+        append(last,p);
+    }
+    head->newlevel=level;
+    cout<<"按顺序建 10^7 个节点: "<<now()-t<<" ms"<<endl;
+
+    t=now();
+    if(!save(head,level,"bench.db",false))
+        cout<<"存储失败"<<endl;
+    t=now()-t;
+    cout<<"缓冲写存储: "<<t<<" ms, "<<(DBHEAD+count*(double)DBRECORD)/1048576/t*1000<<" MB/s"<<endl;
+    t=now();
+    if(!save(head,level,"bench.db",true))
+        cout<<"存储失败"<<endl;
+    t=now()-t;
+    cout<<"O_DIRECT 存储: "<<t<<" ms, "<<(DBHEAD+count*(double)DBRECORD)/1048576/t*1000<<" MB/s"<<endl;
+    destroy(head);
+
+    t=now();
+    head=load("bench.db",level);
+    t=now()-t;
+    if(!head)
+        cout<<"恢复失败"<<endl;
+    else
+    {
+        for(i=0,p=head->forward[0];p;p=p->forward[0])
+            i++;
+        cout<<"恢复 "<<i<<" 个节点: "<<t<<" ms, "<<i/t*1000<<" 节点/s, 最大级数 "<<level<<endl;
+        destroy(head);
+    }
+
+    t=now();
+    if(!mapopen("bench.db",view,true))
+        cout<<"mmap 失败"<<endl;
+    else
+    {
+        cout<<"mmap 并核对 CRC: "<<now()-t<<" ms"<<endl;
+        t=now();
+        for(i=0;i<1000000;i++)
+            found+=mapsearch(view,rand()%(2*count));
+        t=now()-t;
+        cout<<"mmap 检索 10^6 次: "<<t<<" ms, "<<1000000/t*1000<<" 次/s, 找到 "<<found<<endl;
+        mapclose(view);
     }
+    unlink("bench.db");
 }
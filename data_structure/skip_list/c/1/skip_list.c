@@ -5,13 +5,31 @@
 #include <time.h>
 #include <math.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define TIME(A,B) (double)(B-A)/CLOCKS_PER_SEC*1000
 
 /* Skip List Level Limit, Level begin wth 0 */
 #define MAX_SKIP_LEVEL 20
-/* Level Weight for Calc node level */
-#define LEVEL_W 20
+/* Branching probability of the node levels: P(level >= i+1) = P(level >= i) * SKIP_P */
+#define SKIP_P 0.5
+
+/* Key and Value of the Concurrent Skip List: the value is one word, read and written atomically */
+typedef int skip_key_t;
+typedef int skip_value_t;
+#define KEY_LT(a,b) ((a) < (b))
+#define KEY_EQ(a,b) ((a) == (b))
+
+/* Threads which use the Concurrent Skip Lists at the same time, retires before an epoch try */
+#define EBR_SLOTS 64
+#define EBR_BATCH 64
 
 /* Skip List Struct */
 typedef struct skip_list_struct skip_list_t;
@@ -19,53 +37,239 @@ struct skip_list_struct {
     int key;
     int value;
     int level;
-    /* Level[i] have (i+1) pointer to */
-    skip_list_t *forward[MAX_SKIP_LEVEL];
+    /* Level[i] have (i+1) pointer to, the node is allocated with level+1 of them */
+    skip_list_t *forward[1];
+    /* then level+1 spans: the nodes from this one to forward[i] (level 0 steps), 0 if NULL */
+};
+
+/* Bytes of a node of 'level' (a multiple of the pointer size) */
+#define SKIP_NODE_SIZE(level) \
+    ((offsetof(skip_list_t, forward) + ((level) + 1) * (sizeof(skip_list_t *) + sizeof(int)) \
+      + sizeof(skip_list_t *) - 1) & ~(sizeof(skip_list_t *) - 1))
+/* Spans of a node, after its forward pointers */
+#define SKIP_SPAN(node) ((int *)((node)->forward + (node)->level + 1))
+
+/* Node Pool: one free list per size class (node level), the nodes are cut from big chunks */
+#define POOL_CHUNK (1 << 20)
+
+typedef struct skip_pool_chunk_struct skip_pool_chunk_t;
+struct skip_pool_chunk_struct {
+    skip_pool_chunk_t *next;
 };
 
-/* Rand Node Level  */
-int rand_level() 
+static struct {
+    skip_list_t *free_list[MAX_SKIP_LEVEL]; /* freed nodes of each level, linked by forward[0] */
+    skip_pool_chunk_t *chunks;
+    char *cursor;           /* free space of the last chunk */
+    char *end;
+    size_t used;            /* bytes of the live nodes */
+    size_t reserved;        /* bytes of the chunks */
+} skip_pool;
+
+/* Level generator: xorshift64* state, one random word gives the level */
+typedef struct {
+    uint64_t state;
+    int shift;                              /* p = 1/2^shift, 0 if p is no power of 2 */
+    uint64_t threshold[MAX_SKIP_LEVEL];     /* level >= i if the word < p^i * 2^64 */
+} skip_rand_t;
+
+/* A list is its head node, its level generator is just before it */
+typedef struct {
+    skip_rand_t rand;
+    skip_list_t head;   /* last: the forward pointers and spans go on after it */
+} skip_list_head_t;
+
+#define SKIP_HEAD(skip_list) ((skip_list_head_t *)((char *)(skip_list) - offsetof(skip_list_head_t, head)))
+
+void init_skip_rand (skip_rand_t *gen, double p, uint64_t seed)
+{
+    double t = 18446744073709551616.0;  /* 2^64 */
+    int i = 1;
+
+    gen->state = seed != 0 ? seed : 0x9E3779B97F4A7C15ULL;
+    for (gen->shift = 1; gen->shift < 16 && p != 1.0 / (1 << gen->shift); ++gen->shift)
+    {
+        ;
+    }
+    gen->shift = gen->shift < 16 ? gen->shift : 0;
+    gen->threshold[0] = UINT64_MAX;
+    for (; i < MAX_SKIP_LEVEL; ++i)
+    {
+        t *= p;
+        gen->threshold[i] = (uint64_t)t;
+    }
+}
+
+/* Rand Node Level: the high bits of xorshift64* are the best, so the zeros are counted there */
+int skip_rand_level (skip_rand_t *gen)
 {
+    uint64_t word;
     int level = 0;
-    int i = 0;
 
-    /* Node which level more bigger, more less */
-    for(; i< MAX_SKIP_LEVEL-1; ++i)
-    //for(; i< MAX_SKIP_LEVEL; ++i) 这里不对，可能生成超过MAX_SKIP_LEVEL的数
+    gen->state ^= gen->state >> 12;
+    gen->state ^= gen->state << 25;
+    gen->state ^= gen->state >> 27;
+    word = gen->state * 0x2545F4914F6CDD1DULL;
+    if (gen->shift > 0)     /* P(level >= i) = P(i*shift leading zeros) */
+    {
+        level = __builtin_clzll(word | 1) / gen->shift;
+    }
+    else
+    {
+        while (level < MAX_SKIP_LEVEL-1 && word < gen->threshold[level+1])
+        {
+            ++level;
+        }
+    }
+
+    return level < MAX_SKIP_LEVEL-1 ? level : MAX_SKIP_LEVEL-1;  /* 0,1....MAX_SKIP_LEVEL-1 */
+}
+
+/* Take a node of 'level' from the pool */
+skip_list_t *alloc_skip_list_node (int level)
+{
+    size_t size = SKIP_NODE_SIZE(level);
+    skip_pool_chunk_t *chunk;
+    skip_list_t *node = skip_pool.free_list[level];
+
+    if (node != NULL)
     {
-        level += rand()%(2*(LEVEL_W-1)) >= (LEVEL_W - 1) ? 1 : 0;
+        skip_pool.free_list[level] = node->forward[0];
     }
+    else
+    {
+        if (skip_pool.end - skip_pool.cursor < (ptrdiff_t)size)
+        {
+            chunk = (skip_pool_chunk_t *)malloc(POOL_CHUNK);
+            if (chunk == NULL)
+            {
+                return NULL;
+            }
+            chunk->next = skip_pool.chunks;
+            skip_pool.chunks = chunk;
+            skip_pool.cursor = (char *)chunk + sizeof(skip_pool_chunk_t);
+            skip_pool.end = (char *)chunk + POOL_CHUNK;
+            skip_pool.reserved += POOL_CHUNK;
+        }
+        node = (skip_list_t *)skip_pool.cursor;
+        skip_pool.cursor += size;   /* size is a multiple of the pointer size */
+    }
+    skip_pool.used += size;
+
+    return node;
+}
+
+/* Give a node back to the free list of its level */
+void free_skip_list_node (skip_list_t *node)
+{
+    skip_pool.used -= SKIP_NODE_SIZE(node->level);
+    node->forward[0] = skip_pool.free_list[node->level];
+    skip_pool.free_list[node->level] = node;
+}
+
+/* Free the chunks of the pool, no node may be used any more */
+void free_skip_pool ()
+{
+    skip_pool_chunk_t *chunk;
 
-    return level;   /* 0,1....MAX_SKIP_LEVEL-1 */
+    while ((chunk = skip_pool.chunks) != NULL)
+    {
+        skip_pool.chunks = chunk->next;
+        free(chunk);
+    }
+    memset(&skip_pool, 0, sizeof(skip_pool));
 }
 
 /* Make a new node and init it */
 skip_list_t *init_skip_list_node (int level, int key, int value) 
 {
-    skip_list_t *node = (skip_list_t *)malloc(sizeof(skip_list_t));
+    skip_list_t *node = alloc_skip_list_node(level);
+    if (node == NULL)
+    {
+        return NULL;
+    }
     node->level = level;
     node->key = key;
     node->value = value;
     int i = 0;
-    for (; i < MAX_SKIP_LEVEL; ++i)
+    for (; i <= level; ++i)
     {
         node->forward[i] = NULL;
+        SKIP_SPAN(node)[i] = 0;
     }
  
     return node;
 }
 
+/* Link a new node of 'level' after update_node[i] (of rank rank[i]) at every level */
+static skip_list_t *skip_list_link (skip_list_t *skip_list, skip_list_t **update_node, int *rank,
+                                    int level, int key, int value)
+{
+    skip_list_t *node = init_skip_list_node(level, key, value);
+    int i;
+
+    if (node != NULL)
+    {
+        for (i = 0; i <= level; ++i)
+        {
+            node->forward[i] = update_node[i]->forward[i];
+            update_node[i]->forward[i] = node;
+            if (node->forward[i] != NULL)   /* split the span of update_node[i] */
+            {
+                SKIP_SPAN(node)[i] = SKIP_SPAN(update_node[i])[i] - (rank[0] - rank[i]);
+            }
+            SKIP_SPAN(update_node[i])[i] = rank[0] - rank[i] + 1;
+        }
+        for (; i <= skip_list->level; ++i)  /* the links over the node are one longer */
+        {
+            if (update_node[i]->forward[i] != NULL)
+            {
+                ++SKIP_SPAN(update_node[i])[i];
+            }
+        }
+    }
+
+    return node;
+}
+
+/* Make an empty list, the levels of its nodes are geometric with probability p (1/2, 1/4, 1/e...) */
+skip_list_t *init_skip_list (double p)
+{
+    skip_list_head_t *head = (skip_list_head_t *)malloc(offsetof(skip_list_head_t, head)
+                                                        + SKIP_NODE_SIZE(MAX_SKIP_LEVEL-1));
+    int i = 0;
+
+    if (head == NULL)
+    {
+        return NULL;
+    }
+    init_skip_rand(&head->rand, p, ((uint64_t)time(0) << 32) ^ (uintptr_t)head);
+    head->head.level = MAX_SKIP_LEVEL-1;
+    head->head.key = INT_MIN;   /* INT_MIN is the min int value of c */
+    head->head.value = INT_MIN;
+    for (; i < MAX_SKIP_LEVEL; ++i)
+    {
+        head->head.forward[i] = NULL;
+        SKIP_SPAN(&head->head)[i] = 0;
+    }
+
+    return &head->head;
+}
+
 /* Insert or Update a value on Skip List */
 int skip_list_write (skip_list_t *skip_list, int key, int value)
 {
     skip_list_t *update_node[MAX_SKIP_LEVEL];/* point the insert positon of every level */
+    int rank[MAX_SKIP_LEVEL];   /* rank of update_node[i] (the head is 0) */
     skip_list_t *node = skip_list;
     int i = skip_list->level;
 
     for(; i>=0; --i)    /* find the insert positon of every level */
     {
+        rank[i] = i == skip_list->level ? 0 : rank[i+1];
         while (node->forward[i] != NULL && key > node->forward[i]->key)
         {
+            rank[i] += SKIP_SPAN(node)[i];
             node = node->forward[i];
         }
         update_node[i] = node;
@@ -77,13 +281,7 @@ int skip_list_write (skip_list_t *skip_list, int key, int value)
     }
     else    /* insert a node with the value*/
     {
-        int level = rand_level();
-        node = init_skip_list_node(level, key, value);
-        for (i = 0; i <= level; ++i)
-        {
-            node->forward[i] = update_node[i]->forward[i];
-            update_node[i]->forward[i] = node;
-        }
+        skip_list_link(skip_list, update_node, rank, skip_rand_level(&SKIP_HEAD(skip_list)->rand), key, value);
     }
 }
 
@@ -107,13 +305,18 @@ int skip_list_delete (skip_list_t* skip_list, int key)
     {
         for (i = 0; i <= skip_list->level; ++i) 
         {
-            if (update_node[i]->forward[i] != node)
+            if (update_node[i]->forward[i] == node)
             {
-                break;
+                update_node[i]->forward[i] = node->forward[i];
+                SKIP_SPAN(update_node[i])[i] = node->forward[i] == NULL ? 0
+                    : SKIP_SPAN(update_node[i])[i] + SKIP_SPAN(node)[i] - 1;
+            }
+            else if (update_node[i]->forward[i] != NULL)  /* a link over the node */
+            {
+                --SKIP_SPAN(update_node[i])[i];
             }
-            update_node[i]->forward[i] = node->forward[i];
         }
-        free(node);
+        free_skip_list_node(node);
         
         return 0; // SUCCESS
     } 
@@ -148,6 +351,253 @@ int skip_list_search (skip_list_t* skip_list, int key)
     }
 }
 
+/*
+ * Finger: the last search path of a list, update_node[i] is the last node before the key at
+ * level i. The next search climbs from level 0 only while the path does not hold the new key,
+ * so a key at distance d from the last one costs O(log d). The list must only change through
+ * the finger while it is used (skip_list_finger_init() again after other writes or deletes).
+ */
+typedef struct {
+    skip_list_t *skip_list;
+    skip_list_t *update_node[MAX_SKIP_LEVEL];
+    int rank[MAX_SKIP_LEVEL];   /* rank of update_node[i] */
+} skip_list_finger_t;
+
+void skip_list_finger_init (skip_list_t *skip_list, skip_list_finger_t *finger)
+{
+    int i = 0;
+
+    finger->skip_list = skip_list;
+    for (; i < MAX_SKIP_LEVEL; ++i)
+    {
+        finger->update_node[i] = skip_list;
+        finger->rank[i] = 0;
+    }
+}
+
+/* Move the finger to the path of key, returns the node of key or NULL */
+static skip_list_t *skip_list_finger_seek (skip_list_finger_t *finger, int key)
+{
+    skip_list_t *skip_list = finger->skip_list;
+    skip_list_t **update_node = finger->update_node;
+    skip_list_t *node;
+    int i = 0, rank;
+
+    /* a level holds key if its node is before key and its next node is not */
+    while (i < skip_list->level
+           && ((update_node[i] != skip_list && key <= update_node[i]->key)
+               || (update_node[i]->forward[i] != NULL && key > update_node[i]->forward[i]->key)))
+    {
+        ++i;
+    }
+    if (update_node[i] != skip_list && key <= update_node[i]->key)   /* before the top, restart */
+    {
+        update_node[i] = skip_list;
+        finger->rank[i] = 0;
+    }
+    node = update_node[i];
+    rank = finger->rank[i];
+    for (; i >= 0; --i)
+    {
+        while (node->forward[i] != NULL && key > node->forward[i]->key)
+        {
+            rank += SKIP_SPAN(node)[i];
+            node = node->forward[i];
+        }
+        update_node[i] = node;
+        finger->rank[i] = rank;
+    }
+    node = node->forward[0];
+
+    return node != NULL && key == node->key ? node : NULL;
+}
+
+/* Insert or Update a node of 'level' at the finger, the finger moves to the node */
+static skip_list_t *skip_list_finger_link (skip_list_finger_t *finger, int level, int key, int value)
+{
+    skip_list_t *node;
+    int i = 0, rank = finger->rank[0] + 1;
+
+    node = skip_list_link(finger->skip_list, finger->update_node, finger->rank, level, key, value);
+    if (node != NULL)
+    {
+        for (; i <= level; ++i)  /* the node is before the next keys */
+        {
+            finger->update_node[i] = node;
+            finger->rank[i] = rank;
+        }
+    }
+
+    return node;
+}
+
+/* Insert or Update a value near the last key of the finger */
+int skip_list_finger_write (skip_list_finger_t *finger, int key, int value)
+{
+    skip_list_t *node = skip_list_finger_seek(finger, key);
+
+    if (node != NULL)   /* find the node,change value */
+    {
+        node->value = value;
+        return 1;
+    }
+
+    return skip_list_finger_link(finger, skip_rand_level(&SKIP_HEAD(finger->skip_list)->rand), key, value) != NULL ? 0 : -1;
+}
+
+/* Search a key near the last key of the finger, INT_MIN if not found */
+int skip_list_finger_search (skip_list_finger_t *finger, int key)
+{
+    skip_list_t *node = skip_list_finger_seek(finger, key);
+
+    return node != NULL ? node->value : INT_MIN;
+}
+
+/*
+ * Insert (or Update) n keys in one pass, sorted keys are appended from the finger without a
+ * search. A new node of rank r gets the level of the trailing zeros of r, so a sorted run is
+ * built as a perfect skip list. Returns the inserted nodes, -1 if no enough memory.
+ */
+int skip_list_insert_sorted (skip_list_t *skip_list, const int *keys, const int *values, int n)
+{
+    skip_list_finger_t finger;
+    skip_list_t *node;
+    int i = 0, level, inserted = 0;
+
+    skip_list_finger_init(skip_list, &finger);
+    for (; i < n; ++i)
+    {
+        node = skip_list_finger_seek(&finger, keys[i]);
+        if (node != NULL)
+        {
+            node->value = values[i];
+            continue;
+        }
+        level = __builtin_ctz(finger.rank[0] + 1);
+        if (skip_list_finger_link(&finger, level < MAX_SKIP_LEVEL ? level : MAX_SKIP_LEVEL-1,
+                                  keys[i], values[i]) == NULL)
+        {
+            return -1;
+        }
+        ++inserted;
+    }
+
+    return inserted;
+}
+
+/* First node whose key >= key, NULL if none */
+skip_list_t *skip_list_lower_bound (skip_list_t *skip_list, int key)
+{
+    skip_list_t *node = skip_list;
+    int i = skip_list->level;
+
+    for (; i >= 0; --i)
+    {
+        while (node->forward[i] != NULL && key > node->forward[i]->key)
+        {
+            node = node->forward[i];
+        }
+    }
+
+    return node->forward[0];
+}
+
+/* First node whose key > key, NULL if none */
+skip_list_t *skip_list_upper_bound (skip_list_t *skip_list, int key)
+{
+    skip_list_t *node = skip_list;
+    int i = skip_list->level;
+
+    for (; i >= 0; --i)
+    {
+        while (node->forward[i] != NULL && key >= node->forward[i]->key)
+        {
+            node = node->forward[i];
+        }
+    }
+
+    return node->forward[0];
+}
+
+/* Nodes whose key < key: the rank (from 0) of lower_bound(key) */
+int skip_list_rank (skip_list_t *skip_list, int key)
+{
+    skip_list_t *node = skip_list;
+    int rank = 0;
+    int i = skip_list->level;
+
+    for (; i >= 0; --i)
+    {
+        while (node->forward[i] != NULL && key > node->forward[i]->key)
+        {
+            rank += SKIP_SPAN(node)[i];
+            node = node->forward[i];
+        }
+    }
+
+    return rank;
+}
+
+/* The node of rank 'rank' (from 0, in key order), NULL if the list is shorter */
+skip_list_t *skip_list_select (skip_list_t *skip_list, int rank)
+{
+    skip_list_t *node = skip_list;
+    int traversed = -1;     /* rank of node, the head is before the first node */
+    int i = skip_list->level;
+
+    if (rank < 0)
+    {
+        return NULL;
+    }
+    for (; i >= 0; --i)
+    {
+        while (node->forward[i] != NULL && traversed + SKIP_SPAN(node)[i] <= rank)
+        {
+            traversed += SKIP_SPAN(node)[i];
+            node = node->forward[i];
+        }
+        if (traversed == rank)
+        {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+/* Iterator over the keys of [lo, hi), it walks forward[0] */
+typedef struct {
+    skip_list_t *node;  /* next node */
+    int hi;
+} skip_list_iter_t;
+
+void skip_list_range (skip_list_t *skip_list, int lo, int hi, skip_list_iter_t *iter)
+{
+    iter->node = skip_list_lower_bound(skip_list, lo);
+    iter->hi = hi;
+}
+
+/* Next node of the range, NULL at the end (the list must not change meanwhile) */
+skip_list_t *skip_list_next (skip_list_iter_t *iter)
+{
+    skip_list_t *node = iter->node;
+
+    if (node == NULL || node->key >= iter->hi)
+    {
+        iter->node = NULL;
+        return NULL;
+    }
+    iter->node = node->forward[0];
+
+    return node;
+}
+
+/* Keys in [lo, hi) */
+int skip_list_count (skip_list_t *skip_list, int lo, int hi)
+{
+    return lo < hi ? skip_list_rank(skip_list, hi) - skip_list_rank(skip_list, lo) : 0;
+}
+
 /* print the key in every level */
 int print_skip_list (skip_list_t *skip_list)
 {
@@ -176,52 +626,1248 @@ int free_skip_list (skip_list_t* skip_list)
     while (node != NULL)
     {
         next_node = node->forward[0];
-        free(node);
+        free_skip_list_node(node);
         node = next_node;
     }
     
-    free(skip_list);
+    free(SKIP_HEAD(skip_list));
 }
 
-int main(int argc, char *argv[])
+/* Nodes visited by a search of key (the steps along forward[] and the key compares) */
+static int skip_list_path (skip_list_t *skip_list, int key)
 {
-    srand((unsigned)time(0));
-    int count = 0;
-    int i = 0;
-
-    /* Function Test */
-    printf("#### Function Test ####\n");
-
-    count = 20;
-    printf("== Init Skip List ==\n");
+    skip_list_t *node = skip_list;
+    int i = skip_list->level;
+    int path = 0;
 
-    /* INT_MIN is the min int value of c */
-    skip_list_t *skip_list = init_skip_list_node(MAX_SKIP_LEVEL-1, INT_MIN, INT_MIN);
-//skip_list_t* skip_list= init_skip_list_node(MAX_SKIP_LEVEL, INT_MIN, INT_MIN); 多了一层所以会越界
-    for (i = 0; i<count; ++i) 
+    for (; i >= 0; --i)
     {
-        skip_list_write(skip_list, i, i);
+        while (node->forward[i] != NULL && key > node->forward[i]->key)
+        {
+            node = node->forward[i];
+            ++path;
+        }
+        path += node->forward[i] != NULL;   /* the key compare which stops the level */
     }
 
-    printf("== Print Skip List ==\n");
-    print_skip_list(skip_list);
+    return path;
+}
 
-    printf("== Search Key ==\n");
-    for(i = 0; i<count; ++i) 
-    {
-        int key = rand()%(count+5);
-        printf("Search [%d]: %d\n", key, skip_list_search(skip_list, key));
-    }
+/* Insert throughput, memory and search path of the branching probabilities */
+void skip_level_bench (int count)
+{
+    static const double p[] = {0.5, 0.25, 0.36787944117144233};  /* 1/2, 1/4, 1/e */
+    static const char *name[] = {"1/2", "1/4", "1/e"};
+    clock_t start, finish;
+    float time = 0;
+    skip_list_t *skip_list;
+    size_t used;
+    long long path;
+    int i, j;
 
-    printf("== Delete Key ==\n");
-    for(i = 0; i < count; ++i) 
+    for (j = 0; j < 3; ++j)
     {
-        int key = rand()%(count+5);
-        printf("Delete [%d]: %s\n",key,skip_list_delete(skip_list, key) ? "NO FOUND" : "SUCCESS");
-    }
+        printf("== Insert 10^6 Items (p = %s) ==\n", name[j]);
+        used = skip_pool.used;
+        skip_list = init_skip_list(p[j]);
+        start = clock();
+        for (i = 0; i < count; ++i)
+        {
+            skip_list_write(skip_list, i, i);
+        }
+        finish = clock();
+        time = TIME(start, finish);
+        printf ("Time: %f ms, Speed: %f Node/s, Memory: %.1f Byte/Node\n",
+                time, count/time*1000, (double)(skip_pool.used - used)/count);
+
+        start = clock();
+        for (i = 0; i < count; ++i)
+        {
+            skip_list_search(skip_list, rand()%count);
+        }
+        finish = clock();
+        time = TIME(start, finish);
+        for (i = 0, path = 0; i < count; i += 16)
+        {
+            path += skip_list_path(skip_list, rand()%count);
+        }
+        printf ("Search Time: %f ms, Speed: %f Node/s, Path: %.1f Nodes\n",
+                time, count/time*1000, (double)path/((count + 15)/16));
+        free_skip_list(skip_list);
+    }
+}
+
+/* Ordered and clustered inserts and searches: from the head, with a finger, in one sorted pass */
+void skip_finger_bench (int count)
+{
+    clock_t start, finish;
+    float time = 0;
+    skip_list_finger_t finger;
+    skip_list_t *skip_list;
+    int *keys = (int *)malloc(count * sizeof(int));
+    int *near = (int *)malloc(count * sizeof(int));
+    int i, key = count / 2;
+    size_t used;
+
+    if (keys == NULL || near == NULL)
+    {
+        free(keys);
+        free(near);
+        return;
+    }
+    for (i = 0; i < count; ++i)
+    {
+        keys[i] = i;
+        key += rand()%65 - 32;  /* a random walk: the keys are clustered */
+        key = key < 0 ? 0 : key >= count ? count-1 : key;
+        near[i] = key;
+    }
+
+    printf("== Finger Insert 10^6 Items (in order) ==\n");
+    skip_list = init_skip_list(SKIP_P);
+    skip_list_finger_init(skip_list, &finger);
+    start = clock();
+    for (i = 0; i < count; ++i)
+    {
+        skip_list_finger_write(&finger, keys[i], keys[i]);
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s\n", time, count/time*1000);
+
+    printf("== Search 10^6 Clustered Items (from the head) ==\n");
+    start = clock();
+    for (i = 0; i < count; ++i)
+    {
+        skip_list_search(skip_list, near[i]);
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s\n", time, count/time*1000);
+
+    printf("== Finger Search 10^6 Clustered Items ==\n");
+    start = clock();
+    for (i = 0; i < count; ++i)
+    {
+        skip_list_finger_search(&finger, near[i]);
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s\n", time, count/time*1000);
+    free_skip_list(skip_list);
+
+    printf("== Sorted Insert 10^6 Items (one pass) ==\n");
+    used = skip_pool.used;
+    skip_list = init_skip_list(SKIP_P);
+    start = clock();
+    skip_list_insert_sorted(skip_list, keys, keys, count);
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s\n", time, count/time*1000);
+    printf ("Memory: %.1f MB of nodes (%.1f Byte/Node)\n",
+            (skip_pool.used - used)/1048576.0, (double)(skip_pool.used - used)/count);
+
+    printf("== Search 10^6 Items (sorted insert) ==\n");
+    start = clock();
+    for (i = 0; i < count; ++i)
+    {
+        skip_list_search(skip_list, rand()%count);
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s\n", time, count/time*1000);
+    free_skip_list(skip_list);
+
+    free(keys);
+    free(near);
+}
+
+static int compare_int (const void *a, const void *b)
+{
+    return *(const int *)a < *(const int *)b ? -1 : *(const int *)a > *(const int *)b;
+}
+
+/* Range scan, rank and select on 'total' keys (the list holds 0..count-1 already) */
+void skip_range_bench (skip_list_t *skip_list, int count, int total)
+{
+    clock_t start, finish;
+    float time = 0;
+    skip_list_iter_t iter;
+    skip_list_t *node;
+    long long sum = 0;
+    int *keys;
+    int i, lo, n = 0;
+
+    for (i = count; i < total; ++i)
+    {
+        skip_list_write(skip_list, i, i);
+    }
+
+    printf("== Scan 10^7 Items ==\n");
+    start = clock();
+    skip_list_range(skip_list, 0, total, &iter);
+    while ((node = skip_list_next(&iter)) != NULL)
+    {
+        sum += node->value;
+        ++n;
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s (%d keys, sum %lld)\n", time, n/time*1000, n, sum);
+
+    printf("== Load 10^7 Items into an Array and Sort ==\n");
+    keys = (int *)malloc(total * sizeof(int));
+    if (keys != NULL)
+    {
+        start = clock();
+        for (i = 0, node = skip_list->forward[0]; node != NULL && i < total; node = node->forward[0])
+        {
+            keys[i++] = node->key;
+        }
+        qsort(keys, i, sizeof(int), compare_int);
+        finish = clock();
+        time = TIME(start, finish);
+        printf ("Time: %f ms, Speed: %f Node/s\n", time, i/time*1000);
+        free(keys);
+    }
+
+    printf("== 1000 Range Scans of 10^4 Items ==\n");
+    sum = 0;
+    n = 0;
+    start = clock();
+    for (i = 0; i < 1000; ++i)
+    {
+        lo = rand()%(total-10000);
+        skip_list_range(skip_list, lo, lo+10000, &iter);
+        while ((node = skip_list_next(&iter)) != NULL)
+        {
+            sum += node->value;
+            ++n;
+        }
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s\n", time, n/time*1000);
+
+    printf("== Rank and Select 10^6 Items ==\n");
+    n = 0;
+    start = clock();
+    for (i = 0; i < count; ++i)
+    {
+        lo = rand()%total;
+        n += skip_list_rank(skip_list, lo) == lo && skip_list_select(skip_list, lo)->key == lo;
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Op/s (%d right)\n", time, count/time*1000, n);
+
+    printf("== Count 10^6 Ranges ==\n");
+    sum = 0;
+    start = clock();
+    for (i = 0; i < count; ++i)
+    {
+        lo = rand()%total;
+        sum += skip_list_count(skip_list, lo, lo + rand()%(total - lo + 1));
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Op/s\n", time, count/time*1000);
+}
+
+/*
+ * Fat Skip List: the same skip list over blocks of FAT_KEYS sorted keys (a cache line of keys),
+ * like a skip B-tree. A walk loads one block per step and compares its keys all at once, so
+ * a search takes log(n/FAT_KEYS) dependent loads instead of log(n). Each link keeps the first
+ * key of the block it points to, the walk compares it without loading that block.
+ * A full block is split in two (a block appended at the end is not, the new key starts a new
+ * one, so ordered inserts fill the blocks), an empty block is unlinked.
+ */
+#define FAT_KEYS 16
+
+typedef struct fat_node_struct fat_node_t;
+
+typedef struct {
+    fat_node_t *node;
+    int key;                /* first key of node */
+} fat_link_t;
+
+struct fat_node_struct {
+    int keys[FAT_KEYS] __attribute__((aligned(64)));    /* sorted, INT_MAX after count */
+    int values[FAT_KEYS];
+    int count;
+    int level;
+    fat_link_t forward[1];  /* level+1 of them */
+};
+
+typedef struct {
+    skip_rand_t rand;
+    fat_node_t *head;       /* no key, before every block */
+    size_t used;            /* bytes of the blocks */
+} fat_skip_list_t;
+
+/* Bytes of a block of 'level' (a multiple of the cache line) */
+#define FAT_NODE_SIZE(level) \
+    ((offsetof(fat_node_t, forward) + ((level) + 1) * sizeof(fat_link_t) + 63) & ~(size_t)63)
+
+/*
+ * Count of the keys which are < key. The keys of a block are compared all at once,
+ * with AVX2 if the compiler enables it (-mavx2), or SSE2. The slots after count hold INT_MAX.
+ */
+static inline int fat_rank (const fat_node_t *node, int key)
+{
+#if defined(__AVX2__)
+    __m256i k = _mm256_set1_epi32(key);
+    unsigned int lt = 0;
+    int i;
+
+    for (i = 0; i < FAT_KEYS/8; ++i)
+    {
+        __m256i a = _mm256_load_si256((const __m256i *)(node->keys + 8*i));
+        lt |= (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, a))) << (8*i);
+    }
+    return __builtin_popcount(lt);
+#elif defined(__SSE2__)
+    __m128i k = _mm_set1_epi32(key);
+    unsigned int lt = 0;
+    int i;
+
+    for (i = 0; i < FAT_KEYS/4; ++i)
+    {
+        __m128i a = _mm_load_si128((const __m128i *)(node->keys + 4*i));
+        lt |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(a, k))) << (4*i);
+    }
+    return __builtin_popcount(lt);
+#else
+    int i, r = 0;
+
+    for (i = 0; i < FAT_KEYS; ++i)  /* no branch, the compiler can vectorize it */
+    {
+        r += node->keys[i] < key;
+    }
+    return r;
+#endif
+}
+
+static fat_node_t *fat_node_alloc (fat_skip_list_t *list, int level)
+{
+    fat_node_t *node;
+    int i;
+
+    if (posix_memalign((void **)&node, 64, FAT_NODE_SIZE(level)) != 0)
+    {
+        return NULL;
+    }
+    for (i = 0; i < FAT_KEYS; ++i)
+    {
+        node->keys[i] = INT_MAX;
+    }
+    node->count = 0;
+    node->level = level;
+    for (i = 0; i <= level; ++i)
+    {
+        node->forward[i].node = NULL;
+        node->forward[i].key = INT_MAX;
+    }
+    list->used += FAT_NODE_SIZE(level);
+
+    return node;
+}
+
+static void fat_node_free (fat_skip_list_t *list, fat_node_t *node)
+{
+    list->used -= FAT_NODE_SIZE(node->level);
+    free(node);
+}
+
+fat_skip_list_t *init_fat_skip_list (double p)
+{
+    fat_skip_list_t *list = (fat_skip_list_t *)malloc(sizeof(fat_skip_list_t));
+
+    if (list == NULL)
+    {
+        return NULL;
+    }
+    list->used = 0;
+    init_skip_rand(&list->rand, p, ((uint64_t)time(0) << 32) ^ (uintptr_t)list);
+    if ((list->head = fat_node_alloc(list, MAX_SKIP_LEVEL-1)) == NULL)
+    {
+        free(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+/* The block whose range holds key (the head if key is before every block), update[i] at level i */
+static fat_node_t *fat_find (fat_skip_list_t *list, int key, fat_node_t **update)
+{
+    fat_node_t *node = list->head;
+    int i = MAX_SKIP_LEVEL-1;
+
+    for (; i >= 0; --i)
+    {
+        while (node->forward[i].node != NULL && node->forward[i].key <= key)
+        {
+            node = node->forward[i].node;
+        }
+        if (update != NULL)
+        {
+            update[i] = node;
+        }
+    }
+
+    return node;
+}
+
+/* Put key and value at position r of a block which is not full */
+static void fat_node_insert (fat_node_t *node, int r, int key, int value)
+{
+    memmove(node->keys + r + 1, node->keys + r, (node->count - r) * sizeof(int));
+    memmove(node->values + r + 1, node->values + r, (node->count - r) * sizeof(int));
+    node->keys[r] = key;
+    node->values[r] = value;
+    ++node->count;
+}
+
+/* Insert or Update a value on Fat Skip List, 0: inserted, 1: updated, -1: no memory */
+int fat_skip_list_write (fat_skip_list_t *list, int key, int value)
+{
+    fat_node_t *update[MAX_SKIP_LEVEL];
+    fat_node_t *node = fat_find(list, key, update);
+    fat_node_t *next, *pred;
+    int i, r, keep;
+
+    if (node == list->head)     /* before every key: into the first block */
+    {
+        node = list->head->forward[0].node;
+        if (node == NULL)
+        {
+            if ((node = fat_node_alloc(list, skip_rand_level(&list->rand))) == NULL)
+            {
+                return -1;
+            }
+            for (i = 0; i <= node->level; ++i)
+            {
+                list->head->forward[i].node = node;
+            }
+        }
+    }
+    r = fat_rank(node, key);
+    if (r < node->count && node->keys[r] == key)  /* find the key,change value */
+    {
+        node->values[r] = value;
+        return 1;
+    }
+    if (node->count < FAT_KEYS)
+    {
+        fat_node_insert(node, r, key, value);
+        if (r == 0)     /* the first block has a new first key, update[] is the head */
+        {
+            for (i = 0; i <= node->level; ++i)
+            {
+                update[i]->forward[i].key = key;
+            }
+        }
+        return 0;
+    }
+
+    /* split: the last block appended at its end keeps its keys, else half of them */
+    keep = r == FAT_KEYS && node->forward[0].node == NULL ? FAT_KEYS : FAT_KEYS/2;
+    if ((next = fat_node_alloc(list, skip_rand_level(&list->rand))) == NULL)
+    {
+        return -1;
+    }
+    memcpy(next->keys, node->keys + keep, (FAT_KEYS - keep) * sizeof(int));
+    memcpy(next->values, node->values + keep, (FAT_KEYS - keep) * sizeof(int));
+    next->count = FAT_KEYS - keep;
+    for (i = keep; i < FAT_KEYS; ++i)
+    {
+        node->keys[i] = INT_MAX;
+    }
+    node->count = keep;
+    if (r > keep || keep == FAT_KEYS)
+    {
+        fat_node_insert(next, r - keep, key, value);
+    }
+    else
+    {
+        fat_node_insert(node, r, key, value);
+        if (r == 0)
+        {
+            for (i = 0; i <= node->level; ++i)
+            {
+                update[i]->forward[i].key = key;
+            }
+        }
+    }
+    for (i = 0; i <= next->level; ++i)     /* link next after node */
+    {
+        pred = i <= node->level ? node : update[i];
+        next->forward[i] = pred->forward[i];
+        pred->forward[i].node = next;
+        pred->forward[i].key = next->keys[0];
+    }
+
+    return 0;
+}
+
+/* Search a key from Fat Skip List, INT_MIN if not found */
+int fat_skip_list_search (fat_skip_list_t *list, int key)
+{
+    fat_node_t *node = fat_find(list, key, NULL);
+    int r = fat_rank(node, key);
+
+    return r < node->count && node->keys[r] == key ? node->values[r] : INT_MIN;
+}
+
+/* Delete a key on Fat Skip List */
+int fat_skip_list_delete (fat_skip_list_t *list, int key)
+{
+    fat_node_t *update[MAX_SKIP_LEVEL];
+    fat_node_t *node = fat_find(list, key, NULL);
+    fat_node_t *pred;
+    int i, r = fat_rank(node, key);
+
+    if (r >= node->count || node->keys[r] != key)
+    {
+        return 1; // NO FOUND
+    }
+    memmove(node->keys + r, node->keys + r + 1, (node->count - r - 1) * sizeof(int));
+    memmove(node->values + r, node->values + r + 1, (node->count - r - 1) * sizeof(int));
+    node->keys[--node->count] = INT_MAX;
+    if (r == 0)     /* the first key changed: find the links to the block */
+    {
+        pred = list->head;
+        for (i = MAX_SKIP_LEVEL-1; i >= 0; --i)
+        {
+            while (pred->forward[i].node != NULL && pred->forward[i].key < key)
+            {
+                pred = pred->forward[i].node;
+            }
+            update[i] = pred;
+        }
+        for (i = 0; i <= node->level; ++i)
+        {
+            if (node->count == 0)
+            {
+                update[i]->forward[i] = node->forward[i];
+            }
+            else
+            {
+                update[i]->forward[i].key = node->keys[0];
+            }
+        }
+        if (node->count == 0)
+        {
+            fat_node_free(list, node);
+        }
+    }
+
+    return 0; // SUCCESS
+}
+
+/* Free All Blocks */
+void free_fat_skip_list (fat_skip_list_t *list)
+{
+    fat_node_t *node = list->head;
+    fat_node_t *next_node;
+
+    while (node != NULL)
+    {
+        next_node = node->forward[0].node;
+        fat_node_free(list, node);
+        node = next_node;
+    }
+    free(list);
+}
+
+/* Insert, search and delete on both engines, keys 0..count-1 inserted in order */
+void skip_engine_bench (int count)
+{
+    clock_t start, finish;
+    float time = 0;
+    skip_list_t *skip_list;
+    fat_skip_list_t *fat_list;
+    int *keys = (int *)malloc(1000000 * sizeof(int));
+    int i, n = count < 1000000 ? count : 1000000, found;
+
+    if (keys == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        keys[i] = rand()%count;
+    }
+
+    printf("== Skip List: Insert %d Items ==\n", count);
+    skip_list = init_skip_list(SKIP_P);
+    start = clock();
+    for (i = 0; i < count; ++i)
+    {
+        skip_list_write(skip_list, i, i);
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s, Memory: %.1f MB\n", time, count/time*1000, skip_pool.used/1048576.0);
+    start = clock();
+    for (i = found = 0; i < n; ++i)
+    {
+        found += skip_list_search(skip_list, keys[i]) == keys[i];
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Search Time: %f ms, Speed: %f Node/s (%d found)\n", time, n/time*1000, found);
+    start = clock();
+    for (i = 0; i < n; ++i)
+    {
+        skip_list_delete(skip_list, keys[i]);
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Delete Time: %f ms, Speed: %f Node/s\n", time, n/time*1000);
+    free_skip_list(skip_list);
+    free_skip_pool();
+
+    printf("== Fat Skip List (%d Keys per Block): Insert %d Items ==\n", FAT_KEYS, count);
+    fat_list = init_fat_skip_list(SKIP_P);
+    start = clock();
+    for (i = 0; i < count; ++i)
+    {
+        fat_skip_list_write(fat_list, i, i);
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Time: %f ms, Speed: %f Node/s, Memory: %.1f MB\n", time, count/time*1000, fat_list->used/1048576.0);
+    start = clock();
+    for (i = found = 0; i < n; ++i)
+    {
+        found += fat_skip_list_search(fat_list, keys[i]) == keys[i];
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Search Time: %f ms, Speed: %f Node/s (%d found)\n", time, n/time*1000, found);
+    start = clock();
+    for (i = 0; i < n; ++i)
+    {
+        fat_skip_list_delete(fat_list, keys[i]);
+    }
+    finish = clock();
+    time = TIME(start, finish);
+    printf ("Delete Time: %f ms, Speed: %f Node/s\n", time, n/time*1000);
+    free_fat_skip_list(fat_list);
+
+    free(keys);
+}
+
+/*
+ * Concurrent Skip List (lock free, Fraser / Herlihy-Shavit style)
+ *
+ * The low bit of next[i] marks the node as deleted at level i. Delete marks the levels
+ * from the top down, the mark of level 0 is the delete itself, then the marked node is
+ * unlinked by any thread which walks past it. Insert links level 0 first (the node is in
+ * the list from then on), then the upper levels. Search takes no lock and writes nothing.
+ *
+ * Memory: a node is retired when both its insert and its delete are done with its links
+ * (refs), and freed by epoch based reclamation when no thread can still hold it.
+ */
+typedef struct cskip_node_struct cskip_node_t;
+struct cskip_node_struct {
+    skip_key_t key;
+    skip_value_t value;
+    int level;
+    int refs;                   /* insert and delete which may still link or unlink it */
+    cskip_node_t *retire_next;  /* list of the retired nodes */
+    cskip_node_t *next[1];      /* level+1 of them */
+};
+
+typedef struct {
+    cskip_node_t *head;         /* no key, it is before every node */
+} cskip_list_t;
+
+#define MARKED(p) ((uintptr_t)(p) & 1)
+#define MARK(p)   ((cskip_node_t *)((uintptr_t)(p) | 1))
+#define UNMARK(p) ((cskip_node_t *)((uintptr_t)(p) & ~(uintptr_t)1))
+
+/*
+ * Epoch based reclamation: a thread in an operation announces the epoch it saw. The epoch
+ * advances when every active thread has seen it, so a node retired in epoch e is freed
+ * by its thread in epoch e+3, when no operation of before its unlink is left.
+ */
+struct ebr_slot {
+    volatile unsigned long epoch;   /* epoch seen by the thread */
+    volatile int active;            /* in an operation */
+    int used;                       /* the slot has a thread */
+    cskip_node_t *limbo[3];         /* nodes retired in each epoch (mod 3) */
+    int retired;
+    char pad[64];
+} __attribute__((aligned(64)));
+
+static struct ebr_slot ebr_slots[EBR_SLOTS];
+static volatile unsigned long ebr_epoch = 0;
+static __thread struct ebr_slot *ebr_self = NULL;
+
+static void ebr_free (cskip_node_t *node)
+{
+    cskip_node_t *next;
+
+    while (node != NULL)
+    {
+        next = node->retire_next;
+        free(node);
+        node = next;
+    }
+}
+
+/* Bind the thread to a free slot (waits while all the slots are used) */
+static struct ebr_slot *ebr_join ()
+{
+    int i, used;
+
+    while (1)
+    {
+        for (i = 0; i < EBR_SLOTS; ++i)
+        {
+            used = 0;
+            if (__atomic_compare_exchange_n(&ebr_slots[i].used, &used, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                /* the epoch and the limbo lists of the last thread are kept */
+                ebr_self = ebr_slots + i;
+                return ebr_self;
+            }
+        }
+        sched_yield();
+    }
+}
+
+static void ebr_enter ()
+{
+    struct ebr_slot *s = ebr_self != NULL ? ebr_self : ebr_join();
+    unsigned long e = __atomic_load_n(&ebr_epoch, __ATOMIC_ACQUIRE);
+
+    if (s->epoch != e)  /* the list of epoch e-3 is safe now */
+    {
+        ebr_free(s->limbo[e % 3]);
+        s->limbo[e % 3] = NULL;
+        __atomic_store_n(&s->epoch, e, __ATOMIC_RELEASE);
+    }
+    __atomic_exchange_n(&s->active, 1, __ATOMIC_SEQ_CST);   /* a full barrier, pairs with ebr_advance */
+}
+
+static void ebr_leave ()
+{
+    __atomic_store_n(&ebr_self->active, 0, __ATOMIC_RELEASE);
+}
+
+static void ebr_advance ()
+{
+    unsigned long e = __atomic_load_n(&ebr_epoch, __ATOMIC_ACQUIRE);
+    int i;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < EBR_SLOTS; ++i)
+    {
+        if (__atomic_load_n(&ebr_slots[i].active, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&ebr_slots[i].epoch, __ATOMIC_ACQUIRE) != e)
+        {
+            return;     /* a thread is still in an older epoch */
+        }
+    }
+    __atomic_compare_exchange_n(&ebr_epoch, &e, e + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/* Free 'node' when no thread can reach it any more, in an operation of this thread */
+static void ebr_retire (cskip_node_t *node)
+{
+    struct ebr_slot *s = ebr_self;
+
+    node->retire_next = s->limbo[s->epoch % 3];
+    s->limbo[s->epoch % 3] = node;
+    if (++s->retired >= EBR_BATCH)
+    {
+        s->retired = 0;
+        ebr_advance();
+    }
+}
+
+/* Release the slot of the thread before it exits, its retired nodes wait for the next one */
+void cskip_thread_exit ()
+{
+    if (ebr_self != NULL)
+    {
+        __atomic_store_n(&ebr_self->used, 0, __ATOMIC_RELEASE);
+        ebr_self = NULL;
+    }
+}
+
+/* Rand node level, from a generator of the thread (rand() is locked) */
+static __thread skip_rand_t cskip_rand;
+
+int cskip_rand_level ()
+{
+    if (cskip_rand.state == 0)
+    {
+        init_skip_rand(&cskip_rand, SKIP_P, ((uint64_t)time(0) << 32) ^ (uintptr_t)&cskip_rand);
+    }
+
+    return skip_rand_level(&cskip_rand);
+}
+
+cskip_node_t *init_cskip_node (int level, skip_key_t key, skip_value_t value)
+{
+    cskip_node_t *node = (cskip_node_t *)calloc(1, offsetof(cskip_node_t, next) + (level + 1) * sizeof(cskip_node_t *));
+
+    if (node != NULL)
+    {
+        node->level = level;
+        node->key = key;
+        node->value = value;
+        node->refs = 2;
+    }
+
+    return node;
+}
+
+cskip_list_t *init_cskip_list ()
+{
+    cskip_list_t *list = (cskip_list_t *)malloc(sizeof(cskip_list_t));
+
+    if (list == NULL)
+    {
+        return NULL;
+    }
+    list->head = init_cskip_node(MAX_SKIP_LEVEL-1, 0, 0);
+    if (list->head == NULL)
+    {
+        free(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+/* The insert or the delete is done with the links of 'node', the last one retires it */
+static void cskip_release (cskip_node_t *node)
+{
+    if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        ebr_retire(node);
+    }
+}
+
+/*
+ * Find preds[i] (the last node before key) and succs[i] (the first node from key) of every
+ * level, the marked nodes on the way are unlinked. Returns 1 if succs[0] holds key.
+ */
+static int cskip_find (cskip_list_t *list, skip_key_t key, cskip_node_t **preds, cskip_node_t **succs)
+{
+    cskip_node_t *pred, *curr, *succ, *expected;
+    int i;
+
+retry:
+    pred = list->head;
+    for (i = MAX_SKIP_LEVEL-1; i >= 0; --i)
+    {
+        curr = UNMARK(__atomic_load_n(&pred->next[i], __ATOMIC_ACQUIRE));
+        while (curr != NULL)
+        {
+            succ = __atomic_load_n(&curr->next[i], __ATOMIC_SEQ_CST);
+            if (MARKED(succ))   /* curr is deleted, unlink it from pred */
+            {
+                expected = curr;
+                if (!__atomic_compare_exchange_n(&pred->next[i], &expected, UNMARK(succ), 0,
+                                                 __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+                {
+                    goto retry;     /* pred changed or is deleted too */
+                }
+                curr = UNMARK(succ);
+                continue;
+            }
+            if (!KEY_LT(curr->key, key))
+            {
+                break;
+            }
+            pred = curr;
+            curr = succ;
+        }
+        preds[i] = pred;
+        succs[i] = curr;
+    }
+
+    return succs[0] != NULL && KEY_EQ(succs[0]->key, key);
+}
+
+/* Insert or Update a value on the Concurrent Skip List, 0: inserted, 1: updated, -1: no memory */
+int cskip_list_write (cskip_list_t *list, skip_key_t key, skip_value_t value)
+{
+    cskip_node_t *preds[MAX_SKIP_LEVEL], *succs[MAX_SKIP_LEVEL];
+    cskip_node_t *node = NULL, *succ, *expected;
+    int level = cskip_rand_level();
+    int i;
+
+    ebr_enter();
+    while (1)
+    {
+        if (cskip_find(list, key, preds, succs))   /* find the node,change value */
+        {
+            __atomic_store_n(&succs[0]->value, value, __ATOMIC_RELEASE);
+            ebr_leave();
+            free(node);     /* never linked */
+            return 1;
+        }
+        if (node == NULL && (node = init_cskip_node(level, key, value)) == NULL)
+        {
+            ebr_leave();
+            return -1;
+        }
+        for (i = 0; i <= level; ++i)    /* not shared yet */
+        {
+            node->next[i] = succs[i];
+        }
+        expected = succs[0];
+        if (__atomic_compare_exchange_n(&preds[0]->next[0], &expected, node, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    /* the node is in the list, link the upper levels unless it is deleted meanwhile */
+    for (i = 1; i <= level; ++i)
+    {
+        while (1)
+        {
+            succ = __atomic_load_n(&node->next[i], __ATOMIC_SEQ_CST);
+            if (MARKED(succ))
+            {
+                goto linked;
+            }
+            if (succ != succs[i]
+                && !__atomic_compare_exchange_n(&node->next[i], &succ, succs[i], 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            {
+                goto linked;    /* only a delete changes it */
+            }
+            expected = succs[i];
+            if (__atomic_compare_exchange_n(&preds[i]->next[i], &expected, node, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            cskip_find(list, key, preds, succs);
+        }
+    }
+linked:
+    /* a delete may have missed the levels linked after its marks */
+    if (MARKED(__atomic_load_n(&node->next[0], __ATOMIC_SEQ_CST)))
+    {
+        cskip_find(list, key, preds, succs);
+    }
+    cskip_release(node);
+    ebr_leave();
+
+    return 0;
+}
+
+/* Delete a node on the Concurrent Skip List */
+int cskip_list_delete (cskip_list_t *list, skip_key_t key)
+{
+    cskip_node_t *preds[MAX_SKIP_LEVEL], *succs[MAX_SKIP_LEVEL];
+    cskip_node_t *node, *succ;
+    int i;
+
+    ebr_enter();
+    if (!cskip_find(list, key, preds, succs))
+    {
+        ebr_leave();
+        return 1; // NO FOUND
+    }
+    node = succs[0];
+    for (i = node->level; i >= 1; --i)     /* mark the upper levels */
+    {
+        succ = __atomic_load_n(&node->next[i], __ATOMIC_SEQ_CST);
+        while (!MARKED(succ)
+               && !__atomic_compare_exchange_n(&node->next[i], &succ, MARK(succ), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            ;
+        }
+    }
+    succ = __atomic_load_n(&node->next[0], __ATOMIC_SEQ_CST);
+    while (1)   /* the delete which marks level 0 wins */
+    {
+        if (MARKED(succ))
+        {
+            ebr_leave();
+            return 1; // NO FOUND
+        }
+        if (__atomic_compare_exchange_n(&node->next[0], &succ, MARK(succ), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            break;
+        }
+    }
+    cskip_find(list, key, preds, succs);    /* unlink it from every level */
+    cskip_release(node);
+    ebr_leave();
+
+    return 0; // SUCCESS
+}
+
+/* Search a key from the Concurrent Skip List, 0: found (the value is in *value), 1: no found */
+int cskip_list_search (cskip_list_t *list, skip_key_t key, skip_value_t *value)
+{
+    cskip_node_t *pred = list->head;
+    cskip_node_t *curr = NULL, *succ;
+    int i, found;
+
+    ebr_enter();
+    for (i = MAX_SKIP_LEVEL-1; i >= 0; --i)
+    {
+        curr = UNMARK(__atomic_load_n(&pred->next[i], __ATOMIC_ACQUIRE));
+        while (curr != NULL)
+        {
+            succ = __atomic_load_n(&curr->next[i], __ATOMIC_ACQUIRE);
+            if (MARKED(succ))   /* skip a deleted node */
+            {
+                curr = UNMARK(succ);
+                continue;
+            }
+            if (!KEY_LT(curr->key, key))
+            {
+                break;
+            }
+            pred = curr;
+            curr = succ;
+        }
+    }
+    found = curr != NULL && KEY_EQ(curr->key, key);
+    if (found && value != NULL)
+    {
+        *value = __atomic_load_n(&curr->value, __ATOMIC_ACQUIRE);
+    }
+    ebr_leave();
+
+    return found ? 0 : 1;
+}
+
+/* Free All Nodes, and the retired nodes of all the lists: no thread may use a list */
+int free_cskip_list (cskip_list_t *list)
+{
+    cskip_node_t *node = UNMARK(list->head->next[0]);
+    cskip_node_t *next_node;
+    int i, j;
+
+    while (node != NULL)
+    {
+        next_node = UNMARK(node->next[0]);
+        free(node);
+        node = next_node;
+    }
+    for (i = 0; i < EBR_SLOTS; ++i)
+    {
+        for (j = 0; j < 3; ++j)
+        {
+            ebr_free(ebr_slots[i].limbo[j]);
+            ebr_slots[i].limbo[j] = NULL;
+        }
+    }
+    free(list->head);
+    free(list);
+
+    return 0;
+}
+
+/* Performance test of the concurrent skip list: the threads share the keys out */
+#define CSKIP_INSERT 0
+#define CSKIP_SEARCH 1
+#define CSKIP_MIXED  2  /* 80% search, 10% insert, 10% delete */
+
+typedef struct {
+    cskip_list_t *list;
+    int *keys;
+    int count;
+    int op;
+    int id;
+    int threads;
+} cskip_bench_t;
+
+static void *cskip_bench_thread (void *arg)
+{
+    cskip_bench_t *b = (cskip_bench_t *)arg;
+    unsigned int seed = (unsigned int)b->id * 2654435761U + 1;
+    skip_value_t value;
+    int i, key, dice;
+
+    for (i = b->id; i < b->count; i += b->threads)
+    {
+        if (b->op == CSKIP_INSERT)
+        {
+            cskip_list_write(b->list, b->keys[i], b->keys[i]);
+            continue;
+        }
+        key = rand_r(&seed) % b->count;
+        dice = b->op == CSKIP_MIXED ? rand_r(&seed) % 10 : 2;
+        if (dice == 0)
+        {
+            cskip_list_write(b->list, key, key);
+        }
+        else if (dice == 1)
+        {
+            cskip_list_delete(b->list, key);
+        }
+        else
+        {
+            cskip_list_search(b->list, key, &value);
+        }
+    }
+    cskip_thread_exit();
+
+    return NULL;
+}
+
+/* Wall time of 'threads' threads running 'op', in ms */
+static double cskip_bench_run (cskip_list_t *list, int *keys, int count, int op, int threads)
+{
+    pthread_t tid[EBR_SLOTS];
+    cskip_bench_t bench[EBR_SLOTS];
+    struct timespec start, finish;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threads; ++i)
+    {
+        bench[i].list = list;
+        bench[i].keys = keys;
+        bench[i].count = count;
+        bench[i].op = op;
+        bench[i].id = i;
+        bench[i].threads = threads;
+        pthread_create(tid + i, NULL, cskip_bench_thread, bench + i);
+    }
+    for (i = 0; i < threads; ++i)
+    {
+        pthread_join(tid[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    return (finish.tv_sec - start.tv_sec) * 1000.0 + (finish.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+/* Insert and search speed of the single thread list with the same keys as the threads */
+static void cskip_bench_single (int *keys, int count, double *speed)
+{
+    skip_list_t *list = init_skip_list(SKIP_P);
+    struct timespec start, finish;
+    unsigned int seed = 1;      /* the seed of thread 0 */
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i)
+    {
+        skip_list_write(list, keys[i], keys[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    speed[CSKIP_INSERT] = count / ((finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i)
+    {
+        skip_list_search(list, rand_r(&seed) % count);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    speed[CSKIP_SEARCH] = count / ((finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9);
+    free_skip_list(list);
+    free_skip_pool();
+}
+
+/* Insert, search and mixed throughput from 1 to 'max' threads, against the single thread list */
+void cskip_bench (int count, int max)
+{
+    static const char *name[] = {"Insert", "Search", "Mixed"};
+    double speed[3] = {0, 0, 0};
+    cskip_list_t *list;
+    int *keys = (int *)malloc(count * sizeof(int));
+    int threads, op, i, j, tmp;
+    float time = 0;
+
+    if (keys == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < count; ++i)     /* the keys in random order */
+    {
+        keys[i] = i;
+    }
+    for (i = count - 1; i > 0; --i)
+    {
+        j = rand() % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+    cskip_bench_single(keys, count, speed);
+    for (threads = 1; threads <= max; threads = threads < max && threads * 2 > max ? max : threads * 2)
+    {
+        list = init_cskip_list();
+        for (op = CSKIP_INSERT; op <= CSKIP_MIXED; ++op)
+        {
+            printf("== Concurrent %s 10^6 Items (%d Threads) ==\n", name[op], threads);
+            time = cskip_bench_run(list, keys, count, op, threads);
+            printf("Time: %f ms, Speed: %f Node/s", time, count/time*1000);
+            if (speed[op] > 0)
+            {
+                printf(" (%.2fx single thread list)", count/time*1000/speed[op]);
+            }
+            printf("\n");
+        }
+        free_cskip_list(list);
+    }
+    free(keys);
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned)time(0));
+    int count = 0;
+    int i = 0;
+
+    /* Function Test */
+    printf("#### Function Test ####\n");
+
+    count = 20;
+    printf("== Init Skip List ==\n");
+
+    skip_list_t *skip_list = init_skip_list(SKIP_P);
+    for (i = 0; i<count; ++i) 
+    {
+        skip_list_write(skip_list, i, i);
+    }
+
+    printf("== Print Skip List ==\n");
+    print_skip_list(skip_list);
+
+    printf("== Search Key ==\n");
+    for(i = 0; i<count; ++i) 
+    {
+        int key = rand()%(count+5);
+        printf("Search [%d]: %d\n", key, skip_list_search(skip_list, key));
+    }
+
+    printf("== Delete Key ==\n");
+    for(i = 0; i < count; ++i) 
+    {
+        int key = rand()%(count+5);
+        printf("Delete [%d]: %s\n",key,skip_list_delete(skip_list, key) ? "NO FOUND" : "SUCCESS");
+    }
  
     printf("== Print Skip List ==\n");
     print_skip_list(skip_list);
+
+    printf("== Range [5, 15) ==\n");
+    skip_list_iter_t iter;
+    skip_list_t *node;
+    skip_list_range(skip_list, 5, 15, &iter);
+    while ((node = skip_list_next(&iter)) != NULL)
+    {
+        printf("%d(rank %d) ", node->key, skip_list_rank(skip_list, node->key));
+    }
+    printf("\nCount: %d, Select [0]: %d\n", skip_list_count(skip_list, 5, 15),
+           skip_list_select(skip_list, 0) != NULL ? skip_list_select(skip_list, 0)->key : INT_MIN);
  
     /* Performance Test */
     printf("#### Performance Test ####\n");
@@ -238,6 +1884,9 @@ int main(int argc, char *argv[])
     finish = clock();
     time = TIME(start, finish);
     printf ("Time: %f ms, Speed: %f Node/s\n", time, count/time*1000);
+    printf ("Memory: %.1f MB of nodes (%.1f Byte/Node, %.1f MB at full height), %.1f MB of pool\n",
+            skip_pool.used/1048576.0, (double)skip_pool.used/count,
+            (double)count*SKIP_NODE_SIZE(MAX_SKIP_LEVEL-1)/1048576.0, skip_pool.reserved/1048576.0);
  
     printf("== Search 10^6 Items (%d Level) ==\n", MAX_SKIP_LEVEL);
     start = clock();
@@ -248,10 +1897,64 @@ int main(int argc, char *argv[])
     finish = clock();
     time = TIME(start, finish);
     printf ("Time: %f ms, Speed: %f Node/s\n", time, count/time*1000);
+
+    skip_level_bench(count);
+    skip_finger_bench(count);
+    skip_range_bench(skip_list, count, 10000000);
  
     //free memory
     printf("#### Clear Memory ####\n");
     free_skip_list(skip_list);
+    free_skip_pool();
+
+    /* Concurrent Skip List: skip_list [threads], 4 threads at most by default */
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    threads = threads < 1 ? 1 : threads > EBR_SLOTS ? EBR_SLOTS : threads;
+
+    printf("#### Concurrent Function Test ####\n");
+    cskip_list_t *cskip_list = init_cskip_list();
+    skip_value_t value;
+
+    count = 20;
+    for (i = 0; i < count; ++i)
+    {
+        cskip_list_write(cskip_list, i, i);
+    }
+    printf("== Search Key ==\n");
+    for (i = 0; i < count; ++i)
+    {
+        int key = rand()%(count+5);
+        if (cskip_list_search(cskip_list, key, &value) == 0)
+        {
+            printf("Search [%d]: %d\n", key, value);
+        }
+        else
+        {
+            printf("Search [%d]: NO FOUND\n", key);
+        }
+    }
+    printf("== Delete Key ==\n");
+    for (i = 0; i < count; ++i)
+    {
+        int key = rand()%(count+5);
+        printf("Delete [%d]: %s\n", key, cskip_list_delete(cskip_list, key) ? "NO FOUND" : "SUCCESS");
+    }
+    free_cskip_list(cskip_list);
+
+    printf("#### Concurrent Performance Test (random keys) ####\n");
+    cskip_bench(1000000, threads);
+    cskip_thread_exit();
+
+    /*
+     * Engines: skip_list [threads] [keys], 10^6 keys, then 'keys' if it is given.
+     * 10^8 keys take about 4.3 GB for the skip list and 1.2 GB for the fat skip list.
+     */
+    printf("#### Engine Test ####\n");
+    skip_engine_bench(1000000);
+    if (argc > 2 && atoi(argv[2]) > 0)
+    {
+        skip_engine_bench(atoi(argv[2]));
+    }
  
     return 0;
 }
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 /* implementation dependent declarations */ 
 typedef enum {   
@@ -32,6 +34,7 @@ typedef struct nodeTag {
 typedef struct {   
     nodeType *hdr;              /* list Header */
     int listLevel;              /* current level of list */
+    uint64_t seed;              /* xorshift64* state of the level generator */
 } SkipList;
 
 SkipList list;                  /* skip list information */
@@ -39,6 +42,19 @@ SkipList list;                  /* skip list information */
 #define NIL list.hdr
 static int count = 0;
 
+/* random level (p = 1/2): the leading zeros of one random word, its high bits are the best */
+int randomLevel() {
+    uint64_t word;
+    int level;
+
+    list.seed ^= list.seed >> 12;
+    list.seed ^= list.seed << 25;
+    list.seed ^= list.seed >> 27;
+    word = list.seed * 0x2545F4914F6CDD1DULL;
+    level = __builtin_clzll(word | 1);
+    return level < MAXLEVEL ? level : MAXLEVEL;
+}
+
 void print_skip_list()
 {
     int i;
@@ -84,8 +100,8 @@ statusEnum insert(keyType key, recType *rec) {
     if (x != NIL && compEQ(x->key, key))    
         return STATUS_DUPLICATE_KEY;   
 
-   /*随机的计算要插入的值的最高level*/ /* 这个随机函数一般或不太好 */
-    for (newLevel = 0;rand() < RAND_MAX/2 && newLevel < MAXLEVEL;newLevel++);
+   /*随机的计算要插入的值的最高level*/
+    newLevel = randomLevel();
         /*如果大于当前的level，则更新update数组并更新当前level*/  
         if (newLevel > list.listLevel) {   
             for (i = list.listLevel + 1; i <= newLevel; i++)   
@@ -181,6 +197,7 @@ void initList() {
     for (i = 0; i <= MAXLEVEL; i++)
         list.hdr->forward[i] = NIL; /* 注意此处虽然数组越界，但是由于申请的连续内存则无碍 */
     list.listLevel = 0;
+    list.seed = ((uint64_t)time(0) << 32) ^ (uintptr_t)list.hdr;
 }
 
 int main(int argc, char **argv) {